@@ -0,0 +1,280 @@
+
+/*
+   AudioAnalyzeBinaural_F32
+
+   Purpose: Measure the interaural cues, so that we can see whether the processing keeps
+     them.  It takes two pairs of channels (eg, the mics and the ears) and, for each pair:
+       * ITD: the interaural time difference, from a cross-correlation (GCC-PHAT) of the
+         low/mid frequencies.  Positive when the sound reaches the left side first.
+       * ILD: the interaural level difference in each band (L over R, dB).  The band edges
+         follow the multi-band compressor's crossovers, so they can be compared directly.
+
+   Efficiency:
+     * decimated: the audio ISR only low-passes (4th-order, two biquads) and keeps every
+       D-th sample (D = 4 at 96 kHz, so it all runs at 24 kHz).  Nothing else is done in
+       the ISR.  The ITD only matters below a few kHz, and 12 kHz still covers the ILD.
+     * the cross-correlation is done in the frequency domain, and both channels of a pair
+       share one complex radix-4 FFT (left in the real part, right in the imaginary part),
+       like the noise reduction does.  The cross-spectrum is averaged over frames and goes
+       back through one inverse FFT, and then only the lags within +/-1 msec are searched.
+     * the FFTs are done from loop() (service()), not from the ISR.  The ISR fills one
+       frame while loop() works on the other.  If loop() falls behind, frames are skipped,
+       which only slows down the averaging.
+
+   BinauralCues_Core is the analysis on its own, so that it can be tested with synthetic
+   signals outside of the audio graph.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioAnalyzeBinaural_F32_h
+#define _AudioAnalyzeBinaural_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+#include "SOS_Core.h"
+
+#define BINAURAL_FFT (256)              //radix-4.  At 24 kHz that is a frame every 10.7 msec.
+#define BINAURAL_N_BINS (BINAURAL_FFT / 2 + 1)
+#define BINAURAL_N_PAIRS (2)
+#define BINAURAL_MAX_BANDS (8)
+#define BINAURAL_TARGET_FS_HZ (24000.0f)  //decimate down to about this
+
+class BinauralCues_Core {
+  public:
+    struct Cues_t {
+      float itd_usec;                          //positive: the left side leads
+      float coherence;                         //height of the GCC-PHAT peak, 0 to 1.  Low means the ITD is a guess.
+      int n_bands;
+      float ild_dB[BINAURAL_MAX_BANDS];        //L over R
+      float level_dBFS[BINAURAL_MAX_BANDS];    //mean of the two sides
+    };
+
+    BinauralCues_Core(void) {
+      arm_cfft_radix4_init_f32(&fft_inst, BINAURAL_FFT, 0, 1);
+      arm_cfft_radix4_init_f32(&ifft_inst, BINAURAL_FFT, 1, 1);  //the inverse includes the 1/N scaling
+      for (int i = 0; i < BINAURAL_FFT; i++) window[i] = 0.5f * (1.0f - cosf(2.0f * M_PI * ((float)i) / ((float)BINAURAL_FFT)));
+      float default_edges_Hz[] = {500.0f, 2000.0f, 6000.0f};
+      setBands_Hz(default_edges_Hz, 3);
+      setSampleRate_Hz(BINAURAL_TARGET_FS_HZ);
+    }
+
+    //the (decimated) rate of the frames given to analyze()
+    void setSampleRate_Hz(float fs_Hz) {
+      sample_rate_Hz = fs_Hz;
+      bin_Hz = sample_rate_Hz / ((float)BINAURAL_FFT);
+      setBands_Hz(band_edges_Hz, n_bands - 1);
+      setItdRange_Hz(itd_lo_Hz, itd_hi_Hz);
+      setMaxItd_usec(max_itd_usec);
+      setTimeConstant_msec(tau_msec);
+    }
+    float getSampleRate_Hz(void) { return sample_rate_Hz; }
+
+    //the ILD bands: n_edges increasing edges gives n_edges + 1 bands (the last goes up to fs/2)
+    int setBands_Hz(const float *edges_Hz, int n_edges) {
+      n_edges = max(0, min(n_edges, BINAURAL_MAX_BANDS - 1));
+      for (int k = 0; k < n_edges; k++) band_edges_Hz[k] = edges_Hz[k];
+      n_bands = n_edges + 1;
+      band_start_bin[0] = 1;  //not DC
+      for (int k = 0; k < n_edges; k++) band_start_bin[k + 1] = max(1, min(toBin(band_edges_Hz[k]), BINAURAL_N_BINS - 1));
+      band_start_bin[n_bands] = BINAURAL_N_BINS;
+      return n_bands;
+    }
+    //the frequencies used for the ITD.  Above a few kHz, the phase of the individual bins wraps.
+    void setItdRange_Hz(float lo_Hz, float hi_Hz) {
+      itd_lo_Hz = lo_Hz; itd_hi_Hz = hi_Hz;
+      itd_lo_bin = max(1, toBin(lo_Hz));
+      itd_hi_bin = max(itd_lo_bin, min(toBin(hi_Hz), BINAURAL_N_BINS - 2));
+    }
+    void setMaxItd_usec(float usec) {
+      max_itd_usec = usec;
+      max_lag = max(1, min((int)(1.0e-6f * usec * sample_rate_Hz + 0.99f), BINAURAL_FFT / 4));
+    }
+    void setTimeConstant_msec(float msec) {
+      tau_msec = max(1.0f, msec);
+      float frame_sec = ((float)BINAURAL_FFT) / sample_rate_Hz;
+      alpha = 1.0f - expf(-frame_sec / (0.001f * tau_msec));
+    }
+    float getTimeConstant_msec(void) { return tau_msec; }
+
+    void reset(void) {
+      for (int k = 0; k < BINAURAL_N_BINS; k++) { cross_re[k] = 0.0f; cross_im[k] = 0.0f; pow_L[k] = 0.0f; pow_R[k] = 0.0f; }
+      n_frames = 0;
+    }
+    unsigned long getNFrames(void) { return n_frames; }
+
+    //one frame (BINAURAL_FFT samples) of each side.  Updates the averages and the cues.
+    void analyze(const float32_t *L, const float32_t *R, Cues_t &out) {
+      const int N = BINAURAL_FFT;
+      for (int i = 0; i < N; i++) { work[2 * i] = window[i] * L[i]; work[2 * i + 1] = window[i] * R[i]; }
+      arm_cfft_radix4_f32(&fft_inst, work);
+
+      //separate the two sides, and average their powers and their cross-spectrum, conj(L) * R
+      const float32_t a_new = (n_frames == 0) ? 1.0f : alpha, a_old = 1.0f - a_new;
+      for (int k = 1; k < BINAURAL_N_BINS; k++) {
+        int m = (N - k) & (N - 1);
+        float32_t a = work[2 * k], b = work[2 * k + 1], cc = work[2 * m], d = work[2 * m + 1];
+        float32_t xr = 0.5f * (a + cc), xi = 0.5f * (b - d);  //left
+        float32_t rr = 0.5f * (b + d),  ri = -0.5f * (a - cc); //right
+        pow_L[k] = a_old * pow_L[k] + a_new * (xr * xr + xi * xi);
+        pow_R[k] = a_old * pow_R[k] + a_new * (rr * rr + ri * ri);
+        if ((k >= itd_lo_bin) && (k <= itd_hi_bin)) {
+          cross_re[k] = a_old * cross_re[k] + a_new * (xr * rr + xi * ri);
+          cross_im[k] = a_old * cross_im[k] + a_new * (xr * ri - xi * rr);
+        }
+      }
+      n_frames++;
+
+      //ILD and level for each band
+      const float32_t to_ms = 2.0f / (0.375f * ((float32_t)N) * ((float32_t)N));  //one-sided, and the Hann window's power
+      out.n_bands = n_bands;
+      for (int b = 0; b < n_bands; b++) {
+        float32_t sum_L = 0.0f, sum_R = 0.0f;
+        for (int k = band_start_bin[b]; k < band_start_bin[b + 1]; k++) { sum_L += pow_L[k]; sum_R += pow_R[k]; }
+        out.ild_dB[b] = 10.0f * log10f(max(sum_L, 1.0e-20f) / max(sum_R, 1.0e-20f));
+        out.level_dBFS[b] = 10.0f * log10f(max(0.5f * (sum_L + sum_R) * to_ms, 1.0e-20f));
+      }
+
+      //ITD: PHAT-weight the cross-spectrum (keep only the phase), back to the lag domain, and find the peak
+      for (int i = 0; i < 2 * N; i++) work[i] = 0.0f;
+      for (int k = itd_lo_bin; k <= itd_hi_bin; k++) {
+        float32_t mag = sqrtf(cross_re[k] * cross_re[k] + cross_im[k] * cross_im[k]) + 1.0e-20f;
+        float32_t gr = cross_re[k] / mag, gi = cross_im[k] / mag;
+        work[2 * k] = gr; work[2 * k + 1] = gi;
+        work[2 * (N - k)] = gr; work[2 * (N - k) + 1] = -gi;  //so that the lags come out real
+      }
+      arm_cfft_radix4_f32(&ifft_inst, work);
+      int best = 0;
+      float32_t best_val = -1.0e20f;
+      for (int lag = -max_lag; lag <= max_lag; lag++) {
+        float32_t val = work[2 * ((lag + N) & (N - 1))];
+        if (val > best_val) { best_val = val; best = lag; }
+      }
+      //parabola through the peak and its neighbors, for the fraction of a sample
+      float32_t ym = work[2 * ((best - 1 + N) & (N - 1))], yp = work[2 * ((best + 1 + N) & (N - 1))];
+      float32_t denom = ym - 2.0f * best_val + yp, frac = 0.0f;
+      if (denom < 0.0f) frac = max(-0.5f, min(0.5f, 0.5f * (ym - yp) / denom));
+      out.itd_usec = 1.0e6f * (((float)best) + frac) / sample_rate_Hz;
+      const float32_t n_used = 2.0f * ((float32_t)(itd_hi_bin - itd_lo_bin + 1));  //a perfect match peaks at n_used / N
+      out.coherence = max(0.0f, min(1.0f, best_val * ((float32_t)N) / n_used));
+    }
+
+  private:
+    arm_cfft_radix4_instance_f32 fft_inst, ifft_inst;
+    float sample_rate_Hz = BINAURAL_TARGET_FS_HZ, bin_Hz = BINAURAL_TARGET_FS_HZ / BINAURAL_FFT;
+    float band_edges_Hz[BINAURAL_MAX_BANDS - 1];
+    int n_bands = 4, band_start_bin[BINAURAL_MAX_BANDS + 1];
+    float itd_lo_Hz = 100.0f, itd_hi_Hz = 4000.0f, max_itd_usec = 1000.0f, tau_msec = 100.0f;
+    int itd_lo_bin = 1, itd_hi_bin = 42, max_lag = 24;
+    float32_t alpha = 0.1f;
+    unsigned long n_frames = 0;
+
+    float32_t window[BINAURAL_FFT];
+    float32_t work[2 * BINAURAL_FFT];   //interleaved complex
+    float32_t pow_L[BINAURAL_N_BINS], pow_R[BINAURAL_N_BINS], cross_re[BINAURAL_N_BINS], cross_im[BINAURAL_N_BINS];
+
+    int toBin(float freq_Hz) { return (int)(freq_Hz / bin_Hz + 0.5f); }
+};
+
+class AudioAnalyzeBinaural_F32 : public AudioStream_F32 {
+  //GUI: inputs:4, outputs:0 //this line used for automatic generation of GUI node
+  public:
+    //inputs 0-1 are the first pair (L, R), 2-3 are the second pair
+    AudioAnalyzeBinaural_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2 * BINAURAL_N_PAIRS, inputQueueArray) {
+      decimation = max(1, (int)(settings.sample_rate_Hz / BINAURAL_TARGET_FS_HZ + 0.5f));
+      const float fs_decimated_Hz = settings.sample_rate_Hz / ((float)decimation);
+      antiAlias.setSampleRate_Hz(settings.sample_rate_Hz);
+      antiAlias.setLowpass(0, 0.4f * fs_decimated_Hz, 0.5412f);  //4th-order Butterworth, as two sections
+      antiAlias.setLowpass(1, 0.4f * fs_decimated_Hz, 1.3066f);
+      if (decimation == 1) antiAlias.setNumSections(0);
+      for (int p = 0; p < BINAURAL_N_PAIRS; p++) {
+        core[p].setSampleRate_Hz(fs_decimated_Hz);
+        core[p].reset();
+        memset(&cues[p], 0, sizeof(cues[p]));
+      }
+    }
+
+    //starts (and restarts) the averaging
+    void enable(bool state) {
+      if (state && !enabled) {
+        for (int p = 0; p < BINAURAL_N_PAIRS; p++) core[p].reset();
+        fill_ind = 0; ready = false;
+      }
+      enabled = state;
+    }
+    bool isEnabled(void) { return enabled; }
+    void setBands_Hz(const float *edges_Hz, int n_edges) { for (int p = 0; p < BINAURAL_N_PAIRS; p++) core[p].setBands_Hz(edges_Hz, n_edges); }
+    BinauralCues_Core &getCore(int pair) { return core[max(0, min(pair, BINAURAL_N_PAIRS - 1))]; }
+    int getDecimation(void) { return decimation; }
+
+    //call from loop().  Analyzes the waiting frame, if there is one.  Returns true if there was.
+    bool service(void) {
+      if (!ready) return false;
+      asm volatile("" ::: "memory");  //the ISR finished the frame before it set ready
+      uint32_t start = micros();
+      for (int p = 0; p < BINAURAL_N_PAIRS; p++) core[p].analyze(frames[ready_buf][2 * p], frames[ready_buf][2 * p + 1], cues[p]);
+      asm volatile("" ::: "memory");
+      ready = false;
+      last_service_usec = micros() - start;
+      return true;
+    }
+    const BinauralCues_Core::Cues_t &getCues(int pair) { return cues[max(0, min(pair, BINAURAL_N_PAIRS - 1))]; }
+    uint32_t getLastServiceTime_usec(void) { return last_service_usec; }
+    unsigned long getNSkipped(void) { return n_skipped; }
+
+    virtual void update(void) {
+      audio_block_f32_t *blocks[2 * BINAURAL_N_PAIRS];
+      int n = 0;
+      for (int c = 0; c < 2 * BINAURAL_N_PAIRS; c++) {
+        blocks[c] = receiveReadOnly_f32(c);
+        if (blocks[c]) n = blocks[c]->length;
+      }
+      if (enabled && (n > 0)) {
+        //copy, so that they can be filtered in place.  A missing channel is silence.
+        float32_t *data[2 * BINAURAL_N_PAIRS];
+        int chans[2 * BINAURAL_N_PAIRS];
+        for (int c = 0; c < 2 * BINAURAL_N_PAIRS; c++) {
+          if (blocks[c]) arm_copy_f32(blocks[c]->data, block_work[c], n); else arm_fill_f32(0.0f, block_work[c], n);
+          data[c] = block_work[c]; chans[c] = c;
+        }
+        antiAlias.process(data, chans, 2 * BINAURAL_N_PAIRS, n);
+
+        //keep every D-th sample
+        for (int i = decim_phase; i < n; i += decimation) {
+          for (int c = 0; c < 2 * BINAURAL_N_PAIRS; c++) frames[fill_buf][c][fill_ind] = block_work[c][i];
+          if (++fill_ind >= BINAURAL_FFT) {
+            fill_ind = 0;
+            if (!ready) {
+              ready_buf = fill_buf;
+              fill_buf ^= 1;
+              asm volatile("" ::: "memory");
+              ready = true;
+            } else {
+              n_skipped++;  //loop() is still on the last one.  Write over this one.
+            }
+          }
+        }
+        decim_phase = (decim_phase + (decimation - (n % decimation))) % decimation;
+      }
+      for (int c = 0; c < 2 * BINAURAL_N_PAIRS; c++) if (blocks[c]) AudioStream_F32::release(blocks[c]);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2 * BINAURAL_N_PAIRS];
+    bool enabled = false;
+    int decimation = 4, decim_phase = 0;
+    SOS_Core antiAlias;
+    float32_t block_work[2 * BINAURAL_N_PAIRS][AUDIO_BLOCK_SAMPLES];
+
+    //two sets of frames: the ISR fills one while loop() analyzes the other
+    float32_t frames[2][2 * BINAURAL_N_PAIRS][BINAURAL_FFT];
+    volatile int fill_buf = 0, ready_buf = 1, fill_ind = 0;
+    volatile bool ready = false;
+    unsigned long n_skipped = 0;
+
+    BinauralCues_Core core[BINAURAL_N_PAIRS];
+    BinauralCues_Core::Cues_t cues[BINAURAL_N_PAIRS];
+    uint32_t last_service_usec = 0;
+};
+
+#endif
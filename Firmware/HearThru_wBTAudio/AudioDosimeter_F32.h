@@ -0,0 +1,183 @@
+
+/*
+   AudioDosimeter_F32
+
+   Purpose: Noise-exposure measurement at up to four points (eg, the two mics and the two
+     ear outputs).  Every second, for each channel, it makes:
+       * LAeq: the A-weighted level, averaged (energy) over the second
+       * LCpeak: the largest C-weighted sample in the second
+     in dB SPL, using the same calibration as the compressors (the dB SPL of an RMS of 1.0).
+     It only listens (no outputs).  The per-second results go into a small queue that
+     loop() empties (see DoseLogger.h), so the logging and the logs are done out of the ISR.
+
+   Weighting filters (IEC 61672 poles, via the bilinear transform):
+       C(s) = k s^2 / ((s + w1)^2 (s + w4)^2)
+       A(s) = C(s) * s^2 / ((s + w2)(s + w3))
+     So C is two biquads, and A is C plus one more biquad.  The peak is taken between the two
+     stages, which gives both weightings for three biquads per channel.  Each is normalized
+     to 0 dB at 1 kHz.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioDosimeter_F32_h
+#define _AudioDosimeter_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+#include "SOS_Core.h"
+
+#define DOSIMETER_N_CHAN (4)
+#define DOSIMETER_QUEUE_LEN (8)   //seconds.  Must be a power of two.
+
+class AudioDosimeter_F32 : public AudioStream_F32 {
+  //GUI: inputs:4, outputs:0 //this line used for automatic generation of GUI node
+  public:
+    //one second of results (linear: mean-square A-weighted, and peak C-weighted)
+    struct Second_t {
+      uint32_t sec;
+      float32_t a_ms[DOSIMETER_N_CHAN];
+      float32_t c_peak[DOSIMETER_N_CHAN];
+    };
+
+    AudioDosimeter_F32(const AudioSettings_F32 &settings) : AudioStream_F32(DOSIMETER_N_CHAN, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      samples_per_sec = (uint32_t)(sample_rate_Hz + 0.5f);
+      cWeight.setSampleRate_Hz(sample_rate_Hz);
+      aFromC.setSampleRate_Hz(sample_rate_Hz);
+      designWeightings();
+      resetIntegrators();
+    }
+
+    void enable(bool state) { enabled = state; }
+    bool isEnabled(void) { return enabled; }
+    void setCalibration_dBSPL(float dBSPL_at_FS) { cal_dBSPL = dBSPL_at_FS; }
+    float getCalibration_dBSPL(void) { return cal_dBSPL; }
+    float getSampleRate_Hz(void) { return sample_rate_Hz; }
+
+    //from loop().  Returns false if no new second is ready.
+    bool getSecond(Second_t &out) {
+      if (tail == head) return false;
+      out = queue[tail];
+      asm volatile("" ::: "memory");  //finish the copy before giving the slot back
+      tail = (tail + 1) & (DOSIMETER_QUEUE_LEN - 1);
+      return true;
+    }
+    unsigned long getNDropped(void) { return n_dropped; }
+
+    float toLeq_dBSPL(float32_t mean_sq) { return 10.0f * log10f(max(mean_sq, 1.0e-20f)) + cal_dBSPL; }
+    float toPeak_dBSPL(float32_t peak) { return 20.0f * log10f(max(peak, 1.0e-10f)) + cal_dBSPL; }
+
+    virtual void update(void);
+
+  private:
+    audio_block_f32_t *inputQueueArray[DOSIMETER_N_CHAN];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    float cal_dBSPL = 115.0f;
+    bool enabled = true;
+    SOS_Core cWeight, aFromC;
+    float32_t work[DOSIMETER_N_CHAN][AUDIO_BLOCK_SAMPLES];  //the inputs are read-only, so filter a copy
+
+    //integrating the current second
+    uint32_t samples_per_sec = 96000, n_samples = 0, cur_sec = 0;
+    float32_t sum_sq[DOSIMETER_N_CHAN], peak[DOSIMETER_N_CHAN];
+
+    //finished seconds, for loop().  The ISR only moves head, loop() only moves tail.
+    Second_t queue[DOSIMETER_QUEUE_LEN];
+    volatile uint32_t head = 0, tail = 0;
+    unsigned long n_dropped = 0;
+
+    void resetIntegrators(void) {
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) { sum_sq[c] = 0.0f; peak[c] = 0.0f; }
+      n_samples = 0;
+    }
+
+    void designWeightings(void) {
+      const double w1 = 2.0 * M_PI * 20.598997, w2 = 2.0 * M_PI * 107.65265, w3 = 2.0 * M_PI * 737.86223, w4 = 2.0 * M_PI * 12194.217;
+      double b[3], a[3];
+
+      //C: s^2/(s+w1)^2, then w4^2/(s+w4)^2
+      const double b_c1[3] = {1.0, 0.0, 0.0}, a_c1[3] = {1.0, 2.0 * w1, w1 * w1};
+      const double b_c2[3] = {0.0, 0.0, w4 * w4}, a_c2[3] = {1.0, 2.0 * w4, w4 * w4};
+      bilinear(b_c1, a_c1, b, a);
+      double g = gainAt1kHz(b, a);
+      setSection(cWeight, 0, b, a, 1.0);
+      bilinear(b_c2, a_c2, b, a);
+      g *= gainAt1kHz(b, a);
+      setSection(cWeight, 1, b, a, 1.0 / g);  //C is 0 dB at 1 kHz
+
+      //A, from C: s^2/((s+w2)(s+w3))
+      const double b_a[3] = {1.0, 0.0, 0.0}, a_a[3] = {1.0, w2 + w3, w2 * w3};
+      bilinear(b_a, a_a, b, a);
+      setSection(aFromC, 0, b, a, 1.0 / gainAt1kHz(b, a));  //and so is A
+    }
+
+    //analog (b0 s^2 + b1 s + b2)/(a0 s^2 + a1 s + a2) to digital, s = 2 fs (1 - z^-1)/(1 + z^-1)
+    void bilinear(const double *bs, const double *as, double *bz, double *az) {
+      const double K = 2.0 * sample_rate_Hz, K2 = K * K;
+      bz[0] = bs[0] * K2 + bs[1] * K + bs[2];  bz[1] = 2.0 * (bs[2] - bs[0] * K2);  bz[2] = bs[0] * K2 - bs[1] * K + bs[2];
+      az[0] = as[0] * K2 + as[1] * K + as[2];  az[1] = 2.0 * (as[2] - as[0] * K2);  az[2] = as[0] * K2 - as[1] * K + as[2];
+    }
+    double gainAt1kHz(const double *b, const double *a) {
+      const double w = 2.0 * M_PI * 1000.0 / sample_rate_Hz, c1 = cos(w), s1 = sin(w), c2 = cos(2.0 * w), s2 = sin(2.0 * w);
+      double nr = b[0] + b[1] * c1 + b[2] * c2, ni = -(b[1] * s1 + b[2] * s2);
+      double dr = a[0] + a[1] * c1 + a[2] * c2, di = -(a[1] * s1 + a[2] * s2);
+      return sqrt((nr * nr + ni * ni) / (dr * dr + di * di));
+    }
+    void setSection(SOS_Core &sos, int section, const double *b, const double *a, double gain) {
+      float32_t bf[3] = {(float32_t)(b[0] * gain), (float32_t)(b[1] * gain), (float32_t)(b[2] * gain)};
+      float32_t af[3] = {(float32_t)a[0], (float32_t)a[1], (float32_t)a[2]};
+      sos.setCoefficients(section, bf, af);
+    }
+};
+
+void AudioDosimeter_F32::update(void) {
+  float32_t *data[DOSIMETER_N_CHAN];
+  int chans[DOSIMETER_N_CHAN], n_active = 0, n = 0;
+  for (int c = 0; c < DOSIMETER_N_CHAN; c++) {
+    audio_block_f32_t *block = receiveReadOnly_f32(c);
+    if (!block) continue;
+    if (enabled) {
+      n = block->length;
+      arm_copy_f32(block->data, work[n_active], n);
+      data[n_active] = work[n_active]; chans[n_active] = c; n_active++;
+    }
+    AudioStream_F32::release(block);
+  }
+  if (n_active == 0) return;
+
+  //C-weighting, and its peak
+  cWeight.process(data, chans, n_active, n);
+  for (int k = 0; k < n_active; k++) {
+    float32_t block_peak; uint32_t ind;
+    arm_absmax_f32(data[k], n, &block_peak, &ind);
+    if (block_peak > peak[chans[k]]) peak[chans[k]] = block_peak;
+  }
+
+  //then on to A-weighting, and its energy
+  aFromC.process(data, chans, n_active, n);
+  for (int k = 0; k < n_active; k++) {
+    float32_t block_sum_sq;
+    arm_power_f32(data[k], n, &block_sum_sq);
+    sum_sq[chans[k]] += block_sum_sq;
+  }
+
+  //end of a second?
+  n_samples += n;
+  if (n_samples >= samples_per_sec) {
+    uint32_t next = (head + 1) & (DOSIMETER_QUEUE_LEN - 1);
+    if (next != tail) {
+      Second_t &s = queue[head];
+      s.sec = cur_sec;
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) { s.a_ms[c] = sum_sq[c] / ((float32_t)n_samples); s.c_peak[c] = peak[c]; }
+      asm volatile("" ::: "memory");  //fill the slot before handing it over
+      head = next;
+    } else {
+      n_dropped++;  //loop() isn't keeping up.  Lose this second.
+    }
+    cur_sec++;
+    resetIntegrators();
+  }
+}
+
+#endif
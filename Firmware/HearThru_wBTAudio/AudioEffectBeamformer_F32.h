@@ -0,0 +1,201 @@
+
+/*
+   AudioEffectBeamformer_F32
+
+   Purpose: Two-mic directional processing for one ear: a front mic and a rear mic on the
+     same earcup, a few mm apart, so the sound from the front reaches the front mic first.
+     Modes:
+       * OFF: the front mic, as is
+       * DELAY_SUM: delay the front mic by the travel time between the mics and add the
+         rear.  Mild: at these spacings it mostly helps at the top of the band.
+       * DIFFERENTIAL: front minus the delayed rear.  A cardioid, with its null at the back.
+       * ADAPTIVE: two back-to-back cardioids (front-facing and rear-facing), and the rear
+         one is subtracted with whatever weight (beta, 0 to 1) makes the output quietest.
+         That steers the null onto the loudest noise behind the listener: from straight
+         behind (beta = 0) to the side (beta = 1).  NLMS, one weight.
+     The travel time is a fraction of a sample (14 mm is 3.9 samples at 96 kHz), so the
+     delays are 3rd-order Lagrange FIRs, 4 taps.
+
+   The differential outputs fall off at 6 dB/octave toward the low end, so they go through a
+   one-pole low-pass (an integrator above its corner) that flattens them back to the level
+   of the front mic.  Below the corner, they are left to fall off, rather than boosting the
+   wind and the mic noise.
+
+   It is all a few multiplies per sample, so it runs at the full 96 kHz.  No decimation is
+   needed.  Beamformer_Core is the processing on its own, so that it can be tested with
+   synthetic sources outside of the audio graph (Tools/HostSim/BeamformerSim, on the host).
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectBeamformer_F32_h
+#define _AudioEffectBeamformer_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define BEAM_MAX_DELAY (16)                  //samples.  50 mm at 96 kHz.
+#define BEAM_HIST (BEAM_MAX_DELAY + 4)       //past samples kept for the delays
+#define BEAM_SPEED_OF_SOUND_MPS (343.0f)
+
+class Beamformer_Core {
+  public:
+    enum class MODE { OFF = 0, DELAY_SUM, DIFFERENTIAL, ADAPTIVE, N_MODES };
+
+    Beamformer_Core(void) { reset(); }
+
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; setSpacing_mm(spacing_mm); }
+    float setSpacing_mm(float mm) {
+      float max_mm = 1000.0f * BEAM_SPEED_OF_SOUND_MPS * ((float)(BEAM_MAX_DELAY - 1)) / sample_rate_Hz;
+      spacing_mm = max(1.0f, min(mm, max_mm));
+      tau_samples = 0.001f * spacing_mm / BEAM_SPEED_OF_SOUND_MPS * sample_rate_Hz;
+      designDelay(tau_samples);
+      setEqCorner_Hz(eq_Hz);
+      return spacing_mm;
+    }
+    float getSpacing_mm(void) { return spacing_mm; }
+    float getDelay_samples(void) { return tau_samples; }
+    void setEqCorner_Hz(float Hz) {
+      eq_Hz = max(20.0f, Hz);
+      eq_alpha = 1.0f - expf(-2.0f * M_PI * eq_Hz / sample_rate_Hz);
+      const float tau_sec = tau_samples / sample_rate_Hz;
+      eq_gain = 1.0f / (2.0f * tau_sec * 2.0f * M_PI * eq_Hz);  //on-axis, a cardioid is 2*w*tau.  The low-pass is w_eq/w.
+    }
+    void setAdaptRate(float _mu) { mu = max(0.0f, min(_mu, 0.1f)); }
+    float getAdaptRate(void) { return mu; }
+
+    void setMode(MODE m) { if (m != mode) { mode = m; eq_state = 0.0f; } }
+    MODE getMode(void) { return mode; }
+    static const char *getModeName(MODE m) {
+      switch (m) {
+        case MODE::OFF: return "OFF";
+        case MODE::DELAY_SUM: return "Delay-and-Sum";
+        case MODE::DIFFERENTIAL: return "Differential (cardioid)";
+        case MODE::ADAPTIVE: return "Adaptive Null";
+        default: return "?";
+      }
+    }
+
+    //for the adaptive mode.  The null is where the front cardioid (1 + cos) equals beta times the rear one (1 - cos).
+    float getBeta(void) { return beta; }
+    float getNullAngle_deg(void) { return 180.0f / M_PI * acosf((beta - 1.0f) / (beta + 1.0f)); }
+
+    void reset(void) {
+      for (int i = 0; i < BEAM_HIST; i++) { buf_f[i] = 0.0f; buf_r[i] = 0.0f; }
+      eq_state = 0.0f; beta = 0.0f; p_back = 1.0e-6f;
+    }
+
+    //n must be AUDIO_BLOCK_SAMPLES or fewer
+    void process(const float32_t *front, const float32_t *rear, float32_t *out, int n) {
+      //the history and the new block, end to end, so that the delays can reach back
+      arm_copy_f32(front, buf_f + BEAM_HIST, n);
+      arm_copy_f32(rear, buf_r + BEAM_HIST, n);
+      const float32_t *f = buf_f + BEAM_HIST, *r = buf_r + BEAM_HIST;
+
+      switch (mode) {
+        case MODE::OFF:
+          arm_copy_f32(front, out, n);
+          break;
+        case MODE::DELAY_SUM:
+          for (int i = 0; i < n; i++) out[i] = 0.5f * (delayed(f + i) + r[i]);
+          break;
+        case MODE::DIFFERENTIAL:
+          for (int i = 0; i < n; i++) out[i] = f[i] - delayed(r + i);
+          equalize(out, n);
+          break;
+        case MODE::ADAPTIVE: {
+          //the two cardioids, then the weight, one sample at a time (NLMS on one tap)
+          float32_t cb_pow = 0.0f;
+          for (int i = 0; i < n; i++) {
+            cf[i] = f[i] - delayed(r + i);
+            cb[i] = r[i] - delayed(f + i);
+            cb_pow += cb[i] * cb[i];
+          }
+          p_back += 0.2f * (cb_pow / ((float32_t)n) - p_back);
+          const float32_t step = mu / (p_back + 1.0e-10f);
+          float32_t b = beta;
+          for (int i = 0; i < n; i++) {
+            float32_t y = cf[i] - b * cb[i];
+            b += step * y * cb[i];
+            b = max(0.0f, min(b, 1.0f));  //keep the null behind the listener
+            out[i] = y;
+          }
+          beta = b;
+          equalize(out, n);
+          break;
+        }
+        default:
+          arm_copy_f32(front, out, n);
+      }
+
+      //keep the end of this block for the next one
+      for (int i = 0; i < BEAM_HIST; i++) { buf_f[i] = buf_f[n + i]; buf_r[i] = buf_r[n + i]; }
+    }
+
+  private:
+    MODE mode = MODE::OFF;
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    float spacing_mm = 14.0f, tau_samples = 3.9f, eq_Hz = 200.0f;
+    float32_t eq_alpha = 0.013f, eq_gain = 10.0f, eq_state = 0.0f;
+    float32_t mu = 0.002f, beta = 0.0f, p_back = 1.0e-6f;
+    int delay_int = 2;        //the first of the four taps
+    float32_t h[4];           //Lagrange taps
+    float32_t buf_f[BEAM_HIST + AUDIO_BLOCK_SAMPLES], buf_r[BEAM_HIST + AUDIO_BLOCK_SAMPLES];  //the history, then the block
+    float32_t cf[AUDIO_BLOCK_SAMPLES], cb[AUDIO_BLOCK_SAMPLES];
+
+    //3rd-order Lagrange: taps at delay_int..delay_int+3, with the fraction kept between 1 and 2 (the flattest part)
+    void designDelay(float D) {
+      delay_int = max(0, ((int)D) - 1);
+      const float d = D - ((float)delay_int);
+      h[0] = -(d - 1.0f) * (d - 2.0f) * (d - 3.0f) / 6.0f;
+      h[1] = d * (d - 2.0f) * (d - 3.0f) / 2.0f;
+      h[2] = -d * (d - 1.0f) * (d - 3.0f) / 2.0f;
+      h[3] = d * (d - 1.0f) * (d - 2.0f) / 6.0f;
+    }
+    inline float32_t delayed(const float32_t *x) {  //x points at the current sample
+      const float32_t *p = x - delay_int;
+      return h[0] * p[0] + h[1] * p[-1] + h[2] * p[-2] + h[3] * p[-3];
+    }
+    void equalize(float32_t *x, int n) {
+      float32_t s = eq_state;
+      for (int i = 0; i < n; i++) { s += eq_alpha * (x[i] - s); x[i] = eq_gain * s; }
+      eq_state = s;
+    }
+};
+
+class AudioEffectBeamformer_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:1 //this line used for automatic generation of GUI node
+  public:
+    //input 0 is the front mic, input 1 is the rear mic
+    AudioEffectBeamformer_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      core.setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+    Beamformer_Core &getCore(void) { return core; }
+
+    virtual void update(void) {
+      audio_block_f32_t *front = receiveReadOnly_f32(0), *rear = receiveReadOnly_f32(1);
+      if (!front) { if (rear) AudioStream_F32::release(rear); return; }
+      if (!rear || (core.getMode() == Beamformer_Core::MODE::OFF)) {
+        //nothing to do (or no rear mic).  Pass the front along.
+        transmit(front);
+        AudioStream_F32::release(front);
+        if (rear) AudioStream_F32::release(rear);
+        return;
+      }
+      audio_block_f32_t *out = AudioStream_F32::allocate_f32();
+      if (out) {
+        core.process(front->data, rear->data, out->data, front->length);
+        out->length = front->length;
+        transmit(out);
+        AudioStream_F32::release(out);
+      }
+      AudioStream_F32::release(front);
+      AudioStream_F32::release(rear);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    Beamformer_Core core;
+};
+
+#endif
@@ -0,0 +1,106 @@
+
+/*
+   AudioEffectDucker_F32
+
+   Purpose: Turn the hear-thru down while the BT audio (a call, comms, music) is playing, so
+     that it can be heard over the room, and bring it back up once the BT audio stops.
+     Inputs 0-1 are the hear-thru L/R (they get ducked), inputs 2-3 are the side-chain, ie
+     the BT audio L/R (they are only listened to).  Outputs 0-1 are the ducked hear-thru.
+
+   Detection: the louder side-chain channel's mean-square over each block, against a
+     threshold.  Once it goes quiet, the gain holds for a while (the gaps between words)
+     before it is released.  It is stereo-linked, so the image doesn't shift.
+   Gain: moves sample by sample (one-pole) toward the ducked gain or toward unity, with
+     separate attack and release times, so it can't click.
+
+   With no side-chain connected, or at unity gain with nothing playing, the hear-thru
+   blocks go straight through.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectDucker_F32_h
+#define _AudioEffectDucker_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+class AudioEffectDucker_F32 : public AudioStream_F32 {
+  //GUI: inputs:4, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioEffectDucker_F32(const AudioSettings_F32 &settings) : AudioStream_F32(4, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      setThreshold_dBFS(-50.0f);
+      setDepth_dB(-15.0f);
+      setAttack_msec(10.0f);
+      setHold_msec(300.0f);
+      setRelease_msec(500.0f);
+    }
+
+    void enable(bool state) { enabled = state; }
+    bool isEnabled(void) { return enabled; }
+    void setThreshold_dBFS(float dB) { thresh_dBFS = dB; thresh_ms = powf(10.0f, dB / 10.0f); }
+    float getThreshold_dBFS(void) { return thresh_dBFS; }
+    void setDepth_dB(float dB) { depth_dB = min(dB, 0.0f); depth_gain = powf(10.0f, depth_dB / 20.0f); }
+    float getDepth_dB(void) { return depth_dB; }
+    void setAttack_msec(float msec) { attack_msec = max(0.1f, msec); attack_coeff = expf(-1.0f / (0.001f * attack_msec * sample_rate_Hz)); }
+    void setHold_msec(float msec) { hold_msec = max(0.0f, msec); hold_samples = (int)(0.001f * hold_msec * sample_rate_Hz); }
+    void setRelease_msec(float msec) { release_msec = max(0.1f, msec); release_coeff = expf(-1.0f / (0.001f * release_msec * sample_rate_Hz)); }
+
+    bool isDucking(void) { return ducking; }
+    float getGain_dB(void) { return 20.0f * log10f(max(gain, 1.0e-6f)); }
+
+    virtual void update(void) {
+      audio_block_f32_t *side[2];
+      for (int c = 0; c < 2; c++) side[c] = receiveReadOnly_f32(2 + c);
+
+      //detect, on the louder side-chain channel
+      if (enabled && (side[0] || side[1])) {
+        float32_t ms = 0.0f;
+        for (int c = 0; c < 2; c++) {
+          if (!side[c]) continue;
+          float32_t pow_sum;
+          arm_power_f32(side[c]->data, side[c]->length, &pow_sum);
+          ms = max(ms, pow_sum / ((float32_t)side[c]->length));
+        }
+        if (ms > thresh_ms) { ducking = true; hold_left = hold_samples; }
+        else if (hold_left > 0) hold_left -= (side[0] ? side[0] : side[1])->length;
+        else ducking = false;
+      } else {
+        ducking = false;
+      }
+      for (int c = 0; c < 2; c++) if (side[c]) AudioStream_F32::release(side[c]);
+
+      //apply, or just pass them along if there's nothing to do
+      const float32_t target = ducking ? depth_gain : 1.0f;
+      audio_block_f32_t *prog[2] = { receiveWritable_f32(0), receiveWritable_f32(1) };
+      if ((gain != 1.0f) || (target != 1.0f)) {
+        const float32_t coeff = (target < gain) ? attack_coeff : release_coeff;
+        float32_t g = gain;
+        const int n = prog[0] ? prog[0]->length : (prog[1] ? prog[1]->length : 0);
+        for (int i = 0; i < n; i++) {
+          g = target + coeff * (g - target);
+          if (prog[0]) prog[0]->data[i] *= g;
+          if (prog[1]) prog[1]->data[i] *= g;
+        }
+        if ((target == 1.0f) && (g > 0.9999f)) g = 1.0f;  //back up.  Stop paying for it.
+        gain = g;
+      }
+      for (int c = 0; c < 2; c++) {
+        if (!prog[c]) continue;
+        transmit(prog[c], c);
+        AudioStream_F32::release(prog[c]);
+      }
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[4];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    bool enabled = true, ducking = false;
+    float thresh_dBFS = -50.0f, depth_dB = -15.0f, attack_msec = 10.0f, hold_msec = 300.0f, release_msec = 500.0f;
+    float32_t thresh_ms = 1.0e-5f, depth_gain = 0.18f, attack_coeff = 0.999f, release_coeff = 0.99998f;
+    float32_t gain = 1.0f;
+    int hold_samples = 28800, hold_left = 0;
+};
+
+#endif
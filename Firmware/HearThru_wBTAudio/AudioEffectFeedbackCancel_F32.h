@@ -0,0 +1,226 @@
+
+/*
+   AudioEffectFeedbackCancel_F32
+
+   Purpose: Acoustic feedback cancellation, for more hear-thru gain before the earcup rings.
+     The speaker and the mic share the earcup, so some of the output comes straight back in.
+     An adaptive FIR learns that path (from the output that we sent, the "reference", to
+     the mic), and its estimate of the feedback is subtracted from the mic.
+
+   Filter: NLMS, using CMSIS's arm_lms_norm_f32(), which does the filtering and the update
+     together, a block at a time.  Each ear has its own (the two earcups are separate).
+   Decorrelation: in a closed loop, the speaker signal is a delayed, amplified copy of the
+     outside sound, so plain NLMS also "cancels" whatever in the outside sound is predictable
+     (a tone, a vowel, a hum), and the taps wander off the real path.  So, by default, the
+     adaptation is prewhitened (PEM): a short LPC model of the outside sound is fit to the
+     canceller's own output every block, and the taps are adapted on the reference and the
+     mic after both go through that model's inverse (whitening) filter.  The cancellation
+     itself still uses the raw reference (arm_fir_f32, with the same taps).  setPrewhitening(false)
+     goes back to plain NLMS.
+   Alignment: most of the feedback path is just delay (the I2S buffers and the converters),
+     so the reference goes through a plain delay line first, and the taps only have to
+     cover what is left.  The delay should be the measured loopback latency, minus the one
+     block that the graph already adds (the reference comes from the end of the graph, so
+     it arrives a block late), minus a few samples of margin.  See setBulkDelayFromLoopback().
+
+   Memory: everything is a fixed-size member sized for the most taps and the longest delay,
+     so nothing is allocated and nothing moves when the settings change.
+
+   FeedbackCancel_Core is one channel of it, on its own, so that it can be tested in a
+   simulated loop outside of the audio graph (Tools/HostSim/FeedbackSim, on the host).
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectFeedbackCancel_F32_h
+#define _AudioEffectFeedbackCancel_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define FBC_MAX_TAPS (128)       //1.3 msec at 96 kHz
+#define FBC_MAX_DELAY (512)      //samples of bulk delay.  Must be a power of two.
+#define FBC_MARGIN_SAMPLES (8)   //start the taps a little before the measured latency
+#define FBC_LPC_ORDER (12)       //of the prewhitening model
+#define FBC_ACORR_ALPHA (0.98f)  //smoothing of its autocorrelation, per block
+
+class FeedbackCancel_Core {
+  public:
+    FeedbackCancel_Core(void) { setTaps(64); }
+
+    int setTaps(int n) {
+      n_taps = max(4, min(n, FBC_MAX_TAPS));
+      arm_lms_norm_init_f32(&lms, n_taps, coeff, state, mu, AUDIO_BLOCK_SAMPLES);  //zeros the state
+      arm_fir_init_f32(&fir, n_taps, coeff, fir_state, AUDIO_BLOCK_SAMPLES);
+      reset();
+      return n_taps;
+    }
+    int getTaps(void) { return n_taps; }
+    int setBulkDelay_samples(int n) { bulk_delay = max(0, min(n, FBC_MAX_DELAY - AUDIO_BLOCK_SAMPLES)); return bulk_delay; }
+    int getBulkDelay_samples(void) { return bulk_delay; }
+    void setStepSize(float _mu) { mu = max(0.0f, min(_mu, 1.0f)); lms.mu = mu; }  //normalized: 0 freezes the filter
+    float getStepSize(void) { return mu; }
+    void setPrewhitening(bool state) { if (state != prewhiten) { prewhiten = state; reset(); } }
+    bool getPrewhitening(void) { return prewhiten; }
+
+    void reset(void) {
+      arm_fill_f32(0.0f, coeff, FBC_MAX_TAPS);
+      arm_fill_f32(0.0f, state, FBC_MAX_TAPS + AUDIO_BLOCK_SAMPLES);
+      arm_fill_f32(0.0f, delay_line, FBC_MAX_DELAY);
+      arm_fill_f32(0.0f, fir_state, FBC_MAX_TAPS + AUDIO_BLOCK_SAMPLES);
+      lms.energy = 0.0f; lms.x0 = 0.0f;
+      write_ind = 0;
+      arm_fill_f32(0.0f, lpc, FBC_LPC_ORDER + 1); lpc[0] = 1.0f;  //no whitening until there is a model
+      arm_fill_f32(0.0f, acorr, FBC_LPC_ORDER + 1);
+      arm_fill_f32(0.0f, mic_hist, FBC_LPC_ORDER);
+      arm_fill_f32(0.0f, ref_hist, FBC_LPC_ORDER);
+      arm_fill_f32(0.0f, out_hist, FBC_LPC_ORDER);
+    }
+
+    //how much of the feedback path has been learned, as the sum of the squared taps, in dB
+    float getPathGain_dB(void) {
+      float32_t sum_sq;
+      arm_power_f32(coeff, n_taps, &sum_sq);
+      return 10.0f * log10f(max(sum_sq, 1.0e-20f));
+    }
+    //tap j applies to the reference delayed by bulk delay + j samples
+    float32_t getTap(int j) { return ((j >= 0) && (j < n_taps)) ? coeff[n_taps - 1 - j] : 0.0f; }  //CMSIS keeps them time-reversed
+
+    //mic in, the mic minus the estimated feedback out.  ref is what went to the speaker.
+    void process(const float32_t *mic, const float32_t *ref, float32_t *out, int n) {
+      //the reference, through the bulk delay
+      for (int i = 0; i < n; i++) {
+        delay_line[write_ind] = ref[i];
+        delayed_ref[i] = delay_line[(write_ind - bulk_delay) & (FBC_MAX_DELAY - 1)];
+        write_ind = (write_ind + 1) & (FBC_MAX_DELAY - 1);
+      }
+
+      //(The instances are pointed back at our own buffers every time, so that a copy of this
+      //object is a real copy.)
+      lms.pState = state; lms.pCoeffs = coeff; lms.numTaps = n_taps; lms.mu = mu;
+      if (!prewhiten) {
+        //filter, subtract, and update, all in one go
+        arm_lms_norm_f32(&lms, delayed_ref, (float32_t *)mic, estimate, out, n);
+        return;
+      }
+
+      //cancel with the current taps
+      fir.pState = fir_state; fir.pCoeffs = coeff; fir.numTaps = n_taps;
+      arm_fir_f32(&fir, delayed_ref, estimate, n);
+      arm_sub_f32((float32_t *)mic, estimate, out, n);
+
+      //adapt on the whitened mic and reference, then update the model from what came out
+      whiten(mic, mic_hist, white_mic, n);
+      whiten(delayed_ref, ref_hist, white_ref, n);
+      arm_lms_norm_f32(&lms, white_ref, white_mic, estimate, white_err, n);
+      updateModel(out, n);
+    }
+
+  private:
+    arm_lms_norm_instance_f32 lms;
+    arm_fir_instance_f32 fir;
+    int n_taps = 64, bulk_delay = 56, write_ind = 0;
+    float mu = 0.005f;
+    bool prewhiten = true;
+    float32_t coeff[FBC_MAX_TAPS];
+    float32_t state[FBC_MAX_TAPS + AUDIO_BLOCK_SAMPLES];
+    float32_t fir_state[FBC_MAX_TAPS + AUDIO_BLOCK_SAMPLES];
+    float32_t delay_line[FBC_MAX_DELAY];
+    float32_t delayed_ref[AUDIO_BLOCK_SAMPLES], estimate[AUDIO_BLOCK_SAMPLES];
+
+    //the prewhitening: A(z) = 1 + lpc[1] z^-1 + ... , the inverse of the outside sound's model
+    float32_t lpc[FBC_LPC_ORDER + 1], acorr[FBC_LPC_ORDER + 1];
+    float32_t mic_hist[FBC_LPC_ORDER], ref_hist[FBC_LPC_ORDER], out_hist[FBC_LPC_ORDER];  //newest first
+    float32_t white_mic[AUDIO_BLOCK_SAMPLES], white_ref[AUDIO_BLOCK_SAMPLES], white_err[AUDIO_BLOCK_SAMPLES];
+
+    void whiten(const float32_t *x, float32_t *hist, float32_t *y, int n) {
+      for (int i = 0; i < n; i++) {
+        float32_t acc = x[i];
+        for (int k = 1; k <= FBC_LPC_ORDER; k++) acc += lpc[k] * ((i - k >= 0) ? x[i - k] : hist[k - i - 1]);
+        y[i] = acc;
+      }
+      for (int k = 0; k < FBC_LPC_ORDER; k++) hist[k] = (n - 1 - k >= 0) ? x[n - 1 - k] : hist[k - n];
+    }
+
+    //smooth the autocorrelation of the canceller's output (our best guess at the outside
+    //sound), and refit the model to it (Levinson-Durbin)
+    void updateModel(const float32_t *x, int n) {
+      for (int k = 0; k <= FBC_LPC_ORDER; k++) {
+        float32_t r = 0.0f;
+        for (int i = 0; i < n; i++) r += x[i] * ((i - k >= 0) ? x[i - k] : out_hist[k - i - 1]);
+        acorr[k] = FBC_ACORR_ALPHA * acorr[k] + (1.0f - FBC_ACORR_ALPHA) * r;
+      }
+      for (int k = 0; k < FBC_LPC_ORDER; k++) out_hist[k] = (n - 1 - k >= 0) ? x[n - 1 - k] : out_hist[k - n];
+      float32_t a[FBC_LPC_ORDER + 1], prev[FBC_LPC_ORDER + 1];
+      float32_t err = acorr[0] * 1.0001f + 1.0e-12f;  //a touch of white noise, to keep it well-conditioned
+      a[0] = 1.0f;
+      for (int k = 1; k <= FBC_LPC_ORDER; k++) a[k] = 0.0f;
+      for (int m = 1; m <= FBC_LPC_ORDER; m++) {
+        float32_t acc = acorr[m];
+        for (int k = 1; k < m; k++) acc += a[k] * acorr[m - k];
+        const float32_t refl = -acc / err;
+        if (fabsf(refl) >= 1.0f) return;  //numerically unstable.  Keep the last good model.
+        for (int k = 0; k < m; k++) prev[k] = a[k];
+        for (int k = 1; k < m; k++) a[k] = prev[k] + refl * prev[m - k];
+        a[m] = refl;
+        err *= (1.0f - refl * refl);
+      }
+      for (int k = 0; k <= FBC_LPC_ORDER; k++) lpc[k] = a[k];
+    }
+};
+
+class AudioEffectFeedbackCancel_F32 : public AudioStream_F32 {
+  //GUI: inputs:4, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    //inputs 0-1: mics L/R.  Inputs 2-3: the reference, ie what went to the speakers L/R.
+    AudioEffectFeedbackCancel_F32(const AudioSettings_F32 &settings) : AudioStream_F32(4, inputQueueArray) {
+      block_samples = settings.audio_block_samples;
+    }
+
+    void enable(bool state) {
+      if (state && !enabled) { __disable_irq(); core[0].reset(); core[1].reset(); __enable_irq(); }  //start fresh: the path may have changed
+      enabled = state;
+    }
+    bool isEnabled(void) { return enabled; }
+    FeedbackCancel_Core &getCore(int chan) { return core[chan & 0x01]; }
+    void setTaps(int n) { __disable_irq(); core[0].setTaps(n); core[1].setTaps(n); __enable_irq(); }
+    void setStepSize(float mu) { core[0].setStepSize(mu); core[1].setStepSize(mu); }
+    void setPrewhitening(bool state) { __disable_irq(); core[0].setPrewhitening(state); core[1].setPrewhitening(state); __enable_irq(); }
+    void setBulkDelay_samples(int n) { __disable_irq(); core[0].setBulkDelay_samples(n); core[1].setBulkDelay_samples(n); __enable_irq(); }
+
+    //from a loopback latency measurement (output to input, in samples)
+    int setBulkDelayFromLoopback(int loopback_samples) {
+      setBulkDelay_samples(loopback_samples - block_samples - FBC_MARGIN_SAMPLES);
+      return core[0].getBulkDelay_samples();
+    }
+
+    virtual void update(void) {
+      audio_block_f32_t *mic[2], *ref[2];
+      for (int c = 0; c < 2; c++) { mic[c] = receiveReadOnly_f32(c); ref[c] = receiveReadOnly_f32(2 + c); }
+      for (int c = 0; c < 2; c++) {
+        if (!mic[c]) continue;
+        if (!enabled || !ref[c]) {
+          transmit(mic[c], c);  //nothing to cancel with.  Pass it along.
+          continue;
+        }
+        audio_block_f32_t *out = AudioStream_F32::allocate_f32();
+        if (!out) continue;
+        core[c].process(mic[c]->data, ref[c]->data, out->data, mic[c]->length);
+        out->length = mic[c]->length;
+        transmit(out, c);
+        AudioStream_F32::release(out);
+      }
+      for (int c = 0; c < 2; c++) {
+        if (mic[c]) AudioStream_F32::release(mic[c]);
+        if (ref[c]) AudioStream_F32::release(ref[c]);
+      }
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[4];
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    bool enabled = false;
+    FeedbackCancel_Core core[2];
+};
+
+#endif
@@ -0,0 +1,247 @@
+
+/*
+   AudioEffectImpulseClamp_F32
+
+   Purpose: Catch impulses (eg, gunshots) in the first few samples, well before the
+     compressors react (fastComp's attack is 5 msec, which is 480 samples at 96 kHz), and
+     pull the gain down until they're over.  Stereo-linked, so the image doesn't shift.
+
+   Detection, per sub-block (default 8 samples), on the louder of the two channels:
+     * crest factor: the sub-block's peak against the running RMS of the background, or
+     * slope: the largest sample-to-sample step
+     and the peak has to be above a floor, so that quiet clicks don't count.  It is all
+     compares and multiplies: no logs and no square roots.
+     An impulse is short.  Once the detection has kept firing for longer than the maximum
+     impulse length (default 250 msec), it is a loud sound, not an impulse (eg, a loud high
+     tone keeps the slope over its threshold): the background learns it again, the slope
+     no longer counts, and the clamp lets go.  A jump in crest factor above it still counts.
+   Clamping: the whole block is here at once, so the gain can start down a few samples
+     ahead of the impulse's onset (inside the same sub-block), ramp to the clamp gain over
+     a few samples, hold, and then come back up exponentially.
+
+   When the gain is at 1.0 and nothing is happening, the block goes straight through; only
+   the detection is paid for.  The lookahead limiter after this still catches whatever this
+   lets by, so they work together: this cuts the energy, the limiter guards the peak.
+
+   ImpulseClamp_Core is the processing on its own, so that it can be tested with synthetic
+   impulses outside of the audio graph (Tools/HostSim/ImpulseClampTest, on the host).  The
+   node keeps a small queue of the detected impulses for loop() to report and log.  It counts every sample that comes through,
+   whether or not it is enabled, in 64 bits (a 32-bit count wraps after 12.4 hours at
+   96 kHz), so an impulse's sample number is its time since the node started.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectImpulseClamp_F32_h
+#define _AudioEffectImpulseClamp_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define IMPULSE_MAX_SUBBLOCK (32)
+#define IMPULSE_QUEUE_LEN (8)   //must be a power of two
+
+class ImpulseClamp_Core {
+  public:
+    ImpulseClamp_Core(void) { setup(); }
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; setup(); }
+
+    void setup(void) {
+      setSubBlock(8);
+      setCrest_dB(20.0f);
+      setSlope(0.25f);
+      setFloor_dBFS(-30.0f);
+      setClamp_dB(-24.0f);
+      setAttack_samples(4);
+      setHold_msec(20.0f);
+      setRelease_msec(60.0f);
+      setBackground_msec(50.0f);
+      setMaxImpulse_msec(250.0f);
+      reset();
+    }
+    void reset(void) { gain = 1.0f; state = STATE::IDLE; hold_left = 0; run_samples = 0; bg_ms = 1.0e-6f; }
+
+    int setSubBlock(int n) { sub_block = max(2, min(n, IMPULSE_MAX_SUBBLOCK)); return sub_block; }
+    void setCrest_dB(float dB) { crest_dB = dB; crest_sq = powf(10.0f, dB / 10.0f); }
+    void setSlope(float s) { slope_thresh = s; }                //full-scale per sample
+    void setFloor_dBFS(float dB) { floor_dBFS = dB; floor_lin = powf(10.0f, dB / 20.0f); }
+    void setClamp_dB(float dB) { clamp_dB = min(dB, 0.0f); clamp_gain = powf(10.0f, clamp_dB / 20.0f); }
+    void setAttack_samples(int n) { attack_samples = max(1, n); }
+    void setHold_msec(float msec) { hold_msec = msec; hold_samples = (int)(0.001f * msec * sample_rate_Hz); }
+    void setRelease_msec(float msec) { release_msec = max(0.1f, msec); release_coeff = expf(-1.0f / (0.001f * release_msec * sample_rate_Hz)); }
+    void setBackground_msec(float msec) { bg_msec = msec; bg_alpha = 1.0f - expf(-((float)sub_block) / (0.001f * msec * sample_rate_Hz)); }
+    void setMaxImpulse_msec(float msec) { max_impulse_msec = msec; max_run_samples = (int)(0.001f * msec * sample_rate_Hz); }
+    float getClamp_dB(void) { return clamp_dB; }
+    float getGain(void) { return gain; }
+    bool isClamping(void) { return state != STATE::IDLE; }
+
+    //process in place.  R can be NULL (mono).  Returns the number of new impulses (0 or 1),
+    //with the details in the last_* values.
+    int process(float32_t *L, float32_t *R, int n) {
+      int n_new = 0;
+      for (int start = 0; start < n; start += sub_block) {
+        const int len = min(sub_block, n - start);
+        float32_t *xL = L + start, *xR = R ? (R + start) : NULL;
+
+        //detect.  Everything is on the louder channel, sample by sample.
+        float32_t pk = 0.0f, sum_sq = 0.0f, slope = 0.0f, prev = last_x;
+        for (int i = 0; i < len; i++) {
+          float32_t x = xL[i];
+          if (xR && (fabsf(xR[i]) > fabsf(x))) x = xR[i];
+          float32_t ax = fabsf(x);
+          if (ax > pk) pk = ax;
+          sum_sq += x * x;
+          float32_t d = fabsf(x - prev);
+          if (d > slope) slope = d;
+          prev = x;
+        }
+        last_x = prev;
+        const bool is_loud = (pk > floor_lin);
+        const bool over_crest = is_loud && ((pk * pk) > (crest_sq * bg_ms));
+        bool is_impulse = over_crest || (is_loud && (slope > slope_thresh));
+        run_samples = is_impulse ? min(run_samples + len, max_run_samples + 1) : 0;
+        const bool too_long = (run_samples > max_run_samples);
+        if (too_long) is_impulse = over_crest;  //a sustained sound, not an impulse.  Only a jump above it counts.
+
+        if (is_impulse) {
+          //the onset is the first sample over half of the peak.  Start down a little before it.
+          int onset = 0;
+          const float32_t half_pk = 0.5f * pk;
+          while ((onset < len - 1) && (fabsf(xL[onset]) < half_pk) && (!xR || (fabsf(xR[onset]) < half_pk))) onset++;
+          if (state == STATE::IDLE) {
+            n_new = 1;
+            last_offset = start + onset;
+            last_peak = pk;
+            last_crest_sq = (pk * pk) / max(bg_ms, 1.0e-12f);
+          }
+          if ((state == STATE::IDLE) || (state == STATE::RELEASE)) {
+            const int attack_start = max(0, onset - attack_samples);
+            applyGain(xL, xR, 0, attack_start);  //before the attack starts
+            startAttack();
+            applyGain(xL, xR, attack_start, len);
+          } else {
+            hold_left = hold_samples;  //already down.  Another impulse just holds it longer.
+            applyGain(xL, xR, 0, len);
+          }
+        } else {
+          applyGain(xL, xR, 0, len);
+        }
+        if (!is_impulse || too_long) bg_ms += bg_alpha * (sum_sq / ((float32_t)len) - bg_ms);  //the background only learns from non-impulses, and from sustained sounds
+      }
+      return n_new;
+    }
+
+    //about the last impulse
+    int last_offset = 0;            //its onset, within the block that was given to process()
+    float32_t last_peak = 0.0f, last_crest_sq = 0.0f;
+
+  private:
+    enum class STATE { IDLE, ATTACK, HOLD, RELEASE };
+    STATE state = STATE::IDLE;
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int sub_block = 8, attack_samples = 4, hold_samples = 1920, hold_left = 0, max_run_samples = 24000, run_samples = 0;
+    float crest_dB = 20.0f, crest_sq = 100.0f, slope_thresh = 0.25f, floor_dBFS = -30.0f, floor_lin = 0.03f;
+    float clamp_dB = -24.0f, clamp_gain = 0.063f, attack_step = 0.2f;
+    float hold_msec = 20.0f, release_msec = 60.0f, release_coeff = 0.9998f, bg_msec = 50.0f, bg_alpha = 0.002f, max_impulse_msec = 250.0f;
+    float32_t gain = 1.0f, cut = 0.0f, bg_ms = 1.0e-6f, last_x = 0.0f;
+
+    void startAttack(void) {
+      state = STATE::ATTACK;
+      attack_step = (gain - clamp_gain) / ((float32_t)attack_samples);
+      hold_left = hold_samples;
+    }
+
+    //the gain's state machine, over samples [i0, i1)
+    void applyGain(float32_t *xL, float32_t *xR, int i0, int i1) {
+      if ((state == STATE::IDLE) || (i1 <= i0)) return;  //unity.  Nothing to do.
+      for (int i = i0; i < i1; i++) {
+        switch (state) {
+          case STATE::ATTACK:
+            gain -= attack_step;
+            if (gain <= clamp_gain) { gain = clamp_gain; state = STATE::HOLD; }
+            break;
+          case STATE::HOLD:
+            if (--hold_left <= 0) { state = STATE::RELEASE; cut = 1.0f - gain; }
+            break;
+          case STATE::RELEASE:
+            cut *= release_coeff;  //the cut, not the gain: near 1.0, the gain's steps would be lost in the float's rounding, and it would never get there
+            gain = 1.0f - cut;
+            if (cut < 0.0001f) { gain = 1.0f; state = STATE::IDLE; }
+            break;
+          case STATE::IDLE:
+            break;
+        }
+        xL[i] *= gain;
+        if (xR) xR[i] *= gain;
+      }
+    }
+};
+
+class AudioEffectImpulseClamp_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    struct Event_t {
+      uint64_t sample;    //since the node started (see getSampleCount())
+      float32_t peak;     //linear, full scale = 1.0
+      float32_t crest_dB;
+    };
+
+    AudioEffectImpulseClamp_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      core.setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+
+    ImpulseClamp_Core &getCore(void) { return core; }  //for the settings
+    void enable(bool state) { enabled = state; }
+    bool isEnabled(void) { return enabled; }
+
+    //from loop().  Returns false if there are no new impulses.
+    bool getEvent(Event_t &out) {
+      if (tail == head) return false;
+      out = queue[tail];
+      asm volatile("" ::: "memory");
+      tail = (tail + 1) & (IMPULSE_QUEUE_LEN - 1);
+      return true;
+    }
+    unsigned long getNEvents(void) { return n_events; }
+    //every sample that has come through, enabled or not.  (64 bits can't be read in one go, so the ISR is held off.)
+    uint64_t getSampleCount(void) { __disable_irq(); uint64_t n = sample_count; __enable_irq(); return n; }
+
+    virtual void update(void) {
+      audio_block_f32_t *left = receiveWritable_f32(0), *right = receiveWritable_f32(1);
+      if (!left && !right) return;
+      int left_chan = 0;
+      if (!left) { left = right; right = NULL; left_chan = 1; }  //mono: whichever one came
+
+      if (enabled && core.process(left->data, right ? right->data : NULL, left->length)) {
+        n_events++;
+        uint32_t next = (head + 1) & (IMPULSE_QUEUE_LEN - 1);
+        if (next != tail) {
+          Event_t &e = queue[head];
+          e.sample = sample_count + core.last_offset; e.peak = core.last_peak;
+          e.crest_dB = 10.0f * log10f(max(core.last_crest_sq, 1.0e-12f));  //only once per impulse
+          asm volatile("" ::: "memory");
+          head = next;
+        }
+      }
+
+      sample_count += left->length;
+
+      transmit(left, left_chan);
+      if (right) {
+        transmit(right, 1);
+        AudioStream_F32::release(right);
+      }
+      AudioStream_F32::release(left);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    ImpulseClamp_Core core;
+    bool enabled = true;
+    Event_t queue[IMPULSE_QUEUE_LEN];
+    volatile uint32_t head = 0, tail = 0;
+    unsigned long n_events = 0;
+    uint64_t sample_count = 0;
+};
+
+#endif
@@ -0,0 +1,266 @@
+
+/*
+   AudioEffectMultiBandWDRC_F32
+
+   Purpose: Stereo multi-band wide dynamic range compressor, so that loud low-frequency
+     noise doesn't pump down the speech band like it does with the broadband compressor.
+
+   Filterbank: a tree of 4th-order Linkwitz-Riley (LR4) crossovers.  Each crossover is two
+     2nd-order Butterworth low-passes (the band) and two high-passes (which go on to the next
+     crossover), so the bands fall off at 24 dB/oct and meet at -6 dB, in phase.  An LR4
+     pair sums to a 2nd-order allpass, so each band also goes through the allpasses of the
+     crossovers above it, and then all of the bands have the same phase and sum back to a
+     flat magnitude.  Both channels are run through the same loop so that each set of
+     coefficients is only loaded once.
+
+   Compression: each band gets a block-rate level estimate (sum of squares) with attack
+     and release smoothing.  The gain is then ramped linearly across the block as it is
+     applied, so there is no zipper noise.  The parameters follow AudioEffectCompWDRC_F32.
+
+   Linked (setLinked(true), for the binaural mode): each band's gain comes from the louder
+     of the two sides and goes on both, so the compression doesn't squash the level
+     differences between the ears (independent compressors shrink a 6 dB ILD to 2 dB at
+     3:1).  The gains are the same on both sides, so the time differences are kept too.
+
+   MultiBandWDRC_Core is the processing on its own, so that it can be tested with synthetic
+   signals outside of the audio graph (see Tools/HostSim/BinauralSim, on the host).
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectMultiBandWDRC_F32_h
+#define _AudioEffectMultiBandWDRC_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define MULTIBAND_MAX_BANDS (8)
+
+class MultiBandWDRC_Core {
+  public:
+    MultiBandWDRC_Core(void) { setup(); }
+
+    //the rate and block size that process() will be given.  Resets the crossovers to the defaults.
+    void setSampleRate_Hz(float fs_Hz, int _block_samples) {
+      sample_rate_Hz = fs_Hz;
+      block_samples = max(1, min(_block_samples, AUDIO_BLOCK_SAMPLES));
+      setup();
+    }
+    float getSampleRate_Hz(void) { return sample_rate_Hz; }
+
+    void setup(void) {
+      float default_crossovers_Hz[] = {500.0f, 2000.0f, 6000.0f};  //4 bands
+      setCrossovers_Hz(default_crossovers_Hz, 3);
+      for (int b = 0; b < MULTIBAND_MAX_BANDS; b++) {
+        for (int c = 0; c < 2; c++) { env_dB[b][c] = 0.0f; cur_gain[b][c] = 1.0f; }
+      }
+      setParams(5.0f, 100.0f, 115.0f, 0.0f, 3.0f, 70.0f);  //the sketch's multi-band settings, so a core used on its own is sane
+    }
+
+    //There will be (n_crossovers+1) bands.  Each crossover is clamped to between 20 Hz and
+    //0.45 x the sample rate, and then they must be increasing.  Returns the number of bands,
+    //or 0 (and keeps the old crossovers) if they aren't.
+    int setCrossovers_Hz(float *freqs_Hz, int n_crossovers) {
+      n_crossovers = max(1, min(n_crossovers, MULTIBAND_MAX_BANDS - 1));
+      float new_Hz[MULTIBAND_MAX_BANDS - 1];
+      float32_t new_coeff[MULTIBAND_MAX_BANDS - 1][3][5];
+      for (int k = 0; k < n_crossovers; k++) {
+        new_Hz[k] = max(20.0f, min(freqs_Hz[k], 0.45f * sample_rate_Hz));
+        if ((k > 0) && (new_Hz[k] <= new_Hz[k - 1])) return 0;
+        designCrossover(new_Hz[k], new_coeff[k][0], new_coeff[k][1], new_coeff[k][2]);
+      }
+
+      __disable_irq();
+      for (int k = 0; k < n_crossovers; k++) {
+        crossover_Hz[k] = new_Hz[k];
+        for (int j = 0; j < 5; j++) { lp_coeff[k][j] = new_coeff[k][0][j]; hp_coeff[k][j] = new_coeff[k][1][j]; ap_coeff[k][j] = new_coeff[k][2][j]; }
+      }
+      n_bands = n_crossovers + 1;
+      arm_fill_f32(0.0f, &lp_state[0][0][0], sizeof(lp_state) / sizeof(float32_t));
+      arm_fill_f32(0.0f, &hp_state[0][0][0], sizeof(hp_state) / sizeof(float32_t));
+      arm_fill_f32(0.0f, &ap_state[0][0][0], sizeof(ap_state) / sizeof(float32_t));
+      __enable_irq();
+      return n_bands;
+    }
+    int getNumBands(void) { return n_bands; }
+    float getCrossover_Hz(int k) { return crossover_Hz[max(0, min(k, n_bands - 2))]; }
+
+    //the same as AudioEffectCompWDRC_F32::setParams(), except for the expansion and bolt
+    //(the output limiter handles the ceiling).  Applies to all bands.
+    void setParams(float attack_ms, float release_ms, float _maxdB, float _tkgain, float _comp_ratio, float _tk) {
+      maxdB = _maxdB;
+      for (int b = 0; b < MULTIBAND_MAX_BANDS; b++) setBandParams(b, _tkgain, _comp_ratio, _tk);
+      setAttackRelease_msec(attack_ms, release_ms);
+    }
+    void setBandParams(int band, float _tkgain, float _comp_ratio, float _tk) {
+      if ((band < 0) || (band >= MULTIBAND_MAX_BANDS)) return;
+      tkgain_dB[band] = _tkgain;
+      comp_ratio[band] = max(1.0f, _comp_ratio);
+      tk_dBSPL[band] = _tk;
+    }
+
+    void setAttackRelease_msec(float attack_ms, float release_ms) {
+      attack_msec = attack_ms; release_msec = release_ms;
+      float block_sec = ((float)block_samples) / sample_rate_Hz;
+      attack_coeff = 1.0f - expf(-block_sec / max(attack_msec * 0.001f, block_sec));
+      release_coeff = 1.0f - expf(-block_sec / max(release_msec * 0.001f, block_sec));
+    }
+    float getAttack_msec(void) { return attack_msec; }
+    float getRelease_msec(void) { return release_msec; }
+
+    //the kneepoint of the first band stands in for all of them (they move together)
+    float getKneeCompressor_dBSPL(void) { return tk_dBSPL[0]; }
+    void setKneeCompressor_dBSPL(float knee_dB) {
+      float change_dB = knee_dB - tk_dBSPL[0];
+      for (int b = 0; b < MULTIBAND_MAX_BANDS; b++) tk_dBSPL[b] += change_dB;
+    }
+    void setLinked(bool state) { linked = state; }
+    bool isLinked(void) { return linked; }
+
+    float getCurrentGain_dB(int band, int chan) {
+      return 20.0f * log10f(max(cur_gain[max(0, min(band, MULTIBAND_MAX_BANDS - 1))][chan & 0x01], 1.0e-6f));
+    }
+
+    //both channels, in place
+    void process(float32_t *dataL, float32_t *dataR, int n);
+
+  private:
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    int n_bands = 4;
+    bool linked = false;
+    float crossover_Hz[MULTIBAND_MAX_BANDS - 1];
+    float32_t lp_coeff[MULTIBAND_MAX_BANDS - 1][5];  //b0, b1, b2, a1, a2.  Each is used twice in a row (LR4).
+    float32_t hp_coeff[MULTIBAND_MAX_BANDS - 1][5];
+    float32_t ap_coeff[MULTIBAND_MAX_BANDS - 1][5];  //what the crossover's LP+HP sums to
+    float32_t lp_state[MULTIBAND_MAX_BANDS - 1][2][4];  //transposed direct form II: s1L, s2L, s1R, s2R
+    float32_t hp_state[MULTIBAND_MAX_BANDS - 1][2][4];
+    float32_t ap_state[MULTIBAND_MAX_BANDS - 1][MULTIBAND_MAX_BANDS - 1][4];  //[band][crossover above it]
+    float32_t band_buff[MULTIBAND_MAX_BANDS][2][AUDIO_BLOCK_SAMPLES];
+
+    float maxdB = 115.0f;
+    float tkgain_dB[MULTIBAND_MAX_BANDS], comp_ratio[MULTIBAND_MAX_BANDS], tk_dBSPL[MULTIBAND_MAX_BANDS];
+    float attack_msec = 5.0f, release_msec = 100.0f;
+    float attack_coeff = 0.1f, release_coeff = 0.01f;
+    float env_dB[MULTIBAND_MAX_BANDS][2];
+    float32_t cur_gain[MULTIBAND_MAX_BANDS][2];
+
+    //2nd-order Butterworth low- and high-pass via the bilinear transform, and the allpass
+    //that the LR4 pair (each of them squared) sums to: the same poles, with the numerator reversed
+    void designCrossover(float fc_Hz, float32_t *lp, float32_t *hp, float32_t *ap) {
+      float w0 = 2.0f * M_PI * fc_Hz / sample_rate_Hz;
+      float alpha = sinf(w0) / (2.0f * 0.70710678f), cosw = cosf(w0);
+      float a0 = 1.0f + alpha;
+      lp[0] = 0.5f * (1.0f - cosw) / a0;  lp[1] = (1.0f - cosw) / a0;   lp[2] = lp[0];
+      hp[0] = 0.5f * (1.0f + cosw) / a0;  hp[1] = -(1.0f + cosw) / a0;  hp[2] = hp[0];
+      lp[3] = hp[3] = ap[3] = -2.0f * cosw / a0;
+      lp[4] = hp[4] = ap[4] = (1.0f - alpha) / a0;
+      ap[0] = ap[4];  ap[1] = ap[3];  ap[2] = 1.0f;
+    }
+
+    //one biquad on both channels, in place
+    static inline void biquad(const float32_t *c, float32_t *s, float32_t &xL, float32_t &xR) {
+      float32_t yL = c[0] * xL + s[0];
+      float32_t yR = c[0] * xR + s[2];
+      s[0] = c[1] * xL - c[3] * yL + s[1];  s[1] = c[2] * xL - c[4] * yL;
+      s[2] = c[1] * xR - c[3] * yR + s[3];  s[3] = c[2] * xR - c[4] * yR;
+      xL = yL;  xR = yR;
+    }
+
+    //compressor curve, applied once per block per band per channel
+    float32_t targetGain(int band, int chan, float32_t mean_sq) {
+      float level_dB = 10.0f * log10f(max(mean_sq, 1.0e-12f)) + maxdB;
+      float &env = env_dB[band][chan];
+      env += ((level_dB > env) ? attack_coeff : release_coeff) * (level_dB - env);
+      float gain_dB = tkgain_dB[band];
+      if (env > tk_dBSPL[band]) gain_dB += (1.0f / comp_ratio[band] - 1.0f) * (env - tk_dBSPL[band]);
+      return powf(10.0f, gain_dB / 20.0f);
+    }
+};
+
+void MultiBandWDRC_Core::process(float32_t *dataL, float32_t *dataR, int n) {
+  n = min(n, AUDIO_BLOCK_SAMPLES);
+  const int nx = n_bands - 1;
+
+  //split into bands.  Both channels go through each crossover together.
+  for (int i = 0; i < n; i++) {
+    float32_t restL = dataL[i], restR = dataR[i];
+    for (int k = 0; k < nx; k++) {
+      float32_t yL = restL, yR = restR;
+      biquad(lp_coeff[k], lp_state[k][0], yL, yR);  biquad(lp_coeff[k], lp_state[k][1], yL, yR);
+      biquad(hp_coeff[k], hp_state[k][0], restL, restR);  biquad(hp_coeff[k], hp_state[k][1], restL, restR);
+      for (int m = k + 1; m < nx; m++) biquad(ap_coeff[m], ap_state[k][m], yL, yR);  //the phase of the crossovers above
+      band_buff[k][0][i] = yL;  band_buff[k][1][i] = yR;
+    }
+    band_buff[nx][0][i] = restL;  band_buff[nx][1][i] = restR;
+  }
+
+  //compress each band and sum back together
+  arm_fill_f32(0.0f, dataL, n);
+  arm_fill_f32(0.0f, dataR, n);
+  const float32_t inv_n = 1.0f / ((float32_t)n);
+  for (int b = 0; b < n_bands; b++) {
+    float32_t pow[2], new_gain[2];
+    arm_power_f32(band_buff[b][0], n, &pow[0]);  //sum of squares
+    arm_power_f32(band_buff[b][1], n, &pow[1]);
+    if (linked) {
+      new_gain[0] = targetGain(b, 0, max(pow[0], pow[1]) * inv_n);  //the louder side sets both
+      new_gain[1] = new_gain[0];
+      env_dB[b][1] = env_dB[b][0];  //so that unlinking doesn't jump
+    } else {
+      new_gain[0] = targetGain(b, 0, pow[0] * inv_n);
+      new_gain[1] = targetGain(b, 1, pow[1] * inv_n);
+    }
+    for (int chan = 0; chan < 2; chan++) {
+      float32_t *band = band_buff[b][chan];
+      float32_t *out = (chan == 0) ? dataL : dataR;
+      float32_t g = cur_gain[b][chan], dg = (new_gain[chan] - g) * inv_n;
+      for (int i = 0; i < n; i++) { g += dg; out[i] += g * band[i]; }
+      cur_gain[b][chan] = new_gain[chan];
+    }
+  }
+}
+
+class AudioEffectMultiBandWDRC_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioEffectMultiBandWDRC_F32(void) : AudioStream_F32(2, inputQueueArray) {}
+    AudioEffectMultiBandWDRC_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      core.setSampleRate_Hz(settings.sample_rate_Hz, settings.audio_block_samples);
+    }
+    MultiBandWDRC_Core &getCore(void) { return core; }
+
+    //the settings are the core's
+    int setCrossovers_Hz(float *freqs_Hz, int n_crossovers) { return core.setCrossovers_Hz(freqs_Hz, n_crossovers); }
+    int getNumBands(void) { return core.getNumBands(); }
+    float getCrossover_Hz(int k) { return core.getCrossover_Hz(k); }
+    void setParams(float attack_ms, float release_ms, float _maxdB, float _tkgain, float _comp_ratio, float _tk) { core.setParams(attack_ms, release_ms, _maxdB, _tkgain, _comp_ratio, _tk); }
+    void setBandParams(int band, float _tkgain, float _comp_ratio, float _tk) { core.setBandParams(band, _tkgain, _comp_ratio, _tk); }
+    void setAttackRelease_msec(float attack_ms, float release_ms) { core.setAttackRelease_msec(attack_ms, release_ms); }
+    float getAttack_msec(void) { return core.getAttack_msec(); }
+    float getRelease_msec(void) { return core.getRelease_msec(); }
+    float getKneeCompressor_dBSPL(void) { return core.getKneeCompressor_dBSPL(); }
+    void setKneeCompressor_dBSPL(float knee_dB) { core.setKneeCompressor_dBSPL(knee_dB); }
+    void setLinked(bool state) { core.setLinked(state); }
+    bool isLinked(void) { return core.isLinked(); }
+    float getCurrentGain_dB(int band, int chan) { return core.getCurrentGain_dB(band, chan); }
+
+    virtual void update(void) {
+      audio_block_f32_t *blockL = receiveWritable_f32(0);
+      audio_block_f32_t *blockR = receiveWritable_f32(1);
+      if (!blockL || !blockR) {
+        if (blockL) AudioStream_F32::release(blockL);
+        if (blockR) AudioStream_F32::release(blockR);
+        return;
+      }
+      core.process(blockL->data, blockR->data, blockL->length);
+      transmit(blockL, 0); transmit(blockR, 1);
+      AudioStream_F32::release(blockL); AudioStream_F32::release(blockR);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    MultiBandWDRC_Core core;
+};
+
+#endif
@@ -0,0 +1,336 @@
+
+/*
+   AudioEffectNoiseReduction_F32
+
+   Purpose: Stereo STFT noise suppressor for noisy (eg, vehicle) environments.
+
+   Processing:
+     * weighted overlap-add with sqrt-Hann analysis and synthesis windows
+     * both channels share one complex radix-4 FFT (left in the real part, right in the
+       imaginary part), which is cheaper than two real FFTs
+     * the noise is estimated per bin by minimum statistics (the minimum of the smoothed
+       power over the last ~1.5 sec, tracked in sub-windows)
+     * Wiener gain from a decision-directed a-priori SNR, with a floor to limit musical noise
+     * optional decimation (by 2 or 4) ahead of the STFT, which cuts the CPU a lot because
+       there is little worth de-noising above 12-24 kHz anyway.  The band above the decimated
+       Nyquist goes around the STFT (delayed to line up, but not de-noised), so decimating
+       doesn't low-pass the output.  With every gain at 1, the output is exactly the input,
+       delayed by getLatency_samples().
+
+   All of the buffers are fixed-size members sized for the largest allowed FFT, so nothing
+   is allocated at run time.  Use setConfig() to trade latency against CPU.
+
+   NoiseReduction_Core is the processing on its own, so that it can be timed outside of the
+   audio graph (see benchmarkNoiseReduction() in the sketch).  Its CMSIS FIR instances point
+   at its own state, so start another one with setConfig() rather than copying one.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectNoiseReduction_F32_h
+#define _AudioEffectNoiseReduction_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define NR_MAX_FFT (256)                 //radix-4 sizes only: 64 or 256
+#define NR_MAX_BINS (NR_MAX_FFT / 2 + 1)
+#define NR_N_SUBWIN (8)                  //minimum statistics sub-windows
+#define NR_DECIM_TAPS (32)               //must be a multiple of the decimation factor
+#define NR_MAX_DECIM (4)
+
+class NoiseReduction_Core {
+  public:
+    NoiseReduction_Core(void) { setConfig(256, 128, 1); }
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; setMinStatsWindow_sec(min_window_sec); }
+
+    //fft_size: 64 or 256.  hop: fft_size/2 or fft_size/4.  decimation: 1, 2, or 4.
+    //Returns false (and keeps the old config) if the combination isn't allowed.
+    bool setConfig(int _fft_size, int _hop, int _decimation) {
+      if ((_fft_size != 64) && (_fft_size != 256)) return false;
+      if ((_hop != _fft_size / 2) && (_hop != _fft_size / 4)) return false;
+      if ((_decimation != 1) && (_decimation != 2) && (_decimation != 4)) return false;
+
+      //the tables first, while the audio keeps running on the old ones
+      float32_t new_window[NR_MAX_FFT], new_decim_coeff[NR_DECIM_TAPS];
+      for (int i = 0; i < _fft_size; i++) {
+        new_window[i] = sqrtf(0.5f * (1.0f - cosf(2.0f * M_PI * ((float)i) / ((float)_fft_size))));  //sqrt of periodic Hann
+      }
+      if (_decimation > 1) makeDecimationFilter(_decimation, new_decim_coeff);
+
+      //then swap them in
+      __disable_irq();
+      fft_size = _fft_size; hop = _hop; decimation = _decimation;
+      arm_cfft_radix4_init_f32(&fft_inst, fft_size, 0, 1);
+      arm_cfft_radix4_init_f32(&ifft_inst, fft_size, 1, 1);  //the inverse includes the 1/N scaling
+      arm_copy_f32(new_window, window, fft_size);
+      ola_scale = 2.0f * ((float)hop) / ((float)fft_size);  //Hann overlap-added at this hop sums to N/(2*hop)
+      if (decimation > 1) setupDecimation(new_decim_coeff);
+      setMinStatsWindow_sec(min_window_sec);
+      reset();
+      __enable_irq();
+      return true;
+    }
+    int getFFTSize(void) { return fft_size; }
+    int getHop(void) { return hop; }
+    int getDecimation(void) { return decimation; }
+    int getLatency_samples(void) { return decimation * fft_size + getHighBandAlign(); }  //at the full rate
+
+    void setMinGain_dB(float dB) { min_gain = powf(10.0f, min(dB, 0.0f) / 20.0f); }
+    void setMinStatsWindow_sec(float sec) {
+      min_window_sec = max(0.1f, sec);
+      float frames_per_sec = sample_rate_Hz / ((float)(decimation * hop));
+      frames_per_subwin = max(1, (int)(min_window_sec * frames_per_sec / ((float)NR_N_SUBWIN) + 0.5f));
+    }
+
+    void reset(void) {
+      for (int c = 0; c < 2; c++) {
+        for (int i = 0; i < NR_MAX_FFT; i++) { in_buf[c][i] = 0.0f; ola_buf[c][i] = 0.0f; out_buf[c][i] = 0.0f; }
+        for (int i = 0; i < (NR_DECIM_TAPS + AUDIO_BLOCK_SAMPLES - 1); i++) { decim_state[c][i] = 0.0f; interp_state[c][i] = 0.0f; ref_state[c][i] = 0.0f; }
+        for (int i = 0; i < NR_DECIM_TAPS; i++) x_hist[c][i] = 0.0f;
+        for (int i = 0; i < NR_MAX_DECIM * NR_MAX_FFT; i++) hi_delay[c][i] = 0.0f;
+      }
+      frame_count = 0; subwin_count = 0; subwin_ind = 0; samp_count = 0; hi_delay_ind = 0;
+    }
+
+    //both channels, in place, at the full rate
+    void process(float32_t *dataL, float32_t *dataR, int n);
+
+  private:
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int fft_size = 256, hop = 128, decimation = 1;
+    float ola_scale = 1.0f;
+    arm_cfft_radix4_instance_f32 fft_inst, ifft_inst;
+
+    //the arena
+    float32_t window[NR_MAX_FFT];
+    float32_t in_buf[2][NR_MAX_FFT], ola_buf[2][NR_MAX_FFT], out_buf[2][NR_MAX_FFT];
+    float32_t work[2 * NR_MAX_FFT];                 //interleaved complex
+    float32_t psd[2][NR_MAX_BINS];                  //smoothed power
+    float32_t pmin_cur[2][NR_MAX_BINS];             //min in the current sub-window
+    float32_t pmin_sub[NR_N_SUBWIN][2][NR_MAX_BINS];//min of each past sub-window
+    float32_t prev_clean[2][NR_MAX_BINS];           //|gain*X|^2 of the previous frame
+    float32_t dec_buf[2][AUDIO_BLOCK_SAMPLES];
+    float32_t hi_buf[2][AUDIO_BLOCK_SAMPLES];
+
+    //decimation and interpolation around the STFT
+    float32_t decim_coeff[NR_DECIM_TAPS], interp_coeff[NR_DECIM_TAPS];
+    float32_t decim_state[2][NR_DECIM_TAPS + AUDIO_BLOCK_SAMPLES - 1];
+    float32_t interp_state[2][NR_DECIM_TAPS + AUDIO_BLOCK_SAMPLES - 1];
+    arm_fir_decimate_instance_f32 decim_inst[2];
+    arm_fir_interpolate_instance_f32 interp_inst[2];
+
+    //the band above the decimated Nyquist, around the STFT: x - interp(decim(x)), then delayed by
+    //the STFT's latency.  ref_inst interpolates the un-processed decimated signal for that.
+    float32_t ref_state[2][NR_DECIM_TAPS + AUDIO_BLOCK_SAMPLES - 1];
+    arm_fir_interpolate_instance_f32 ref_inst[2];
+    float32_t x_hist[2][NR_DECIM_TAPS];                       //the input, delayed to line up with interp(decim(x))
+    float32_t hi_delay[2][NR_MAX_DECIM * NR_MAX_FFT];         //ring, one STFT latency long
+    int hi_delay_ind = 0;
+
+    //algorithm parameters and counters
+    float min_gain = 0.178f;        //-15 dB
+    float min_window_sec = 1.5f;
+    const float psd_alpha = 0.8f;   //smoothing of the power for the noise tracker
+    const float dd_alpha = 0.98f;   //decision-directed smoothing
+    const float noise_bias = 1.5f;  //the min of a noisy estimate is biased low
+    int frames_per_subwin = 10;
+    int frame_count = 0, subwin_count = 0, subwin_ind = 0;
+    int samp_count = 0;
+
+    //windowed-sinc low-pass at the new Nyquist (a bit below)
+    static void makeDecimationFilter(int _decimation, float32_t *coeff) {
+      float fc = 0.45f / ((float)_decimation);
+      for (int i = 0; i < NR_DECIM_TAPS; i++) {
+        float t = ((float)i) - 0.5f * ((float)(NR_DECIM_TAPS - 1));
+        float sinc = (fabsf(t) < 1.0e-6f) ? (2.0f * fc) : (sinf(2.0f * M_PI * fc * t) / (M_PI * t));
+        float hamming = 0.54f - 0.46f * cosf(2.0f * M_PI * ((float)i) / ((float)(NR_DECIM_TAPS - 1)));
+        coeff[i] = sinc * hamming;
+      }
+    }
+    void setupDecimation(const float32_t *coeff) {
+      for (int i = 0; i < NR_DECIM_TAPS; i++) {
+        decim_coeff[i] = coeff[i];
+        interp_coeff[i] = coeff[i] * ((float)decimation);  //interpolation needs the gain back
+      }
+      for (int c = 0; c < 2; c++) {
+        arm_fir_decimate_init_f32(&decim_inst[c], NR_DECIM_TAPS, decimation, decim_coeff, decim_state[c], AUDIO_BLOCK_SAMPLES);
+        arm_fir_interpolate_init_f32(&interp_inst[c], decimation, NR_DECIM_TAPS, interp_coeff, interp_state[c], AUDIO_BLOCK_SAMPLES / decimation);
+        arm_fir_interpolate_init_f32(&ref_inst[c], decimation, NR_DECIM_TAPS, interp_coeff, ref_state[c], AUDIO_BLOCK_SAMPLES / decimation);
+      }
+    }
+
+    //decimating and interpolating again delays x by this much (the two FIRs, less the decimator's M-1 look-ahead)
+    int getHighBandAlign(void) { return (decimation > 1) ? (NR_DECIM_TAPS - decimation) : 0; }
+
+    void processFrame(void);
+    void updateNoiseEstimate(int c, int k, float32_t pow);
+    void processSamples(float32_t *dataL, float32_t *dataR, int n);
+};
+
+//run the STFT on n samples (at the decimated rate), in place
+void NoiseReduction_Core::processSamples(float32_t *dataL, float32_t *dataR, int n) {
+  int ind = 0;
+  while (ind < n) {
+    int n_chunk = min(n - ind, hop - samp_count);
+    int in_ind = fft_size - hop + samp_count;
+    for (int i = 0; i < n_chunk; i++) {
+      in_buf[0][in_ind + i] = dataL[ind + i];  in_buf[1][in_ind + i] = dataR[ind + i];
+      dataL[ind + i] = out_buf[0][samp_count + i]; dataR[ind + i] = out_buf[1][samp_count + i];
+    }
+    samp_count += n_chunk; ind += n_chunk;
+    if (samp_count >= hop) {
+      processFrame();
+      samp_count = 0;
+    }
+  }
+}
+
+void NoiseReduction_Core::processFrame(void) {
+  const int N = fft_size, n_bins = fft_size / 2 + 1;
+
+  //window both channels into one complex frame and transform
+  for (int i = 0; i < N; i++) {
+    work[2 * i] = window[i] * in_buf[0][i];
+    work[2 * i + 1] = window[i] * in_buf[1][i];
+  }
+  arm_cfft_radix4_f32(&fft_inst, work);
+
+  //separate the two channels, compute the gains, and put the two back together
+  for (int k = 0; k < n_bins; k++) {
+    int m = (N - k) & (N - 1);
+    float32_t a = work[2 * k], b = work[2 * k + 1], cc = work[2 * m], d = work[2 * m + 1];
+    float32_t xr = 0.5f * (a + cc), xi = 0.5f * (b - d);  //left
+    float32_t rr = 0.5f * (b + d),  ri = -0.5f * (a - cc); //right
+
+    float32_t gain[2];
+    float32_t pow[2] = { xr * xr + xi * xi, rr * rr + ri * ri };
+    for (int c = 0; c < 2; c++) {
+      updateNoiseEstimate(c, k, pow[c]);
+      float32_t noise = noise_bias * min(pmin_cur[c][k], pmin_sub[0][c][k]);
+      for (int s = 1; s < NR_N_SUBWIN; s++) noise = min(noise, noise_bias * pmin_sub[s][c][k]);
+      noise = max(noise, 1.0e-20f);
+
+      //decision-directed a-priori SNR and the Wiener gain
+      float32_t post_snr = pow[c] / noise;
+      float32_t prio_snr = dd_alpha * prev_clean[c][k] / noise + (1.0f - dd_alpha) * max(post_snr - 1.0f, 0.0f);
+      float32_t g = max(prio_snr / (1.0f + prio_snr), min_gain);
+      prev_clean[c][k] = g * g * pow[c];
+      gain[c] = g;
+    }
+
+    work[2 * k]     = gain[0] * xr - gain[1] * ri;
+    work[2 * k + 1] = gain[0] * xi + gain[1] * rr;
+    if ((k > 0) && (k < N / 2)) {
+      work[2 * m]     = gain[0] * xr + gain[1] * ri;
+      work[2 * m + 1] = -gain[0] * xi + gain[1] * rr;
+    }
+  }
+  frame_count++;
+  if (++subwin_count >= frames_per_subwin) {
+    //this sub-window is done.  Remember its min and start a new one.
+    for (int c = 0; c < 2; c++) {
+      for (int k = 0; k < n_bins; k++) { pmin_sub[subwin_ind][c][k] = pmin_cur[c][k]; pmin_cur[c][k] = psd[c][k]; }
+    }
+    subwin_ind = (subwin_ind + 1) % NR_N_SUBWIN;
+    subwin_count = 0;
+  }
+
+  //back to the time domain, window again, and overlap-add
+  arm_cfft_radix4_f32(&ifft_inst, work);
+  for (int c = 0; c < 2; c++) {
+    for (int i = 0; i < N; i++) ola_buf[c][i] += ola_scale * window[i] * work[2 * i + c];
+    arm_copy_f32(ola_buf[c], out_buf[c], hop);                 //these are finished
+    arm_copy_f32(ola_buf[c] + hop, ola_buf[c], N - hop);       //slide the rest down
+    arm_fill_f32(0.0f, ola_buf[c] + N - hop, hop);
+    arm_copy_f32(in_buf[c] + hop, in_buf[c], N - hop);         //slide the input down
+  }
+}
+
+void NoiseReduction_Core::updateNoiseEstimate(int c, int k, float32_t pow) {
+  if (frame_count == 0) {
+    //first frame: start everything at the current power
+    psd[c][k] = pow; pmin_cur[c][k] = pow; prev_clean[c][k] = pow;
+    for (int s = 0; s < NR_N_SUBWIN; s++) pmin_sub[s][c][k] = pow;
+    return;
+  }
+  psd[c][k] = psd_alpha * psd[c][k] + (1.0f - psd_alpha) * pow;
+  if (psd[c][k] < pmin_cur[c][k]) pmin_cur[c][k] = psd[c][k];
+}
+
+void NoiseReduction_Core::process(float32_t *dataL, float32_t *dataR, int n) {
+  if (decimation == 1) {
+    processSamples(dataL, dataR, n);
+  } else {
+    const int n_dec = n / decimation, align = getHighBandAlign();
+    float32_t *data[2] = { dataL, dataR };
+    for (int c = 0; c < 2; c++) {
+      //decimate, and keep what that loses: hi = x - interp(decim(x))
+      arm_fir_decimate_f32(&decim_inst[c], data[c], dec_buf[c], n);
+      arm_fir_interpolate_f32(&ref_inst[c], dec_buf[c], hi_buf[c], n_dec);
+      for (int i = 0; i < n; i++) hi_buf[c][i] = ((i < align) ? x_hist[c][i] : data[c][i - align]) - hi_buf[c][i];
+      arm_copy_f32(data[c] + n - align, x_hist[c], align);
+    }
+    processSamples(dec_buf[0], dec_buf[1], n_dec);
+    const int delay_len = decimation * fft_size;
+    for (int c = 0; c < 2; c++) {
+      arm_fir_interpolate_f32(&interp_inst[c], dec_buf[c], data[c], n_dec);
+
+      //add the high band back, delayed by as much as the STFT delayed the rest
+      int ind = hi_delay_ind;
+      for (int i = 0; i < n; i++) {
+        data[c][i] += hi_delay[c][ind];
+        hi_delay[c][ind] = hi_buf[c][i];
+        if (++ind >= delay_len) ind = 0;
+      }
+    }
+    hi_delay_ind = (hi_delay_ind + n) % delay_len;
+  }
+}
+
+class AudioEffectNoiseReduction_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioEffectNoiseReduction_F32(void) : AudioStream_F32(2, inputQueueArray) {}
+    AudioEffectNoiseReduction_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      core.setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+    NoiseReduction_Core &getCore(void) { return core; }
+
+    //the settings are the core's
+    bool setConfig(int _fft_size, int _hop, int _decimation) { return core.setConfig(_fft_size, _hop, _decimation); }
+    int getFFTSize(void) { return core.getFFTSize(); }
+    int getHop(void) { return core.getHop(); }
+    int getDecimation(void) { return core.getDecimation(); }
+    int getLatency_samples(void) { return core.getLatency_samples(); }
+    void setMinGain_dB(float dB) { core.setMinGain_dB(dB); }
+    void setMinStatsWindow_sec(float sec) { core.setMinStatsWindow_sec(sec); }
+
+    void enable(bool state) {
+      __disable_irq();
+      if (state != enabled) core.reset();
+      enabled = state;
+      __enable_irq();
+    }
+    bool isEnabled(void) { return enabled; }
+
+    virtual void update(void) {
+      audio_block_f32_t *blockL = receiveWritable_f32(0);
+      audio_block_f32_t *blockR = receiveWritable_f32(1);
+      if (!blockL || !blockR) {
+        if (blockL) AudioStream_F32::release(blockL);
+        if (blockR) AudioStream_F32::release(blockR);
+        return;
+      }
+      if (enabled) core.process(blockL->data, blockR->data, blockL->length);
+      transmit(blockL, 0); transmit(blockR, 1);
+      AudioStream_F32::release(blockL); AudioStream_F32::release(blockR);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    NoiseReduction_Core core;
+    bool enabled = false;
+};
+
+#endif
@@ -0,0 +1,163 @@
+
+/*
+   AudioLatencyTester_F32
+
+   Purpose: Measure the latency of the audio path by injecting a known maximum-length
+     sequence (MLS) and then finding it again in a captured signal via cross-correlation.
+
+   Two kinds of measurement are supported:
+     * LOOPBACK: the MLS replaces the audio on output 0 (ie, to the DAC) and is captured
+       on input 1 (ie, from the ADC).  Use a loopback cable or let the mics hear the speaker.
+     * GRAPH: the MLS is sent out of output 1 into the front of the processing and is
+       captured on input 2 from the end of the processing.  This is the algorithmic delay.
+
+   The capture happens in the audio ISR.  The cross-correlation is done in small pieces
+   from loop() via service() so that it never stalls the rest of the system.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioLatencyTester_F32_h
+#define _AudioLatencyTester_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define LATENCY_MLS_ORDER (10)
+#define LATENCY_MLS_LEN ((1 << LATENCY_MLS_ORDER) - 1)  //1023 samples
+#define LATENCY_MAX_LAG (2048)                          //21 msec at 96 kHz
+
+class AudioLatencyTester_F32 : public AudioStream_F32 {
+  //GUI: inputs:3, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioLatencyTester_F32(void) : AudioStream_F32(3, inputQueueArray) { setup(); }
+    AudioLatencyTester_F32(const AudioSettings_F32 &settings) : AudioStream_F32(3, inputQueueArray) {
+      setup();
+      setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+
+    enum class MODE { LOOPBACK = 0, GRAPH };
+    enum class STATE { IDLE = 0, CAPTURING, CORRELATING, DONE };
+
+    void setSampleRate_Hz(const float fs_Hz) { sample_rate_Hz = fs_Hz; }
+    void setAmplitude(float amp) { amplitude = max(0.0f, min(amp, 1.0f)); }  //keep it quiet, it's going into someone's ears
+    float getAmplitude(void) { return amplitude; }
+
+    //start a new measurement (only if one isn't already running)
+    bool startMeasurement(MODE _mode) {
+      if ((state == STATE::CAPTURING) || (state == STATE::CORRELATING)) return false;
+      mode = _mode;
+      capture_ind = 0; stim_ind = 0;
+      corr_lag = 0; best_lag = 0; best_corr = 0.0f; sum_abs_corr = 0.0f;
+      state = STATE::CAPTURING;  //do this last, as the ISR starts working as soon as it sees this
+      return true;
+    }
+    STATE getState(void) { return state; }
+    MODE getMode(void) { return mode; }
+
+    //call from loop().  Does a few lags of the cross-correlation each call.  Returns
+    //true only on the call where the measurement finishes.
+    bool service(void) {
+      if (state != STATE::CORRELATING) return false;
+      int end_lag = min(corr_lag + lags_per_service, LATENCY_MAX_LAG);
+      for (; corr_lag < end_lag; corr_lag++) {
+        float32_t r;
+        arm_dot_prod_f32(capture_buff + corr_lag, mls, LATENCY_MLS_LEN, &r);
+        r = fabsf(r);  //the processing might invert the polarity
+        sum_abs_corr += r;
+        if (r > best_corr) { best_corr = r; best_lag = corr_lag; }
+      }
+      if (corr_lag >= LATENCY_MAX_LAG) {
+        state = STATE::DONE;
+        return true;
+      }
+      return false;
+    }
+
+    //results of the last measurement.  The GRAPH mode includes one block of delay
+    //because its stimulus re-enters the graph in the next update, so remove it here.
+    int getLatency_samples(void) {
+      if (mode == MODE::GRAPH) return best_lag - latency_offset_samples;
+      return best_lag;
+    }
+    float getLatency_msec(void) { return 1000.0f * ((float)getLatency_samples()) / sample_rate_Hz; }
+    float getPeakToMeanRatio(void) {  //bigger is more trustworthy.  Below ~5 means it didn't really find it.
+      float mean = sum_abs_corr / ((float)LATENCY_MAX_LAG);
+      if (mean <= 0.0f) return 0.0f;
+      return best_corr / mean;
+    }
+
+    virtual void update(void);
+
+  private:
+    audio_block_f32_t *inputQueueArray[3];
+    float32_t mls[LATENCY_MLS_LEN];
+    float32_t capture_buff[LATENCY_MLS_LEN + LATENCY_MAX_LAG];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    float amplitude = 0.03f;
+    volatile STATE state = STATE::IDLE;
+    MODE mode = MODE::LOOPBACK;
+    int capture_ind = 0, stim_ind = 0;
+    int latency_offset_samples = 0;
+    int corr_lag = 0, best_lag = 0;
+    float32_t best_corr = 0.0f, sum_abs_corr = 0.0f;
+    const int lags_per_service = 32;  //each lag is LATENCY_MLS_LEN multiply-adds
+
+    void setup(void) {
+      //build the MLS from a 10-bit Fibonacci LFSR (taps at 10 and 7)
+      unsigned int lfsr = 0x001;
+      for (int i = 0; i < LATENCY_MLS_LEN; i++) {
+        mls[i] = (lfsr & 0x0001) ? 1.0f : -1.0f;
+        unsigned int bit = ((lfsr >> 0) ^ (lfsr >> 3)) & 0x0001;
+        lfsr = (lfsr >> 1) | (bit << (LATENCY_MLS_ORDER - 1));
+      }
+    }
+    void fillStimulus(audio_block_f32_t *block) {
+      for (int i = 0; i < block->length; i++) {
+        block->data[i] = (stim_ind < LATENCY_MLS_LEN) ? (amplitude * mls[stim_ind]) : 0.0f;
+        stim_ind++;
+      }
+    }
+    void appendCapture(audio_block_f32_t *block) {
+      const int n_total = LATENCY_MLS_LEN + LATENCY_MAX_LAG;
+      int n = block ? min(block->length, n_total - capture_ind) : 0;
+      for (int i = 0; i < n; i++) capture_buff[capture_ind + i] = block->data[i];
+      capture_ind += n;
+      if (capture_ind >= n_total) state = STATE::CORRELATING;
+    }
+};
+
+void AudioLatencyTester_F32::update(void) {
+  audio_block_f32_t *through = receiveReadOnly_f32(0);
+  audio_block_f32_t *loop_capture = receiveReadOnly_f32(1);
+  audio_block_f32_t *graph_capture = receiveReadOnly_f32(2);
+
+  if (state != STATE::CAPTURING) {
+    //not measuring, so just pass the audio through
+    if (through) { transmit(through, 0); AudioStream_F32::release(through); }
+    if (loop_capture) AudioStream_F32::release(loop_capture);
+    if (graph_capture) AudioStream_F32::release(graph_capture);
+    return;
+  }
+
+  audio_block_f32_t *stim = AudioStream_F32::allocate_f32();
+  if (stim) {
+    if (through) stim->length = through->length;
+    latency_offset_samples = stim->length;
+    fillStimulus(stim);
+    if (mode == MODE::LOOPBACK) {
+      transmit(stim, 0);     //stimulus to the DAC instead of the normal audio
+    } else {
+      if (through) transmit(through, 0);
+      transmit(stim, 1);     //stimulus to the front of the processing
+    }
+    AudioStream_F32::release(stim);
+  }
+  appendCapture((mode == MODE::LOOPBACK) ? loop_capture : graph_capture);
+
+  if (through) AudioStream_F32::release(through);
+  if (loop_capture) AudioStream_F32::release(loop_capture);
+  if (graph_capture) AudioStream_F32::release(graph_capture);
+}
+
+#endif
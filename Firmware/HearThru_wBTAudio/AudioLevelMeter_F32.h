@@ -0,0 +1,108 @@
+
+/*
+   AudioLevelMeter_F32
+
+   Purpose: A sound level meter that can be tapped onto any point in the graph (it has no
+     outputs, so it only ever reads the blocks).  For each channel it keeps:
+       * the RMS, exponentially averaged (default 125 msec, "fast" on a sound level meter)
+       * the peak (largest sample) since the last time loop() read it
+     and reports them as dBFS or as dB SPL, using the same calibration as the compressors
+     (the dB SPL of a full-scale signal, ie an RMS of 1.0).
+
+   The ISR side is one CMSIS sum-of-squares and one CMSIS abs-max per channel per block,
+   and a multiply-add for the averaging.  Everything else (the logs, the printing) is done
+   from loop().
+
+   Reading the levels doesn't need interrupts turned off.  update() publishes them with a
+   sequence counter (odd while writing), and getLevels() just copies again if the audio
+   interrupt landed in the middle of its copy.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioLevelMeter_F32_h
+#define _AudioLevelMeter_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define LEVEL_METER_N_CHAN (2)
+
+class AudioLevelMeter_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:0 //this line used for automatic generation of GUI node
+  public:
+    struct Levels_t {
+      float32_t rms[LEVEL_METER_N_CHAN];
+      float32_t peak[LEVEL_METER_N_CHAN];
+    };
+
+    AudioLevelMeter_F32(const AudioSettings_F32 &settings) : AudioStream_F32(LEVEL_METER_N_CHAN, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_samples = settings.audio_block_samples;
+      for (int c = 0; c < LEVEL_METER_N_CHAN; c++) { ave_ms[c] = 0.0f; peak[c] = 0.0f; snap.rms[c] = 0.0f; snap.peak[c] = 0.0f; }
+      setTimeConstant_msec(125.0f);
+    }
+
+    float setTimeConstant_msec(float msec) {
+      tau_msec = max(1.0f, msec);
+      alpha = 1.0f - expf(-((float)block_samples) / (0.001f * tau_msec * sample_rate_Hz));
+      return tau_msec;
+    }
+    float getTimeConstant_msec(void) { return tau_msec; }
+    void setCalibration_dBSPL(float dBSPL_at_FS) { cal_dBSPL = dBSPL_at_FS; }  //eg, maxdB for the compressors
+    float getCalibration_dBSPL(void) { return cal_dBSPL; }
+
+    //copy out the latest levels (linear).  The peaks start over after each call.
+    void getLevels(Levels_t &out) {
+      uint32_t s;
+      do {
+        s = seq;
+        asm volatile("" ::: "memory");  //don't let the compiler move the copy outside of the two reads of seq
+        out = snap;
+        asm volatile("" ::: "memory");
+      } while ((s & 1) || (s != seq));
+      reset_peak = true;
+    }
+
+    //the same, but in dB.  Use getLevels() once and these to convert, if reading both channels.
+    float rms_dBFS(const Levels_t &lev, int chan) { return toDB(lev.rms[chan]); }
+    float peak_dBFS(const Levels_t &lev, int chan) { return toDB(lev.peak[chan]); }
+    float rms_dBSPL(const Levels_t &lev, int chan) { return toDB(lev.rms[chan]) + cal_dBSPL; }
+    float peak_dBSPL(const Levels_t &lev, int chan) { return toDB(lev.peak[chan]) + cal_dBSPL; }
+
+    virtual void update(void) {
+      if (reset_peak) { for (int c = 0; c < LEVEL_METER_N_CHAN; c++) peak[c] = 0.0f; reset_peak = false; }
+      for (int c = 0; c < LEVEL_METER_N_CHAN; c++) {
+        audio_block_f32_t *block = receiveReadOnly_f32(c);
+        if (!block) continue;
+        float32_t sum_sq, block_peak;
+        uint32_t ind;
+        arm_power_f32(block->data, block->length, &sum_sq);
+        arm_absmax_f32(block->data, block->length, &block_peak, &ind);
+        ave_ms[c] += alpha * (sum_sq / ((float32_t)block->length) - ave_ms[c]);
+        if (block_peak > peak[c]) peak[c] = block_peak;
+        AudioStream_F32::release(block);
+      }
+
+      //publish
+      seq++;
+      asm volatile("" ::: "memory");
+      for (int c = 0; c < LEVEL_METER_N_CHAN; c++) { snap.rms[c] = sqrtf(ave_ms[c]); snap.peak[c] = peak[c]; }
+      asm volatile("" ::: "memory");
+      seq++;
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[LEVEL_METER_N_CHAN];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    float tau_msec = 125.0f, alpha = 0.1f, cal_dBSPL = 115.0f;
+    float32_t ave_ms[LEVEL_METER_N_CHAN], peak[LEVEL_METER_N_CHAN];
+    Levels_t snap;
+    volatile uint32_t seq = 0;
+    volatile bool reset_peak = false;
+
+    static float toDB(float32_t x) { return 20.0f * log10f(max(x, 1.0e-10f)); }
+};
+
+#endif
@@ -0,0 +1,219 @@
+
+/*
+   AudioLimiterLookahead_F32
+
+   Purpose: Stereo-linked brick-wall limiter with lookahead, for hearing protection.
+     The audio is delayed by the lookahead time so that the gain is already down by the
+     time an impulse (eg, a gunshot) reaches the output.  The compressors are too slow for that.
+
+   How it works, per sample:
+     * the peak is the larger of the two channels, including an estimate of the
+       inter-sample peak so that the DAC doesn't overshoot.  Each channel is interpolated
+       half-way between samples (4-point), on the signed samples, and then the magnitude
+       is taken: a peak that falls between two samples of opposite sign, or of the same
+       sign on either side of a crest, is only there in the signed waveform.
+     * the required gain is the sliding-window minimum over the lookahead window,
+       computed in O(1) per sample using a monotonic deque
+     * the gain is released slowly (attack is instant) and then smoothed with a moving
+       average that is as long as the lookahead, so it ramps down just in time
+
+   LimiterLookahead_Core is the processing on its own, so that it can be timed outside of the
+   audio graph (see benchmarkBlockSizes() in the sketch).
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioLimiterLookahead_F32_h
+#define _AudioLimiterLookahead_F32_h
+
+#include <Tympan_Library.h>
+
+#define LIMITER_MAX_LOOKAHEAD (128)  //samples. 1 msec at 96 kHz is 96 samples
+
+class LimiterLookahead_Core {
+  public:
+    LimiterLookahead_Core(void) { setup(); }
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; setup(); }
+
+    void setup(void) {
+      setThreshold_dBFS(-1.0f);
+      setRelease_msec(50.0f);
+      setLookahead_msec(0.5f);
+    }
+
+    //lookahead is 0.25 to 1 msec.  This is also the added latency.
+    float setLookahead_msec(float msec) {
+      msec = max(0.25f, min(msec, 1.0f));
+      int n = (int)(msec * 0.001f * sample_rate_Hz + 0.5f);
+      __disable_irq();
+      lookahead = max(1, min(n, LIMITER_MAX_LOOKAHEAD - 1));
+      resetState();
+      __enable_irq();
+      return getLookahead_msec();
+    }
+    float getLookahead_msec(void) { return 1000.0f * ((float)lookahead) / sample_rate_Hz; }
+    int getLookahead_samples(void) { return lookahead; }
+
+    float setThreshold_dBFS(float dBFS) {
+      thresh_dBFS = min(dBFS, 0.0f);
+      thresh = powf(10.0f, thresh_dBFS / 20.0f);
+      return thresh_dBFS;
+    }
+    float getThreshold_dBFS(void) { return thresh_dBFS; }
+
+    float setRelease_msec(float msec) {
+      release_msec = max(1.0f, msec);
+      release_coeff = 1.0f - expf(-1.0f / (release_msec * 0.001f * sample_rate_Hz));
+      return release_msec;
+    }
+    float getRelease_msec(void) { return release_msec; }
+
+    float getCurrentGain_dB(void) { return 20.0f * log10f(max(cur_gain, 1.0e-6f)); }
+    float getMinGain_dB(void) { return 20.0f * log10f(max(min_gain, 1.0e-6f)); }
+    void resetMinGain(void) { min_gain = 1.0f; }
+
+    //both channels, in place
+    void process(float32_t *dataL, float32_t *dataR, int n);
+
+  private:
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    float thresh_dBFS, thresh = 1.0f;
+    float release_msec, release_coeff = 0.01f;
+    int lookahead = 48;
+
+    //delay lines for the audio (so the gain can get there first)
+    float32_t delayL[LIMITER_MAX_LOOKAHEAD], delayR[LIMITER_MAX_LOOKAHEAD];
+    //monotonic deque for the sliding-window minimum of the required gain
+    float32_t dq_val[LIMITER_MAX_LOOKAHEAD];
+    unsigned long dq_time[LIMITER_MAX_LOOKAHEAD];
+    int dq_head = 0, dq_count = 0;
+    //moving average of the gain
+    float32_t avg_buff[LIMITER_MAX_LOOKAHEAD];
+    float32_t avg_sum = 0.0f;
+    //other state
+    int write_ind = 0;
+    unsigned long sample_count = 0;
+    float32_t histL[3] = {0.0f, 0.0f, 0.0f}, histR[3] = {0.0f, 0.0f, 0.0f};  //previous samples for the inter-sample estimate, newest first
+    float32_t held_gain = 1.0f, cur_gain = 1.0f, min_gain = 1.0f;
+
+    void resetState(void) {
+      for (int i = 0; i < LIMITER_MAX_LOOKAHEAD; i++) {
+        delayL[i] = 0.0f; delayR[i] = 0.0f; avg_buff[i] = 1.0f;
+      }
+      avg_sum = (float32_t)lookahead;
+      dq_head = 0; dq_count = 0; write_ind = 0; sample_count = 0;
+      for (int i = 0; i < 3; i++) { histL[i] = 0.0f; histR[i] = 0.0f; }
+      held_gain = 1.0f; cur_gain = 1.0f;
+    }
+
+    //push a new value onto the back of the deque, dropping anything larger (it can never be the min again)
+    inline void dequePush(float32_t val, unsigned long t) {
+      while (dq_count > 0) {
+        int back = (dq_head + dq_count - 1) % LIMITER_MAX_LOOKAHEAD;
+        if (dq_val[back] < val) break;
+        dq_count--;
+      }
+      int ind = (dq_head + dq_count) % LIMITER_MAX_LOOKAHEAD;
+      dq_val[ind] = val; dq_time[ind] = t; dq_count++;
+    }
+    //drop anything at the front that has fallen out of the window, then the front is the min
+    inline float32_t dequeMin(unsigned long t) {
+      while ((dq_count > 1) && ((t - dq_time[dq_head]) > (unsigned long)lookahead)) {
+        dq_head = (dq_head + 1) % LIMITER_MAX_LOOKAHEAD;
+        dq_count--;
+      }
+      return dq_val[dq_head];
+    }
+};
+
+void LimiterLookahead_Core::process(float32_t *dataL, float32_t *dataR, int n) {
+  //re-sum the moving average once per block so that round-off can't accumulate
+  avg_sum = 0.0f;
+  for (int i = 0; i < lookahead; i++) avg_sum += avg_buff[(write_ind + LIMITER_MAX_LOOKAHEAD - i) % LIMITER_MAX_LOOKAHEAD];
+  const float32_t inv_lookahead = 1.0f / ((float32_t)lookahead);
+
+  float32_t block_min_gain = 1.0f;
+  for (int i = 0; i < n; i++) {
+    float32_t inL = dataL[i], inR = dataR[i];
+
+    //stereo-linked peak, plus the inter-sample peak half-way between the previous two samples
+    //(interpolated on the signed samples of each channel, and only then made positive)
+    float32_t midL = 0.5625f * (histL[1] + histL[0]) - 0.0625f * (histL[2] + inL);
+    float32_t midR = 0.5625f * (histR[1] + histR[0]) - 0.0625f * (histR[2] + inR);
+    histL[2] = histL[1]; histL[1] = histL[0]; histL[0] = inL;
+    histR[2] = histR[1]; histR[1] = histR[0]; histR[0] = inR;
+    float32_t pk = max(max(fabsf(inL), fabsf(inR)), max(fabsf(midL), fabsf(midR)));
+
+    //gain needed for this sample, then the min over the lookahead window
+    float32_t need = (pk > thresh) ? (thresh / pk) : 1.0f;
+    dequePush(need, sample_count);
+    float32_t win_min = dequeMin(sample_count);
+    sample_count++;
+
+    //instant attack, exponential release
+    if (win_min < held_gain) {
+      held_gain = win_min;
+    } else {
+      held_gain += release_coeff * (win_min - held_gain);
+    }
+
+    //moving average over the lookahead, so the gain ramps down over the lookahead time
+    int next_ind = (write_ind + 1) % LIMITER_MAX_LOOKAHEAD;
+    int old_ind = (next_ind + LIMITER_MAX_LOOKAHEAD - lookahead) % LIMITER_MAX_LOOKAHEAD;
+    avg_sum += held_gain - avg_buff[old_ind];
+    avg_buff[next_ind] = held_gain;
+    float32_t gain = avg_sum * inv_lookahead;
+
+    //read the delayed audio, write the new audio
+    int read_ind = (next_ind + LIMITER_MAX_LOOKAHEAD - lookahead) % LIMITER_MAX_LOOKAHEAD;
+    dataL[i] = gain * delayL[read_ind];
+    dataR[i] = gain * delayR[read_ind];
+    delayL[next_ind] = inL; delayR[next_ind] = inR;
+    write_ind = next_ind;
+
+    if (gain < block_min_gain) block_min_gain = gain;
+  }
+  cur_gain = block_min_gain;
+  if (block_min_gain < min_gain) min_gain = block_min_gain;
+}
+
+class AudioLimiterLookahead_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioLimiterLookahead_F32(void) : AudioStream_F32(2, inputQueueArray) {}
+    AudioLimiterLookahead_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      core.setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+    LimiterLookahead_Core &getCore(void) { return core; }
+
+    //the settings are the core's
+    float setLookahead_msec(float msec) { return core.setLookahead_msec(msec); }
+    float getLookahead_msec(void) { return core.getLookahead_msec(); }
+    int getLookahead_samples(void) { return core.getLookahead_samples(); }
+    float setThreshold_dBFS(float dBFS) { return core.setThreshold_dBFS(dBFS); }
+    float getThreshold_dBFS(void) { return core.getThreshold_dBFS(); }
+    float setRelease_msec(float msec) { return core.setRelease_msec(msec); }
+    float getRelease_msec(void) { return core.getRelease_msec(); }
+    float getCurrentGain_dB(void) { return core.getCurrentGain_dB(); }
+    float getMinGain_dB(void) { return core.getMinGain_dB(); }
+    void resetMinGain(void) { core.resetMinGain(); }
+
+    virtual void update(void) {
+      audio_block_f32_t *blockL = receiveWritable_f32(0);
+      audio_block_f32_t *blockR = receiveWritable_f32(1);
+      if (!blockL || !blockR) {
+        if (blockL) AudioStream_F32::release(blockL);
+        if (blockR) AudioStream_F32::release(blockR);
+        return;
+      }
+      core.process(blockL->data, blockR->data, blockL->length);
+      transmit(blockL, 0); transmit(blockR, 1);
+      AudioStream_F32::release(blockL); AudioStream_F32::release(blockR);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    LimiterLookahead_Core core;
+};
+
+#endif
@@ -134,10 +134,10 @@ class AudioSDWriter_F32 : public AudioSDWriter, public AudioStream_F32 {
     void prepareSDforRecording(void) {
       if (current_SD_state == STATE::UNPREPARED) {
         if (buffSDWriterI16) {
-          buffSDWriterI16->init(); //part of SDWriter, which is the base for BufferedSDWriter_I16
+          if (!buffSDWriterI16->init()) return; //part of SDWriter, which is the base for BufferedSDWriter_I16.  No card: stay unprepared, to try again next time
           if (PRINT_FULL_SD_TIMING) buffSDWriterI16->enablePrintElapsedWriteTime(); //for debugging.  make sure time is less than (audio_block_samples/sample_rate_Hz * 1e6) = 2900 usec for 128 samples at 44.1 kHz
         } else if (buffSDWriterF32) {
-          buffSDWriterF32->init();
+          if (!buffSDWriterF32->init()) return;
           if (PRINT_FULL_SD_TIMING) buffSDWriterF32->enablePrintElapsedWriteTime(); //for debugging.  make sure time is less than (audio_block_samples/sample_rate_Hz * 1e6) = 2900 usec for 128 samples at 44.1 kHz
         }
         current_SD_state = STATE::STOPPED;
@@ -179,6 +179,7 @@ class AudioSDWriter_F32 : public AudioSDWriter, public AudioStream_F32 {
             serial_ptr->println(fname);
           }
           queueL.begin(); queueR.begin();
+          n_dropped_samples = 0;
           current_SD_state = STATE::RECORDING;
         } else {
           if (serial_ptr) {
@@ -208,6 +209,11 @@ class AudioSDWriter_F32 : public AudioSDWriter, public AudioStream_F32 {
 
         //stop the queues so that they stop accumulating data
         queueL.end();  queueR.end();
+
+        if (serial_ptr && (n_dropped_samples > 0)) {
+          serial_ptr->print("stopRecording: WARNING: "); serial_ptr->print(n_dropped_samples);
+          serial_ptr->println(" samples per channel were dropped (no free audio blocks).");
+        }
       }
     }
 
@@ -215,8 +221,25 @@ class AudioSDWriter_F32 : public AudioSDWriter, public AudioStream_F32 {
     //only service the recording queues so as to buffer the audio data.
     //The acutal SD writing should occur in the loop() as invoked by a service routine
     void update(void) {
-      queueL.update(receiveReadOnly_f32(0));
-      queueR.update(receiveReadOnly_f32(1));
+      audio_block_f32_t *left = receiveReadOnly_f32(0), *right = receiveReadOnly_f32(1);
+
+      //full-sized blocks (or a missing channel) go straight into the queues, as before
+      if ((left == NULL) || (right == NULL) || (left->length >= AUDIO_BLOCK_SAMPLES)) {
+        releaseAccumulators();
+        queueL.update(left);
+        queueR.update(right);
+        return;
+      }
+
+      //small blocks (low-latency mode) get gathered into full-sized blocks so that
+      //the queues don't fill up any faster than they do for 128-sample blocks
+      if (current_SD_state == STATE::RECORDING) {
+        accumulateAndQueue(left, right);
+      } else {
+        releaseAccumulators();
+      }
+      AudioStream_F32::release(left);
+      AudioStream_F32::release(right);
     }
 
     bool isFileOpen(void) {
@@ -302,14 +325,55 @@ class AudioSDWriter_F32 : public AudioSDWriter, public AudioStream_F32 {
       queueL.clearOverrun();
       queueR.clearOverrun();
     }
+    //samples (per channel) that never made it into the queues because there was no block to
+    //gather them into (low-latency mode only).  Counts from the start of the recording.
+    unsigned long getNDroppedSamples(void) { return n_dropped_samples; }
+    //number of full-sized blocks waiting to go to the SD (the loop() scheduler watches this)
+    int getQueueDepth(void) {
+      if (numWriteChannels == 1) return queueL.available();
+      return max(queueL.available(), queueR.available());
+    }
 
   protected:
     audio_block_f32_t *inputQueueArray[2]; //two input channels
     AudioRecordQueue_F32 queueL, queueR;
+    audio_block_f32_t *accumL = NULL, *accumR = NULL; //for gathering small blocks into full-sized blocks
+    int accum_ind = 0;
+    volatile unsigned long n_dropped_samples = 0;
     BufferedSDWriter_I16 *buffSDWriterI16 = 0;
     BufferedSDWriter_F32 *buffSDWriterF32 = 0;
     Print *serial_ptr = &Serial;
 
+    //copy the (small) incoming blocks into the accumulator blocks.  When the accumulators
+    //are full, hand them to the queues, which take ownership of them.
+    void accumulateAndQueue(audio_block_f32_t *left, audio_block_f32_t *right) {
+      if (accumL == NULL) accumL = AudioStream_F32::allocate_f32();
+      if (accumR == NULL) accumR = AudioStream_F32::allocate_f32();
+      if ((accumL == NULL) || (accumR == NULL)) { n_dropped_samples += left->length; return; }  //out of memory.  try again next time.
+
+      if (accum_ind == 0) {
+        accumL->id = left->id;  accumL->fs_Hz = left->fs_Hz;
+        accumR->id = right->id; accumR->fs_Hz = right->fs_Hz;
+      }
+      int n = min(left->length, AUDIO_BLOCK_SAMPLES - accum_ind);
+      for (int i = 0; i < n; i++) {
+        accumL->data[accum_ind + i] = left->data[i];
+        accumR->data[accum_ind + i] = right->data[i];
+      }
+      accum_ind += n;
+
+      if (accum_ind >= AUDIO_BLOCK_SAMPLES) {
+        accumL->length = accum_ind;  accumR->length = accum_ind;
+        queueL.update(accumL);  queueR.update(accumR);
+        accumL = NULL;  accumR = NULL;  accum_ind = 0;
+      }
+    }
+    void releaseAccumulators(void) {
+      if (accumL) AudioStream_F32::release(accumL);
+      if (accumR) AudioStream_F32::release(accumR);
+      accumL = NULL;  accumR = NULL;  accum_ind = 0;
+    }
+
     bool open(char *fname) {
       if (buffSDWriterI16) {
         return buffSDWriterI16->open(fname);
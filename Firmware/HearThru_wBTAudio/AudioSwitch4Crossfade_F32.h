@@ -0,0 +1,104 @@
+
+/*
+   AudioSwitch4Crossfade_F32
+
+   Purpose: Drop-in replacement for AudioSwitch4_F32 that crossfades instead of cutting
+     over.  On setChannel(), the old output fades out while the new one fades in (linear,
+     default 10 msec).  The outputs are summed downstream (the output mixer), and the
+     algorithms all see the same input, so a linear fade keeps the level steady.
+
+   Like AudioSwitch4_F32, the outputs that are fully off get no blocks at all, so the
+   algorithms that aren't selected don't cost any CPU.  The fully-on output is just handed
+   the input block (no copy).  Only the two outputs in a fade get new blocks.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioSwitch4Crossfade_F32_h
+#define _AudioSwitch4Crossfade_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define SWITCH_XFADE_N_CHAN (4)
+
+class AudioSwitch4Crossfade_F32 : public AudioStream_F32 {
+  //GUI: inputs:1, outputs:4 //this line used for automatic generation of GUI node
+  public:
+    AudioSwitch4Crossfade_F32(void) : AudioStream_F32(1, inputQueueArray) { setup(); }
+    AudioSwitch4Crossfade_F32(const AudioSettings_F32 &settings) : AudioStream_F32(1, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      setup();
+    }
+
+    void setup(void) {
+      for (int i = 0; i < SWITCH_XFADE_N_CHAN; i++) { cur_gain[i] = 0.0f; target_gain[i] = 0.0f; }
+      cur_gain[0] = 1.0f; target_gain[0] = 1.0f;
+      setFadeTime_msec(10.0f);
+    }
+
+    int setChannel(unsigned int chan) {
+      if (chan >= SWITCH_XFADE_N_CHAN) return out_chan;
+      __disable_irq();
+      out_chan = chan;
+      for (int i = 0; i < SWITCH_XFADE_N_CHAN; i++) target_gain[i] = (i == out_chan) ? 1.0f : 0.0f;
+      __enable_irq();
+      return out_chan;
+    }
+    int getChannel(void) { return out_chan; }
+
+    float setFadeTime_msec(float msec) {
+      step_per_sample = 1.0f / max(1.0f, max(0.0f, msec) * 0.001f * sample_rate_Hz);
+      return getFadeTime_msec();
+    }
+    float getFadeTime_msec(void) { return 1000.0f / (step_per_sample * sample_rate_Hz); }
+
+    bool isFading(void) {
+      for (int i = 0; i < SWITCH_XFADE_N_CHAN; i++) if (cur_gain[i] != target_gain[i]) return true;
+      return false;
+    }
+
+    virtual void update(void);
+
+  private:
+    audio_block_f32_t *inputQueueArray[1];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    float32_t step_per_sample = 0.001f;
+    int out_chan = 0;
+    float32_t cur_gain[SWITCH_XFADE_N_CHAN], target_gain[SWITCH_XFADE_N_CHAN];
+};
+
+void AudioSwitch4Crossfade_F32::update(void) {
+  audio_block_f32_t *in = receiveReadOnly_f32();
+  if (!in) return;
+  const int n = in->length;
+
+  for (int chan = 0; chan < SWITCH_XFADE_N_CHAN; chan++) {
+    float32_t g = cur_gain[chan];
+    const float32_t target = target_gain[chan];
+    if ((g == 0.0f) && (target == 0.0f)) continue;   //off.  Send nothing.
+    if ((g == 1.0f) && (target == 1.0f)) { transmit(in, chan); continue; }  //on.  Pass the block.
+
+    //fading.  Ramp toward the target, and then hold there for the rest of the block.
+    audio_block_f32_t *out = allocate_f32();
+    if (!out) { cur_gain[chan] = target; continue; }  //no memory.  Just jump.
+    const float32_t dg = (target > g) ? step_per_sample : -step_per_sample;
+    int n_ramp = min(n, (int)(fabsf(target - g) / step_per_sample));
+    for (int i = 0; i < n_ramp; i++) { g += dg; out->data[i] = g * in->data[i]; }
+    if (n_ramp < n) {
+      g = target;
+      if (g == 0.0f) {
+        arm_fill_f32(0.0f, out->data + n_ramp, n - n_ramp);
+      } else {
+        arm_copy_f32(in->data + n_ramp, out->data + n_ramp, n - n_ramp);
+      }
+    }
+    cur_gain[chan] = g;
+    out->length = n;
+    transmit(out, chan);
+    AudioStream_F32::release(out);
+  }
+  AudioStream_F32::release(in);
+}
+
+#endif
@@ -0,0 +1,365 @@
+
+/*
+   BC127Driver
+
+   Purpose: Runs the BC127 Bluetooth module without ever waiting on it.  Everything is
+     driven from loop(): receive() reads Serial1, and service() moves the state machine
+     along.  Commands go out through the SerialTxQueue, and the replies are handled when
+     they arrive, so nothing blocks the audio or the SD.
+
+   Demultiplexing: the module's messages ("OK", "OPEN_OK 11 A2DP 20FABB...", "Ready", etc)
+     and the app's commands (single characters, and the binary frames) arrive on the same
+     Serial1.  The module's messages always start with one of a known set of words, at the
+     start of a line.  So, bytes that could still be the start of one of those words are
+     held back (for a few msec at most), and whatever can't be is passed to the app right
+     away.  Once a word is matched, the rest of the line is the module's.  Inside one of the
+     app's binary frames, everything goes to the app.
+
+   Connection: at boot, it asks for the status.  If nothing is connected, the module is
+     restored to a clean sink (as the old blocking code did: RESTORE, CLASSIC_ROLE=0, WRITE,
+     RESET), so that a phone can pair with it.  If a link drops, it tries to reconnect to the
+     last device a few times (backing off), and then restores the module and waits.  Nothing
+     is polled while connected: the connects and disconnects are reported by the module.
+
+   The app's traffic only goes out Serial1 while the app (SPP or BLE) is connected; the rest
+   of the time, it would only look like bad commands to the module (and the module's ERRORs
+   would look like replies to ours).  That includes the time before the module's state is
+   known, so the boot text never goes to the module.  The commands go through their own
+   queue (see SerialTxQueue::pushCommand), never in the middle of one of the app's lines,
+   and the wait for the reply only starts once the command has actually gone out.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _BC127Driver_h
+#define _BC127Driver_h
+
+#include <Arduino.h>
+#include <Print.h>
+#include "SerialTxQueue.h"
+
+#define BT_LINE_LEN (96)            //longest module message kept.  Longer ones are cut short.
+#define BT_HOLD_LEN (24)            //longer than the longest word, plus one
+#define BT_HOLD_MSEC (5)            //a whole module message arrives well within this
+#define BT_REPLY_MSEC (2000)        //for "OK"
+#define BT_READY_MSEC (5000)        //for "Ready", after a reset
+#define BT_OPEN_MSEC (10000)        //for a reconnect
+#define BT_MAX_RECONNECTS (3)
+#define BT_MAX_BACKOFF_MSEC (30000)
+
+class BC127Driver {
+  public:
+    typedef void (*ByteFcn_t)(char c);
+    typedef bool (*BusyFcn_t)(void);
+    enum class STATE { IDLE = 0, QUERYING, RESTORING, WAITING, CONNECTED, RECONNECT_WAIT, RECONNECTING, NO_REPLY };
+
+    BC127Driver(Stream *_port, SerialTxQueue &_txq) : port(_port), txq(_txq) {
+      txq.setPortEnabled(SERIAL_PORT_BT, false);  //no app text to the module until we know that the app is there
+    };
+    void setSerial(Print *_serial_ptr) { serial_ptr = _serial_ptr; }
+
+    //where the app's bytes go, and (optionally) a check for whether the app is in the middle of a binary frame
+    void setAppReceiver(ByteFcn_t _to_app, BusyFcn_t _app_busy) { to_app = _to_app; app_busy = _app_busy; }
+
+    //call from loop(), as often as possible.  Returns true if anything came in.
+    bool receive(void) {
+      bool did_work = false;
+      checkCommandSent();  //before the reply can be read
+      while (port->available()) { receiveByte((char)port->read()); did_work = true; }
+      if ((hold_len > 0) && ((millis() - hold_msec) > BT_HOLD_MSEC)) {
+        for (int i = 0; i < hold_len; i++) toApp(hold[i]);  //it wasn't the module after all
+        hold_len = 0;
+      }
+      return did_work;
+    }
+
+    //call from loop().  Never waits.  Returns true if it did something.
+    bool service(void) {
+      const unsigned long now = millis();
+      switch (state) {
+        case STATE::IDLE:
+          startQuery();
+          return true;
+        case STATE::QUERYING: case STATE::RESTORING:
+          checkCommandSent();
+          if ((awaiting || cmd_in_queue) && ((now - cmd_msec) > (awaiting_ready ? BT_READY_MSEC : BT_REPLY_MSEC))) {
+            awaiting = false; cmd_in_queue = false;
+            n_timeouts++;
+            setState(STATE::NO_REPLY);
+            return true;
+          }
+          return false;
+        case STATE::NO_REPLY:
+          if ((now - state_msec) < backoff_msec(n_timeouts)) return false;
+          startQuery();
+          return true;
+        case STATE::RECONNECT_WAIT:
+          if ((now - state_msec) < backoff_msec(n_reconnects)) return false;
+          n_reconnects++;
+          sendCommand("OPEN ", last_addr, " A2DP", false);
+          setState(STATE::RECONNECTING);
+          return true;
+        case STATE::RECONNECTING:
+          checkCommandSent();
+          if ((now - cmd_msec) > BT_OPEN_MSEC) { awaiting = false; cmd_in_queue = false; reconnectFailed(); return true; }
+          return false;
+        case STATE::WAITING: case STATE::CONNECTED:
+          return false;  //the module tells us when something changes
+      }
+      return false;
+    }
+
+    STATE getState(void) { return state; }
+    bool isConnected(void) { return links != 0; }
+    bool isStreaming(void) { return streaming; }
+    static const char *getStateName(STATE s) {
+      switch (s) {
+        case STATE::IDLE: return "IDLE";
+        case STATE::QUERYING: return "QUERYING";
+        case STATE::RESTORING: return "RESTORING";
+        case STATE::WAITING: return "WAITING";
+        case STATE::CONNECTED: return "CONNECTED";
+        case STATE::RECONNECT_WAIT: return "RECONNECT_WAIT";
+        case STATE::RECONNECTING: return "RECONNECTING";
+        case STATE::NO_REPLY: return "NO_REPLY";
+      }
+      return "?";
+    }
+
+    void printStatus(Print *p) {
+      p->print("BT: state="); p->print(getStateName(state));
+      p->print(", links=");
+      if (links == 0) p->print("none");
+      for (int i = 0, n = 0; i < N_PROFILES; i++) if (links & (1 << i)) { if (n++) p->print("+"); p->print(profile_names[i]); }
+      p->print(", addr="); p->print((last_addr[0] != '\0') ? last_addr : "none");
+      p->print(", streaming="); p->print(streaming ? 1 : 0);
+      p->print(", reconnects="); p->print(n_reconnects);
+      p->print(", timeouts="); p->print(n_timeouts);
+      p->print(", module lines="); p->print(n_module_lines);
+      p->print(", app bytes="); p->println(n_app_bytes);
+    }
+
+  private:
+    Stream *port;
+    SerialTxQueue &txq;
+    Print *serial_ptr = &Serial;
+    ByteFcn_t to_app = NULL;
+    BusyFcn_t app_busy = NULL;
+
+    //receiving
+    char hold[BT_HOLD_LEN], line[BT_LINE_LEN];
+    int hold_len = 0, line_len = 0;
+    bool in_line = false, after_eol = false;
+    unsigned long hold_msec = 0, n_module_lines = 0, n_app_bytes = 0;
+
+    //the connection
+    enum { PROF_A2DP = 0, PROF_AVRCP, PROF_HFP, PROF_SPP, PROF_BLE, N_PROFILES };
+    const char *profile_names[N_PROFILES] = { "A2DP", "AVRCP", "HFP", "SPP", "BLE" };
+    STATE state = STATE::IDLE;
+    unsigned long state_msec = 0, cmd_msec = 0;
+    bool awaiting = false, awaiting_ready = false, cmd_in_queue = false, streaming = false, booted = false;
+    uint32_t links = 0;
+    char last_addr[16] = "";
+    int restore_step = 0, n_reconnects = 0, n_timeouts = 0;
+
+    static unsigned long backoff_msec(int n) { return min((unsigned long)BT_MAX_BACKOFF_MSEC, 2000UL << min(n, 8)); }
+
+    void toApp(char c) { n_app_bytes++; if (to_app) to_app(c); }
+
+    // ///////// receiving
+
+    //the words that start the module's messages
+    int matchWord(void) {  //0: can't be one.  1: could still be one.  2: is one (with its delimiter)
+      static const char *words[] = { "OK", "ERROR", "Ready", "READY", "PENDING", "OPEN_OK", "OPEN_ERROR", "CLOSE_OK",
+        "CLOSE_ERROR", "LINK", "LINK_LOSS", "STATE", "RECV", "A2DP_STREAM_START", "A2DP_STREAM_SUSPEND", "AVRCP_PLAY",
+        "AVRCP_PAUSE", "AVRCP_MEDIA", "ABS_VOL", "PAIR_OK", "PAIR_ERROR", "PAIR_PENDING", "INQUIRY", "Melody", "(c)", "Build" };
+      int result = 0;
+      for (unsigned int k = 0; k < sizeof(words) / sizeof(words[0]); k++) {
+        const int len = strlen(words[k]);
+        if ((hold_len <= len) && (strncmp(hold, words[k], hold_len) == 0)) result = 1;
+        if ((hold_len == len + 1) && (strncmp(hold, words[k], len) == 0) && isDelimiter(hold[len])) return 2;
+      }
+      return result;
+    }
+    static bool isDelimiter(char c) { return (c == ' ') || (c == '\r') || (c == '\n'); }
+
+    void receiveByte(char c) {
+      if (in_line) {
+        if ((c == '\r') || (c == '\n')) {
+          line[line_len] = '\0';
+          in_line = false; after_eol = true;
+          handleLine();
+        } else if (line_len < BT_LINE_LEN - 1) {
+          line[line_len++] = c;
+        }
+        return;
+      }
+      if (after_eol && ((c == '\r') || (c == '\n'))) return;  //the rest of the module's line ending
+      after_eol = false;
+      if ((hold_len == 0) && app_busy && app_busy()) { toApp(c); return; }  //inside one of the app's frames
+
+      hold[hold_len++] = c; hold_msec = millis();
+      while (hold_len > 0) {
+        const int m = matchWord();
+        if (m == 2) {
+          //the module's.  Take the rest of the line.
+          const bool eol = (c == '\r') || (c == '\n');
+          line_len = hold_len - 1;
+          memcpy(line, hold, line_len);
+          if (!eol) line[line_len++] = c;
+          hold_len = 0;
+          if (eol) { line[line_len] = '\0'; after_eol = true; handleLine(); } else { in_line = true; }
+          return;
+        }
+        if (m == 1) return;  //wait for more
+        toApp(hold[0]);      //the first byte can't be the module's.  Check again from the next one.
+        hold_len--;
+        memmove(hold, hold + 1, hold_len);
+      }
+    }
+
+    bool lineStartsWith(const char *word) { return strncmp(line, word, strlen(word)) == 0; }
+
+    //the n-th space-separated word of the line (0 is the message), copied into out
+    bool lineWord(int n, char *out, int max_len) {
+      const char *p = line;
+      for (int k = 0; k < n; k++) {
+        p = strchr(p, ' ');
+        if (!p) return false;
+        while (*p == ' ') p++;
+      }
+      int i = 0;
+      while ((p[i] != '\0') && (p[i] != ' ') && (i < max_len - 1)) { out[i] = p[i]; i++; }
+      out[i] = '\0';
+      return i > 0;
+    }
+
+    int profileIndex(const char *name) {
+      for (int i = 0; i < N_PROFILES; i++) if (strcmp(name, profile_names[i]) == 0) return i;
+      return -1;
+    }
+
+    void handleLine(void) {
+      n_module_lines++;
+      char word[16];
+      if (lineStartsWith("OK")) {
+        replyReceived(true);
+      } else if (lineStartsWith("ERROR")) {
+        replyReceived(false);
+      } else if (lineStartsWith("Ready") || lineStartsWith("READY")) {
+        links = 0; streaming = false;
+        updateAppPort();
+        readyReceived();
+      } else if (lineStartsWith("OPEN_OK")) {  //OPEN_OK <link id> <profile> <address>
+        if (lineWord(2, word, sizeof(word))) addLink(profileIndex(word));
+        if (lineWord(3, word, sizeof(word))) strncpy(last_addr, word, sizeof(last_addr) - 1);
+        if (state == STATE::RECONNECTING) awaiting = false;
+        if (links && (state != STATE::QUERYING) && (state != STATE::RESTORING)) { n_reconnects = 0; setState(STATE::CONNECTED); }
+      } else if (lineStartsWith("OPEN_ERROR")) {
+        if (state == STATE::RECONNECTING) { awaiting = false; reconnectFailed(); }
+      } else if (lineStartsWith("CLOSE_OK")) {  //CLOSE_OK <link id> <profile> <address>
+        if (lineWord(2, word, sizeof(word))) removeLink(profileIndex(word));
+        if ((links == 0) && (state == STATE::CONNECTED)) linkLost();
+      } else if (lineStartsWith("LINK") && !lineStartsWith("LINK_LOSS")) {  //from STATUS: LINK <link id> CONNECTED <profile> <address>
+        if (lineWord(3, word, sizeof(word))) addLink(profileIndex(word));
+        if (lineWord(4, word, sizeof(word))) strncpy(last_addr, word, sizeof(last_addr) - 1);
+      } else if (lineStartsWith("A2DP_STREAM_START")) {
+        streaming = true;
+      } else if (lineStartsWith("A2DP_STREAM_SUSPEND")) {
+        streaming = false;
+      } else if (lineStartsWith("RECV")) {  //RECV <link id> <n bytes> <data>: data from the app, in command mode
+        const char *p = line;
+        for (int k = 0; (k < 3) && p; k++) { p = strchr(p, ' '); if (p) p++; }
+        if (p) while (*p) toApp(*p++);
+      }
+      //anything else (STATE, AVRCP_*, the boot banner...) is just noted
+    }
+
+    // ///////// the connection
+
+    void setState(STATE s) {
+      if (s == state) return;
+      state = s; state_msec = millis();
+      if (serial_ptr) printStatus(serial_ptr);
+    }
+
+    //one whole command, only to the module.  Replies only count once it has gone out (see
+    //checkCommandSent()).  If the queue is full, the reply times out and it is tried again later.
+    void sendCommand(const char *a, const char *b, const char *c, bool wait_for_ready) {
+      char cmd[48];
+      int n = snprintf(cmd, sizeof(cmd), "%s%s%s\r", a, b ? b : "", c ? c : "");
+      cmd_in_queue = txq.pushCommand(SERIAL_PORT_BT, (const uint8_t *)cmd, min(n, (int)sizeof(cmd) - 1));
+      awaiting = !cmd_in_queue;  //if it couldn't be queued, let it time out
+      awaiting_ready = wait_for_ready; cmd_msec = millis();
+    }
+    void checkCommandSent(void) {
+      if (cmd_in_queue && txq.isCommandSent(SERIAL_PORT_BT)) { cmd_in_queue = false; awaiting = true; cmd_msec = millis(); }
+    }
+    void sendCommand(const char *cmd, bool wait_for_ready) { sendCommand(cmd, NULL, NULL, wait_for_ready); }
+
+    void startQuery(void) {
+      links = 0; streaming = false;
+      sendCommand("STATUS", false);  //LINK lines come back, then OK
+      setState(STATE::QUERYING);
+    }
+
+    //put the module back to a clean sink, so that a phone can pair with it
+    const char *restore_cmds[4] = { "RESTORE", "SET CLASSIC_ROLE=0", "WRITE", "RESET" };
+    void startRestore(void) {
+      restore_step = 0;
+      sendCommand(restore_cmds[0], false);
+      setState(STATE::RESTORING);
+    }
+
+    void replyReceived(bool ok) {
+      if (!awaiting || awaiting_ready) return;  //not ours, or waiting for "Ready" instead
+      awaiting = false;
+      n_timeouts = 0;
+      if (state == STATE::QUERYING) {
+        if (!ok) { setState(STATE::NO_REPLY); return; }  //try again later, rather than wiping the module
+        updateAppPort();
+        if (links != 0) { setState(STATE::CONNECTED); }
+        else if (!booted || (last_addr[0] == '\0')) { startRestore(); }  //like the old code: a clean start at boot
+        else { n_reconnects = 0; setState(STATE::RECONNECT_WAIT); }
+        booted = true;
+      } else if (state == STATE::RESTORING) {
+        if (!ok) { setState(STATE::NO_REPLY); return; }
+        restore_step++;
+        sendCommand(restore_cmds[restore_step], restore_step == 3);  //the reset answers with "Ready"
+      }
+    }
+    void readyReceived(void) {
+      if (state != STATE::RESTORING) { setState(STATE::WAITING); return; }  //the module restarted on its own
+      if (!awaiting) return;
+      if (awaiting_ready) {
+        awaiting = false;
+        last_addr[0] = '\0';  //the pairings are gone
+        setState(STATE::WAITING);
+      } else {
+        replyReceived(true);   //some steps restart the module instead of answering
+      }
+    }
+
+    void addLink(int prof) { if (prof >= 0) links |= (1UL << prof); updateAppPort(); }
+    void removeLink(int prof) {
+      if (prof >= 0) links &= ~(1UL << prof);
+      if (prof == PROF_A2DP) streaming = false;
+      updateAppPort();
+    }
+    void linkLost(void) {
+      n_reconnects = 0;
+      setState((last_addr[0] != '\0') ? STATE::RECONNECT_WAIT : STATE::WAITING);
+    }
+    void reconnectFailed(void) {
+      if (n_reconnects < BT_MAX_RECONNECTS) { setState(STATE::RECONNECT_WAIT); return; }
+      startRestore();  //give up on that device.  Let any phone pair.
+    }
+
+    //the app's traffic only goes out to the module while the app is connected
+    void updateAppPort(void) {
+      const bool app_open = (links & ((1UL << PROF_SPP) | (1UL << PROF_BLE))) != 0;
+      txq.setPortEnabled(SERIAL_PORT_BT, app_open);
+    }
+};
+
+#endif
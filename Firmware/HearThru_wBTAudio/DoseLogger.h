@@ -0,0 +1,176 @@
+
+/*
+   DoseLogger
+
+   Purpose: Takes the per-second results of AudioDosimeter_F32 (from loop()) and
+     * keeps the running noise exposure for each channel: the LAeq since the last reset, the
+       highest LCpeak, and the dose (NIOSH: 85 dBA for 8 hours is 100%, 3 dB exchange rate)
+     * optionally logs one 32-byte record per second to the SD (DOSExx.BIN), instead of
+       the audio.  That is 2.8 MB per day instead of 33 GB.
+
+   The records are gathered into 512 bytes (16 records) before each write, so the SD is only
+   touched every 16 seconds.  It goes through an SDWriter, so it shares the card with the
+   audio recorder.
+
+   File format (little-endian):
+     header (32 bytes): "DOSE", uint16 version, uint16 record bytes, uint16 n_chan, uint16 0,
+                        float cal_dBSPL, float sample_rate_Hz, uint32 millis() at start, 8 x 0
+     records (32 bytes): uint32 second (since the dosimeter started),
+                        int16 LAeq[4] (0.01 dB SPL), int16 LCpeak[4] (0.01 dB SPL),
+                        uint16 dose[2] (ear L/R, running, 0.01%), uint16 flags (1 = seconds were
+                        lost before this one), uint16 n_lost, uint16 0,
+                        uint16 check (XOR of the other 15 uint16 words)
+   The channels are 0-1: mics L/R, 2-3: ears L/R.  Gaps in "second" show where the logging
+   was stopped or seconds were lost.
+   Tools/DoseReport (on the host) adds up the DOSExx.BIN files into one exposure report.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _DoseLogger_h
+#define _DoseLogger_h
+
+#include "SDWriter.h"
+#include "AudioDosimeter_F32.h"
+
+#define DOSE_LOG_VERSION (1)
+#define DOSE_RECORD_BYTES (32)
+#define DOSE_WRITE_BYTES (512)
+#define DOSE_CRITERION_dBA (85.0)
+#define DOSE_CRITERION_SEC (8.0 * 3600.0)
+
+class DoseLogger {
+  public:
+    DoseLogger(AudioDosimeter_F32 &_meter) : meter(_meter) { resetExposure(); }
+    void setSerial(Print *_serial_ptr) { serial_ptr = _serial_ptr; writer.setSerial(_serial_ptr); }
+
+    //open the next DOSExx.BIN and start logging
+    bool start(void) {
+      if (logging) return true;
+      if (!writer.init()) {  //no card
+        if (serial_ptr) serial_ptr->println("DoseLogger: could not open a file.");
+        return false;
+      }
+      char fname[] = "DOSE00.BIN";
+      int i = 0;
+      for ( ; i < 100; i++) {
+        fname[4] = '0' + (i / 10); fname[5] = '0' + (i % 10);
+        if (!writer.exists(fname)) break;
+      }
+      if ((i >= 100) || !writer.open(fname)) {
+        if (serial_ptr) serial_ptr->println("DoseLogger: could not open a file.");
+        return false;
+      }
+      uint8_t header[DOSE_RECORD_BYTES];
+      memset(header, 0, sizeof(header));
+      memcpy(header, "DOSE", 4);
+      putU16(header + 4, DOSE_LOG_VERSION); putU16(header + 6, DOSE_RECORD_BYTES); putU16(header + 8, DOSIMETER_N_CHAN);
+      float cal = meter.getCalibration_dBSPL(), fs = meter.getSampleRate_Hz();
+      memcpy(header + 12, &cal, 4); memcpy(header + 16, &fs, 4);
+      uint32_t t = millis(); memcpy(header + 20, &t, 4);
+      buff_ind = 0;
+      append(header);
+      logging = true;
+      if (serial_ptr) { serial_ptr->print("DoseLogger: logging to "); serial_ptr->println(fname); }
+      return true;
+    }
+    void stop(void) {
+      if (!logging) return;
+      if (buff_ind > 0) writer.write(buff, buff_ind);
+      buff_ind = 0;
+      writer.close();
+      logging = false;
+      if (serial_ptr) serial_ptr->println("DoseLogger: stopped.");
+    }
+    bool isLogging(void) { return logging; }
+
+    //call from loop().  Returns true if there was anything to do.
+    bool service(void) {
+      bool did_work = false;
+      AudioDosimeter_F32::Second_t s;
+      while (meter.getSecond(s)) {
+        did_work = true;
+        addToExposure(s);
+        if (!logging) continue;
+        append(makeRecord(s));
+        if (buff_ind >= DOSE_WRITE_BYTES) {
+          writer.write(buff, DOSE_WRITE_BYTES);
+          buff_ind = 0;  //the header is one record long, so the writes always line up
+        }
+      }
+      return did_work;
+    }
+
+    void resetExposure(void) {
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) { energy_sum[c] = 0.0; max_peak_dB[c] = -200.0f; dose[c] = 0.0; }
+      n_sec = 0;
+    }
+    float getLAeq_dBSPL(int chan) { return (n_sec > 0) ? (float)(10.0 * log10(max(energy_sum[chan] / n_sec, 1.0e-20))) : 0.0f; }
+    float getMaxLCpeak_dBSPL(int chan) { return max_peak_dB[chan]; }
+    float getDose_percent(int chan) { return (float)(100.0 * dose[chan]); }
+
+    void printExposure(Print *p) {
+      const char *names[DOSIMETER_N_CHAN] = {"Mic L", "Mic R", "Ear L", "Ear R"};
+      p->print("Exposure over "); p->print(n_sec / 60.0f, 1); p->print(" min");
+      p->println(logging ? " (logging to SD):" : ":");
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) {
+        p->print("  "); p->print(names[c]);
+        p->print(": LAeq = "); p->print(getLAeq_dBSPL(c), 1);
+        p->print(" dB, max LCpeak = "); p->print(getMaxLCpeak_dBSPL(c), 1);
+        p->print(" dB, dose = "); p->print(getDose_percent(c), 2); p->println("%");
+      }
+      if (meter.getNDropped() > 0) { p->print("  (seconds lost: "); p->print(meter.getNDropped()); p->println(")"); }
+    }
+
+  private:
+    AudioDosimeter_F32 &meter;
+    SDWriter writer;
+    Print *serial_ptr = &Serial;
+    bool logging = false;
+    uint8_t buff[DOSE_WRITE_BYTES];
+    int buff_ind = 0;
+    unsigned long last_n_dropped = 0;
+
+    //exposure since the last reset
+    double energy_sum[DOSIMETER_N_CHAN], dose[DOSIMETER_N_CHAN];
+    float max_peak_dB[DOSIMETER_N_CHAN];
+    uint32_t n_sec = 0;
+
+    void addToExposure(const AudioDosimeter_F32::Second_t &s) {
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) {
+        double energy = pow(10.0, 0.1 * meter.toLeq_dBSPL(s.a_ms[c]));
+        energy_sum[c] += energy;
+        dose[c] += energy / (pow(10.0, 0.1 * DOSE_CRITERION_dBA) * DOSE_CRITERION_SEC);  //same energy as 85 dBA for 8 hours = 1.0
+        max_peak_dB[c] = max(max_peak_dB[c], meter.toPeak_dBSPL(s.c_peak[c]));
+      }
+      n_sec++;
+    }
+
+    const uint8_t *makeRecord(const AudioDosimeter_F32::Second_t &s) {
+      static uint8_t rec[DOSE_RECORD_BYTES];
+      memset(rec, 0, sizeof(rec));
+      memcpy(rec, &s.sec, 4);
+      for (int c = 0; c < DOSIMETER_N_CHAN; c++) {
+        putU16(rec + 4 + 2 * c, (uint16_t)toCentiDB(meter.toLeq_dBSPL(s.a_ms[c])));
+        putU16(rec + 12 + 2 * c, (uint16_t)toCentiDB(meter.toPeak_dBSPL(s.c_peak[c])));
+      }
+      putU16(rec + 20, (uint16_t)min(65535.0, 10000.0 * dose[2]));
+      putU16(rec + 22, (uint16_t)min(65535.0, 10000.0 * dose[3]));
+      unsigned long n_lost = meter.getNDropped() - last_n_dropped;
+      last_n_dropped = meter.getNDropped();
+      putU16(rec + 24, (n_lost > 0) ? 1 : 0);
+      putU16(rec + 26, (uint16_t)min(n_lost, 65535UL));
+      uint16_t check = 0;
+      for (int i = 0; i < DOSE_RECORD_BYTES - 2; i += 2) check ^= (uint16_t)(rec[i] | (rec[i + 1] << 8));
+      putU16(rec + DOSE_RECORD_BYTES - 2, check);
+      return rec;
+    }
+    void append(const uint8_t *rec) {
+      memcpy(buff + buff_ind, rec, DOSE_RECORD_BYTES);
+      buff_ind += DOSE_RECORD_BYTES;
+    }
+    static int16_t toCentiDB(float dB) { return (int16_t)max(-32768.0f, min(32767.0f, 100.0f * dB + ((dB < 0.0f) ? -0.5f : 0.5f))); }
+    static void putU16(uint8_t *p, uint16_t val) { p[0] = val & 0xFF; p[1] = val >> 8; }
+};
+
+#endif
@@ -0,0 +1,75 @@
+
+/*
+   EventLogger
+
+   Purpose: A small text (CSV) log on the SD card, for things that happen now and then (eg,
+     impulses), as opposed to the audio.  One line per event.  It goes through an SDWriter,
+     so it shares the card with the audio recorder, and is written from loop() only.
+
+   Each open() takes the next free PREFIXxx.CSV.  Lines are collected and written 512 bytes
+   at a time (or on close()), so a burst of events doesn't mean a burst of SD writes.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _EventLogger_h
+#define _EventLogger_h
+
+#include "SDWriter.h"
+
+#define EVENT_LOG_WRITE_BYTES (512)
+
+class EventLogger : public Print {
+  public:
+    EventLogger(void) {};
+    void setSerial(Print *_serial_ptr) { serial_ptr = _serial_ptr; writer.setSerial(_serial_ptr); }
+
+    //prefix is up to 4 characters, eg "EVNT" gives EVNT00.CSV, EVNT01.CSV...
+    bool open(const char *prefix) {
+      if (writer.isFileOpen()) return true;
+      if (!writer.init()) {  //no card
+        if (serial_ptr) serial_ptr->println("EventLogger: could not open a file.");
+        return false;
+      }
+      char fname[13];
+      int i = 0;
+      for ( ; i < 100; i++) {
+        snprintf(fname, sizeof(fname), "%.4s%02d.CSV", prefix, i);
+        if (!writer.exists(fname)) break;
+      }
+      if ((i >= 100) || !writer.open(fname)) {
+        if (serial_ptr) serial_ptr->println("EventLogger: could not open a file.");
+        return false;
+      }
+      buff_ind = 0;
+      if (serial_ptr) { serial_ptr->print("EventLogger: logging to "); serial_ptr->println(fname); }
+      return true;
+    }
+    void close(void) {
+      if (!writer.isFileOpen()) return;
+      flush();
+      writer.close();
+    }
+    bool isOpen(void) { return writer.isFileOpen(); }
+
+    //print lines into it, like any other Print
+    virtual size_t write(uint8_t b) {
+      if (!writer.isFileOpen()) return 0;
+      buff[buff_ind++] = b;
+      if (buff_ind >= EVENT_LOG_WRITE_BYTES) flush();
+      return 1;
+    }
+    using Print::write;
+    virtual void flush(void) {
+      if (buff_ind > 0) writer.write(buff, buff_ind);
+      buff_ind = 0;
+    }
+
+  private:
+    SDWriter writer;
+    Print *serial_ptr = &Serial;
+    uint8_t buff[EVENT_LOG_WRITE_BYTES];
+    int buff_ind = 0;
+};
+
+#endif
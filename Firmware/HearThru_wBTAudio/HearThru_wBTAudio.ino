@@ -15,11 +15,11 @@
 
 // Include all the of the needed libraries
 #include <Tympan_Library.h>
-#include <SparkFunbc127.h>  //from https://github.com/sparkfun/SparkFun_BC127_Bluetooth_Module_Arduino_Library
+#include <malloc.h>         //for mallinfo(), to watch the heap
 
 // State constants
 const int AUDIO_MUTE=0, AUDIO_MONO=1, AUDIO_STEREO=2;
-const int ALG_LINEAR=0, ALG_FASTCOMP=1, ALG_SLOWCOMP=2;
+const int ALG_LINEAR=0, ALG_FASTCOMP=1, ALG_SLOWCOMP=2, ALG_MULTIBAND=3;
 const int INPUT_PCBMICS=0, INPUT_MICJACK=1,INPUT_LINEIN_SE=2;
 
 //define state
@@ -33,47 +33,130 @@ class State_t {
 
 //local files
 #include "AudioSDWriter.h" 
+#include "SerialTxQueue.h"
+#include "LoopScheduler.h"
+#include "AudioLatencyTester_F32.h"
+#include "AudioLimiterLookahead_F32.h"
+#include "AudioEffectMultiBandWDRC_F32.h"
+#include "AudioEffectNoiseReduction_F32.h"
+#include "AudioMixer4Ramped_F32.h"
+#include "AudioSwitch4Crossfade_F32.h"
+#include "AudioMemoryProfiler.h"
+#include "PresetStore.h"
+#include "AudioLevelMeter_F32.h"
+#include "AudioDosimeter_F32.h"
+#include "DoseLogger.h"
+#include "AudioEffectImpulseClamp_F32.h"
+#include "EventLogger.h"
+#include "AudioAnalyzeBinaural_F32.h"
+#include "AudioEffectBeamformer_F32.h"
+#include "AudioEffectFeedbackCancel_F32.h"
+#include "AudioEffectDucker_F32.h"
+#include "BC127Driver.h"
 #include "SerialManager.h"
 
 //definitions for memory for SD writing
-#define MAX_F32_BLOCKS (192)      //Can't seem to use more than 192, so you could set it to 192.  Won't run at all if much above 400.  
-
+#define MAX_F32_BLOCKS (192)      //The library's pool can't be bigger than 192.  A smaller size can be measured ('u') and saved ('U').
+int n_audio_blocks = 0;           //the size of the pool that was actually made at boot
+
+
+//4-channel Tympan (an AIC shield on top): the front mics are on the Tympan (channels 0/1) and the
+//rear mics are on the shield's mic jack (channels 2/3).  With 0, the beamformers just pass the front mics.
+#define USE_FOUR_CHANNELS 0
+
+//BT audio through the processing (the compressors and the limiter, with the hear-thru ducked under
+//it), instead of straight to the headphone amp.  The BC127's audio reaches the codec as analog, on
+//IN1 (shared with the line input), so it needs the Tympan's ADCs, and the mics move to the AIC
+//shield's mic jack (channels 2/3).  With 0, the BT audio is mixed in at the headphone amp.
+#define BT_AUDIO_IN_GRAPH 0
+#if USE_FOUR_CHANNELS && BT_AUDIO_IN_GRAPH
+#error "USE_FOUR_CHANNELS and BT_AUDIO_IN_GRAPH both need the shield's inputs.  Pick one."
+#endif
+#define USE_AIC_SHIELD (USE_FOUR_CHANNELS || BT_AUDIO_IN_GRAPH)
+#if BT_AUDIO_IN_GRAPH
+#define MIC_CODEC aicShield   //the codec with the mics on it
+#define MIC_CHAN_L (2)        //i2s_in's channels for the mics...
+#define MIC_CHAN_R (3)
+#define BT_CHAN_L (0)         //...and for the BT audio
+#define BT_CHAN_R (1)
+#else
+#define MIC_CODEC myTympan
+#define MIC_CHAN_L (0)
+#define MIC_CHAN_R (1)
+#endif
 
 //set the sample rate and block size
 const float sample_rate_Hz = 96000.0f ; //24000 or 44117 (or other frequencies in the table in AudioOutputI2S_F32)
-const int audio_block_samples = 128;     //do not make bigger than AUDIO_BLOCK_SAMPLES from AudioStream.h (which is 128)  Must be 128 for SD recording.
+const int audio_block_samples = 32;      //16, 32, 64, or 128.  Do not make bigger than AUDIO_BLOCK_SAMPLES from AudioStream.h (which is 128).  Smaller is lower latency but more CPU overhead.
 AudioSettings_F32 audio_settings(sample_rate_Hz, audio_block_samples);
+const int n_blocks_io_latency = 3;       //approx number of blocks of delay from the double-buffered I2S input and output (only until 't' measures it)
 
 // Define the overall setup
-String overall_name = String("Tympan: Multi-Mode Hear-Thru wBTAudio");
+const char overall_name[] = "Tympan: Multi-Mode Hear-Thru wBTAudio";
 float default_input_gain_dB = 5.0f; //gain on the microphone
 float input_gain_dB = default_input_gain_dB;
 float vol_knob_gain_dB = 0.0; //will be overridden by volume knob, if used
 float output_volume_dB = 0.0; //volume setting of output PGA
-
-// Sparkfun Class for enabling BT Audio
-BC127 BTModu(&Serial1); //which serial is connected to the BT module? Serial1 is.
+float bt_input_gain_dB = 0.0; //gain on the BT audio (it is line level).  Only when BT_AUDIO_IN_GRAPH.
 
 // /////////// Define audio objects...they are configured later
 
 //create audio library objects for handling the audio
 Tympan                        myTympan(TympanRev::D);
+#if USE_AIC_SHIELD
+AICShield                     aicShield(TympanRev::D, AICShieldRev::A);  //the second codec, for the rear mics (or the mics, with BT_AUDIO_IN_GRAPH)
+AudioInputI2SQuad_F32         i2s_in(audio_settings);   //Digital audio input from both ADCs
+#else
 AudioInputI2S_F32             i2s_in(audio_settings);   //Digital audio input from the ADC
+#endif
+AudioEffectBeamformer_F32     beamL(audio_settings), beamR(audio_settings);  //front and rear mics into one, for each ear
+AudioEffectFeedbackCancel_F32 feedbackCancel(audio_settings);  //takes the speaker's sound back out of the mics.  Off by default.
+AudioEffectDucker_F32         btDucker(audio_settings);  //turns the hear-thru down while there is BT audio
 AudioSDWriter_F32             audioSDWriter(audio_settings); //this is stereo by default
-AudioMixer4_F32               inputMixerL(audio_settings),  inputMixerR(audio_settings);
-AudioSwitch4_F32              inputSwitchL(audio_settings), inputSwitchR(audio_settings); //for switching between the algorithms
+AudioMixer4Ramped_F32         inputMixerL(audio_settings),  inputMixerR(audio_settings);  //gain changes are ramped (no clicks)
+AudioEffectNoiseReduction_F32 noiseReduction(audio_settings);  //STFT noise suppression (stereo).  Off by default.
+AudioSwitch4Crossfade_F32     inputSwitchL(audio_settings), inputSwitchR(audio_settings); //for switching between the algorithms (crossfades)
 AudioEffectCompWDRC_F32       fastCompL(audio_settings),    fastCompR(audio_settings);  // fast compression
 AudioEffectCompWDRC_F32       slowCompL(audio_settings),    slowCompR(audio_settings);  // slow compression
-AudioMixer4_F32               outputMixerL(audio_settings), outputMixerR(audio_settings);  // for mixing together the diff algorithms
+AudioEffectMultiBandWDRC_F32  multiBandComp(audio_settings);  // multi-band compression (stereo)
+AudioMixer4Ramped_F32         outputMixerL(audio_settings), outputMixerR(audio_settings);  // for mixing together the diff algorithms (and muting)
+AudioEffectImpulseClamp_F32   impulseClamp(audio_settings);  //pulls the gain down within samples of an impulse (eg, gunshot)
+AudioLimiterLookahead_F32     limiter(audio_settings);   //stereo-linked lookahead limiter for hearing protection
+AudioLatencyTester_F32        latencyTester(audio_settings); //passes audio through, except when measuring latency
+AudioLevelMeter_F32           inputMeter(audio_settings), outputMeter(audio_settings);  //levels at the mics and at the ears
+AudioDosimeter_F32            dosimeter(audio_settings);  //noise exposure (LAeq, LCpeak) at the mics and at the ears
+AudioAnalyzeBinaural_F32      binaural(audio_settings);   //interaural cues (ITD, ILD) at the mics and at the ears
+#if USE_AIC_SHIELD
+AudioOutputI2SQuad_F32        i2s_out(audio_settings);  //Digital audio output to the DACs (only the Tympan's is used).  Should always be last.
+#else
 AudioOutputI2S_F32            i2s_out(audio_settings);  //Digital audio output to the DAC.  Should always be last.
+#endif
   
 //AUDIO CONNECTIONS...start with inputs
-AudioConnection_F32           patchcord3(i2s_in, 0, inputMixerL, 0);     //Left audio to Left mixer 
-AudioConnection_F32           patchcord4(i2s_in, 1, inputMixerL, 1);     //Right audio to Left mixer 
-AudioConnection_F32           patchcord5(i2s_in, 0, inputMixerR, 0);     //Left audio to Right mixer
-AudioConnection_F32           patchcord6(i2s_in, 1, inputMixerR, 1);     //Right audio to Right mixer
-AudioConnection_F32           patchcord7(inputMixerL, 0, inputSwitchL, 0);   //connect left audio to switch
-AudioConnection_F32           patchcord8(inputMixerR, 0, inputSwitchR, 0);  //connect right audio to switch
+AudioConnection_F32           patchcord20(i2s_in, MIC_CHAN_L, beamL, 0);     //Left front mic to the left beamformer
+AudioConnection_F32           patchcord21(i2s_in, MIC_CHAN_R, beamR, 0);     //Right front mic to the right beamformer
+#if USE_FOUR_CHANNELS
+AudioConnection_F32           patchcord22(i2s_in, 2, beamL, 1);     //Left rear mic
+AudioConnection_F32           patchcord23(i2s_in, 3, beamR, 1);     //Right rear mic
+#endif
+AudioConnection_F32           patchcord24(beamL, 0, feedbackCancel, 0); //Left mic to the feedback canceller
+AudioConnection_F32           patchcord25(beamR, 0, feedbackCancel, 1); //Right mic to the feedback canceller
+AudioConnection_F32           patchcord26(feedbackCancel, 0, btDucker, 0);  //and to the ducker
+AudioConnection_F32           patchcord27(feedbackCancel, 1, btDucker, 1);
+AudioConnection_F32           patchcord3(btDucker, 0, inputMixerL, 0);     //Left audio to Left mixer 
+AudioConnection_F32           patchcord4(btDucker, 1, inputMixerL, 1);     //Right audio to Left mixer 
+AudioConnection_F32           patchcord5(btDucker, 0, inputMixerR, 0);     //Left audio to Right mixer
+AudioConnection_F32           patchcord6(btDucker, 1, inputMixerR, 1);     //Right audio to Right mixer
+#if BT_AUDIO_IN_GRAPH
+AudioConnection_F32           patchcord28(i2s_in, BT_CHAN_L, btDucker, 2);     //BT audio is the ducker's side-chain...
+AudioConnection_F32           patchcord29(i2s_in, BT_CHAN_R, btDucker, 3);
+AudioConnection_F32           patchcord30(i2s_in, BT_CHAN_L, inputMixerL, 3);  //...and is mixed in ahead of the processing
+AudioConnection_F32           patchcord31(i2s_in, BT_CHAN_R, inputMixerR, 3);
+#endif
+AudioConnection_F32           patchcord7(inputMixerL, 0, noiseReduction, 0);   //connect left audio to noise reduction
+AudioConnection_F32           patchcord8(inputMixerR, 0, noiseReduction, 1);   //connect right audio to noise reduction
+AudioConnection_F32           patchcord9(noiseReduction, 0, inputSwitchL, 0);  //connect left audio to switch
+AudioConnection_F32           patchcord10(noiseReduction, 1, inputSwitchR, 0); //connect right audio to switch
 
 // Connections for Linear
 AudioConnection_F32           patchcord100(inputSwitchL,ALG_LINEAR,outputMixerL,ALG_LINEAR); //pass the left signal through to the left output mixer
@@ -91,13 +174,56 @@ AudioConnection_F32           patchcord301(inputSwitchR,ALG_SLOWCOMP,slowCompR,0
 AudioConnection_F32           patchcord302(slowCompL,0,outputMixerL,ALG_SLOWCOMP); //pass the left signal to left compressor
 AudioConnection_F32           patchcord303(slowCompR,0,outputMixerR,ALG_SLOWCOMP); //pass the right signal to right compressor
 
+//Connections for Multi-Band Compression
+AudioConnection_F32           patchcord400(inputSwitchL,ALG_MULTIBAND,multiBandComp,0); //pass the left signal to the multi-band compressor
+AudioConnection_F32           patchcord401(inputSwitchR,ALG_MULTIBAND,multiBandComp,1); //pass the right signal to the multi-band compressor
+AudioConnection_F32           patchcord402(multiBandComp,0,outputMixerL,ALG_MULTIBAND); //pass the left signal to the left output mixer
+AudioConnection_F32           patchcord403(multiBandComp,1,outputMixerR,ALG_MULTIBAND); //pass the right signal to the right output mixer
+
 //Connect to outputs
-AudioConnection_F32           patchcord500(outputMixerL, 0, i2s_out, 0);    //Left mixer to left output
-AudioConnection_F32           patchcord501(outputMixerR, 0, i2s_out, 1);    //Right mixer to right output
+AudioConnection_F32           patchcord500(outputMixerL, 0, impulseClamp, 0);    //Left mixer to the impulse clamp
+AudioConnection_F32           patchcord501(outputMixerR, 0, impulseClamp, 1);    //Right mixer to the impulse clamp
+AudioConnection_F32           patchcord505(impulseClamp, 0, limiter, 0);    //and then to the limiter
+AudioConnection_F32           patchcord506(impulseClamp, 1, limiter, 1);
+AudioConnection_F32           patchcord502(limiter, 0, latencyTester, 0);   //Left limiter through the latency tester...
+AudioConnection_F32           patchcord503(latencyTester, 0, i2s_out, 0);   //...to left output
+AudioConnection_F32           patchcord504(limiter, 1, i2s_out, 1);         //Right limiter to right output
+
+//Connections for latency testing (left side only)
+AudioConnection_F32           patchcord700(i2s_in, MIC_CHAN_L, latencyTester, 1);       //loopback measurement captures the raw input
+AudioConnection_F32           patchcord701(limiter, 0, latencyTester, 2);      //graph measurement captures the processed output
+AudioConnection_F32           patchcord702(latencyTester, 1, inputMixerL, 2);  //graph measurement injects into the front of the processing
+
+//What went to the speakers, for the feedback canceller.  (It is earlier in the graph, so it gets them one block later.)
+AudioConnection_F32           patchcord710(limiter, 0, feedbackCancel, 2);
+AudioConnection_F32           patchcord711(limiter, 1, feedbackCancel, 3);
+
+//Connect the level meters (they only listen)
+AudioConnection_F32           patchcord800(i2s_in, MIC_CHAN_L, inputMeter, 0);
+AudioConnection_F32           patchcord801(i2s_in, MIC_CHAN_R, inputMeter, 1);
+AudioConnection_F32           patchcord802(limiter, 0, outputMeter, 0);
+AudioConnection_F32           patchcord803(limiter, 1, outputMeter, 1);
+
+//Connect the dosimeter: mics, and the ears (after the compressors and the limiter)
+AudioConnection_F32           patchcord810(i2s_in, MIC_CHAN_L, dosimeter, 0);
+AudioConnection_F32           patchcord811(i2s_in, MIC_CHAN_R, dosimeter, 1);
+AudioConnection_F32           patchcord812(limiter, 0, dosimeter, 2);
+AudioConnection_F32           patchcord813(limiter, 1, dosimeter, 3);
+
+//Connect the mics and the ears to the binaural cue analyzer
+AudioConnection_F32           patchcord820(i2s_in, MIC_CHAN_L, binaural, 0);
+AudioConnection_F32           patchcord821(i2s_in, MIC_CHAN_R, binaural, 1);
+AudioConnection_F32           patchcord822(limiter, 0, binaural, 2);
+AudioConnection_F32           patchcord823(limiter, 1, binaural, 3);
 
 //Connect to SD logging
-AudioConnection_F32           patchcord600(i2s_in, 0, audioSDWriter, 0);   //connect Raw audio to left channel of SD writer
-AudioConnection_F32           patchcord601(i2s_in, 1, audioSDWriter, 1);   //connect Raw audio to right channel of SD writer
+AudioConnection_F32           patchcord600(i2s_in, MIC_CHAN_L, audioSDWriter, 0);   //connect Raw audio to left channel of SD writer
+AudioConnection_F32           patchcord601(i2s_in, MIC_CHAN_R, audioSDWriter, 1);   //connect Raw audio to right channel of SD writer
+
+//noise reduction settings to step through: FFT size, hop, decimation.  Latency goes down (and CPU up) from top to bottom
+const int n_nr_configs = 4;
+const int nr_configs[n_nr_configs][3] = { {256, 64, 4}, {256, 128, 2}, {256, 128, 1}, {64, 32, 1} };
+int nr_config_ind = 0;
 
 void setAlgorithmParameters(void) {
   { 
@@ -129,6 +255,57 @@ void setAlgorithmParameters(void) {
     slowCompL.setParams(attack_ms, release_ms, maxdB, exp_cr, exp_end_knee, tkgain, comp_ratio, tk, bolt);
     slowCompR.setParams(attack_ms, release_ms, maxdB, exp_cr, exp_end_knee, tkgain, comp_ratio, tk, bolt);   
   }
+  {
+    //configure multi-band compression
+    float attack_ms = 5.0, release_ms = 100.0;
+    float comp_ratio = 3.0; //compression regime: compression ratio
+    float tk = 70.0;        //compression regime: compression knee point (dB SPL...related via maxdB)
+    float crossovers_Hz[] = {500.0, 2000.0, 6000.0};  //gives 4 bands
+
+    multiBandComp.setCrossovers_Hz(crossovers_Hz, 3);
+    multiBandComp.setParams(attack_ms, release_ms, maxdB, tkgain, comp_ratio, tk);
+    multiBandComp.setBandParams(0, tkgain, 5.0, 65.0);  //squash the low-frequency noise harder
+    binaural.setBands_Hz(crossovers_Hz, 3);  //measure the ILDs in the same bands
+  }
+  {
+    //configure the beamformers (they start off)
+    float mic_spacing_mm = 14.0;  //front to rear mic, on each earcup
+    beamL.getCore().setSpacing_mm(mic_spacing_mm); beamR.getCore().setSpacing_mm(mic_spacing_mm);
+    beamL.getCore().setEqCorner_Hz(200.0); beamR.getCore().setEqCorner_Hz(200.0);  //below this, let the low end fall off
+  }
+  {
+    //configure the feedback canceller (it starts disabled).  The bulk delay is a guess until the
+    //loopback latency is measured ('t'), which then sets it.
+    feedbackCancel.setTaps(64);
+    feedbackCancel.setStepSize(0.005);
+    feedbackCancel.setBulkDelayFromLoopback(n_blocks_io_latency * audio_block_samples);
+  }
+  {
+    //configure the ducking of the hear-thru under the BT audio
+    btDucker.setThreshold_dBFS(-50.0);  //anything above the BT's noise floor counts as playing
+    btDucker.setDepth_dB(-15.0);        //the room is still there, just quieter
+    btDucker.setAttack_msec(10.0); btDucker.setHold_msec(300.0); btDucker.setRelease_msec(500.0);  //don't come up between words
+  }
+  {
+    //configure the noise reduction (it starts disabled)
+    noiseReduction.setConfig(nr_configs[0][0], nr_configs[0][1], nr_configs[0][2]);
+    noiseReduction.setMinGain_dB(-15.0);  //deeper is more reduction but more artifacts
+  }
+  {
+    //configure the output limiter.  It catches what the compressors are too slow to catch.
+    float ceiling_dBSPL = 110.0;  //never louder than this (dB SPL...related via maxdB)
+    float lookahead_ms = 0.5, release_ms = 50.0;
+
+    limiter.setThreshold_dBFS(ceiling_dBSPL - maxdB);
+    limiter.setLookahead_msec(lookahead_ms);
+    limiter.setRelease_msec(release_ms);
+  }
+  {
+    //the level meters use the same calibration as the compressors
+    inputMeter.setCalibration_dBSPL(maxdB);
+    outputMeter.setCalibration_dBSPL(maxdB);
+    dosimeter.setCalibration_dBSPL(maxdB);
+  }
 }
 
 //control display and serial interaction
@@ -138,26 +315,82 @@ void setPrintMemoryAndCPU(bool state) { enable_printCPUandMemory = state; };
 bool enable_printAveSignalLevels = false;
 bool printAveSignalLevels_as_dBSPL = false;
 void togglePrintAveSignalLevels(bool as_dBSPL) { enable_printAveSignalLevels = !enable_printAveSignalLevels; printAveSignalLevels_as_dBSPL = as_dBSPL;};
+bool binaural_mode = false;  //see setBinauralMode()
+bool enable_printBinauralCues = false;
+void togglePrintBinauralCues(void) { enable_printBinauralCues = !enable_printBinauralCues; binaural.enable(enable_printBinauralCues); };
+SerialTxQueue serialTxQueue(&Serial, &Serial1);  //non-blocking output to USB and BT
+SerialTxPort serialUI(serialTxQueue, SERIAL_PRIORITY_UI), serialTelemetry(serialTxQueue, SERIAL_PRIORITY_TELEMETRY);
+BC127Driver btModule(&Serial1, serialTxQueue);  //the BT module shares Serial1 with the app
+LoopScheduler scheduler;  //runs all of the services from loop()
+#define SD_QUEUE_WATERMARK (8)  //blocks waiting for the SD.  Past this, the SD writing jumps the line.
 SerialManager serialManager;
-#define BOTH_SERIAL myTympan
+DoseLogger doseLogger(dosimeter);  //exposure totals, and the once-a-second log to the SD
+EventLogger impulseLog;            //the impulses, alongside the audio recording
+#define BOTH_SERIAL serialUI
 
 //keep track of state
 State_t myState;
 
 int current_config = 0;
+
+//Changing the input is done in steps from loop(), with no delay()s: fade the output
+//down, switch the hardware, give the codec time to settle, and then fade back up.
+#define CONFIG_SETTLE_MSEC (50)
+enum class CONFIG_STEP { IDLE = 0, FADING_OUT, SETTLING };
+CONFIG_STEP config_step = CONFIG_STEP::IDLE;
+int pending_config = NO_STATE;
+unsigned long config_switched_msec = 0;
+
+//Presets.  There are built-in ones, which get used for any slot with nothing saved in it.
+PresetStore presetStore;
+Preset_t default_preset;          //the settings from setAlgorithmParameters()
+Preset_t pending_preset;          //applied by serviceConfiguration() while the output is faded out
+bool preset_pending = false;
+int current_preset = 0;
+unsigned long setup_start_msec = 0, boot_audio_msec = 0;  //for timing the boot
+
 void setConfiguration(int config) { 
-  
-  myTympan.volume_dB(-60.0); delay(50);  //mute the output audio
   myState.input_source = config;
-  
+  pending_config = config;
+  outputMixerL.mute(true); outputMixerR.mute(true);  //fade out the output audio
+  config_step = CONFIG_STEP::FADING_OUT;
+}
+
+//run by the scheduler
+bool serviceConfiguration(void) {
+  switch (config_step) {
+    case CONFIG_STEP::IDLE:
+      return false;
+    case CONFIG_STEP::FADING_OUT:
+      if (outputMixerL.isRamping() || outputMixerR.isRamping()) return false;
+      applyConfiguration(pending_config);
+      if (preset_pending) { applyPresetSettings(pending_preset); preset_pending = false; }  //while it is still quiet
+      config_switched_msec = millis();
+      config_step = CONFIG_STEP::SETTLING;
+      return true;
+    case CONFIG_STEP::SETTLING:
+      if ((millis() - config_switched_msec) < CONFIG_SETTLE_MSEC) return false;
+      outputMixerL.mute(false); outputMixerR.mute(false);  //fade the output audio back in
+      config_step = CONFIG_STEP::IDLE;
+      if (boot_audio_msec == 0) {
+        boot_audio_msec = max(1UL, millis());
+        printBootTime();
+      }
+      serialManager.sendChangedGUIState();  //a preset might have changed more than was asked for
+      return true;
+  }
+  return false;
+}
+
+void applyConfiguration(int config) {
   switch (config) {
     case INPUT_PCBMICS:
       //Select Input
-      myTympan.inputSelect(TYMPAN_INPUT_ON_BOARD_MIC); // use the on-board microphones
+      MIC_CODEC.inputSelect(TYMPAN_INPUT_ON_BOARD_MIC); // use the on-board microphones
 
       //Set input gain to 0dB
       input_gain_dB = 15;
-      myTympan.setInputGain_dB(input_gain_dB);
+      MIC_CODEC.setInputGain_dB(input_gain_dB);
 
       //Store configuration
       current_config = INPUT_PCBMICS;
@@ -165,12 +398,12 @@ void setConfiguration(int config) {
       
     case INPUT_MICJACK:
       //Select Input
-      myTympan.inputSelect(TYMPAN_INPUT_JACK_AS_MIC); // use the mic jack
-      myTympan.setEnableStereoExtMicBias(true);
+      MIC_CODEC.inputSelect(TYMPAN_INPUT_JACK_AS_MIC); // use the mic jack
+      MIC_CODEC.setEnableStereoExtMicBias(true);
 
       //Set input gain to 0dB
       input_gain_dB = default_input_gain_dB;
-      myTympan.setInputGain_dB(input_gain_dB);
+      MIC_CODEC.setInputGain_dB(input_gain_dB);
 
       //Store configuration
       current_config = INPUT_MICJACK;
@@ -178,38 +411,52 @@ void setConfiguration(int config) {
       
     case INPUT_LINEIN_SE:
       //Select Input
-      myTympan.inputSelect(TYMPAN_INPUT_LINE_IN); // use the line-input through holes
+      MIC_CODEC.inputSelect(TYMPAN_INPUT_LINE_IN); // use the line-input through holes
 
       //Set input gain to 0dB
       input_gain_dB = default_input_gain_dB;
-      myTympan.setInputGain_dB(input_gain_dB);
+      MIC_CODEC.setInputGain_dB(input_gain_dB);
 
       //Store configuration
       current_config = INPUT_LINEIN_SE;
       break;
   }
 
-  //bring the output volume back up
-  delay(50);  myTympan.volume_dB(output_volume_dB);  // output amp: -63.6 to +24 dB in 0.5dB steps.  uses signed 8-bit
+#if USE_FOUR_CHANNELS
+  //the rear mics are always on the shield's mic jack
+  aicShield.inputSelect(TYMPAN_INPUT_JACK_AS_MIC);
+  aicShield.setEnableStereoExtMicBias(true);
+  aicShield.setInputGain_dB(input_gain_dB);
+#endif
+
+  //bring the output volume back up (it is muted at boot).  The audio is faded out, so this can't click.
+  myTympan.volume_dB(output_volume_dB);  // output amp: -63.6 to +24 dB in 0.5dB steps.  uses signed 8-bit
 }
 
 // ///////////////// Main setup() and loop() as required for all Arduino programs
 
 // define the setup() function, the function that is called once when the device is booting
+//Everything up to the first audio is kept short: no delay()s, no waiting on the serial
+//ports (the output is queued), and the BT module isn't touched until the audio is running.
 void setup() {
-  delay(100);
-  
-  myTympan.beginBothSerial(); delay(1000);
+  setup_start_msec = millis();
+  myTympan.beginBothSerial();
   BOTH_SERIAL.print(overall_name);BOTH_SERIAL.println(": setup():...");
   BOTH_SERIAL.print("Sample Rate (Hz): "); BOTH_SERIAL.println(audio_settings.sample_rate_Hz);
   BOTH_SERIAL.print("Audio Block Size (samples): "); BOTH_SERIAL.println(audio_settings.audio_block_samples);
+  BOTH_SERIAL.print("Estimated I/O Buffer Latency (msec): "); BOTH_SERIAL.print(getEstimatedLatency_msec(),2); BOTH_SERIAL.println(" ('t' measures it)");
 
   //allocate the audio memory
-  AudioMemory_F32_wSettings(MAX_F32_BLOCKS,audio_settings); //I can only seem to allocate 400 blocks
-  BOTH_SERIAL.println("Setup: memory allocated.");
+  n_audio_blocks = allocateAudioMemory_F32(MAX_F32_BLOCKS, audio_settings); //sized from the saved profile, if there is one
+  BOTH_SERIAL.print("Setup: memory allocated: "); BOTH_SERIAL.print(n_audio_blocks); BOTH_SERIAL.println(" F32 blocks.");
   
   //activate the Tympan audio hardware
   myTympan.enable();        // activate AIC
+#if USE_AIC_SHIELD
+  aicShield.enable();       // and the one on the shield
+  aicShield.volume_dB(-60.0);
+  aicShield.setHPFonADC(true, 70.0, audio_settings.sample_rate_Hz);
+#endif
   
   //temporariliy mute the system
   myTympan.volume_dB(-60.0);  // output amp: -63.6 to +24 dB in 0.5dB steps.  uses signed 8-bit
@@ -218,29 +465,57 @@ void setup() {
 
   //setup the audio processing
   setAlgorithmParameters();
-  setAudioStereo();
-  setAudioLinear();
+  capturePreset(default_preset, "Default");  //the built-in presets start from these
+  inputMixerL.gain(2, 1.0);  //the latency tester's stimulus.  It is silent unless measuring.
 
-  //Configure for Tympan PCB mics
-  BOTH_SERIAL.println("Setup: Using Mic Jack with Mic Bias.");
-  setConfiguration(INPUT_MICJACK); //this will also unmute the system
+  //restore the boot preset (input, gains, algorithm...).  It is all in place before the
+  //audio is un-muted, which happens once loop() is running.
+  presetStore.begin();
+  loadPreset(presetStore.getBootPreset());
  
   //update the potentiometer settings
 	//servicePotentiometer(millis());
 
-  //service BT Audio
-  serviceBTAudio();
-
+#if BT_AUDIO_IN_GRAPH
+  //The Bluetooth audio comes in through the Tympan's codec and is mixed in ahead of the
+  //processing, so it is compressed and limited too.  The hear-thru is ducked under it.
+  myTympan.inputSelect(TYMPAN_INPUT_BT_AUDIO);
+  myTympan.setInputGain_dB(bt_input_gain_dB);
+  inputMixerL.gain(3, 1.0); inputMixerR.gain(3, 1.0);
+#else
   //Set the Bluetooth audio to go straight to the headphone amp, not through the Tympan software
   myTympan.mixBTAudioWithOutput(true);
+#endif
 
   //prepare the SD writer for the format that we want and any error statements
-  audioSDWriter.setSerial(&myTympan);
+  audioSDWriter.setSerial(&serialUI);
   audioSDWriter.setWriteDataType(AudioSDWriter::WriteDataType::INT16);  //this is the built-in the default, but here you could change it to FLOAT32
   audioSDWriter.setNumWriteChannels(2);             //this is also the defaullt, but you could set it to 2
+  doseLogger.setSerial(&serialUI);
+  impulseLog.setSerial(&serialUI);
+  btModule.setSerial(&serialUI);
+  btModule.setAppReceiver(respondToBTAppByte, isAppInBinaryFrame);
  
   //End of setup
-  BOTH_SERIAL.println("Setup: complete.");serialManager.printHelp();
+  BOTH_SERIAL.println("Setup: complete.");serialManager.printHelp();  //it goes out from loop()
+
+  //set up the services for loop(), most important first.  Budgets are in microseconds.
+  scheduler.setSerial(&serialUI);  //warnings: no room for a task, or a task over its budget
+  int sd_task = scheduler.addTask("SD", serviceSD, 0, 5000);
+  scheduler.setUrgentTask(sd_task, isSDFallingBehind, 4);
+  scheduler.addTask("SerialIn", serviceSerialInput, 0, 1000);
+  scheduler.addTask("SerialOut", serviceSerialOutput, 0, 200);
+  scheduler.addTask("Config", serviceConfiguration, 0, 2000);
+  scheduler.addTask("Latency", serviceLatencyTest, 0, 500);
+  scheduler.addTask("CPU", printCPUandMemory, 3000, 500);
+  scheduler.addTask("Levels", printAveSignalLevels, 1000, 500);
+  scheduler.addTask("Dose", serviceDoseLogger, 250, 5000);  //one record a second; the SD every 16 seconds
+  scheduler.addTask("Impulses", serviceImpulseLog, 20, 2000);
+  scheduler.addTask("Binaural", serviceBinaural, 5, 2000);  //a frame every 10.7 msec, when it is enabled
+  scheduler.addTask("Cues", printBinauralCues, 500, 500);
+  scheduler.addTask("LEDs", serviceLEDs, 50, 50);
+  scheduler.addTask("MemProfile", serviceMemoryProfile, 100, 500);
+  scheduler.addTask("BT", serviceBT, 20, 500);  //connection management.  Never waits on the module.
 
 } //end setup()
 
@@ -248,96 +523,464 @@ void setup() {
 
 
 void loop() {
-  //asm(" WFI");  //save power by sleeping.  Wakes when an interrupt is fired (usually by the audio subsystem...so every 256 audio samples)
+  //everything is a task in the scheduler.  It also sleeps (WFI) when there is nothing to do.
+  scheduler.run();
+} //end loop()
 
-  //respond to Serial commands
-  while (Serial.available()) serialManager.respondToByte((char)Serial.read());   //USB Serial
-  while (Serial1.available()) serialManager.respondToByte((char)Serial1.read()); //BT Serial
-  
-  //service the SD recording
-  serviceSD();
 
-  //update the memory and CPU usage...if enough time has passed
-  if (enable_printCPUandMemory) printCPUandMemory(millis());
 
-  serviceLEDs();
-  
-  //print info about the signal processing
-  //updateAveSignalLevels(millis());
-  //if (enable_printAveSignalLevels) printAveSignalLevels(millis(),printAveSignalLevels_as_dBSPL);
+// ///////////////// Servicing routines
 
-} //end loop()
+bool serviceSerialInput(void) {
+  bool did_work = false;
+  while (Serial.available()) { serialManager.respondToByte((char)Serial.read()); did_work = true; }   //USB Serial
+  if (btModule.receive()) did_work = true;  //BT Serial: the module's messages are taken out, the rest goes to the serialManager
+  return did_work;
+}
 
+//send some of whatever is waiting to go out the serial ports (never blocks)
+bool serviceSerialOutput(void) { return (serialTxQueue.service() > 0); }
 
+//the app's bytes, once the BT module's messages have been taken out
+void respondToBTAppByte(char c) { serialManager.respondToByte(c); }
+bool isAppInBinaryFrame(void) { return serialManager.isInBinaryFrame(); }
 
-// ///////////////// Servicing routines
+//run by the scheduler.  The BT module isn't touched until the audio is running.
+bool serviceBT(void) {
+  if (boot_audio_msec == 0) return false;
+  return btModule.service();
+}
+void printBTStatus(void) { btModule.printStatus(&BOTH_SERIAL); }
 
-void serviceBTAudio(void) {
-  // resetFlag tracks the state of the module. When true, the module is reset and
-  //  ready to receive a connection. When false, the module either has an active
-  //  connection or has lost its connection; checking connectionState() will verify
-  //  which of those conditions we're in.
-  static boolean resetFlag = false;
+//the I2S input and output are each double-buffered, so the hear-thru path has a few blocks of delay.
+//This is only a guess, for until the latency has been measured.
+float getEstimatedLatency_msec(void) {
+  return 1000.0f * ((float)(n_blocks_io_latency * audio_settings.audio_block_samples)) / audio_settings.sample_rate_Hz;
+}
 
-  // This is where we determine the state of the module. If resetFlag is false, and
-  //  we have a CONNECT_ERROR, we need to restart the module to clear its pairing
-  //  list so it can accept another connection.
-  if (BTModu.connectionState() == BC127::CONNECT_ERROR  && !resetFlag)
-  {  
-    Serial.println("Connection lost! Resetting...");
-    // Blast the existing settings of the BC127 module, so I know that the module is
-    //  set to factory defaults...
-    BTModu.restore();
+//the last measurements: the loopback ('t', output to input) and the processing ('T').  -1 until measured.
+float measured_loopback_msec = -1.0f, measured_graph_msec = -1.0f;
+int measured_graph_alg = -1;
 
-    // ...but, before I restart, I need to set the device to be a SINK, so it will
-    //  enable its audio output and dump the audio to the output.
-    BTModu.setClassicSink();
+void startLatencyTest(bool graph_only) {
+  AudioLatencyTester_F32::MODE mode = AudioLatencyTester_F32::MODE::LOOPBACK;
+  if (graph_only) mode = AudioLatencyTester_F32::MODE::GRAPH;
+  if (!latencyTester.startMeasurement(mode)) BOTH_SERIAL.println("Latency: measurement already running.");
+}
+bool serviceLatencyTest(void) {
+  bool was_correlating = (latencyTester.getState() == AudioLatencyTester_F32::STATE::CORRELATING);
+  if (latencyTester.service()) {
+    //report in one line so that it is easy to log
+    serialTelemetry.print("LATENCY: mode=");
+    serialTelemetry.print((latencyTester.getMode() == AudioLatencyTester_F32::MODE::GRAPH) ? "GRAPH" : "LOOPBACK");
+    serialTelemetry.print(", alg="); serialTelemetry.print(myState.alg);
+    serialTelemetry.print(", block="); serialTelemetry.print(audio_settings.audio_block_samples);
+    serialTelemetry.print(", samples="); serialTelemetry.print(latencyTester.getLatency_samples());
+    serialTelemetry.print(", msec="); serialTelemetry.print(latencyTester.getLatency_msec(),3);
+    serialTelemetry.print(", quality="); serialTelemetry.println(latencyTester.getPeakToMeanRatio(),1);
+
+    //keep the ones that can be trusted.  The loopback is also the feedback path's delay.
+    if (latencyTester.getPeakToMeanRatio() > 5.0f) {
+      if (latencyTester.getMode() == AudioLatencyTester_F32::MODE::LOOPBACK) {
+        measured_loopback_msec = latencyTester.getLatency_msec();
+        int bulk = feedbackCancel.setBulkDelayFromLoopback(latencyTester.getLatency_samples());
+        BOTH_SERIAL.print("Feedback Cancel: bulk delay set to "); BOTH_SERIAL.print(bulk); BOTH_SERIAL.println(" samples");
+      } else {
+        measured_graph_msec = latencyTester.getLatency_msec();
+        measured_graph_alg = myState.alg;
+      }
+    }
+  }
+  return was_correlating;
+}
 
-    // Write, reset, to commit and effect the change to a source.
-    BTModu.writeConfig();
-    // Repeat the connection process if we've lost our connection.
-    BTModu.reset();
-    // Change the resetFlag, so we know we've restored the module to a usable state.
-    resetFlag = true;
+//The on-device benchmarks run straight through from loop(), with the audio interrupt held off
+//while each block is timed, so the SD writer, the dose log, the serial and BT queues, and the BC127
+//all wait until they are done.  So they are refused while anything is being recorded or measured.
+bool isOkToBenchmark(const char *name) {
+  const char *why = NULL;
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) {
+    why = "recording to the SD ('s' stops it)";
+  } else if (doseLogger.isLogging()) {
+    why = "logging the exposure to the SD ('D' stops it)";
+  } else if ((latencyTester.getState() == AudioLatencyTester_F32::STATE::CAPTURING) || (latencyTester.getState() == AudioLatencyTester_F32::STATE::CORRELATING)) {
+    why = "measuring the latency";
   }
-  // If we ARE connected, we'll issue the "PLAY" command. Note that issuing this when
-  //  we are already playing doesn't hurt anything.
-  else {
-    //BTModu.musicCommands(BC127::PLAY);
+  if (why == NULL) return true;
+  BOTH_SERIAL.print(name); BOTH_SERIAL.print(": not while "); BOTH_SERIAL.println(why);
+  return false;
+}
+//Afterwards: the audio updates that were held off show up as CPU peaks, and the tasks that
+//were held off as late, so forget those.
+void endBenchmark(void) {
+  audio_settings.processorUsageMaxReset();
+  limiter.processorUsageMaxReset(); multiBandComp.processorUsageMaxReset();
+  noiseReduction.processorUsageMaxReset(); feedbackCancel.processorUsageMaxReset();
+  scheduler.resetStats();
+}
+
+//CPU vs block size: copies of the live processing cores (so, the same settings) run the same
+//0.25 sec of noise in blocks of 16 to 128 samples.  The graph's own cost per block (the update
+//list, and passing the blocks along) comes on top of this, so 'c' is the whole story, but only
+//for the block size that is built in (audio_block_samples).  The limiter is also timed on its
+//own, per block, against the block's time budget.  It gets the noise 18 dB hotter, so that it
+//is limiting all of the time.
+void benchmarkBlockSizes(void) {
+  if (!isOkToBenchmark("Block size benchmark")) return;
+  static MultiBandWDRC_Core comp;
+  static FeedbackCancel_Core fbc[2];
+  static ImpulseClamp_Core clamp;
+  static LimiterLookahead_Core lim;
+  static float32_t L[AUDIO_BLOCK_SAMPLES], R[AUDIO_BLOCK_SAMPLES], outL[AUDIO_BLOCK_SAMPLES], outR[AUDIO_BLOCK_SAMPLES];  //out is also the next block's reference
+  const float fs = audio_settings.sample_rate_Hz;
+  const int n_samples = (int)(0.25f * fs);
+  const int sizes[] = {16, 32, 64, 128};
+  uint32_t seed = 12345;
+  auto noise = [&seed](void) { seed = seed * 1664525UL + 1013904223UL; return 0.1f * (((float)(seed >> 8)) / 8388608.0f - 1.0f); };
+  float crossovers_Hz[MULTIBAND_MAX_BANDS - 1];
+  const int n_crossovers = multiBandComp.getNumBands() - 1;
+  for (int k = 0; k < n_crossovers; k++) crossovers_Hz[k] = multiBandComp.getCrossover_Hz(k);
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;  //turn on the cycle counter
+  BOTH_SERIAL.println("Block size benchmark: feedback cancel (x2), multi-band compressor, impulse clamp; then the limiter");
+  for (int N : sizes) {
+    comp = multiBandComp.getCore();
+    const float attack_msec = comp.getAttack_msec(), release_msec = comp.getRelease_msec();
+    comp.setSampleRate_Hz(fs, N);  //resets the crossovers and time constants, so put them back
+    comp.setCrossovers_Hz(crossovers_Hz, n_crossovers);
+    comp.setAttackRelease_msec(attack_msec, release_msec);
+    for (int c = 0; c < 2; c++) { fbc[c] = feedbackCancel.getCore(c); fbc[c].reset(); }
+    clamp = impulseClamp.getCore(); clamp.reset();
+    lim = limiter.getCore();
+    for (int i = 0; i < N; i++) { outL[i] = 0.0f; outR[i] = 0.0f; }
+
+    uint32_t cycles = 0, lim_cycles = 0, lim_worst = 0;
+    int n_done = 0;
+    for ( ; n_done + N <= n_samples; n_done += N) {
+      for (int i = 0; i < N; i++) { L[i] = noise(); R[i] = noise(); }
+      __disable_irq(); uint32_t start = ARM_DWT_CYCCNT;
+      fbc[0].process(L, outL, outL, N);
+      fbc[1].process(R, outR, outR, N);
+      comp.process(outL, outR, N);
+      clamp.process(outL, outR, N);
+      cycles += ARM_DWT_CYCCNT - start; __enable_irq();
+
+      for (int i = 0; i < N; i++) { L[i] *= 8.0f; R[i] *= 8.0f; }
+      __disable_irq(); start = ARM_DWT_CYCCNT;
+      lim.process(L, R, N);
+      uint32_t lim_block = ARM_DWT_CYCCNT - start; __enable_irq();
+      lim_cycles += lim_block; lim_worst = max(lim_worst, lim_block);
+    }
+    const int n_blocks = n_done / N;
+    const float cpu_percent = 100.0f * ((float)cycles) / (F_CPU * (n_done / fs));
+    const float block_cycles = F_CPU * N / fs;  //the time budget of one block
+    BOTH_SERIAL.print("  "); BOTH_SERIAL.print(N); BOTH_SERIAL.print(" samples: ");
+    BOTH_SERIAL.print(cpu_percent, 2); BOTH_SERIAL.print("% CPU, ");
+    BOTH_SERIAL.print(((float)cycles) / n_blocks / (F_CPU / 1.0e6f), 1); BOTH_SERIAL.print(" usec per block, I/O latency ~");
+    BOTH_SERIAL.print(1000.0f * n_blocks_io_latency * N / fs, 2); BOTH_SERIAL.println(" msec (est.)");
+    BOTH_SERIAL.print("    limiter: "); BOTH_SERIAL.print(((float)lim_cycles) / n_blocks, 0);
+    BOTH_SERIAL.print(" cycles per block (worst "); BOTH_SERIAL.print(lim_worst);
+    BOTH_SERIAL.print("), "); BOTH_SERIAL.print(100.0f * ((float)lim_worst) / block_cycles, 2);
+    BOTH_SERIAL.print("% of the block's "); BOTH_SERIAL.print(block_cycles, 0); BOTH_SERIAL.println(" cycles at worst");
   }
+  endBenchmark();
+}
 
-  // We want to look for a connection to be made to the module; once a connection
-  //  has been made, we can clear the resetFlag.
-  if (BTModu.connectionState() == BC127::SUCCESS) resetFlag = false;
+void printSchedulerStats(bool reset) {
+  scheduler.printStats(&serialUI);
+  if (reset) scheduler.resetStats();
+}
 
+//Memory profile: every algorithm, with and without noise reduction.  Afterwards, put them back.
+//The SD recording's queue is the biggest user of blocks (and the dose and impulse logs slow the
+//SD down, which deepens it), so the result is only saved if the recording and the dose log were
+//on for the whole profile.  Otherwise, a pool sized without them makes the recording drop samples.
+AudioMemoryProfiler memProfiler;
+const int n_mem_profile_steps = 8;
+const char *mem_profile_names[n_mem_profile_steps] = {"Linear", "Fast-Comp", "Slow-Comp", "Multi-Band",
+                                                      "Linear + NR", "Fast-Comp + NR", "Slow-Comp + NR", "Multi-Band + NR"};
+int mem_profile_saved_alg = ALG_LINEAR;
+bool mem_profile_saved_nr = false, mem_profile_saved_binaural = false;  //the Fast- and Slow-Comp steps turn the binaural mode off
+bool mem_profile_covered_sd = false;  //recording and dose logging, through every step
+void applyMemoryProfileStep(int step) {
+  bool recording = (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+  mem_profile_covered_sd = mem_profile_covered_sd && recording && doseLogger.isLogging();  //at the start of each step, and at the end
+  if (step < n_mem_profile_steps) {
+    setAlgorithm(step % 4);
+    noiseReduction.enable(step >= 4);
+  } else {
+    setAlgorithm(mem_profile_saved_alg);
+    noiseReduction.enable(mem_profile_saved_nr);
+    if (mem_profile_saved_binaural != binaural_mode) setBinauralMode(mem_profile_saved_binaural);
+  }
+}
+void startMemoryProfile(void) {
+  if (memProfiler.isRunning()) {
+    BOTH_SERIAL.println("Memory Profile: already running.");
+    return;
+  }
+  mem_profile_saved_alg = myState.alg;
+  mem_profile_saved_nr = noiseReduction.isEnabled();
+  mem_profile_saved_binaural = binaural_mode;
+  mem_profile_covered_sd = true;
+  memProfiler.begin(n_mem_profile_steps, applyMemoryProfileStep, 1000);
+  BOTH_SERIAL.print("Memory Profile: running (about "); BOTH_SERIAL.print(n_mem_profile_steps); BOTH_SERIAL.print(" sec");
+  if (mem_profile_covered_sd) {
+    BOTH_SERIAL.println(", including SD recording and the dose log)...");
+  } else {
+    BOTH_SERIAL.println(")...");
+    BOTH_SERIAL.println("  Not recording to the SD with the dose log on ('d', then 'r'), so this one can't be saved.");
+  }
+}
+bool serviceMemoryProfile(void) {
+  if (!memProfiler.service()) return false;
+  memProfiler.printReport(&serialUI, mem_profile_names, MAX_F32_BLOCKS);
+  if (mem_profile_covered_sd) {
+    serialUI.println("  Send 'U' to use the recommended pool size from the next boot.");
+  } else {
+    serialUI.println("  The SD recording and dose log weren't on the whole time, so this can't be saved.");
+  }
+  return true;
+}
+void saveMemoryProfile(void) {
+  if (memProfiler.getPeakBlocks() == 0) { BOTH_SERIAL.println("Memory Profile: run it first ('u')."); return; }
+  if (memProfiler.isRunning()) { BOTH_SERIAL.println("Memory Profile: wait for it to finish."); return; }
+  if (!mem_profile_covered_sd) {
+    BOTH_SERIAL.println("Memory Profile: not saved.  The SD recording and the dose log weren't on for the whole profile,");
+    BOTH_SERIAL.println("  and a pool sized without them would make the recording drop samples.  Start both ('d', then 'r'), and run 'u' again.");
+    return;
+  }
+  int n = memProfiler.getRecommendedBlocks(MAX_F32_BLOCKS);
+  saveAudioPoolSize(n);
+  BOTH_SERIAL.print("Memory Profile: saved.  The pool will be "); BOTH_SERIAL.print(n); BOTH_SERIAL.println(" blocks from the next boot.");
 }
 
+//Report the impulses.  While the audio is being recorded, they also go into an EVNTxx.CSV
+//on the SD, timed from the start of the recording, so that they can be found in it.
+uint64_t impulse_log_start_sample = 0;
+bool serviceImpulseLog(void) {
+  bool did_work = false;
+  bool recording = (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+  if (recording && !impulseLog.isOpen()) {
+    if (impulseLog.open("EVNT")) {
+      impulse_log_start_sample = impulseClamp.getSampleCount();  //to within a pass of loop()
+      impulseLog.print("# impulses. fs_Hz="); impulseLog.print(audio_settings.sample_rate_Hz, 0);
+      impulseLog.print(", clamp_dB="); impulseLog.println(impulseClamp.getCore().getClamp_dB(), 1);
+      impulseLog.println("millis,sample,rec_sec,peak_dBFS,crest_dB");
+    }
+    did_work = true;
+  } else if (!recording && impulseLog.isOpen()) {
+    impulseLog.close();
+    did_work = true;
+  }
 
-void printCPUandMemory(unsigned long curTime_millis) {
-  static unsigned long updatePeriod_millis = 3000; //how many milliseconds between updating gain reading?
-  static unsigned long lastUpdate_millis = 0;
+  AudioEffectImpulseClamp_F32::Event_t e;
+  while (impulseClamp.getEvent(e)) {
+    did_work = true;
+    float peak_dBFS = 20.0f * log10f(max(e.peak, 1.0e-10f));
+    serialTelemetry.print("IMPULSE: sample="); serialTelemetry.print(e.sample);
+    serialTelemetry.print(", peak_dBFS="); serialTelemetry.print(peak_dBFS, 1);
+    serialTelemetry.print(", crest_dB="); serialTelemetry.println(e.crest_dB, 1);
+    if (impulseLog.isOpen()) {
+      impulseLog.print(millis()); impulseLog.print(",");
+      impulseLog.print(e.sample); impulseLog.print(",");
+      impulseLog.print(((double)((int64_t)(e.sample - impulse_log_start_sample))) / audio_settings.sample_rate_Hz, 4); impulseLog.print(",");  //double: a float runs out of digits after a few hours
+      impulseLog.print(peak_dBFS, 1); impulseLog.print(",");
+      impulseLog.println(e.crest_dB, 1);
+    }
+  }
+  return did_work;
+}
+void setImpulseClamp(bool state) {
+  impulseClamp.enable(state);
+  BOTH_SERIAL.print("Impulse Clamp: "); BOTH_SERIAL.println(state ? "ON" : "OFF");
+}
 
-  //has enough time passed to update everything?
-  if (curTime_millis < lastUpdate_millis) lastUpdate_millis = 0; //handle wrap-around of the clock
-  if ((curTime_millis - lastUpdate_millis) > updatePeriod_millis) { //is it time to update the user interface?
-    printCPUandMemoryMessage();  
-    lastUpdate_millis = curTime_millis; //we will use this value the next time around.
+bool serviceDoseLogger(void) { return doseLogger.service(); }
+void startDoseLogging(void) { doseLogger.start(); }
+void stopDoseLogging(void) { doseLogger.stop(); }
+void printExposure(bool reset) {
+  doseLogger.printExposure(&serialUI);
+  if (reset) { doseLogger.resetExposure(); BOTH_SERIAL.println("Exposure: reset."); }
+}
+
+//run by the scheduler every second.  The averaging is done by the meters, in the audio
+//interrupt; this just reads their latest levels.
+bool printAveSignalLevels(void) {
+  if (!enable_printAveSignalLevels) return false;
+  AudioLevelMeter_F32::Levels_t in, out;
+  inputMeter.getLevels(in); outputMeter.getLevels(out);
+  const bool spl = printAveSignalLevels_as_dBSPL;
+  serialTelemetry.print(spl ? "LEVELS dBSPL: " : "LEVELS dBFS: ");
+  serialTelemetry.print("in RMS L/R = ");
+  serialTelemetry.print(spl ? inputMeter.rms_dBSPL(in, 0) : inputMeter.rms_dBFS(in, 0), 1); serialTelemetry.print("/");
+  serialTelemetry.print(spl ? inputMeter.rms_dBSPL(in, 1) : inputMeter.rms_dBFS(in, 1), 1);
+  serialTelemetry.print(", in Peak L/R = ");
+  serialTelemetry.print(spl ? inputMeter.peak_dBSPL(in, 0) : inputMeter.peak_dBFS(in, 0), 1); serialTelemetry.print("/");
+  serialTelemetry.print(spl ? inputMeter.peak_dBSPL(in, 1) : inputMeter.peak_dBFS(in, 1), 1);
+  serialTelemetry.print(", out RMS L/R = ");
+  serialTelemetry.print(spl ? outputMeter.rms_dBSPL(out, 0) : outputMeter.rms_dBFS(out, 0), 1); serialTelemetry.print("/");
+  serialTelemetry.print(spl ? outputMeter.rms_dBSPL(out, 1) : outputMeter.rms_dBFS(out, 1), 1);
+  serialTelemetry.print(", out Peak L/R = ");
+  serialTelemetry.print(spl ? outputMeter.peak_dBSPL(out, 0) : outputMeter.peak_dBFS(out, 0), 1); serialTelemetry.print("/");
+  serialTelemetry.println(spl ? outputMeter.peak_dBSPL(out, 1) : outputMeter.peak_dBFS(out, 1), 1);
+  return true;
+}
+
+//the cue analysis (two FFTs per pair) is done here, not in the audio interrupt
+bool serviceBinaural(void) { return binaural.service(); }
+
+//run by the scheduler.  The cues at the mics, at the ears, and how far apart they are.
+bool printBinauralCues(void) {
+  if (!enable_printBinauralCues) return false;
+  const BinauralCues_Core::Cues_t &mic = binaural.getCues(0), &ear = binaural.getCues(1);
+  serialTelemetry.print("CUES: binaural="); serialTelemetry.print(binaural_mode ? "ON" : "OFF");
+  serialTelemetry.print(", mics ITD_us="); serialTelemetry.print(mic.itd_usec, 0);
+  serialTelemetry.print(" (coh "); serialTelemetry.print(mic.coherence, 2); serialTelemetry.print(")");
+  serialTelemetry.print(", ears ITD_us="); serialTelemetry.print(ear.itd_usec, 0);
+  serialTelemetry.print(" (coh "); serialTelemetry.print(ear.coherence, 2); serialTelemetry.print(")");
+  serialTelemetry.print(", ILD_dB mics/ears =");
+  float worst_ild_err = 0.0f;
+  for (int b = 0; b < mic.n_bands; b++) {
+    serialTelemetry.print(" "); serialTelemetry.print(mic.ild_dB[b], 1);
+    serialTelemetry.print("/"); serialTelemetry.print(ear.ild_dB[b], 1);
+    worst_ild_err = max(worst_ild_err, fabsf(ear.ild_dB[b] - mic.ild_dB[b]));
   }
+  serialTelemetry.print(", err ITD_us="); serialTelemetry.print(ear.itd_usec - mic.itd_usec, 0);
+  serialTelemetry.print(" ILD_dB="); serialTelemetry.println(worst_ild_err, 1);
+  return true;
+}
+
+//Binaural mode: the processing keeps the interaural cues.  That means stereo (the mono mix
+//throws them away) and the same gain on both sides: either linear, or the multi-band
+//compressor with its bands linked.  The broadband compressors run each side on its own.
+bool isBinauralMode(void) { return binaural_mode; }
+void setBinauralMode(bool state) {
+  binaural_mode = state;
+  multiBandComp.setLinked(state);
+  if (state) {
+    if (myState.audio == AUDIO_MONO) setAudioStereo();
+    if ((myState.alg == ALG_FASTCOMP) || (myState.alg == ALG_SLOWCOMP)) setAudioMultiBand();
+  }
+  BOTH_SERIAL.print("Binaural Mode: "); BOTH_SERIAL.println(state ? "ON (stereo, linked multi-band)" : "OFF");
+}
+void toggleBinauralMode(void) { setBinauralMode(!binaural_mode); }
+
+//Time the cue measurement, on synthetic signals whose cues are known (so its accuracy comes
+//along for free).  What the multi-band compressor does to the cues, independent and linked, is
+//simulated on the host: see Tools/HostSim/BinauralSim.
+void benchmarkBinaural(void) {
+  if (!isOkToBenchmark("Binaural benchmark")) return;
+  static BinauralCues_Core core;
+  static float32_t L[BINAURAL_FFT], R[BINAURAL_FFT], x[BINAURAL_FFT + 32];
+  BinauralCues_Core::Cues_t cues;
+  const float fs = binaural.getCore(0).getSampleRate_Hz();
+  const int n_frames = 40;
+  uint32_t seed = 12345;
+  auto noise = [&seed](void) { seed = seed * 1664525UL + 1013904223UL; return ((float)(seed >> 8)) / 8388608.0f - 1.0f; };
+  core = binaural.getCore(0);  //same bands and rate as the live one
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;  //turn on the cycle counter
+  BOTH_SERIAL.print("Binaural benchmark: "); BOTH_SERIAL.print(fs, 0); BOTH_SERIAL.print(" Hz (decimated by ");
+  BOTH_SERIAL.print(binaural.getDecimation()); BOTH_SERIAL.print("), FFT "); BOTH_SERIAL.println(BINAURAL_FFT);
+
+  //accuracy: white noise, with the right side delayed by a whole number of (decimated) samples and turned down
+  const int delays[] = {-14, -7, -2, 0, 3, 7, 14};
+  const float ilds_dB[] = {0.0f, 6.0f, -12.0f};
+  float worst_itd_err = 0.0f, worst_ild_err = 0.0f;
+  uint32_t cycles = 0, n_analyzed = 0;
+  for (int d : delays) {
+    for (float ild : ilds_dB) {
+      core.reset();
+      const float gain_R = powf(10.0f, -ild / 20.0f);
+      for (int f = 0; f < n_frames; f++) {
+        for (int i = 0; i < BINAURAL_FFT + 32; i++) x[i] = 0.1f * noise();
+        for (int i = 0; i < BINAURAL_FFT; i++) { L[i] = x[16 + i]; R[i] = gain_R * x[16 + i - d]; }
+        __disable_irq(); uint32_t start = ARM_DWT_CYCCNT;
+        core.analyze(L, R, cues);
+        cycles += ARM_DWT_CYCCNT - start; __enable_irq();
+        n_analyzed++;
+      }
+      worst_itd_err = max(worst_itd_err, fabsf(cues.itd_usec - 1.0e6f * d / fs));
+      for (int b = 0; b < cues.n_bands; b++) worst_ild_err = max(worst_ild_err, fabsf(cues.ild_dB[b] - ild));
+    }
+  }
+  const float usec_per_frame = ((float)cycles) / ((float)n_analyzed) / (F_CPU / 1.0e6f);
+  const float frame_usec = 1.0e6f * BINAURAL_FFT / fs;
+  BOTH_SERIAL.print("  worst error: ITD "); BOTH_SERIAL.print(worst_itd_err, 1); BOTH_SERIAL.print(" usec (one sample is ");
+  BOTH_SERIAL.print(1.0e6f / fs, 1); BOTH_SERIAL.print(" usec), ILD "); BOTH_SERIAL.print(worst_ild_err, 2); BOTH_SERIAL.println(" dB");
+  BOTH_SERIAL.print("  analysis: "); BOTH_SERIAL.print(usec_per_frame, 1); BOTH_SERIAL.print(" usec per pair per frame, ");
+  BOTH_SERIAL.print(100.0f * BINAURAL_N_PAIRS * usec_per_frame / frame_usec, 2); BOTH_SERIAL.println("% CPU for both pairs (from loop())");
+  endBenchmark();
+}
+
+//run by the scheduler every few seconds
+bool printCPUandMemory(void) {
+  if (!enable_printCPUandMemory) return false;
+  printCPUandMemoryMessage();
+  return true;
 }
 void printCPUandMemoryMessage(void) {
-    BOTH_SERIAL.print("CPU Cur/Pk: ");
-    BOTH_SERIAL.print(audio_settings.processorUsage(),1);
-    BOTH_SERIAL.print("%/");
-    BOTH_SERIAL.print(audio_settings.processorUsageMax(),1);
-    BOTH_SERIAL.print("%, ");
-    BOTH_SERIAL.print("MEM Cur/Pk: ");
-    BOTH_SERIAL.print(AudioMemoryUsage_F32());
-    BOTH_SERIAL.print("/");
-    BOTH_SERIAL.print(AudioMemoryUsageMax_F32());
-    BOTH_SERIAL.println();
-}
-
-void serviceLEDs(void) {
+    serialTelemetry.print("Block: ");
+    serialTelemetry.print(audio_settings.audio_block_samples);
+    if (measured_loopback_msec >= 0.0f) {
+      serialTelemetry.print(" (I/O ");
+      serialTelemetry.print(measured_loopback_msec,2);
+      serialTelemetry.print("ms measured");
+    } else {
+      serialTelemetry.print(" (I/O ~");
+      serialTelemetry.print(getEstimatedLatency_msec(),1);
+      serialTelemetry.print("ms est.");
+    }
+    if (measured_graph_msec >= 0.0f) {
+      serialTelemetry.print(", processing ");
+      serialTelemetry.print(measured_graph_msec,2);
+      serialTelemetry.print("ms measured");
+      if (measured_graph_alg != myState.alg) serialTelemetry.print(" with another alg");
+    }
+    serialTelemetry.print("), ");
+    serialTelemetry.print("CPU Cur/Pk: ");
+    serialTelemetry.print(audio_settings.processorUsage(),1);
+    serialTelemetry.print("%/");
+    serialTelemetry.print(audio_settings.processorUsageMax(),1);
+    serialTelemetry.print("%, ");
+    serialTelemetry.print("MEM Cur/Pk: ");
+    serialTelemetry.print(AudioMemoryUsage_F32());
+    serialTelemetry.print("/");
+    serialTelemetry.print(AudioMemoryUsageMax_F32());
+    serialTelemetry.print(" of ");
+    serialTelemetry.print(n_audio_blocks);
+    serialTelemetry.print(", Limiter CPU Cur/Pk: ");
+    serialTelemetry.print(audio_settings.cpu_load_percent(limiter.cpu_cycles),1);  //scaled for our sample rate and block size
+    serialTelemetry.print("%/");
+    serialTelemetry.print(audio_settings.cpu_load_percent(limiter.cpu_cycles_max),1);
+    serialTelemetry.print("%, MultiBand CPU Cur/Pk: ");
+    serialTelemetry.print(audio_settings.cpu_load_percent(multiBandComp.cpu_cycles),1);
+    serialTelemetry.print("%/");
+    serialTelemetry.print(audio_settings.cpu_load_percent(multiBandComp.cpu_cycles_max),1);
+    serialTelemetry.print("%, NR CPU Cur/Pk: ");
+    serialTelemetry.print(audio_settings.cpu_load_percent(noiseReduction.cpu_cycles),1);
+    serialTelemetry.print("%/");
+    serialTelemetry.print(audio_settings.cpu_load_percent(noiseReduction.cpu_cycles_max),1);
+    serialTelemetry.print("%, FBC CPU Cur/Pk: ");
+    serialTelemetry.print(audio_settings.cpu_load_percent(feedbackCancel.cpu_cycles),1);
+    serialTelemetry.print("%/");
+    serialTelemetry.print(audio_settings.cpu_load_percent(feedbackCancel.cpu_cycles_max),1);
+    serialTelemetry.print("%, Limiter Min Gain (dB): ");
+    serialTelemetry.print(limiter.getMinGain_dB(),1);
+    serialTelemetry.print(", Heap Used (bytes): ");
+    serialTelemetry.print(mallinfo().uordblks);  //should not grow over time
+    serialTelemetry.print(", SD Dropped Samples: ");
+    serialTelemetry.print(audioSDWriter.getNDroppedSamples());
+    serialTelemetry.print(", Serial Dropped UI/Telem: ");
+    serialTelemetry.print(serialTxQueue.getNDropped(SERIAL_PRIORITY_UI));
+    serialTelemetry.print("/");
+    serialTelemetry.print(serialTxQueue.getNDropped(SERIAL_PRIORITY_TELEMETRY));
+    serialTelemetry.println();
+    limiter.resetMinGain();
+}
+
+bool serviceLEDs(void) {
   if (audioSDWriter.getState() == AudioSDWriter::STATE::UNPREPARED) {
     myTympan.setRedLED(HIGH); myTympan.setAmberLED(HIGH); //Turn ON both
   } else if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) {
@@ -345,10 +988,12 @@ void serviceLEDs(void) {
   } else {
     myTympan.setRedLED(HIGH); myTympan.setAmberLED(LOW); //Go Red
   }
+  return false;  //cheap, so never worth staying awake for
 }
 
 #define PRINT_OVERRUN_WARNING 1   //set to 1 to print a warning that the there's been a hiccup in the writing to the SD.
-void serviceSD(void) {
+bool isSDFallingBehind(void) { return (audioSDWriter.getQueueDepth() > SD_QUEUE_WATERMARK); }
+bool serviceSD(void) {
   if (audioSDWriter.serviceSD()) {
     //if we're here, data was written to the SD, so do some checking of the timing...
   
@@ -359,6 +1004,14 @@ void serviceSD(void) {
         BOTH_SERIAL.print("SD Write Warning: there was a hiccup in the writing.  Approx Time (sec): ");
         BOTH_SERIAL.println( ((float)audioSDWriter.getNBlocksWritten()) / blocksPerSecond );
       }
+      static unsigned long last_n_dropped = 0;
+      unsigned long n_dropped = audioSDWriter.getNDroppedSamples();
+      if (n_dropped < last_n_dropped) last_n_dropped = 0;  //a new recording
+      if (n_dropped > last_n_dropped) {
+        BOTH_SERIAL.print("SD Write Warning: no free audio blocks, so samples were dropped.  Total so far: ");
+        BOTH_SERIAL.println(n_dropped);
+        last_n_dropped = n_dropped;
+      }
     }
 
     //print timing information to help debug hiccups in the audio.  Are the writes fast enough?  Are there overruns?
@@ -378,9 +1031,11 @@ void serviceSD(void) {
     
     audioSDWriter.clearQueueOverrun();
     i2s_in.clear_isOutOfMemory();
+    return true;
   } else {
     //no SD recording currently, so no SD action
   }
+  return false;
 }
 
 
@@ -393,7 +1048,15 @@ void incrementInputGain(float increment_dB) {
     BOTH_SERIAL.println("Setting input gain to 0 dB.");
     input_gain_dB = 0.0;
   }
-  myTympan.setInputGain_dB(input_gain_dB);
+  setInputGain(input_gain_dB);
+}
+
+void setInputGain(float gain_dB) {
+  input_gain_dB = max(0.0f, gain_dB);
+  MIC_CODEC.setInputGain_dB(input_gain_dB);
+#if USE_FOUR_CHANNELS
+  aicShield.setInputGain_dB(input_gain_dB);  //the rear mics need to match the front ones
+#endif
 }
 
 void setAudioMute(void) {
@@ -402,6 +1065,7 @@ void setAudioMute(void) {
   inputMixerR.gain(0, 0.0);      inputMixerR.gain(1, 0.0); //mute left and right input to the right side
 }
 void setAudioMono(void) {
+  if (binaural_mode) setBinauralMode(false);  //the mono mix loses the cues
   myState.audio = AUDIO_MONO;
   inputMixerL.gain(0, 0.5);      inputMixerL.gain(1, 0.5);  //50% left and 50% right to the left side
   inputMixerR.gain(0, 0.5);      inputMixerR.gain(1, 0.5);  //50% left and 50% right to the right side
@@ -416,13 +1080,293 @@ void setAudioLinear(void) {
   inputSwitchL.setChannel(ALG_LINEAR);  inputSwitchR.setChannel(ALG_LINEAR);
 }
 void setAudioFastComp(void) {
+  if (binaural_mode) setBinauralMode(false);  //independent left and right compressors
   myState.alg = ALG_FASTCOMP;
   inputSwitchL.setChannel(ALG_FASTCOMP);  inputSwitchR.setChannel(ALG_FASTCOMP);
 }
 void setAudioSlowComp(void) {
+  if (binaural_mode) setBinauralMode(false);  //independent left and right compressors
   myState.alg = ALG_SLOWCOMP;
   inputSwitchL.setChannel(ALG_SLOWCOMP);  inputSwitchR.setChannel(ALG_SLOWCOMP);
 }
+void setAudioMultiBand(void) {
+  myState.alg = ALG_MULTIBAND;
+  inputSwitchL.setChannel(ALG_MULTIBAND);  inputSwitchR.setChannel(ALG_MULTIBAND);
+}
+
+void toggleBTDucking(void) {
+  btDucker.enable(!btDucker.isEnabled());
+  BOTH_SERIAL.print("BT Ducking: "); BOTH_SERIAL.print(btDucker.isEnabled() ? "ON" : "OFF");
+  BOTH_SERIAL.print(" (hear-thru "); BOTH_SERIAL.print(btDucker.getDepth_dB(), 0);
+  BOTH_SERIAL.print(" dB while the BT audio is above "); BOTH_SERIAL.print(btDucker.getThreshold_dBFS(), 0); BOTH_SERIAL.print(" dBFS)");
+  if (!BT_AUDIO_IN_GRAPH) BOTH_SERIAL.print(" (but the BT audio isn't in the graph: see BT_AUDIO_IN_GRAPH)");
+  BOTH_SERIAL.println();
+}
+
+//step both ears through the beamformer modes
+void stepBeamformerMode(void) {
+  Beamformer_Core::MODE mode = beamL.getCore().getMode();
+  mode = (Beamformer_Core::MODE)((((int)mode) + 1) % ((int)Beamformer_Core::MODE::N_MODES));
+  beamL.getCore().setMode(mode); beamR.getCore().setMode(mode);
+  BOTH_SERIAL.print("Beamformer: "); BOTH_SERIAL.print(Beamformer_Core::getModeName(mode));
+  if (!USE_FOUR_CHANNELS) BOTH_SERIAL.print(" (but there are no rear mics: see USE_FOUR_CHANNELS)");
+  BOTH_SERIAL.println();
+}
+
+//The cost of each beamformer mode: a copy of the live one (so, the same spacing and EQ) runs
+//0.25 sec of a plane wave from the side.  The directivity itself is checked on the host: see
+//Tools/HostSim/BeamformerSim.
+void benchmarkBeamformer(void) {
+  if (!isOkToBenchmark("Beamformer benchmark")) return;
+  static Beamformer_Core core;
+  static float32_t f[AUDIO_BLOCK_SAMPLES], r[AUDIO_BLOCK_SAMPLES], y[AUDIO_BLOCK_SAMPLES];
+  const int n = audio_settings.audio_block_samples;
+  const float fs = audio_settings.sample_rate_Hz;
+  const float block_cycles = F_CPU * n / fs;  //the time budget of one block
+  uint32_t seed = 12345;
+  auto noise = [&seed](void) { seed = seed * 1664525UL + 1013904223UL; return 0.1f * (((float)(seed >> 8)) / 8388608.0f - 1.0f); };
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;  //turn on the cycle counter
+  BOTH_SERIAL.print("Beamformer benchmark: mic spacing "); BOTH_SERIAL.print(beamL.getCore().getSpacing_mm(), 1);
+  BOTH_SERIAL.print(" mm, "); BOTH_SERIAL.print(n); BOTH_SERIAL.println(" sample blocks");
+  for (int m = (int)Beamformer_Core::MODE::OFF; m < (int)Beamformer_Core::MODE::N_MODES; m++) {
+    core = beamL.getCore();
+    core.setMode((Beamformer_Core::MODE)m); core.reset();
+    uint32_t cycles = 0, n_samples = 0;
+    float32_t prev = 0.0f;
+    for ( ; n_samples < (uint32_t)(0.25f * fs); n_samples += n) {
+      for (int i = 0; i < n; i++) { f[i] = noise(); r[i] = prev; prev = f[i]; }  //from the side, near enough
+      __disable_irq(); uint32_t start = ARM_DWT_CYCCNT;
+      core.process(f, r, y, n);
+      cycles += ARM_DWT_CYCCNT - start; __enable_irq();
+    }
+    BOTH_SERIAL.print("  "); BOTH_SERIAL.print(Beamformer_Core::getModeName((Beamformer_Core::MODE)m)); BOTH_SERIAL.print(": ");
+    BOTH_SERIAL.print(((float)cycles) / ((float)n_samples), 1); BOTH_SERIAL.print(" cycles/sample, ");
+    BOTH_SERIAL.print(100.0f * 2.0f * ((float)cycles) * n / n_samples / block_cycles, 2); BOTH_SERIAL.println("% CPU for both ears");
+  }
+  endBenchmark();
+}
+
+void setFeedbackCancel(bool state) {
+  feedbackCancel.enable(state);
+  BOTH_SERIAL.print("Feedback Cancel: "); BOTH_SERIAL.print(state ? "ON" : "OFF");
+  BOTH_SERIAL.print(" (bulk delay "); BOTH_SERIAL.print(feedbackCancel.getCore(0).getBulkDelay_samples());
+  BOTH_SERIAL.print(" samples, "); BOTH_SERIAL.print(feedbackCancel.getCore(0).getTaps()); BOTH_SERIAL.print(" taps");
+  BOTH_SERIAL.println(feedbackCancel.getCore(0).getPrewhitening() ? ", prewhitened)" : ")");
+}
+void toggleFeedbackCancel(void) { setFeedbackCancel(!feedbackCancel.isEnabled()); }
+
+void setNoiseReduction(bool state) {
+  noiseReduction.enable(state);
+  BOTH_SERIAL.print("Noise Reduction: "); BOTH_SERIAL.println(state ? "ON" : "OFF");
+}
+void stepNoiseReductionConfig(void) {
+  nr_config_ind = (nr_config_ind + 1) % n_nr_configs;
+  const int *cfg = nr_configs[nr_config_ind];
+  noiseReduction.setConfig(cfg[0], cfg[1], cfg[2]);
+  BOTH_SERIAL.print("Noise Reduction: FFT "); BOTH_SERIAL.print(cfg[0]);
+  BOTH_SERIAL.print(", hop "); BOTH_SERIAL.print(cfg[1]);
+  BOTH_SERIAL.print(", decimate "); BOTH_SERIAL.print(cfg[2]);
+  BOTH_SERIAL.print(", approx latency (msec) "); 
+  BOTH_SERIAL.println(1000.0f * ((float)noiseReduction.getLatency_samples()) / audio_settings.sample_rate_Hz, 2);
+}
+
+//CPU of the noise reduction at the full rate and decimated by 2 and 4: a fresh core, with the
+//live FFT size and hop, runs 1 sec of noise in the live block size.  The frames only come every
+//hop, so the blocks that get one cost a lot more than the ones that don't; the worst block is
+//what has to fit in the audio interrupt.
+void benchmarkNoiseReduction(void) {
+  if (!isOkToBenchmark("Noise reduction benchmark")) return;
+  static NoiseReduction_Core core;
+  static float32_t L[AUDIO_BLOCK_SAMPLES], R[AUDIO_BLOCK_SAMPLES];
+  const float fs = audio_settings.sample_rate_Hz;
+  const int N = audio_settings.audio_block_samples;
+  const int fft_size = noiseReduction.getFFTSize(), hop = noiseReduction.getHop();
+  const int decimations[] = {1, 2, 4};
+  const float block_cycles = F_CPU * N / fs;  //the time budget of one block
+  uint32_t seed = 12345;
+  auto noise = [&seed](void) { seed = seed * 1664525UL + 1013904223UL; return 0.1f * (((float)(seed >> 8)) / 8388608.0f - 1.0f); };
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;  //turn on the cycle counter
+  BOTH_SERIAL.print("Noise reduction benchmark: FFT "); BOTH_SERIAL.print(fft_size); BOTH_SERIAL.print(", hop "); BOTH_SERIAL.print(hop);
+  BOTH_SERIAL.print(", "); BOTH_SERIAL.print(N); BOTH_SERIAL.print(" sample blocks ("); BOTH_SERIAL.print(block_cycles, 0); BOTH_SERIAL.println(" cycles each)");
+  for (int d : decimations) {
+    core.setConfig(fft_size, hop, d);
+    uint32_t cycles = 0, worst = 0;
+    int n_blocks = 0;
+    for ( ; n_blocks * N < (int)fs; n_blocks++) {
+      for (int i = 0; i < N; i++) { L[i] = noise(); R[i] = noise(); }
+      __disable_irq(); uint32_t start = ARM_DWT_CYCCNT;
+      core.process(L, R, N);
+      uint32_t block = ARM_DWT_CYCCNT - start; __enable_irq();
+      cycles += block; worst = max(worst, block);
+    }
+    BOTH_SERIAL.print("  decimate "); BOTH_SERIAL.print(d); BOTH_SERIAL.print(" (STFT at "); BOTH_SERIAL.print(fs / d / 1000.0f, 0);
+    BOTH_SERIAL.print(" kHz): "); BOTH_SERIAL.print(((float)cycles) / n_blocks, 0); BOTH_SERIAL.print(" cycles per block, worst ");
+    BOTH_SERIAL.print(worst); BOTH_SERIAL.print(" ("); BOTH_SERIAL.print(100.0f * ((float)cycles) / n_blocks / block_cycles, 1);
+    BOTH_SERIAL.print("% CPU, worst block "); BOTH_SERIAL.print(100.0f * ((float)worst) / block_cycles, 1); BOTH_SERIAL.print("%), latency ");
+    BOTH_SERIAL.print(1000.0f * ((float)core.getLatency_samples()) / fs, 2); BOTH_SERIAL.println(" msec");
+  }
+  endBenchmark();
+}
+
+// //////////////////////////////////// Presets
+void capturePreset(Preset_t &p, const char *name) {
+  memset(&p, 0, sizeof(p));  //so the padding is the same every time (it goes into the CRC)
+  strncpy(p.name, name, PRESET_NAME_LEN - 1);
+  p.input_source = myState.input_source; p.audio = myState.audio; p.alg = myState.alg;
+  p.nr_on = noiseReduction.isEnabled(); p.nr_config = nr_config_ind;
+  p.binaural_on = binaural_mode; p.duck_on = btDucker.isEnabled(); p.duck_depth_dB = btDucker.getDepth_dB();
+  p.input_gain_dB = input_gain_dB; p.output_volume_dB = output_volume_dB;
+  p.knee_dBSPL[0] = fastCompL.getKneeCompressor_dBSPL(); p.attack_msec[0] = fastCompL.getAttack_msec(); p.release_msec[0] = fastCompL.getRelease_msec();
+  p.knee_dBSPL[1] = slowCompL.getKneeCompressor_dBSPL(); p.attack_msec[1] = slowCompL.getAttack_msec(); p.release_msec[1] = slowCompL.getRelease_msec();
+  p.knee_dBSPL[2] = multiBandComp.getKneeCompressor_dBSPL(); p.attack_msec[2] = multiBandComp.getAttack_msec(); p.release_msec[2] = multiBandComp.getRelease_msec();
+}
+
+//the built-in presets, for when nothing has been saved
+void makeFactoryPreset(int ind, Preset_t &p) {
+  const char *names[PRESET_N_SLOTS] = {"Headset", "PCB Mics", "Fast Comp", "Noisy"};
+  p = default_preset;
+  strncpy(p.name, names[ind], PRESET_NAME_LEN - 1);
+  p.input_source = INPUT_MICJACK; p.audio = AUDIO_STEREO; p.alg = ALG_LINEAR; p.nr_on = false; p.nr_config = 0; p.binaural_on = false;
+  p.input_gain_dB = default_input_gain_dB; p.output_volume_dB = 0.0f;
+  switch (ind) {
+    case 1: p.input_source = INPUT_PCBMICS; p.input_gain_dB = 15.0f; break;
+    case 2: p.alg = ALG_FASTCOMP; break;
+    case 3: p.alg = ALG_MULTIBAND; p.nr_on = true; break;
+  }
+}
+
+void applyPresetSettings(const Preset_t &p) {
+  setAudioMode(p.audio);
+  setAlgorithm(p.alg);
+  if (binaural_mode != (bool)p.binaural_on) setBinauralMode(p.binaural_on);  //after the algorithm, which can turn it off
+  btDucker.setDepth_dB(p.duck_depth_dB);
+  btDucker.enable(p.duck_on);
+  nr_config_ind = max(0, min((int)p.nr_config, n_nr_configs - 1));
+  noiseReduction.setConfig(nr_configs[nr_config_ind][0], nr_configs[nr_config_ind][1], nr_configs[nr_config_ind][2]);
+  noiseReduction.enable(p.nr_on);
+  fastCompL.setKneeCompressor_dBSPL(p.knee_dBSPL[0]); fastCompR.setKneeCompressor_dBSPL(p.knee_dBSPL[0]);
+  fastCompL.setAttackRelease_msec(p.attack_msec[0], p.release_msec[0]); fastCompR.setAttackRelease_msec(p.attack_msec[0], p.release_msec[0]);
+  slowCompL.setKneeCompressor_dBSPL(p.knee_dBSPL[1]); slowCompR.setKneeCompressor_dBSPL(p.knee_dBSPL[1]);
+  slowCompL.setAttackRelease_msec(p.attack_msec[1], p.release_msec[1]); slowCompR.setAttackRelease_msec(p.attack_msec[1], p.release_msec[1]);
+  multiBandComp.setKneeCompressor_dBSPL(p.knee_dBSPL[2]);
+  multiBandComp.setAttackRelease_msec(p.attack_msec[2], p.release_msec[2]);
+  setInputGain(p.input_gain_dB);  //after applyConfiguration(), which sets the input's default gain
+  output_volume_dB = p.output_volume_dB;
+  myTympan.volume_dB(output_volume_dB);
+}
+
+//fade out, apply the preset (and its input), fade back in.  It also becomes the boot preset.
+void loadPreset(int ind) {
+  if ((ind < 0) || (ind >= PRESET_N_SLOTS)) return;
+  bool was_saved = presetStore.load(ind, pending_preset);
+  if (!was_saved) makeFactoryPreset(ind, pending_preset);
+  current_preset = ind;
+  presetStore.setBootPreset(ind);
+  preset_pending = true;
+  setConfiguration(pending_preset.input_source);
+  BOTH_SERIAL.print("Preset "); BOTH_SERIAL.print(ind + 1); BOTH_SERIAL.print(": ");
+  BOTH_SERIAL.print(pending_preset.name); BOTH_SERIAL.println(was_saved ? "" : " (built-in)");
+}
+
+//save the current settings into the current preset (keeping its name)
+void saveCurrentPreset(void) {
+  Preset_t p;
+  if (!presetStore.load(current_preset, p)) makeFactoryPreset(current_preset, p);
+  char name[PRESET_NAME_LEN];
+  strncpy(name, p.name, PRESET_NAME_LEN);
+  capturePreset(p, name);
+  presetStore.save(current_preset, p);
+  BOTH_SERIAL.print("Preset "); BOTH_SERIAL.print(current_preset + 1); BOTH_SERIAL.print(": saved as "); BOTH_SERIAL.println(p.name);
+}
+
+void printPresets(void) {
+  BOTH_SERIAL.println("Presets:");
+  for (int i = 0; i < PRESET_N_SLOTS; i++) {
+    Preset_t p;
+    bool was_saved = presetStore.load(i, p);
+    if (!was_saved) makeFactoryPreset(i, p);
+    BOTH_SERIAL.print((i == current_preset) ? "  * " : "    "); BOTH_SERIAL.print(i + 1); BOTH_SERIAL.print(": ");
+    BOTH_SERIAL.print(p.name); BOTH_SERIAL.print(was_saved ? "" : " (built-in)");
+    BOTH_SERIAL.print(", input="); BOTH_SERIAL.print(p.input_source);
+    BOTH_SERIAL.print(", audio="); BOTH_SERIAL.print(p.audio);
+    BOTH_SERIAL.print(", alg="); BOTH_SERIAL.print(p.alg);
+    BOTH_SERIAL.print(", NR="); BOTH_SERIAL.print(p.nr_on ? "on" : "off");
+    BOTH_SERIAL.print(", binaural="); BOTH_SERIAL.print(p.binaural_on ? "on" : "off");
+    BOTH_SERIAL.print(", BT duck="); BOTH_SERIAL.print(p.duck_on ? "on" : "off");
+    BOTH_SERIAL.print(", gain="); BOTH_SERIAL.print(p.input_gain_dB, 1); BOTH_SERIAL.println(" dB");
+  }
+  printBootTime();
+}
+
+void printBootTime(void) {
+  if (boot_audio_msec == 0) return;
+  BOTH_SERIAL.print("Boot: audio out at "); BOTH_SERIAL.print(boot_audio_msec);
+  BOTH_SERIAL.print(" msec after reset (setup() started at "); BOTH_SERIAL.print(setup_start_msec);
+  BOTH_SERIAL.println(" msec)");
+}
+
+bool setAlgorithm(int alg) {
+  switch (alg) {
+    case ALG_LINEAR: setAudioLinear(); return true;
+    case ALG_FASTCOMP: setAudioFastComp(); return true;
+    case ALG_SLOWCOMP: setAudioSlowComp(); return true;
+    case ALG_MULTIBAND: setAudioMultiBand(); return true;
+  }
+  return false;
+}
+bool setAudioMode(int audio) {
+  switch (audio) {
+    case AUDIO_MUTE: setAudioMute(); return true;
+    case AUDIO_MONO: setAudioMono(); return true;
+    case AUDIO_STEREO: setAudioStereo(); return true;
+  }
+  return false;
+}
+bool isNoiseReductionEnabled(void) { return noiseReduction.isEnabled(); }
+
+//direct setters and getters for whichever compressor is active (the linear algorithm has none)
+void setKneepoint(float knee_dB) {
+  knee_dB = max(0.0f, knee_dB);
+  switch (myState.alg) {
+    case ALG_FASTCOMP: fastCompL.setKneeCompressor_dBSPL(knee_dB); fastCompR.setKneeCompressor_dBSPL(knee_dB); break;
+    case ALG_SLOWCOMP: slowCompL.setKneeCompressor_dBSPL(knee_dB); slowCompR.setKneeCompressor_dBSPL(knee_dB); break;
+    case ALG_MULTIBAND: multiBandComp.setKneeCompressor_dBSPL(knee_dB); break;
+  }
+}
+float getKneepoint(void) {
+  switch (myState.alg) {
+    case ALG_FASTCOMP: return fastCompL.getKneeCompressor_dBSPL();
+    case ALG_SLOWCOMP: return slowCompL.getKneeCompressor_dBSPL();
+    case ALG_MULTIBAND: return multiBandComp.getKneeCompressor_dBSPL();
+  }
+  return 0.0f;
+}
+void setAttackRelease(float attack_msec, float release_msec) {
+  attack_msec = max(2.0f, attack_msec); release_msec = max(50.0f, release_msec);  //same limits as incrementAttackRelease
+  switch (myState.alg) {
+    case ALG_FASTCOMP: fastCompL.setAttackRelease_msec(attack_msec,release_msec); fastCompR.setAttackRelease_msec(attack_msec,release_msec); break;
+    case ALG_SLOWCOMP: slowCompL.setAttackRelease_msec(attack_msec,release_msec); slowCompR.setAttackRelease_msec(attack_msec,release_msec); break;
+    case ALG_MULTIBAND: multiBandComp.setAttackRelease_msec(attack_msec,release_msec); break;
+  }
+}
+float getAttack_msec(void) {
+  switch (myState.alg) {
+    case ALG_FASTCOMP: return fastCompL.getAttack_msec();
+    case ALG_SLOWCOMP: return slowCompL.getAttack_msec();
+    case ALG_MULTIBAND: return multiBandComp.getAttack_msec();
+  }
+  return 0.0f;
+}
+float getRelease_msec(void) {
+  switch (myState.alg) {
+    case ALG_FASTCOMP: return fastCompL.getRelease_msec();
+    case ALG_SLOWCOMP: return slowCompL.getRelease_msec();
+    case ALG_MULTIBAND: return multiBandComp.getRelease_msec();
+  }
+  return 0.0f;
+}
 
 void scaleCompressionSpeed(float scale_value, bool print_new_vals) {
   switch (myState.alg) {
@@ -436,6 +1380,9 @@ void scaleCompressionSpeed(float scale_value, bool print_new_vals) {
    case ALG_SLOWCOMP:
       incrementAttackRelease(scale_value,slowCompL,slowCompR,print_new_vals);
       //printAttackRelease(slowCompL);
+      break;
+   case ALG_MULTIBAND:
+      incrementAttackRelease(scale_value,multiBandComp,print_new_vals);
   }
 }
 void incrementAttackRelease(float scale_value,AudioEffectCompWDRC_F32 &compL, AudioEffectCompWDRC_F32 &compR,bool print_new_vals) {
@@ -451,6 +1398,16 @@ void incrementAttackRelease(float scale_value,AudioEffectCompWDRC_F32 &compL, Au
     BOTH_SERIAL.print((int)release_msec); BOTH_SERIAL.println("ms release");
   }
 }
+void incrementAttackRelease(float scale_value,AudioEffectMultiBandWDRC_F32 &comp,bool print_new_vals) {
+  float min_attack_msec = 2.0, min_release_msec = 50;
+  float attack_msec = max(min_attack_msec,comp.getAttack_msec()*scale_value);
+  float release_msec = max(min_release_msec,comp.getRelease_msec()*scale_value);
+  comp.setAttackRelease_msec(attack_msec,release_msec);
+  if (print_new_vals) {
+    BOTH_SERIAL.print("Comp: "); BOTH_SERIAL.print((int)attack_msec); BOTH_SERIAL.print("ms attack, ");
+    BOTH_SERIAL.print((int)release_msec); BOTH_SERIAL.println("ms release");
+  }
+}
 void incrementKneepoint(float increment_dB,bool print_new_vals) {
   switch (myState.alg) {
     case ALG_LINEAR:
@@ -461,6 +1418,9 @@ void incrementKneepoint(float increment_dB,bool print_new_vals) {
       break;
    case ALG_SLOWCOMP:
       incrementKneepoint(increment_dB,slowCompL,slowCompR,print_new_vals);
+      break;
+   case ALG_MULTIBAND:
+      incrementKneepoint(increment_dB,multiBandComp,print_new_vals);
   }
 }
 void incrementKneepoint(float increment_dB,AudioEffectCompWDRC_F32 &compL, AudioEffectCompWDRC_F32 &compR,bool print_new_vals) {
@@ -473,4 +1433,11 @@ void incrementKneepoint(float increment_dB,AudioEffectCompWDRC_F32 &compL, Audio
     BOTH_SERIAL.print("Comp: Kneepoint set to "); BOTH_SERIAL.print((int)knee_dB); BOTH_SERIAL.println("dB");
   }
 }
-
+void incrementKneepoint(float increment_dB,AudioEffectMultiBandWDRC_F32 &comp,bool print_new_vals) {
+  float min_knee_dB = 0.0;
+  float knee_dB = max(min_knee_dB,comp.getKneeCompressor_dBSPL()+increment_dB);
+  comp.setKneeCompressor_dBSPL(knee_dB);
+  if (print_new_vals) {
+    BOTH_SERIAL.print("Comp: Kneepoint set to "); BOTH_SERIAL.print((int)knee_dB); BOTH_SERIAL.println("dB (lowest band)");
+  }
+}
\ No newline at end of file
@@ -0,0 +1,151 @@
+
+/*
+   LoopScheduler
+
+   Purpose: A small cooperative scheduler for the services that run from loop().  Each task
+     has a period (0 means every pass) and a time budget.  Tasks run in the order in which
+     they were added, so add the most important ones first.
+
+   Extras:
+     * one task (the SD writing) can be marked urgent.  Whenever its is_urgent() check says
+       so (eg, the SD queue is past a watermark), it runs first, repeatedly, before anything else
+     * if no task had anything to do on a pass, the CPU sleeps (WFI) until the next interrupt.
+       The audio interrupts come every block, so this never delays the audio.
+     * per-task stats: number of runs, the longest run, how often it went over its budget,
+       and how often it started more than a whole period late
+     * the budgets can't be enforced (a task can't be stopped part way), but they are
+       reported: whenever a task sets a new worst time that is over its budget, it says so
+       on the serial (see setSerial()).  So each task reports at most a few times, unless it
+       keeps getting slower.
+     * if there's no room for a task (more than SCHED_MAX_TASKS), addTask() says so on the
+       serial, and printStats() keeps saying so
+
+   A task returns true if it did some work (and so might have more to do).  There is no
+   need to handle millis() wrap-around in the tasks; the scheduler does it.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _LoopScheduler_h
+#define _LoopScheduler_h
+
+#include <Arduino.h>
+#include <Print.h>
+
+#define SCHED_MAX_TASKS (16)   //the same in every sketch's copy of this file
+
+class LoopScheduler {
+  public:
+    typedef bool (*TaskFcn_t)(void);
+    LoopScheduler(void) {};
+
+    void setSerial(Print *_serial_ptr) { serial_ptr = _serial_ptr; }  //for the warnings.  NULL for none.
+
+    //returns the task index, or -1 (and a warning) if there's no room
+    int addTask(const char *name, TaskFcn_t fcn, unsigned long period_msec, unsigned long budget_usec) {
+      if (n_tasks >= SCHED_MAX_TASKS) {
+        n_rejected++;
+        if (serial_ptr) { serial_ptr->print("LoopScheduler: ERROR: no room for task "); serial_ptr->print(name); serial_ptr->println(".  Raise SCHED_MAX_TASKS."); }
+        return -1;
+      }
+      Task_t &t = tasks[n_tasks];
+      t.name = name; t.fcn = fcn; t.period_msec = period_msec; t.budget_usec = budget_usec;
+      t.last_run_msec = millis();
+      return n_tasks++;
+    }
+
+    //the given task jumps the line (up to max_repeats times per pass) whenever is_urgent() is true
+    void setUrgentTask(int task_ind, TaskFcn_t _is_urgent, int _max_repeats) {
+      urgent_ind = task_ind; is_urgent = _is_urgent; max_urgent_repeats = max(1, _max_repeats);
+    }
+    void enableSleep(bool state) { sleep_enabled = state; }
+
+    //call this (and only this) from loop()
+    void run(void) {
+      bool did_work = false;
+
+      //service the urgent task first if it is falling behind
+      if ((urgent_ind >= 0) && is_urgent) {
+        for (int k = 0; (k < max_urgent_repeats) && is_urgent(); k++) {
+          n_urgent++;
+          if (!runTask(urgent_ind)) break;
+          did_work = true;
+        }
+      }
+
+      //then everyone else, in order
+      for (int i = 0; i < n_tasks; i++) {
+        Task_t &t = tasks[i];
+        if (t.period_msec > 0) {
+          unsigned long since_msec = millis() - t.last_run_msec;  //unsigned math handles wrap-around
+          if (since_msec < t.period_msec) continue;
+          if (since_msec >= 2 * t.period_msec) t.n_late++;
+          t.last_run_msec = millis();
+        }
+        if (runTask(i)) did_work = true;
+      }
+
+      //nothing to do?  Then sleep until the next interrupt.
+      if (!did_work && sleep_enabled) {
+        n_sleeps++;
+        asm(" WFI");
+      }
+      n_passes++;
+    }
+
+    void printStats(Print *p) {
+      p->print("Scheduler: passes = "); p->print(n_passes);
+      p->print(", slept = "); p->print(n_sleeps);
+      p->print(", urgent = "); p->println(n_urgent);
+      if (n_rejected > 0) { p->print("  ERROR: "); p->print(n_rejected); p->println(" task(s) didn't fit and never run.  Raise SCHED_MAX_TASKS."); }
+      for (int i = 0; i < n_tasks; i++) {
+        Task_t &t = tasks[i];
+        p->print("  "); p->print(t.name);
+        p->print(": runs = "); p->print(t.n_runs);
+        p->print(", max us = "); p->print(t.max_usec);
+        p->print(" (budget "); p->print(t.budget_usec);
+        p->print("), over budget = "); p->print(t.n_overruns);
+        p->print(", late = "); p->println(t.n_late);
+      }
+    }
+    void resetStats(void) {
+      n_passes = 0; n_sleeps = 0; n_urgent = 0;
+      for (int i = 0; i < n_tasks; i++) {
+        tasks[i].n_runs = 0; tasks[i].max_usec = 0; tasks[i].n_overruns = 0; tasks[i].n_late = 0;
+      }
+    }
+
+  private:
+    struct Task_t {
+      const char *name;
+      TaskFcn_t fcn;
+      unsigned long period_msec, budget_usec, last_run_msec;
+      unsigned long n_runs = 0, max_usec = 0, n_overruns = 0, n_late = 0;
+    };
+    Task_t tasks[SCHED_MAX_TASKS];
+    int n_tasks = 0, n_rejected = 0;
+    Print *serial_ptr = &Serial;
+    int urgent_ind = -1, max_urgent_repeats = 4;
+    TaskFcn_t is_urgent = NULL;
+    bool sleep_enabled = true;
+    unsigned long n_passes = 0, n_sleeps = 0, n_urgent = 0;
+
+    bool runTask(int i) {
+      Task_t &t = tasks[i];
+      unsigned long start_usec = micros();
+      bool did_work = t.fcn();
+      unsigned long dt_usec = micros() - start_usec;
+      t.n_runs++;
+      if (dt_usec > t.budget_usec) {
+        t.n_overruns++;
+        if ((dt_usec > t.max_usec) && serial_ptr) {  //a new worst
+          serial_ptr->print("LoopScheduler: "); serial_ptr->print(t.name); serial_ptr->print(" took "); serial_ptr->print(dt_usec);
+          serial_ptr->print(" us (budget "); serial_ptr->print(t.budget_usec); serial_ptr->println(" us)");
+        }
+      }
+      if (dt_usec > t.max_usec) t.max_usec = dt_usec;
+      return did_work;
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+
+/*
+   PresetStore
+
+   Purpose: Keep a few named presets (input, gains, mixer mode, algorithm, binaural mode, the
+     BT ducking, and the compressor settings) in EEPROM, so that the tweaks made from the app or the serial monitor survive
+     a reboot.  One of them is the boot preset, which setup() restores before the audio is
+     un-muted.
+
+   Layout (after the audio pool size record of AudioMemoryProfiler, which is at address 0):
+       header: magic, version, boot preset, CRC
+       slots:  PRESET_N_SLOTS x (Preset_t, CRC)
+   Each slot has its own CRC-16 (CCITT), so a bad slot doesn't lose the others.  The version
+   is folded into the CRC too, so when Preset_t changes (bump PRESET_VERSION!), the old slots
+   just read as empty and the sketch falls back to its built-in presets.
+
+   EEPROM.put() only writes the bytes that changed, so saving the same preset again is free.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _PresetStore_h
+#define _PresetStore_h
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#define PRESET_EEPROM_ADDR (16)     //leave room for the audio pool size (see AudioMemoryProfiler.h)
+#define PRESET_MAGIC (0x5054)
+#define PRESET_VERSION (2)          //bump this whenever Preset_t changes
+#define PRESET_N_SLOTS (4)
+#define PRESET_NAME_LEN (12)
+#define PRESET_N_COMP (3)           //fast, slow, multi-band
+
+struct Preset_t {
+  char name[PRESET_NAME_LEN];
+  int8_t input_source, audio, alg, nr_on, nr_config, binaural_on, duck_on;
+  float input_gain_dB, output_volume_dB, duck_depth_dB;
+  float knee_dBSPL[PRESET_N_COMP], attack_msec[PRESET_N_COMP], release_msec[PRESET_N_COMP];
+};
+
+class PresetStore {
+  public:
+    PresetStore(void) {};
+
+    //read the header.  Returns false if there is no (current) preset store in the EEPROM.
+    bool begin(void) {
+      Header_t h;
+      EEPROM.get(PRESET_EEPROM_ADDR, h);
+      valid = (h.magic == PRESET_MAGIC) && (h.version == PRESET_VERSION) && (h.crc == crc16((const uint8_t *)&h, sizeof(h) - sizeof(h.crc)));
+      boot_preset = (valid && (h.boot_preset < PRESET_N_SLOTS)) ? h.boot_preset : 0;
+      return valid;
+    }
+
+    //returns false (and leaves p alone) if the slot is empty or corrupt
+    bool load(int ind, Preset_t &p) {
+      if (!valid || (ind < 0) || (ind >= PRESET_N_SLOTS)) return false;
+      Slot_t s;
+      EEPROM.get(slotAddress(ind), s);
+      if (s.crc != crc16((const uint8_t *)&s.preset, sizeof(s.preset))) return false;
+      p = s.preset;
+      p.name[PRESET_NAME_LEN - 1] = '\0';
+      return true;
+    }
+    bool save(int ind, const Preset_t &p) {
+      if ((ind < 0) || (ind >= PRESET_N_SLOTS)) return false;
+      if (!valid) writeHeader();  //first save (or a new version).  The other slots stay empty.
+      Slot_t s;
+      memset(&s, 0, sizeof(s));  //no random padding bytes going into the CRC
+      s.preset = p;
+      s.crc = crc16((const uint8_t *)&s.preset, sizeof(s.preset));
+      EEPROM.put(slotAddress(ind), s);
+      return true;
+    }
+
+    int getBootPreset(void) { return boot_preset; }
+    void setBootPreset(int ind) {
+      if ((ind < 0) || (ind >= PRESET_N_SLOTS) || (valid && (ind == boot_preset))) return;
+      boot_preset = ind;
+      writeHeader();
+    }
+
+  private:
+    struct Header_t { uint16_t magic; uint8_t version, boot_preset; uint16_t crc; };
+    struct Slot_t { Preset_t preset; uint16_t crc; };
+    bool valid = false;
+    int boot_preset = 0;
+
+    int slotAddress(int ind) { return PRESET_EEPROM_ADDR + sizeof(Header_t) + ind * sizeof(Slot_t); }
+    void writeHeader(void) {
+      Header_t h = {PRESET_MAGIC, PRESET_VERSION, (uint8_t)boot_preset, 0};
+      h.crc = crc16((const uint8_t *)&h, sizeof(h) - sizeof(h.crc));
+      EEPROM.put(PRESET_EEPROM_ADDR, h);
+      valid = true;
+    }
+
+    //CRC-16/CCITT, seeded with the version so that old slots don't pass
+    static uint16_t crc16(const uint8_t *data, int n) {
+      uint16_t crc = 0xFFFF ^ PRESET_VERSION;
+      for (int i = 0; i < n; i++) {
+        crc ^= ((uint16_t)data[i]) << 8;
+        for (int b = 0; b < 8; b++) crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+      }
+      return crc;
+    }
+};
+
+#endif
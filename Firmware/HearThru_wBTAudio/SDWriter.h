@@ -41,9 +41,18 @@ class SDWriter : public Print
     void setup(void) {
       init();
     }
-    virtual void init() {
-      if (!sd.begin()) sd.errorHalt(serial_ptr, "SDWriter: begin failed");
+    //the card is only started once, however many SDWriters there are.  With no card (or a
+    //bad one), it says so and returns false, and the next call tries again.
+    virtual bool init() {
+      if (sd_began()) return true;
+      if (!sd.begin()) {
+        if (serial_ptr) serial_ptr->println("SDWriter: begin failed (is there an SD card?)");
+        return false;
+      }
+      sd_began() = true;
+      return true;
     }
+    bool exists(const char *fname) { return sd_began() && sd.exists(fname); }
 
     bool open(char *fname) {
       if (sd.exists(fname)) {  //maybe this isn't necessary when using the O_TRUNC flag below
@@ -151,8 +160,11 @@ class SDWriter : public Print
     };
 
   protected:
-    //SdFatSdio sd; //slower
-    SdFatSdioEX sd; //faster
+    //One card, so one volume for all of the SDWriters (eg, the audio recorder and the
+    //dose logger).  Each of them has its own file on it.
+    static SdFatSdioEX &sharedSD(void) { static SdFatSdioEX the_sd; return the_sd; }  //SdFatSdio is slower
+    static bool &sd_began(void) { static bool began = false; return began; }
+    SdFatSdioEX &sd = sharedSD();
     SdFile_Gre file;
     boolean flagPrintElapsedWriteTime = false;
     elapsedMicros usec;
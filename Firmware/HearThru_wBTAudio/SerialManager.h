@@ -6,6 +6,7 @@
 
 //Extern variables
 extern Tympan myTympan;
+extern SerialTxPort serialUI;
 extern AudioSDWriter_F32 audioSDWriter;
 extern float vol_knob_gain_dB;
 extern float input_gain_dB;
@@ -19,12 +20,13 @@ extern const int AUDIO_STEREO;
 extern const int ALG_LINEAR;
 extern const int ALG_FASTCOMP;
 extern const int ALG_SLOWCOMP;
+extern const int ALG_MULTIBAND;
 
 //Extern Functions
 extern void setConfiguration(int);
 extern void togglePrintMemoryAndCPU(void);
 extern void setPrintMemoryAndCPU(bool);
-//extern void togglePrintAveSignalLevels(bool);
+extern void togglePrintAveSignalLevels(bool);
 //extern void beginRecordingProcess(void);
 //extern void stopRecording(void);
 extern void incrementInputGain(float);
@@ -35,8 +37,88 @@ extern void setAudioStereo(void);
 extern void setAudioLinear(void);
 extern void setAudioFastComp(void);
 extern void setAudioSlowComp(void);
+extern void setAudioMultiBand(void);
 extern void scaleCompressionSpeed(float,bool);
 extern void incrementKneepoint(float,bool);
+extern void startLatencyTest(bool);
+extern void benchmarkBlockSizes(void);
+extern void benchmarkNoiseReduction(void);
+extern void setNoiseReduction(bool);
+extern void stepNoiseReductionConfig(void);
+extern void setInputGain(float);
+extern void setKneepoint(float);
+extern float getKneepoint(void);
+extern void setAttackRelease(float,float);
+extern float getAttack_msec(void);
+extern float getRelease_msec(void);
+extern bool setAlgorithm(int);
+extern bool setAudioMode(int);
+extern bool isNoiseReductionEnabled(void);
+extern void printSchedulerStats(bool);
+extern void startMemoryProfile(void);
+extern void saveMemoryProfile(void);
+extern void loadPreset(int);
+extern void saveCurrentPreset(void);
+extern void printPresets(void);
+extern void startDoseLogging(void);
+extern void stopDoseLogging(void);
+extern void printExposure(bool);
+extern void setImpulseClamp(bool);
+extern void toggleBinauralMode(void);
+extern bool isBinauralMode(void);
+extern void togglePrintBinauralCues(void);
+extern void benchmarkBinaural(void);
+extern void stepBeamformerMode(void);
+extern void benchmarkBeamformer(void);
+extern void toggleFeedbackCancel(void);
+extern void toggleBTDucking(void);
+extern void printBTStatus(void);
+
+//Binary protocol.  A frame is:
+//    SYNC, LEN, RECORDS (LEN bytes), CHECKSUM (XOR of the LEN bytes of RECORDS)
+//and RECORDS is one or more: TYPE, NBYTES, DATA (NBYTES bytes).  Multi-byte values are
+//little-endian and floats are IEEE float32.  SYNC is not a printable character, so a
+//frame can never be confused with the single-character commands, which still work.
+//Every frame gets one frame back: an ACK record followed by a STATE record.
+#define BIN_SYNC            (0xA5)
+#define BIN_MAX_LEN         (64)
+#define BIN_TIMEOUT_MSEC    (200)    //give up on a partial frame after this long
+//request record types
+#define BIN_REC_CHARS       (0x01)   //DATA: one or more single-character commands
+#define BIN_REC_INPUT_GAIN  (0x10)   //DATA: float, dB
+#define BIN_REC_KNEE        (0x11)   //DATA: float, dB SPL (for the current algorithm)
+#define BIN_REC_ATT_REL     (0x12)   //DATA: float, float, msec (for the current algorithm)
+#define BIN_REC_ALG         (0x13)   //DATA: uint8, ALG_LINEAR etc
+#define BIN_REC_AUDIO       (0x14)   //DATA: uint8, AUDIO_MUTE etc
+#define BIN_REC_INPUT       (0x15)   //DATA: uint8, INPUT_PCBMICS etc
+#define BIN_REC_GET_STATE   (0x20)   //no DATA.  (the state is always sent anyway)
+//reply record types
+#define BIN_REC_ACK         (0x40)   //DATA: uint8 n_records_ok, uint8 n_records_bad
+#define BIN_REC_STATE       (0x41)   //DATA: int8 input, audio, alg, recording, nr_on;  float input_gain, knee, attack, release
+
+extern bool enable_printCPUandMemory;
+
+//Every button in the app whose state we report.  The state comes from a function so that
+//the table can be a compile-time constant and nothing needs to be built at run time.
+typedef bool (*ButtonIsOn_t)(void);
+struct GUIButton_t { const char *id; ButtonIsOn_t isOn; };
+const GUIButton_t guiButtons[] = {
+  {"mute",          []() { return myState.audio == AUDIO_MUTE; }},
+  {"mono",          []() { return myState.audio == AUDIO_MONO; }},
+  {"stereo",        []() { return myState.audio == AUDIO_STEREO; }},
+  {"linear",        []() { return myState.alg == ALG_LINEAR; }},
+  {"fast",          []() { return myState.alg == ALG_FASTCOMP; }},
+  {"slow",          []() { return myState.alg == ALG_SLOWCOMP; }},
+  {"multiband",     []() { return myState.alg == ALG_MULTIBAND; }},
+  {"binaural",      []() { return isBinauralMode(); }},
+  {"configPCB",     []() { return myState.input_source == INPUT_PCBMICS; }},
+  {"configHeadset", []() { return myState.input_source == INPUT_MICJACK; }},
+  {"nrOn",          []() { return isNoiseReductionEnabled(); }},
+  {"cpuStart",      []() { return enable_printCPUandMemory; }},
+  {"recordStart",   []() { return audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING; }},
+};
+const int n_guiButtons = sizeof(guiButtons) / sizeof(guiButtons[0]);
+static_assert(n_guiButtons <= 32, "guiButtons[] has more entries than the bits in sent_button_states");
 
 //now, define the Serial Manager class
 class SerialManager {
@@ -44,62 +126,122 @@ class SerialManager {
     SerialManager(void) {  };
 
     void respondToByte(char c);
+    void respondToChar(char c);
     void printHelp(void);
     void printFullGUIState(void);
+    void sendChangedGUIState(void);
     void printGainSettings(void);
-    void setButtonState(String btnId, bool newState);
+    void setButtonState(const char *btnId, bool newState);
+    bool isInBinaryFrame(void) { return (bin_state != BIN_STATE::IDLE) && ((millis() - bin_start_millis) <= BIN_TIMEOUT_MSEC); }
     float gainIncrement_dB = 2.5f;
     float compScaleFactor = 0.5; //twice as fast
     float kneeIncrement_dB = 5.0f;
 
   private:
+    uint32_t sent_button_states = 0;  //one bit per entry in guiButtons[]
+    bool sent_any_button_states = false;
+    void sendButtonStates(bool force_all);
 
+    //binary protocol
+    enum class BIN_STATE { IDLE, LEN, RECORDS, CHECKSUM };
+    BIN_STATE bin_state = BIN_STATE::IDLE;
+    uint8_t bin_buff[BIN_MAX_LEN];
+    int bin_len = 0, bin_ind = 0;
+    uint8_t bin_checksum = 0;
+    unsigned long bin_start_millis = 0;
+    bool respondToBinaryByte(uint8_t b);
+    void processBinaryFrame(void);
+    bool processBinaryRecord(uint8_t type, const uint8_t *data, int n);
+    void sendBinaryReply(int n_ok, int n_bad);
+    float readFloat(const uint8_t *data) { float val; memcpy(&val, data, sizeof(val)); return val; }
+    int writeFloat(uint8_t *data, float val) { memcpy(data, &val, sizeof(val)); return sizeof(val); }
 };
 
 void SerialManager::printHelp(void) {
-  myTympan.println();
-  myTympan.println("SerialManager Help: Available Commands:");
-  //myTympan.println("   J: Print the JSON config object, for the Tympan Remote app");
-  //myTympan.println("    j: Print the button state for the Tympan Remote app");
-  myTympan.println("   C: Toggle printing of CPU and Memory usage");
-  myTympan.println("   w: Switch Input to PCB Mics");
-  myTympan.println("   W: Switch Input to Headset Mics");
-  myTympan.print  ("   i: Input: Increase gain by "); myTympan.print(gainIncrement_dB); myTympan.println(" dB");
-  myTympan.print  ("   I: Input: Decrease gain by "); myTympan.print(gainIncrement_dB); myTympan.println(" dB");
-  myTympan.println("   q: Input: Mute");
-  myTympan.println("   m: Input: Mono");
-  myTympan.println("   M: Input: Stereo");
-  myTympan.println("   l: Processing: linear.");
-  myTympan.println("   k: Processing: Fast-compression.");
-  myTympan.println("   K: Processing: Slow-compression.");
-  myTympan.println("   a: Compression: make 2x faster.");
-  myTympan.println("   A: Compression: make 2x slower.");
-  myTympan.println("   b: Compression: increase kneepoint.");
-  myTympan.println("   B: Compression: decrease kneebpoint.");
-  myTympan.println("   p: SD: prepare for recording");
-  myTympan.println("   r: SD: begin recording");
-  myTympan.println("   s: SD: stop recording");
-  myTympan.println("   h: Print this help");
+  serialUI.println();
+  serialUI.println("SerialManager Help: Available Commands:");
+  //serialUI.println("   J: Print the JSON config object, for the Tympan Remote app");
+  //serialUI.println("    j: Print the button state for the Tympan Remote app");
+  serialUI.println("   C: Toggle printing of CPU and Memory usage");
+  serialUI.println("   g: Toggle printing of signal levels (dBFS)");
+  serialUI.println("   G: Toggle printing of signal levels (dB SPL)");
+  serialUI.println("   w: Switch Input to PCB Mics");
+  serialUI.println("   W: Switch Input to Headset Mics");
+  serialUI.print  ("   i: Input: Increase gain by "); serialUI.print(gainIncrement_dB); serialUI.println(" dB");
+  serialUI.print  ("   I: Input: Decrease gain by "); serialUI.print(gainIncrement_dB); serialUI.println(" dB");
+  serialUI.println("   q: Input: Mute");
+  serialUI.println("   m: Input: Mono");
+  serialUI.println("   M: Input: Stereo");
+  serialUI.println("   l: Processing: linear.");
+  serialUI.println("   k: Processing: Fast-compression.");
+  serialUI.println("   K: Processing: Slow-compression.");
+  serialUI.println("   n: Processing: Multi-band compression.");
+  serialUI.println("   L: Processing: Binaural mode on/off (stereo, linked gains: keeps the ITD and ILD)");
+  serialUI.println("   j: Binaural: Toggle printing of the interaural cues (mics and ears)");
+  serialUI.println("   Z: Binaural: benchmark the cue measurement (not while recording)");
+  serialUI.println("   F: Beamformer: next mode (off, delay-and-sum, cardioid, adaptive null)");
+  serialUI.println("   H: Beamformer: benchmark the CPU of each mode (not while recording)");
+  serialUI.println("   a: Compression: make 2x faster.");
+  serialUI.println("   A: Compression: make 2x slower.");
+  serialUI.println("   b: Compression: increase kneepoint.");
+  serialUI.println("   B: Compression: decrease kneebpoint.");
+  serialUI.println("   N: Feedback Cancel: on/off");
+  serialUI.println("   P: BT Audio: ducking of the hear-thru on/off");
+  serialUI.println("   S: BT Audio: print the connection state");
+  serialUI.println("   e: Noise Reduction: on");
+  serialUI.println("   E: Noise Reduction: off");
+  serialUI.println("   f: Noise Reduction: next FFT/hop/decimation setting");
+  serialUI.println("   v: Impulse Clamp: on");
+  serialUI.println("   V: Impulse Clamp: off");
+  serialUI.println("   t: Latency: measure loopback (output to input)");
+  serialUI.println("   T: Latency: measure processing (graph only)");
+  serialUI.println("   R: Latency: benchmark the CPU of the processing, and the limiter per block, at 16 to 128 sample blocks, and the noise reduction decimated by 1, 2, 4 (not while recording)");
+  serialUI.println("   1-4: Presets: load (and use from the next boot)");
+  serialUI.println("   o: Presets: save the current settings into the current preset");
+  serialUI.println("   O: Presets: list them, and the boot time");
+  serialUI.println("   u: Profile the audio memory (steps through the algorithms)");
+  serialUI.println("   U: Save the profiled audio memory size (used from the next boot)");
+  serialUI.println("   y: Print loop() task timing");
+  serialUI.println("   Y: Print loop() task timing, then reset it");
+  serialUI.println("   x: Exposure: print the noise dose (mics and ears)");
+  serialUI.println("   X: Exposure: print the noise dose, then reset it");
+  serialUI.println("   d: SD: start logging the exposure (one record per second)");
+  serialUI.println("   D: SD: stop logging the exposure");
+  serialUI.println("   p: SD: prepare for recording");
+  serialUI.println("   r: SD: begin recording");
+  serialUI.println("   s: SD: stop recording");
+  serialUI.println("   h: Print this help");
+  serialUI.println("   (binary frames starting with 0xA5 are also accepted.  See SerialManager.h)");
 
 
-  myTympan.println();
+  serialUI.println();
 }
 
 
-//switch yard to determine the desired action
+//all incoming bytes come here.  Binary frames are pulled out, the rest are single-character commands.
 void SerialManager::respondToByte(char c) {
+  if (!respondToBinaryByte((uint8_t)c)) respondToChar(c);
+  sendChangedGUIState();  //only sends the buttons whose state actually changed
+}
+
+//switch yard to determine the desired action
+void SerialManager::respondToChar(char c) {
   switch (c) {
     case 'h': case '?':
       printHelp(); break;
     case 'c':
-      myTympan.println("Received: start CPU reporting");
+      serialUI.println("Received: start CPU reporting");
       setPrintMemoryAndCPU(true);
-      setButtonState("cpuStart",true);
       break;
     case 'C':
-      myTympan.println("Received: stop CPU reporting");
+      serialUI.println("Received: stop CPU reporting");
       setPrintMemoryAndCPU(false);
-      setButtonState("cpuStart",false);
+      break;
+    case 'g':
+      togglePrintAveSignalLevels(false);
+      break;
+    case 'G':
+      togglePrintAveSignalLevels(true);
       break;
     case 'i':
       incrementInputGain(gainIncrement_dB);
@@ -126,74 +268,142 @@ void SerialManager::respondToByte(char c) {
       incrementKneepoint(-kneeIncrement_dB,true);   //the "true" is to print out the new values
       break;    
     case 'q':
-      myTympan.println("Received: Muting");
+      serialUI.println("Received: Muting");
       setAudioMute();
-      setButtonState("mute",true);delay(20);
-      setButtonState("mono",false);delay(20);
-      setButtonState("stereo",false);
       break;
     case 'm':
-      myTympan.println("Received: Mono");
+      serialUI.println("Received: Mono");
       setAudioMono();
-      setButtonState("mute",false);delay(20);
-      setButtonState("mono",true);delay(20);
-      setButtonState("stereo",false);
       break;      
     case 'M':
-      myTympan.println("Received: Stereo");
+      serialUI.println("Received: Stereo");
       setAudioStereo();
-      setButtonState("mute",false);delay(20);
-      setButtonState("mono",false);delay(20);
-      setButtonState("stereo",true);
       break;
     case  'l':
-      myTympan.println("Received: Linear processing");
+      serialUI.println("Received: Linear processing");
       setAudioLinear();
-      setButtonState("linear",true);delay(20);
-      setButtonState("fast",false);delay(20);
-      setButtonState("slow",false);
       break;
     case 'k':
-      myTympan.println("Received: Fast compression");
+      serialUI.println("Received: Fast compression");
       setAudioFastComp();
-      setButtonState("linear",false);delay(20);
-      setButtonState("fast",true);delay(20);
-      setButtonState("slow",false);
       break;
     case 'K':
-      myTympan.println("Received: Slow compression");
+      serialUI.println("Received: Slow compression");
       setAudioSlowComp();
-      setButtonState("linear",false);delay(20);
-      setButtonState("fast",false);delay(20);
-      setButtonState("slow",true);
+      break;
+    case 'n':
+      serialUI.println("Received: Multi-band compression");
+      setAudioMultiBand();
       break;
     case 'w':
-      myTympan.println("Received: PCB Mics");
+      serialUI.println("Received: PCB Mics");
       setConfiguration(INPUT_PCBMICS);
-      setButtonState("configPCB",true);
-      setButtonState("configHeadset",false);
       break;
     case 'W':
-      myTympan.println("Recevied: Headset Mics.");
+      serialUI.println("Recevied: Headset Mics.");
       setConfiguration(INPUT_MICJACK);
-      setButtonState("configPCB",false);
-      setButtonState("configHeadset",true);
+      break;
+    case 'e':
+      serialUI.println("Received: Noise Reduction on");
+      setNoiseReduction(true);
+      break;
+    case 'E':
+      serialUI.println("Received: Noise Reduction off");
+      setNoiseReduction(false);
+      break;
+    case 'f':
+      stepNoiseReductionConfig();
+      break;
+    case 'v':
+      setImpulseClamp(true);
+      break;
+    case 'V':
+      setImpulseClamp(false);
+      break;
+    case 'L':
+      toggleBinauralMode();
+      break;
+    case 'j':
+      togglePrintBinauralCues();
+      break;
+    case 'Z':
+      benchmarkBinaural();
+      break;
+    case 'F':
+      stepBeamformerMode();
+      break;
+    case 'H':
+      benchmarkBeamformer();
+      break;
+    case 'S':
+      printBTStatus();
+      break;
+    case 'P':
+      toggleBTDucking();
+      break;
+    case 'N':
+      toggleFeedbackCancel();
+      break;
+    case 't':
+      serialUI.println("Received: measure loopback latency");
+      startLatencyTest(false);
+      break;
+    case 'T':
+      serialUI.println("Received: measure processing latency");
+      startLatencyTest(true);
+      break;
+    case 'R':
+      benchmarkBlockSizes();
+      benchmarkNoiseReduction();
+      break;
+    case '1': case '2': case '3': case '4':
+      loadPreset(c - '1');
+      break;
+    case 'o':
+      saveCurrentPreset();
+      break;
+    case 'O':
+      printPresets();
+      break;
+    case 'u':
+      startMemoryProfile();
+      break;
+    case 'U':
+      saveMemoryProfile();
+      break;
+    case 'y':
+      printSchedulerStats(false);
+      break;
+    case 'Y':
+      printSchedulerStats(true);
+      break;
+    case 'x':
+      printExposure(false);
+      break;
+    case 'X':
+      printExposure(true);
+      break;
+    case 'd':
+      serialUI.println("Received: start exposure logging");
+      startDoseLogging();
+      break;
+    case 'D':
+      serialUI.println("Received: stop exposure logging");
+      stopDoseLogging();
       break;
     case 'p':
-      myTympan.println("Received: prepare SD for recording");
+      serialUI.println("Received: prepare SD for recording");
       //prepareSDforRecording();
       audioSDWriter.prepareSDforRecording();
       break;
     case 'r':
-      myTympan.println("Received: begin SD recording");
+      serialUI.println("Received: begin SD recording");
       //beginRecordingProcess();
       audioSDWriter.startRecording();
-      setButtonState("recordStart",true);
       break;
     case 's':
-      myTympan.println("Received: stop SD recording");
+      serialUI.println("Received: stop SD recording");
       audioSDWriter.stopRecording();
-      setButtonState("recordStart",false);
       break;
     case 'J':
       {
@@ -204,15 +414,17 @@ void SerialManager::respondToByte(char c) {
         // Please don't put commas or colons in your ID strings!
         // The 'icon' is how the device appears in the app - could be an icon, could be a pic of the device.  Put the
         // image in the TympanRemote app in /src/assets/devIcon/ and set 'icon' to the filename.
-        char jsonConfig[] = "JSON={"
+        static const char jsonConfig[] = "JSON={"
           "'icon':'tympan.png',"
           "'pages':["
             "{'title':'Presets','cards':["
               "{'name':'Audio Type','buttons':[{'label': 'Mute', 'cmd': 'q', 'id': 'mute'},{'label': 'Mono', 'cmd': 'm', 'id': 'mono'},{'label': 'Stereo', 'cmd': 'M', 'id': 'stereo'}]},"
-              "{'name':'Audio Processing','buttons':[{'label': 'Linear','cmd': 'l', 'id': 'linear'},{'label': 'Fast-Comp','cmd': 'k', 'id': 'fast'},{'label': 'Slow-Comp','cmd': 'K', 'id': 'slow'}]}"
+              "{'name':'Audio Processing','buttons':[{'label': 'Linear','cmd': 'l', 'id': 'linear'},{'label': 'Fast-Comp','cmd': 'k', 'id': 'fast'},{'label': 'Slow-Comp','cmd': 'K', 'id': 'slow'},{'label': 'Multi-Band','cmd': 'n', 'id': 'multiband'},{'label': 'Binaural','cmd': 'L', 'id': 'binaural'}]},"
+              "{'name':'Saved Presets','buttons':[{'label': '1','cmd': '1'},{'label': '2','cmd': '2'},{'label': '3','cmd': '3'},{'label': '4','cmd': '4'},{'label': 'Save','cmd': 'o'}]}"
             "]},"
             "{'title':'Tuner','cards':["
               "{'name':'Select Input','buttons':[{'label': 'Headset Mics', 'cmd': 'W', 'id':'configHeadset'},{'label': 'PCB Mics', 'cmd': 'w', 'id': 'configPCB'}]},"
+              "{'name':'Noise Reduction','buttons':[{'label': 'Off', 'cmd': 'E'},{'label': 'On', 'cmd': 'e', 'id':'nrOn'},{'label': 'Next Setting', 'cmd': 'f'}]},"
               "{'name':'Input Gain', 'buttons':[{'label': 'Less', 'cmd' :'I'},{'label': 'More', 'cmd': 'i'}]},"
               "{'name':'Record Mics to SD Card','buttons':[{'label': 'Prepare', 'cmd': 'p'},{'label': 'Start', 'cmd': 'r', 'id':'recordStart'},{'label': 'Stop', 'cmd': 's'}]},"
               "{'name':'CPU Reporting', 'buttons':[{'label': 'Start', 'cmd' :'c','id':'cpuStart'},{'label': 'Stop', 'cmd': 'C'}]},"
@@ -221,75 +433,144 @@ void SerialManager::respondToByte(char c) {
             "]}"                            
           "]"
         "}";
-        myTympan.println(jsonConfig);
-        delay(100);
+        serialUI.println(jsonConfig);
         printFullGUIState();
         break;
       }
   }
 }
 
+//send the state of every button (eg, when the app first connects)
 void SerialManager::printFullGUIState(void) {
-  switch (myState.audio) {
-    case (AUDIO_MUTE):
-      setButtonState("mute",true);delay(20);
-      setButtonState("mono",false);delay(20);
-      setButtonState("stereo",false);
-      break;
-    case (AUDIO_MONO):
-      setButtonState("mute",false);delay(20);
-      setButtonState("mono",true);delay(20);
-      setButtonState("stereo",false);
-      break;
-    case (AUDIO_STEREO):
-      setButtonState("mute",false);delay(20);
-      setButtonState("mono",false);delay(20);
-      setButtonState("stereo",true);
-      break;
+  sendButtonStates(true);
+}
+//send the state of only those buttons that changed since the last time
+void SerialManager::sendChangedGUIState(void) {
+  sendButtonStates(false);
+}
+void SerialManager::sendButtonStates(bool force_all) {
+  for (int i = 0; i < n_guiButtons; i++) {
+    bool state = guiButtons[i].isOn();
+    uint32_t bit = 1UL << i;
+    if (force_all || !sent_any_button_states || (((sent_button_states & bit) != 0) != state)) {
+      setButtonState(guiButtons[i].id, state);
+      if (state) { sent_button_states |= bit; } else { sent_button_states &= ~bit; }
+    }
   }
-  switch (myState.alg) {
-    case (ALG_LINEAR):
-      setButtonState("linear",true);delay(20);
-      setButtonState("fast",false);delay(20);
-      setButtonState("slow",false);
-      break;
-    case (ALG_FASTCOMP):
-      setButtonState("linear",false);delay(20);
-      setButtonState("fast",true);delay(20);
-      setButtonState("slow",false);
-      break;
-    case (ALG_SLOWCOMP):
-      setButtonState("linear",false);delay(20);
-      setButtonState("fast",false);delay(20);
-      setButtonState("slow",true);
-      break;
+  sent_any_button_states = true;
+}
+
+//returns true if the byte was consumed by the binary protocol
+bool SerialManager::respondToBinaryByte(uint8_t b) {
+  if ((bin_state != BIN_STATE::IDLE) && ((millis() - bin_start_millis) > BIN_TIMEOUT_MSEC)) {
+    bin_state = BIN_STATE::IDLE;  //stale partial frame.  Drop it.
   }
-  switch (myState.input_source) {
-    case (INPUT_PCBMICS):
-      setButtonState("configPCB",true); delay(20);
-      setButtonState("configHeadset",false);
+  switch (bin_state) {
+    case BIN_STATE::IDLE:
+      if (b != BIN_SYNC) return false;
+      bin_state = BIN_STATE::LEN; bin_start_millis = millis();
+      break;
+    case BIN_STATE::LEN:
+      if ((b == 0) || (b > BIN_MAX_LEN)) { bin_state = BIN_STATE::IDLE; break; }
+      bin_len = b; bin_ind = 0; bin_checksum = 0;
+      bin_state = BIN_STATE::RECORDS;
       break;
-    case (INPUT_MICJACK): 
-      setButtonState("configPCB",false); delay(20);
-      setButtonState("configHeadset",true);
+    case BIN_STATE::RECORDS:
+      bin_buff[bin_ind++] = b; bin_checksum ^= b;
+      if (bin_ind >= bin_len) bin_state = BIN_STATE::CHECKSUM;
+      break;
+    case BIN_STATE::CHECKSUM:
+      bin_state = BIN_STATE::IDLE;
+      if (b == bin_checksum) {
+        processBinaryFrame();
+      } else {
+        sendBinaryReply(0, 1);
+      }
       break;
   }
+  return true;
 }
 
-void SerialManager::printGainSettings(void) {
-  myTympan.print("Vol Knob = ");
-  myTympan.print(vol_knob_gain_dB, 1);
-  myTympan.print(", Input PGA = ");
-  myTympan.print(input_gain_dB, 1);
-  myTympan.println();
+void SerialManager::processBinaryFrame(void) {
+  int n_ok = 0, n_bad = 0, ind = 0;
+  while (ind + 2 <= bin_len) {
+    uint8_t type = bin_buff[ind], n = bin_buff[ind + 1];
+    if (ind + 2 + n > bin_len) { n_bad++; break; }  //truncated record
+    if (processBinaryRecord(type, bin_buff + ind + 2, n)) { n_ok++; } else { n_bad++; }
+    ind += 2 + n;
+  }
+  sendBinaryReply(n_ok, n_bad);
 }
 
-void SerialManager::setButtonState(String btnId, bool newState) {
-  if (newState) {
-    myTympan.println("STATE=BTN:" + btnId + ":1");
-  } else {
-    myTympan.println("STATE=BTN:" + btnId + ":0");
+bool SerialManager::processBinaryRecord(uint8_t type, const uint8_t *data, int n) {
+  switch (type) {
+    case BIN_REC_CHARS:
+      for (int i = 0; i < n; i++) respondToChar((char)data[i]);
+      return true;
+    case BIN_REC_INPUT_GAIN:
+      if (n != 4) return false;
+      setInputGain(readFloat(data));
+      return true;
+    case BIN_REC_KNEE:
+      if (n != 4) return false;
+      setKneepoint(readFloat(data));
+      return true;
+    case BIN_REC_ATT_REL:
+      if (n != 8) return false;
+      setAttackRelease(readFloat(data), readFloat(data + 4));
+      return true;
+    case BIN_REC_ALG:
+      if (n != 1) return false;
+      return setAlgorithm(data[0]);
+    case BIN_REC_AUDIO:
+      if (n != 1) return false;
+      return setAudioMode(data[0]);
+    case BIN_REC_INPUT:
+      if ((n != 1) || ((data[0] != INPUT_PCBMICS) && (data[0] != INPUT_MICJACK) && (data[0] != INPUT_LINEIN_SE))) return false;
+      setConfiguration(data[0]);
+      return true;
+    case BIN_REC_GET_STATE:
+      return true;
   }
+  return false;
+}
+
+//one frame holding the ACK and the full state, so the app never needs a series of replies
+void SerialManager::sendBinaryReply(int n_ok, int n_bad) {
+  uint8_t frame[BIN_MAX_LEN + 3];
+  int ind = 2;
+  frame[ind++] = BIN_REC_ACK; frame[ind++] = 2;
+  frame[ind++] = (uint8_t)min(n_ok, 255); frame[ind++] = (uint8_t)min(n_bad, 255);
+  frame[ind++] = BIN_REC_STATE; frame[ind++] = 5 + 4 * 4;
+  frame[ind++] = (uint8_t)myState.input_source;
+  frame[ind++] = (uint8_t)myState.audio;
+  frame[ind++] = (uint8_t)myState.alg;
+  frame[ind++] = (uint8_t)(audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+  frame[ind++] = (uint8_t)isNoiseReductionEnabled();
+  ind += writeFloat(frame + ind, input_gain_dB);
+  ind += writeFloat(frame + ind, getKneepoint());
+  ind += writeFloat(frame + ind, getAttack_msec());
+  ind += writeFloat(frame + ind, getRelease_msec());
+
+  frame[0] = BIN_SYNC; frame[1] = ind - 2;
+  uint8_t checksum = 0;
+  for (int i = 2; i < ind; i++) checksum ^= frame[i];
+  frame[ind++] = checksum;
+  serialUI.writeFrame(frame, ind);  //whole, so a 0x0A in it can't get it cut like a line
+}
+
+void SerialManager::printGainSettings(void) {
+  serialUI.print("Vol Knob = ");
+  serialUI.print(vol_knob_gain_dB, 1);
+  serialUI.print(", Input PGA = ");
+  serialUI.print(input_gain_dB, 1);
+  serialUI.println();
+}
+
+void SerialManager::setButtonState(const char *btnId, bool newState) {
+  serialUI.print("STATE=BTN:");
+  serialUI.print(btnId);
+  serialUI.println(newState ? ":1" : ":0");
 }
 
 #endif
@@ -0,0 +1,240 @@
+
+/*
+   SerialTxQueue
+
+   Purpose: Non-blocking transmit queues for the USB Serial and the BT Serial (Serial1).
+     Printing to Serial1 directly blocks once its small hardware buffer is full, and at
+     the BT baud rate that stalls loop() (and therefore the SD writing) for a long time.
+     Instead, everything printed goes into ring buffers here, and service() (from loop())
+     moves only as many bytes as each port can take right now, up to a per-call limit.
+
+   Priorities: there are three queues per port.  Commands to a device on the port (eg, the
+     BT module) go first, then UI traffic (command replies, button states, help, JSON), and
+     then TELEMETRY (CPU reports, levels, etc).  Each message (a line, a frame, a command)
+     goes out whole: once one has started, the port finishes it before anything else goes,
+     so a command can't land in the middle of a line that was only partly sent.
+
+   Drop policy: text is staged a line at a time, and only goes into the queue (where it can
+     be sent) at its '\n'.  A line printed in pieces is still all-or-nothing: if the queue
+     fills up partway, the pieces already staged are dropped too, and so is the rest of the
+     line, so the app never sees half of a line (or two lines run together).  So, text
+     without a '\n' at the end waits for one.  Binary frames (which can hold 0x0A bytes)
+     don't go through the line staging: they use writeFrame(), all-or-nothing, and they go
+     ahead of any line that is partly staged.  Drops are counted per queue.
+
+   Use a SerialTxPort (which is a Print) to print into the queue at a given priority.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _SerialTxQueue_h
+#define _SerialTxQueue_h
+
+#include <Arduino.h>
+#include <Print.h>
+
+#define SERIAL_PRIORITY_UI (0)
+#define SERIAL_PRIORITY_TELEMETRY (1)
+#define SERIAL_N_PRIORITY (2)
+#define SERIAL_N_PORTS (2)  //USB and BT
+#define SERIAL_PORT_USB (0)
+#define SERIAL_PORT_BT (1)
+#define SERIAL_FLUSH_TIMEOUT_MSEC (200)  //flush() gives up after this long with no progress
+#define SERIAL_MAX_MSG_ENDS (32)          //messages tracked per queue, so that each goes out whole
+
+//so that rings of different sizes can be serviced together
+class SerialTxRingBase {
+  public:
+    virtual int drainTo(Print *port, int max_bytes) = 0;
+    virtual bool isMidMessage(void) = 0;
+};
+
+//simple byte ring buffer.  Size must be a power of two.
+//  tail..head: committed, ready to send.  head..stage: the line being staged (not sent yet).
+template <int SIZE>
+class SerialTxRing : public SerialTxRingBase {
+  public:
+    int available(void) { return (int)((head - tail) & (SIZE - 1)); }
+    int space(void) { return SIZE - 1 - (int)((stage - tail) & (SIZE - 1)); }
+
+    //text.  Staged until the '\n', then committed all at once.  If it doesn't fit, the
+    //whole line goes (including what was already staged).
+    size_t push(const uint8_t *buf, size_t n) {
+      for (size_t i = 0; i < n; i++) {
+        const uint8_t c = buf[i];
+        if (dropping) {
+          n_dropped++;
+          if (c == '\n') dropping = false;
+          continue;
+        }
+        if (space() < 1) {
+          n_dropped += ((stage - head) & (SIZE - 1)) + 1;
+          stage = head;  //un-stage the start of the line
+          dropping = (c != '\n');
+          continue;
+        }
+        data[stage] = c;
+        stage = (stage + 1) & (SIZE - 1);
+        if (c == '\n') commit(stage);  //the line is whole.  It can go.
+      }
+      return n;  //pretend it was all written so that Print doesn't retry
+    }
+
+    //all-or-nothing, and not line-based: for binary frames and other whole messages.  It
+    //goes in ahead of any partly-staged line (which gets moved along behind it).
+    bool pushWhole(const uint8_t *buf, size_t n) {
+      if ((int)n > space()) { n_dropped += n; return false; }
+      const int n_staged = (int)((stage - head) & (SIZE - 1));
+      for (int i = n_staged - 1; i >= 0; i--) data[(head + n + i) & (SIZE - 1)] = data[(head + i) & (SIZE - 1)];
+      for (size_t i = 0; i < n; i++) data[(head + i) & (SIZE - 1)] = buf[i];
+      stage = (stage + n) & (SIZE - 1);
+      commit((head + n) & (SIZE - 1));
+      return true;
+    }
+
+    //write as much as possible (up to max_bytes) to the port without blocking, but only to
+    //the end of the current message.  isMidMessage() says that it hasn't got there yet.
+    int drainTo(Print *port, int max_bytes) {
+      int n_written = 0;
+      while (n_written < max_bytes) {
+        if (!isMidMessage()) {
+          if (n_ends == 0) break;  //all sent
+          drain_end = ends[0];     //the next message
+          for (int i = 1; i < n_ends; i++) ends[i - 1] = ends[i];
+          n_ends--;
+        }
+        int n_contig = min((int)((drain_end - tail) & (SIZE - 1)), max_bytes - n_written);
+        n_contig = min(n_contig, SIZE - tail);  //don't wrap within one write
+        port->write(data + tail, n_contig);
+        tail = (tail + n_contig) & (SIZE - 1);
+        n_written += n_contig;
+      }
+      return n_written;
+    }
+    bool isMidMessage(void) { return tail != drain_end; }
+    unsigned long getNDropped(void) { return n_dropped; }
+
+  private:
+    uint8_t data[SIZE];
+    int head = 0, tail = 0, stage = 0, drain_end = 0;  //only touched from loop(), never from an ISR
+    int ends[SERIAL_MAX_MSG_ENDS], n_ends = 0;          //where the committed messages end, oldest first
+    bool dropping = false;
+    unsigned long n_dropped = 0;
+
+    void commit(int end) {
+      head = end;
+      if (n_ends < SERIAL_MAX_MSG_ENDS) { ends[n_ends++] = end; } else { ends[n_ends - 1] = end; }  //too many: the last ones go as one
+    }
+};
+
+class SerialTxQueue {
+  public:
+    SerialTxQueue(Print *_usb, Print *_bt) {
+      ports[0] = _usb; ports[1] = _bt;
+      enabled[0] = true; enabled[1] = true;
+    }
+
+    size_t push(const uint8_t *buf, size_t n, int priority) {
+      for (int p = 0; p < SERIAL_N_PORTS; p++) {
+        if (!enabled[p]) continue;
+        if (priority == SERIAL_PRIORITY_UI) {
+          ui[p].push(buf, n);
+        } else {
+          telem[p].push(buf, n);
+        }
+      }
+      return n;
+    }
+
+    //a binary frame (or any other message that isn't a line), all-or-nothing, to every enabled port
+    size_t pushWhole(const uint8_t *buf, size_t n, int priority) {
+      for (int p = 0; p < SERIAL_N_PORTS; p++) {
+        if (!enabled[p]) continue;
+        if (priority == SERIAL_PRIORITY_UI) {
+          ui[p].pushWhole(buf, n);
+        } else {
+          telem[p].pushWhole(buf, n);
+        }
+      }
+      return n;
+    }
+
+    //a command to the device on one port (eg, the BT module), whole.  It goes even if that
+    //port is disabled for everything else.  isCommandSent() says when it has gone out.
+    bool pushCommand(int port, const uint8_t *buf, size_t n) {
+      if ((port < 0) || (port >= SERIAL_N_PORTS)) return false;
+      return cmd[port].pushWhole(buf, n);
+    }
+    bool isCommandSent(int port) { return cmd[port & 0x01].available() == 0; }
+
+    //call from loop().  Never blocks.  Returns number of bytes sent.
+    int service(void) {
+      int n_total = 0;
+      for (int p = 0; p < SERIAL_N_PORTS; p++) {
+        int budget = min(max_bytes_per_service[p], ports[p]->availableForWrite());
+        if (budget <= 0) continue;
+        SerialTxRingBase *rings[3] = { &cmd[p], &ui[p], &telem[p] };  //in priority order
+
+        //finish whatever message was started, before anything else goes
+        int n = 0;
+        for (int r = 0; r < 3; r++) {
+          if (rings[r]->isMidMessage()) { n += rings[r]->drainTo(ports[p], budget); break; }
+        }
+        //then, in priority order, as far as the budget goes (stopping at a message that doesn't finish)
+        for (int r = 0; r < 3; r++) {
+          if (budget - n <= 0) break;
+          if (rings[r]->isMidMessage()) break;
+          n += rings[r]->drainTo(ports[p], budget - n);
+          if (rings[r]->isMidMessage()) break;
+        }
+        n_total += n;
+      }
+      return n_total;
+    }
+
+    //for use only where blocking is OK (eg, the end of setup()).  Gives up if a port stops
+    //taking bytes (eg, nothing is draining the BT UART), rather than hanging.
+    void flush(void) {
+      unsigned long last_progress_msec = millis();
+      while (getNQueued(0) + getNQueued(1) > 0) {
+        if (service() > 0) {
+          last_progress_msec = millis();
+        } else if ((millis() - last_progress_msec) > SERIAL_FLUSH_TIMEOUT_MSEC) {
+          return;
+        }
+      }
+    }
+
+    void setMaxBytesPerService(int port, int n) { if ((port >= 0) && (port < SERIAL_N_PORTS)) max_bytes_per_service[port] = max(1, n); }
+    void setPortEnabled(int port, bool state) { if ((port >= 0) && (port < SERIAL_N_PORTS)) enabled[port] = state; }
+    unsigned long getNDropped(int priority) {
+      if (priority == SERIAL_PRIORITY_UI) return ui[0].getNDropped() + ui[1].getNDropped();
+      return telem[0].getNDropped() + telem[1].getNDropped();
+    }
+    int getNQueued(int port) { return cmd[port & 0x01].available() + ui[port & 0x01].available() + telem[port & 0x01].available(); }
+
+  private:
+    Print *ports[SERIAL_N_PORTS];
+    bool enabled[SERIAL_N_PORTS];
+    int max_bytes_per_service[SERIAL_N_PORTS] = {256, 64};  //USB is fast.  The BT UART is not.
+    SerialTxRing<128> cmd[SERIAL_N_PORTS];
+    SerialTxRing<4096> ui[SERIAL_N_PORTS];
+    SerialTxRing<512> telem[SERIAL_N_PORTS];
+};
+
+//this is what the rest of the code prints to
+class SerialTxPort : public Print {
+  public:
+    SerialTxPort(SerialTxQueue &_queue, int _priority) : queue(_queue), priority(_priority) {};
+    virtual size_t write(uint8_t b) { return queue.push(&b, 1, priority); }
+    virtual size_t write(const uint8_t *buf, size_t n) { return queue.push(buf, n, priority); }
+    using Print::write;
+    size_t writeFrame(const uint8_t *buf, size_t n) { return queue.pushWhole(buf, n, priority); }  //binary: not line-based
+    virtual void flush(void) { queue.flush(); }
+
+  private:
+    SerialTxQueue &queue;
+    int priority;
+};
+
+#endif
@@ -0,0 +1,197 @@
+
+/*
+   AudioAnalyzeSpectrum_F32
+
+   Purpose: A live spectrum of the ultrasound band, so that the carrier can be tuned by eye
+     instead of blindly: SPEC_N_BINS bins (64) from 15 to 48 kHz, about 10 times a second,
+     each quantized to 8 bits (see SpectrumStreamer for sending them to the app).
+
+   Analysis: 1024-point FFTs with a Hann window.  Both channels share one complex FFT (left
+     in the real part, right in the imaginary part), and |L|^2 + |R|^2 comes straight out of
+     bins k and N-k, so the two channels cost one FFT.  Each output bin is the strongest FFT
+     bin in its range (so a narrow tone shows up at its full level, however wide the output
+     bin is), averaged over the FFTs in the frame.  A full-scale sine reads 0 dBFS.
+   CPU: it doesn't look at every sample.  It takes up to setMaxFFTsPerFrame() FFTs per frame
+     (4, by default), spread out over the frame, and skips the blocks in between.  Each FFT
+     is done in the update() that fills its buffer.  While disabled, it costs nothing.
+   Quantization: code = (dB - SPEC_FLOOR_dBFS) / SPEC_STEP_dB, from 0 to 255.  So 0.5 dB
+     steps from -120 dBFS up to +7.5 dBFS.
+
+   The frames go into a small queue for loop().
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioAnalyzeSpectrum_F32_h
+#define _AudioAnalyzeSpectrum_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define SPEC_N_BINS (64)
+#define SPEC_FFT_SIZE (1024)        //must be a power of 4 (for the radix-4 FFT)
+#define SPEC_FLOOR_dBFS (-120.0f)   //code 0
+#define SPEC_STEP_dB (0.5f)         //per code
+#define SPEC_QUEUE_LEN (2)          //must be a power of two
+
+class AudioAnalyzeSpectrum_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:0 //this line used for automatic generation of GUI node
+  public:
+    struct Frame_t {
+      uint16_t seq;                 //counts up by one per frame (a gap means that loop() lost some)
+      uint8_t n_ffts;               //averaged into this frame
+      uint8_t code[SPEC_N_BINS];
+    };
+
+    AudioAnalyzeSpectrum_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_samples = settings.audio_block_samples;
+      arm_cfft_radix4_init_f32(&fft_inst, SPEC_FFT_SIZE, 0, 1);
+      for (int i = 0; i < SPEC_FFT_SIZE; i++) window[i] = 0.5f * (1.0f - cosf(2.0f * M_PI * ((float)i) / ((float)SPEC_FFT_SIZE)));  //periodic Hann
+      setFrequencyRange_Hz(15000.0f, 48000.0f);
+      setFrameRate_Hz(10.0f);
+    }
+
+    void enable(bool state) {
+      __disable_irq();
+      if (state && !enabled) resetFrame();
+      enabled = state;
+      __enable_irq();
+    }
+    bool isEnabled(void) { return enabled; }
+
+    //the output bins are evenly spaced between these.  The top is limited to Nyquist.
+    void setFrequencyRange_Hz(float lo_Hz, float hi_Hz) {
+      const float df = sample_rate_Hz / ((float)SPEC_FFT_SIZE);
+      hi_Hz = min(hi_Hz, 0.5f * sample_rate_Hz);
+      lo_Hz = max(0.0f, min(lo_Hz, hi_Hz - SPEC_N_BINS * df));
+      __disable_irq();
+      f_lo_Hz = lo_Hz; f_hi_Hz = hi_Hz;
+      for (int b = 0; b <= SPEC_N_BINS; b++) {
+        float f = lo_Hz + (hi_Hz - lo_Hz) * ((float)b) / ((float)SPEC_N_BINS);
+        edge[b] = min(SPEC_FFT_SIZE / 2, (int)(f / df + 0.5f));
+      }
+      for (int b = 0; b < SPEC_N_BINS; b++) edge[b + 1] = max(edge[b + 1], edge[b] + 1);  //at least one FFT bin each
+      resetFrame();
+      __enable_irq();
+    }
+    float getLowFreq_Hz(void) { return f_lo_Hz; }
+    float getHighFreq_Hz(void) { return f_hi_Hz; }
+
+    void setFrameRate_Hz(float Hz) {
+      blocks_per_frame = max(SPEC_FFT_SIZE / block_samples, (int)(sample_rate_Hz / (max(0.1f, Hz) * block_samples) + 0.5f));
+      setMaxFFTsPerFrame(max_ffts);
+    }
+    float getFrameRate_Hz(void) { return sample_rate_Hz / ((float)(blocks_per_frame * block_samples)); }
+
+    //the CPU budget: FFTs per frame (at least 1)
+    void setMaxFFTsPerFrame(int n) {
+      max_ffts = max(1, n);
+      gap_blocks = max(0, blocks_per_frame / max_ffts - SPEC_FFT_SIZE / block_samples);
+    }
+    int getMaxFFTsPerFrame(void) { return max_ffts; }
+
+    //from loop()
+    bool getFrame(Frame_t &out) {
+      if (tail == head) return false;
+      out = queue[tail];
+      asm volatile("" ::: "memory");  //finish the copy before giving the slot back
+      tail = (tail + 1) & (SPEC_QUEUE_LEN - 1);
+      return true;
+    }
+    unsigned long getNDropped(void) { return n_dropped; }
+
+    virtual void update(void) {
+      audio_block_f32_t *in[2] = { receiveReadOnly_f32(0), receiveReadOnly_f32(1) };
+      if (enabled && (in[0] || in[1])) {
+        if (skip_left > 0) {
+          skip_left--;
+        } else {
+          //into the FFT buffer.  A missing channel copies the other one (the level comes out the same).
+          const audio_block_f32_t *l = in[0] ? in[0] : in[1], *r = in[1] ? in[1] : in[0];
+          const int n = min(l->length, SPEC_FFT_SIZE - fill_ind);
+          float32_t *w = work + 2 * fill_ind;
+          for (int i = 0; i < n; i++) { w[2 * i] = l->data[i]; w[2 * i + 1] = r->data[i]; }
+          fill_ind += n;
+          if (fill_ind >= SPEC_FFT_SIZE) {
+            processFFT();
+            fill_ind = 0;
+            skip_left = gap_blocks;
+          }
+        }
+        if (++frame_blocks >= blocks_per_frame) sendFrame();
+      }
+      for (int c = 0; c < 2; c++) if (in[c]) AudioStream_F32::release(in[c]);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    bool enabled = false;
+    arm_cfft_radix4_instance_f32 fft_inst;
+    float32_t window[SPEC_FFT_SIZE];
+    float32_t work[2 * SPEC_FFT_SIZE];   //interleaved complex
+    int fill_ind = 0, skip_left = 0, gap_blocks = 10;
+
+    //the output bins
+    float f_lo_Hz = 15000.0f, f_hi_Hz = 48000.0f;
+    int edge[SPEC_N_BINS + 1];           //FFT bins [edge[b], edge[b+1]) go into output bin b
+    float32_t acc[SPEC_N_BINS];
+    int n_ffts = 0, max_ffts = 4, frame_blocks = 0, blocks_per_frame = 75;
+    uint16_t seq = 0;
+
+    //finished frames, for loop()
+    Frame_t queue[SPEC_QUEUE_LEN];
+    volatile uint32_t head = 0, tail = 0;
+    unsigned long n_dropped = 0;
+
+    void resetFrame(void) {
+      for (int b = 0; b < SPEC_N_BINS; b++) acc[b] = 0.0f;
+      n_ffts = 0; frame_blocks = 0; fill_ind = 0; skip_left = 0;
+    }
+
+    void processFFT(void) {
+      const int N = SPEC_FFT_SIZE;
+      for (int i = 0; i < N; i++) { work[2 * i] *= window[i]; work[2 * i + 1] *= window[i]; }
+      arm_cfft_radix4_f32(&fft_inst, work);
+
+      //|L|^2 + |R|^2 = (|Z[k]|^2 + |Z[N-k]|^2) / 2.  Averaged over the two channels, and scaled
+      //so that a full-scale sine is 1.0 (the Hann window's peak is N/4).
+      const float32_t scale = 0.25f * 16.0f / (((float32_t)N) * ((float32_t)N));
+      for (int b = 0; b < SPEC_N_BINS; b++) {
+        float32_t best = 0.0f;
+        for (int k = edge[b]; k < edge[b + 1]; k++) {
+          const int m = (N - k) & (N - 1);
+          float32_t p = work[2 * k] * work[2 * k] + work[2 * k + 1] * work[2 * k + 1] + work[2 * m] * work[2 * m] + work[2 * m + 1] * work[2 * m + 1];
+          best = max(best, p);
+        }
+        acc[b] += scale * best;
+      }
+      n_ffts++;
+    }
+
+    void sendFrame(void) {
+      if (n_ffts > 0) {
+        uint32_t next = (head + 1) & (SPEC_QUEUE_LEN - 1);
+        if (next != tail) {
+          Frame_t &f = queue[head];
+          f.seq = seq; f.n_ffts = (uint8_t)min(n_ffts, 255);
+          const float32_t inv = 1.0f / ((float32_t)n_ffts);
+          for (int b = 0; b < SPEC_N_BINS; b++) {
+            float dB = 10.0f * log10f(max(acc[b] * inv, 1.0e-20f));
+            f.code[b] = (uint8_t)max(0.0f, min(255.0f, (dB - SPEC_FLOOR_dBFS) / SPEC_STEP_dB + 0.5f));
+          }
+          asm volatile("" ::: "memory");  //fill the slot before handing it over
+          head = next;
+        } else {
+          n_dropped++;  //loop() isn't keeping up.  Lose this frame.
+        }
+        seq++;
+      }
+      for (int b = 0; b < SPEC_N_BINS; b++) acc[b] = 0.0f;
+      n_ffts = 0; frame_blocks = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,250 @@
+
+/*
+   AudioAnalyzeUltrasoundEvents_F32
+
+   Purpose: Find bursts of ultrasound (eg, a gas leak's hiss, or an electrical arc) so that
+     only those get saved, instead of recording everything at 96 kHz.
+
+   Detection, once per block, on the louder channel:
+     * band energy: a 4th-order high-pass at 20 kHz (so, 20-48 kHz), then the mean-square
+     * the background: a floor that follows the quiet parts (it drops quickly and rises
+       slowly, and it only learns when there's no event)
+     * an event starts when the band is some dB over the floor (and over an absolute
+       minimum), and ends once it has been back under a lower threshold for a while
+   While an event is on, a small Goertzel bank (16 frequencies from 21 to 46 kHz) adds up
+   where the energy is, so each event gets a dominant frequency too.  The block is Hann
+   windowed first: without it, a tone halfway between two of the frequencies can land in
+   the null of the nearer one.  When idle, none of that is computed.
+
+   Snippets: the raw input (both channels) is kept as int16 in a ring of blocks.  Every
+     block that belongs to a snippet gets that event's id: the blocks from a little before
+     the start (the pre-trigger, which is already in the ring), to a little after the end.
+     loop() (see UltrasoundEventLogger) writes the marked blocks to the SD.  loop() never
+     passes an unmarked block that is newer than the pre-trigger, so the marking after the
+     fact is never too late.
+
+   The finished events go into a small queue for loop(), with their stats.  If loop() lets it
+   fill up, the newest event is lost, and counted (getNDropped()).
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioAnalyzeUltrasoundEvents_F32_h
+#define _AudioAnalyzeUltrasoundEvents_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+#include "SOS_Core.h"
+
+#define USEVT_RING_BLOCKS (64)      //must be a power of two.  64 blocks of 128 stereo int16 is 32 kB.
+#define USEVT_PRE_BLOCKS (16)       //pre-trigger: 21 msec at 96 kHz, 128 samples
+#define USEVT_POST_BLOCKS (16)
+#define USEVT_MAX_BLOCKS (375)      //longest event (0.5 sec).  A longer sound becomes several events.
+#define USEVT_N_GOERTZEL (16)
+#define USEVT_QUEUE_LEN (8)         //must be a power of two
+
+class AudioAnalyzeUltrasoundEvents_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:0 //this line used for automatic generation of GUI node
+  public:
+    struct Event_t {
+      uint16_t id;
+      uint32_t start_block, n_blocks;   //of the event itself (the snippet adds the pre- and post-trigger)
+      uint32_t snip_start_block;        //the first block of its snippet: the start of the pre-trigger
+      uint32_t start_msec;
+      float32_t peak_ms, floor_ms;      //band energy, mean-square (full scale = 1.0)
+      float32_t peak_Hz;                //from the Goertzel bank
+    };
+
+    AudioAnalyzeUltrasoundEvents_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_samples = settings.audio_block_samples;
+      sos.setSampleRate_Hz(sample_rate_Hz);
+      sos.setHighpass(0, 20000.0f, 0.5412f);  //4th-order Butterworth, as two sections
+      sos.setHighpass(1, 20000.0f, 1.3066f);
+      for (int k = 0; k < USEVT_N_GOERTZEL; k++) {
+        goertzel_Hz[k] = 21000.0f + 25000.0f * ((float)k) / ((float)(USEVT_N_GOERTZEL - 1));
+        goertzel_coeff[k] = 2.0f * cosf(2.0f * M_PI * goertzel_Hz[k] / sample_rate_Hz);
+      }
+      for (int i = 0; i < block_samples; i++) window[i] = 0.5f * (1.0f - cosf(2.0f * M_PI * ((float)i) / ((float)block_samples)));
+      setThreshold_dB(12.0f);
+      setMinLevel_dBFS(-80.0f);
+      setHold_msec(30.0f);
+      setFloorTime_sec(2.0f);
+      for (int i = 0; i < USEVT_RING_BLOCKS; i++) ring_id[i] = 0;
+    }
+
+    void enable(bool state) { enabled = state; }
+    bool isEnabled(void) { return enabled; }
+    void setThreshold_dB(float dB) { thresh_dB = max(3.0f, dB); thresh_ratio = powf(10.0f, thresh_dB / 10.0f); end_ratio = powf(10.0f, 0.5f * thresh_dB / 10.0f); }
+    float getThreshold_dB(void) { return thresh_dB; }
+    void setMinLevel_dBFS(float dB) { min_dBFS = dB; min_ms = powf(10.0f, dB / 10.0f); }
+    void setHold_msec(float msec) { hold_blocks = max(1, (int)(0.001f * msec * sample_rate_Hz / block_samples + 0.5f)); }
+    void setFloorTime_sec(float sec) { floor_alpha_up = 1.0f - expf(-((float)block_samples) / (sec * sample_rate_Hz)); }
+
+    float getLevel_dBFS(void) { return 10.0f * log10f(max(level_ms, 1.0e-12f)); }
+    float getFloor_dBFS(void) { return 10.0f * log10f(max(floor_ms, 1.0e-12f)); }
+    bool isActive(void) { return active; }
+    unsigned long getNEvents(void) { return n_events; }
+    unsigned long getNDropped(void) { return n_dropped; }   //events lost because the queue was full
+    int getBlockSamples(void) { return block_samples; }
+    float getSampleRate_Hz(void) { return sample_rate_Hz; }
+
+    //from loop(): the finished events
+    bool getEvent(Event_t &out) {
+      if (q_tail == q_head) return false;
+      out = queue[q_tail];
+      asm volatile("" ::: "memory");
+      q_tail = (q_tail + 1) & (USEVT_QUEUE_LEN - 1);
+      return true;
+    }
+
+    //from loop(): the ring of raw blocks.  Block b (counting from the start) is at slot b % USEVT_RING_BLOCKS.
+    uint32_t getNBlocksWritten(void) { return n_written; }
+    uint16_t getBlockId(uint32_t b) { return ring_id[b & (USEVT_RING_BLOCKS - 1)]; }
+    const int16_t *getBlockData(uint32_t b) { return ring[b & (USEVT_RING_BLOCKS - 1)]; }
+
+    virtual void update(void) {
+      audio_block_f32_t *in[2] = { receiveReadOnly_f32(0), receiveReadOnly_f32(1) };
+      if (!in[0] && !in[1]) return;
+      if (!enabled) {
+        for (int c = 0; c < 2; c++) if (in[c]) AudioStream_F32::release(in[c]);
+        return;
+      }
+      const int n = min(block_samples, (in[0] ? in[0] : in[1])->length);
+
+      //keep the raw audio (interleaved; a missing channel is zeros)
+      const uint32_t slot = n_written & (USEVT_RING_BLOCKS - 1);
+      int16_t *dest = ring[slot];
+      for (int i = 0; i < n; i++) {
+        dest[2 * i] = in[0] ? toInt16(in[0]->data[i]) : 0;
+        dest[2 * i + 1] = in[1] ? toInt16(in[1]->data[i]) : 0;
+      }
+
+      //the band energy, on the louder channel
+      float32_t *data[2]; int chans[2], n_active = 0;
+      for (int c = 0; c < 2; c++) {
+        if (!in[c]) continue;
+        arm_copy_f32(in[c]->data, band[c], n);
+        data[n_active] = band[c]; chans[n_active] = c; n_active++;
+      }
+      sos.process(data, chans, n_active, n);
+      float32_t ms = 0.0f;
+      for (int k = 0; k < n_active; k++) {
+        float32_t p;
+        arm_power_f32(data[k], n, &p);
+        ms = max(ms, p / ((float32_t)n));
+      }
+      level_ms = ms;
+      for (int c = 0; c < 2; c++) if (in[c]) AudioStream_F32::release(in[c]);
+
+      detect(ms, data, n_active, n);
+
+      //mark this block (and, at the start of an event, the pre-trigger before it)
+      ring_id[slot] = (active || (post_left > 0)) ? cur_id : 0;
+      if (post_left > 0) post_left--;
+      asm volatile("" ::: "memory");
+      n_written++;
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    bool enabled = true;
+    SOS_Core sos;
+    float32_t band[2][AUDIO_BLOCK_SAMPLES];
+
+    //detection
+    float thresh_dB = 12.0f, min_dBFS = -80.0f;
+    float32_t thresh_ratio = 15.8f, end_ratio = 4.0f, min_ms = 1.0e-8f, floor_alpha_up = 3.0e-4f;
+    float32_t level_ms = 0.0f, floor_ms = 1.0e-8f;
+    int hold_blocks = 23, quiet_blocks = 0, post_left = 0;
+    bool active = false;
+    uint16_t cur_id = 0;
+    Event_t cur;
+    unsigned long n_events = 0, n_dropped = 0;
+
+    //where the energy is, during an event
+    float32_t goertzel_Hz[USEVT_N_GOERTZEL], goertzel_coeff[USEVT_N_GOERTZEL], goertzel_sum[USEVT_N_GOERTZEL];
+    float32_t window[AUDIO_BLOCK_SAMPLES], windowed[AUDIO_BLOCK_SAMPLES];
+
+    //the raw audio
+    int16_t ring[USEVT_RING_BLOCKS][2 * AUDIO_BLOCK_SAMPLES];
+    volatile uint16_t ring_id[USEVT_RING_BLOCKS];
+    volatile uint32_t n_written = 0;
+
+    //finished events, for loop()
+    Event_t queue[USEVT_QUEUE_LEN];
+    volatile uint32_t q_head = 0, q_tail = 0;
+
+    static int16_t toInt16(float32_t x) { return (int16_t)(max(-1.0f, min(x, 1.0f)) * 32767.0f); }
+
+    void detect(float32_t ms, float32_t **data, int n_active, int n) {
+      if (!active) {
+        if ((ms > min_ms) && (ms > thresh_ratio * floor_ms)) {
+          startEvent(ms);
+        } else {
+          //the background: down quickly, up slowly
+          const float32_t alpha = (ms < floor_ms) ? 0.1f : floor_alpha_up;
+          floor_ms = max(1.0e-12f, floor_ms + alpha * (ms - floor_ms));
+          return;
+        }
+      }
+
+      //during the event
+      cur.n_blocks++;
+      cur.peak_ms = max(cur.peak_ms, ms);
+      accumulateGoertzel(data, n_active, n);
+      if (ms < end_ratio * floor_ms) quiet_blocks++; else quiet_blocks = 0;
+      if ((quiet_blocks >= hold_blocks) || (cur.n_blocks >= USEVT_MAX_BLOCKS)) endEvent();
+    }
+
+    void startEvent(float32_t ms) {
+      active = true; quiet_blocks = 0; post_left = 0;
+      cur_id = (cur_id == 0xFFFF) ? 1 : (cur_id + 1);
+      cur.id = cur_id; cur.start_block = n_written; cur.n_blocks = 0;
+      cur.start_msec = millis(); cur.peak_ms = ms; cur.floor_ms = floor_ms;
+      for (int k = 0; k < USEVT_N_GOERTZEL; k++) goertzel_sum[k] = 0.0f;
+
+      //the pre-trigger.  Not the blocks that are already in another snippet.
+      cur.snip_start_block = n_written;
+      for (int b = 1; (b <= USEVT_PRE_BLOCKS) && (b <= (int)n_written); b++) {
+        const uint32_t s = (n_written - b) & (USEVT_RING_BLOCKS - 1);
+        if (ring_id[s] != 0) break;
+        ring_id[s] = cur_id;
+        cur.snip_start_block = n_written - b;
+      }
+    }
+
+    void endEvent(void) {
+      active = false;
+      post_left = USEVT_POST_BLOCKS;
+      n_events++;
+      int best = 0;
+      for (int k = 1; k < USEVT_N_GOERTZEL; k++) if (goertzel_sum[k] > goertzel_sum[best]) best = k;
+      cur.peak_Hz = goertzel_Hz[best];
+      uint32_t next = (q_head + 1) & (USEVT_QUEUE_LEN - 1);
+      if (next != q_tail) {
+        queue[q_head] = cur;
+        asm volatile("" ::: "memory");
+        q_head = next;
+      } else {
+        n_dropped++;  //loop() isn't keeping up.  Lose this event.
+      }
+    }
+
+    //the power at each frequency, for this block, added to the event's totals
+    void accumulateGoertzel(float32_t **data, int n_active, int n) {
+      for (int c = 0; c < n_active; c++) {
+        arm_mult_f32(data[c], window, windowed, n);
+        for (int k = 0; k < USEVT_N_GOERTZEL; k++) {
+          const float32_t coeff = goertzel_coeff[k];
+          float32_t s1 = 0.0f, s2 = 0.0f;
+          for (int i = 0; i < n; i++) { float32_t s0 = windowed[i] + coeff * s1 - s2; s2 = s1; s1 = s0; }
+          goertzel_sum[k] += s1 * s1 + s2 * s2 - coeff * s1 * s2;
+        }
+      }
+    }
+};
+
+#endif
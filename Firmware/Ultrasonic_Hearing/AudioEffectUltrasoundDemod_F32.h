@@ -0,0 +1,91 @@
+
+/*
+   AudioEffectUltrasoundDemod_F32
+
+   Purpose: The whole ultrasound path in one node, for both channels:
+       gain -> high-pass (biquad cascade) -> multiply by the carrier
+     This used to be nine nodes (carrier, two gains, the high-pass, two multipliers) and the
+     patchcords between them, each moving blocks through the shared F32 pool.  Here the only
+     pool blocks are the two that come in (and go out again, in place).  The carrier lives in
+     a member buffer and is made once for both channels.
+
+   Fusing:
+     * the gain is folded into the carrier's amplitude.  The filter is linear, so gaining
+       before it or after it is the same, and this way the gain costs nothing.  Gain changes
+       glide along with the carrier's amplitude.
+     * the high-pass runs the two channels together (see SOS_Core)
+     * the multiply is one CMSIS arm_mult_f32 per channel
+
+   A missing input block just means that channel is skipped (eg, when running mono).
+
+   Tools/HostSim/DemodTest (on the host) checks it, sample for sample, against the unfused
+     chain, and checks the carrier against its -94 dBFS error bound.
+
+   Scope: this is the one chain that is fused, by hand.  It is not a graph compiler; the rest
+     of the sketch still passes blocks through the pool, node to node, because that is how
+     Tympan_Library's AudioStream_F32 and AudioConnection_F32 work, and a static schedule
+     with shared scratch buffers would have to replace them.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioEffectUltrasoundDemod_F32_h
+#define _AudioEffectUltrasoundDemod_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+#include "NCO_Core.h"
+#include "SOS_Core.h"
+
+class AudioEffectUltrasoundDemod_F32 : public AudioStream_F32 {
+  //GUI: inputs:2, outputs:2 //this line used for automatic generation of GUI node
+  public:
+    AudioEffectUltrasoundDemod_F32(const AudioSettings_F32 &settings) : AudioStream_F32(2, inputQueueArray) {
+      nco.setSampleRate_Hz(settings.sample_rate_Hz);
+      nco.setBlockSize(settings.audio_block_samples);
+      sos.setSampleRate_Hz(settings.sample_rate_Hz);
+    }
+
+    //the gain before the demodulation (it glides)
+    float setGain_dB(float gain_dB) { nco.amplitude(powf(10.0f, gain_dB / 20.0f)); return gain_dB; }
+    float getGain_dB(void) { return 20.0f * log10f(max(nco.getAmplitude(), 1.0e-6f)); }
+
+    //the carrier (it glides)
+    void setCarrier_Hz(float freq_Hz) { nco.frequency(freq_Hz); }
+    float getCarrier_Hz(void) { return nco.getFrequency_Hz(); }
+    float setGlideTime_msec(float msec) { return nco.setGlideTime_msec(msec); }
+
+    //the high-pass ahead of the demodulation
+    void setFilterCoefficients(int section, const float32_t *b, const float32_t *a) { sos.setCoefficients(section, b, a); }
+    void setHighpass(int section, float fc_Hz) { sos.setHighpass(section, fc_Hz); }
+
+    virtual void update(void) {
+      audio_block_f32_t *blocks[2];
+      float32_t *data[2];
+      int chans[2], n_active = 0;
+      for (int c = 0; c < 2; c++) {
+        audio_block_f32_t *b = receiveWritable_f32(c);
+        if (b) { blocks[n_active] = b; data[n_active] = b->data; chans[n_active] = c; n_active++; }
+      }
+
+      //keep the carrier running even with no input, so that its phase and glides stay on time
+      nco.generateBlock(carrier_buff, NULL);
+      if (n_active == 0) return;
+
+      const int n = blocks[0]->length;
+      sos.process(data, chans, n_active, n);
+      for (int k = 0; k < n_active; k++) {
+        arm_mult_f32(data[k], carrier_buff, data[k], n);
+        transmit(blocks[k], chans[k]);
+        AudioStream_F32::release(blocks[k]);
+      }
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[2];
+    NCO_Core nco;
+    SOS_Core sos;
+    float32_t carrier_buff[AUDIO_BLOCK_SAMPLES];
+};
+
+#endif
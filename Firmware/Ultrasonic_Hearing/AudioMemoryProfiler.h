@@ -0,0 +1,128 @@
+
+/*
+   AudioMemoryProfiler
+
+   Purpose: Find out how many F32 audio blocks the graph really needs, instead of guessing.
+     The sketch gives it a list of steps (eg, each algorithm, with and without noise
+     reduction).  It goes through them from loop(), waiting at each one and keeping the
+     peak of AudioMemoryUsageMax_F32(), then recommends a pool size with some headroom.
+
+   The recommendation can be saved to EEPROM.  At boot, allocateAudioMemory_F32() makes
+   the pool that size (from the heap) instead of always making MAX_F32_BLOCKS, and the
+   RAM that is left over stays free for everything else (eg, the SD recording buffers).
+
+   The library's pool can't go above 192 blocks, so the saved size is only ever used to
+   make the pool smaller.  Run the profile while recording to the SD if you want the pool
+   to cover that too; the SD queues are included in the peak.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioMemoryProfiler_h
+#define _AudioMemoryProfiler_h
+
+#include <Tympan_Library.h>
+#include <EEPROM.h>
+
+#define MEMPROF_MAX_STEPS (16)
+#define MEMPROF_MIN_BLOCKS (16)
+#define MEMPROF_EEPROM_ADDR (0)        //the pool size record lives at the very start of EEPROM
+#define MEMPROF_EEPROM_MAGIC (0xB10C)
+
+class AudioMemoryProfiler {
+  public:
+    typedef void (*StepFcn_t)(int step);  //set up for the given step.  step == n_steps means "put everything back"
+
+    bool begin(int _n_steps, StepFcn_t _apply_step, unsigned long _dwell_msec) {
+      if (running) return false;
+      n_steps = max(1, min(_n_steps, MEMPROF_MAX_STEPS));
+      apply_step = _apply_step;
+      dwell_msec = _dwell_msec;
+      cur_step = 0;
+      startStep();
+      running = true;
+      return true;
+    }
+    bool isRunning(void) { return running; }
+
+    //call from loop().  Returns true when the profile has just finished.
+    bool service(void) {
+      if (!running) return false;
+      if ((millis() - step_start_msec) < dwell_msec) return false;
+      peak_blocks[cur_step] = AudioMemoryUsageMax_F32();
+      cur_step++;
+      if (cur_step < n_steps) {
+        startStep();
+        return false;
+      }
+      apply_step(n_steps);  //done.  Restore.
+      running = false;
+      return true;
+    }
+
+    int getPeakBlocks(void) {
+      int peak = 0;
+      for (int i = 0; i < n_steps; i++) peak = max(peak, peak_blocks[i]);
+      return peak;
+    }
+    //the peak, plus 25% and a few blocks for the things that didn't happen during the profile
+    int getRecommendedBlocks(int max_blocks) {
+      int n = (getPeakBlocks() * 5 + 3) / 4 + 4;
+      return max(MEMPROF_MIN_BLOCKS, min(n, max_blocks));
+    }
+
+    //works with anything that prints (eg, Serial, or the Tympan, which prints to both serial ports)
+    template <class T>
+    void printReport(T *p, const char **step_names, int max_blocks) {
+      p->println("Audio memory profile (peak F32 blocks per step):");
+      for (int i = 0; i < n_steps; i++) {
+        p->print("  "); p->print(step_names[i]); p->print(": "); p->println(peak_blocks[i]);
+      }
+      p->print("  Peak = "); p->print(getPeakBlocks());
+      p->print(", recommended pool = "); p->print(getRecommendedBlocks(max_blocks));
+      p->print(" of "); p->print(max_blocks);
+      p->print(" (saves "); p->print((max_blocks - getRecommendedBlocks(max_blocks)) * (int)sizeof(audio_block_f32_t));
+      p->println(" bytes)");
+    }
+
+  private:
+    bool running = false;
+    int n_steps = 0, cur_step = 0;
+    StepFcn_t apply_step = NULL;
+    unsigned long dwell_msec = 1000, step_start_msec = 0;
+    int peak_blocks[MEMPROF_MAX_STEPS];
+
+    void startStep(void) {
+      apply_step(cur_step);
+      AudioMemoryUsageMaxReset_F32();
+      step_start_msec = millis();
+    }
+};
+
+//the saved pool size.  Returns default_blocks if nothing valid has been saved.
+int loadAudioPoolSize(int default_blocks) {
+  uint16_t rec[3];
+  EEPROM.get(MEMPROF_EEPROM_ADDR, rec);
+  if ((rec[0] != MEMPROF_EEPROM_MAGIC) || (rec[2] != (uint16_t)(~rec[1]))) return default_blocks;
+  return max(MEMPROF_MIN_BLOCKS, min((int)rec[1], default_blocks));
+}
+void saveAudioPoolSize(int n_blocks) {
+  uint16_t rec[3] = {MEMPROF_EEPROM_MAGIC, (uint16_t)n_blocks, (uint16_t)(~((uint16_t)n_blocks))};
+  EEPROM.put(MEMPROF_EEPROM_ADDR, rec);
+}
+
+//make the F32 pool from the heap, sized from EEPROM (or max_blocks if nothing is saved).
+//Returns the number of blocks.
+int allocateAudioMemory_F32(int max_blocks, const AudioSettings_F32 &settings) {
+  int n_blocks = loadAudioPoolSize(max_blocks);
+  audio_block_f32_t *pool = (audio_block_f32_t *)malloc(n_blocks * sizeof(audio_block_f32_t));
+  while (!pool && (n_blocks > MEMPROF_MIN_BLOCKS)) {  //shouldn't happen at boot, but just in case
+    n_blocks -= 16;
+    pool = (audio_block_f32_t *)malloc(n_blocks * sizeof(audio_block_f32_t));
+  }
+  if (!pool) return 0;
+  AudioStream_F32::initialize_f32_memory(pool, n_blocks, settings);
+  return n_blocks;
+}
+
+#endif
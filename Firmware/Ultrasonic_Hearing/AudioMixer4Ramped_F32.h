@@ -0,0 +1,140 @@
+
+/*
+   AudioMixer4Ramped_F32
+
+   Purpose: Drop-in replacement for AudioMixer4_F32 where gain changes are ramped instead of
+     jumping, so switching mute/mono/stereo (or audio/ultrasound) doesn't click.  The gains
+     move linearly to the new value over the ramp time (default 10 msec).  gain() returns
+     right away; the ramp happens in update().
+
+   Also has a mute() that ramps every channel to zero but remembers the gains, so that
+   un-muting puts them back.  That is what replaces the blocking delay()s around changes
+   to the input hardware.
+
+   Channels that are at a steady gain are done with the (vectorized) CMSIS scale and add.
+   Only the samples inside a ramp are done one at a time.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _AudioMixer4Ramped_F32_h
+#define _AudioMixer4Ramped_F32_h
+
+#include <Tympan_Library.h>
+#include <arm_math.h>
+
+#define MIXER_RAMPED_N_CHAN (4)
+
+class AudioMixer4Ramped_F32 : public AudioStream_F32 {
+  //GUI: inputs:4, outputs:1 //this line used for automatic generation of GUI node
+  public:
+    AudioMixer4Ramped_F32(void) : AudioStream_F32(MIXER_RAMPED_N_CHAN, inputQueueArray) { setup(); }
+    AudioMixer4Ramped_F32(const AudioSettings_F32 &settings) : AudioStream_F32(MIXER_RAMPED_N_CHAN, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_samples = settings.audio_block_samples;
+      setup();
+    }
+
+    void setup(void) {
+      for (int i = 0; i < MIXER_RAMPED_N_CHAN; i++) {
+        user_gain[i] = 1.0f; cur_gain[i] = 1.0f; target_gain[i] = 1.0f; step_gain[i] = 0.0f; n_remaining[i] = 0;
+      }
+      setRampTime_msec(10.0f);
+    }
+
+    //same as AudioMixer4_F32, except that it ramps to the new gain
+    void gain(int chan, float g) {
+      if ((chan < 0) || (chan >= MIXER_RAMPED_N_CHAN)) return;
+      user_gain[chan] = g;
+      startRamp(chan);
+    }
+    float getGain(int chan) { return user_gain[max(0, min(chan, MIXER_RAMPED_N_CHAN - 1))]; }
+
+    //ramp all channels down to zero (or back up to their gains)
+    void mute(bool state) {
+      is_muted = state;
+      for (int i = 0; i < MIXER_RAMPED_N_CHAN; i++) startRamp(i);
+    }
+    bool isMuted(void) { return is_muted; }
+
+    float setRampTime_msec(float msec) {
+      ramp_samples = max(1, (int)(max(0.0f, msec) * 0.001f * sample_rate_Hz + 0.5f));
+      return getRampTime_msec();
+    }
+    float getRampTime_msec(void) { return 1000.0f * ((float)ramp_samples) / sample_rate_Hz; }
+
+    //true until every channel has reached its new gain
+    bool isRamping(void) {
+      for (int i = 0; i < MIXER_RAMPED_N_CHAN; i++) if (n_remaining[i] > 0) return true;
+      return false;
+    }
+
+    virtual void update(void);
+
+  private:
+    audio_block_f32_t *inputQueueArray[MIXER_RAMPED_N_CHAN];
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    int ramp_samples = 480;
+    bool is_muted = false;
+    float32_t user_gain[MIXER_RAMPED_N_CHAN];   //what the user asked for
+    float32_t cur_gain[MIXER_RAMPED_N_CHAN];    //where the ramp is now
+    float32_t target_gain[MIXER_RAMPED_N_CHAN]; //where the ramp is going (zero, if muted)
+    float32_t step_gain[MIXER_RAMPED_N_CHAN];   //per sample
+    int n_remaining[MIXER_RAMPED_N_CHAN];       //samples left in the ramp
+    float32_t scratch[AUDIO_BLOCK_SAMPLES];
+
+    void startRamp(int chan) {
+      float32_t target = is_muted ? 0.0f : user_gain[chan];
+      __disable_irq();  //update() must not see half of the new ramp
+      target_gain[chan] = target;
+      step_gain[chan] = (target - cur_gain[chan]) / ((float32_t)ramp_samples);
+      n_remaining[chan] = (target == cur_gain[chan]) ? 0 : ramp_samples;
+      __enable_irq();
+    }
+};
+
+void AudioMixer4Ramped_F32::update(void) {
+  audio_block_f32_t *out = NULL;
+
+  for (int chan = 0; chan < MIXER_RAMPED_N_CHAN; chan++) {
+    audio_block_f32_t *in = receiveReadOnly_f32(chan);
+    const int n = in ? in->length : block_samples;
+
+    //how much of this block is still ramping?
+    int n_ramp = min(n_remaining[chan], n);
+    n_remaining[chan] -= n_ramp;
+    if (!in) {
+      //keep the ramp moving even with no input, so that isRamping() always finishes
+      cur_gain[chan] = (n_remaining[chan] > 0) ? (cur_gain[chan] + n_ramp * step_gain[chan]) : target_gain[chan];
+      continue;
+    }
+    if (!out) {
+      out = allocate_f32();
+      if (!out) { AudioStream_F32::release(in); return; }
+      out->length = n;
+      arm_fill_f32(0.0f, out->data, n);
+    }
+
+    //the ramped part, one sample at a time
+    float32_t g = cur_gain[chan];
+    const float32_t dg = step_gain[chan];
+    for (int i = 0; i < n_ramp; i++) { g += dg; out->data[i] += g * in->data[i]; }
+    if (n_remaining[chan] == 0) g = target_gain[chan];  //land exactly on the target
+    cur_gain[chan] = g;
+
+    //the steady part, vectorized (and skipped entirely for a muted channel)
+    if ((n_ramp < n) && (g != 0.0f)) {
+      arm_scale_f32(in->data + n_ramp, g, scratch, n - n_ramp);
+      arm_add_f32(out->data + n_ramp, scratch, out->data + n_ramp, n - n_ramp);
+    }
+    AudioStream_F32::release(in);
+  }
+
+  if (out) {
+    transmit(out);
+    AudioStream_F32::release(out);
+  }
+}
+
+#endif
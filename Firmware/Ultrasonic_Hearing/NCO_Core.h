@@ -0,0 +1,123 @@
+
+/*
+   NCO_Core
+
+   Purpose: Carrier oscillator (numerically controlled oscillator) for the ultrasound
+     demodulation.  Makes the cosine (I) and the sine (Q) in one pass, so an SSB mixer gets
+     both for the price of one.
+
+   How it works:
+     * 32-bit phase accumulator, so the frequency resolution is fs/2^32 (22 uHz at 96 kHz)
+       and the phase is continuous through any frequency change
+     * one 512-point sine table with linear interpolation.  The cosine is the same table,
+       a quarter turn later.  The table step is 2*pi/512, so the worst-case error is about
+       (2*pi/512)^2/8 = 1.9e-5, which is -94 dBFS.
+     * frequency() glides exponentially (an even sweep in octaves) over the glide time.
+       Within each block the phase increment moves linearly, so there are no steps at all.
+     * amplitude() glides linearly over the same time
+
+   It is not an audio node.  It gets built into the fused ultrasound demodulator, and it can
+   be benchmarked without getting added to the audio update list.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _NCO_Core_h
+#define _NCO_Core_h
+
+#include <Tympan_Library.h>
+
+#define NCO_TABLE_BITS (9)
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define NCO_FRAC_BITS (32 - NCO_TABLE_BITS)
+#define NCO_QUARTER_TURN (0x40000000UL)
+
+class NCO_Core {
+  public:
+    NCO_Core(void) {
+      for (int i = 0; i <= NCO_TABLE_SIZE; i++) table[i] = sinf(2.0f * M_PI * ((float)i) / ((float)NCO_TABLE_SIZE));  //extra point for the interpolation
+      table[NCO_TABLE_SIZE] = table[0];
+    }
+
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; }
+    uint32_t freqToIncrement(float freq_Hz) {
+      double turns = ((double)freq_Hz) / ((double)sample_rate_Hz);
+      turns -= floor(turns);  //alias into 0 to fs, like the hardware would
+      return (uint32_t)(turns * 4294967296.0);
+    }
+    void setIncrement(uint32_t inc) { phase_inc = inc; }
+    uint32_t getIncrement(void) { return phase_inc; }
+    uint32_t getPhase(void) { return phase; }
+    void setPhase(uint32_t p) { phase = p; }
+
+    //make n samples while the phase increment moves linearly to end_inc and the amplitude
+    //moves linearly from amp to end_amp.  Q can be NULL if only I is needed.
+    void generate(float32_t *I, float32_t *Q, int n, uint32_t end_inc, float32_t amp, float32_t end_amp) {
+      const float32_t frac_scale = 1.0f / ((float32_t)(1UL << NCO_FRAC_BITS));
+      const int32_t dinc = ((int32_t)(end_inc - phase_inc)) / n;
+      const float32_t damp = (end_amp - amp) / ((float32_t)n);
+      uint32_t p = phase, inc = phase_inc;
+      float32_t a = amp;
+      for (int i = 0; i < n; i++) {
+        uint32_t pc = p + NCO_QUARTER_TURN;  //cos(x) = sin(x + 90 deg)
+        uint32_t ind = pc >> NCO_FRAC_BITS;
+        float32_t frac = ((float32_t)(pc & ((1UL << NCO_FRAC_BITS) - 1))) * frac_scale;
+        I[i] = a * (table[ind] + frac * (table[ind + 1] - table[ind]));
+        if (Q) {
+          ind = p >> NCO_FRAC_BITS;
+          frac = ((float32_t)(p & ((1UL << NCO_FRAC_BITS) - 1))) * frac_scale;
+          Q[i] = a * (table[ind] + frac * (table[ind + 1] - table[ind]));
+        }
+        p += inc; inc += dinc; a += damp;
+      }
+      phase = p;
+      phase_inc = end_inc;  //land exactly on the target (the integer step can be a little short)
+    }
+
+    //the gliding interface.  Call setBlockSize() first.
+    void setBlockSize(int n) { block_samples = n; setGlideTime_msec(glide_msec); }
+    void frequency(float freq_Hz) {  //the first one jumps straight there
+      freq_Hz = max(freq_Hz, 1.0f);
+      float mult = (cur_freq_Hz > 0.0f) ? powf(freq_Hz / cur_freq_Hz, 1.0f / ((float)glide_blocks)) : 1.0f;
+      __disable_irq();
+      if (cur_freq_Hz <= 0.0f) { cur_freq_Hz = freq_Hz; setIncrement(freqToIncrement(freq_Hz)); }
+      target_freq_Hz = freq_Hz; freq_mult = mult; n_freq_blocks = glide_blocks;
+      __enable_irq();
+    }
+    float getFrequency_Hz(void) { return target_freq_Hz; }
+    void amplitude(float amp) {
+      float step = (amp - cur_amp) / ((float)glide_blocks);
+      __disable_irq();
+      target_amp = amp; amp_step = step; n_amp_blocks = glide_blocks;
+      __enable_irq();
+    }
+    float getAmplitude(void) { return target_amp; }
+    float setGlideTime_msec(float msec) {
+      glide_msec = max(0.0f, msec);
+      float block_sec = ((float)block_samples) / sample_rate_Hz;
+      glide_blocks = max(1, (int)(glide_msec * 0.001f / block_sec + 0.5f));
+      return 1000.0f * glide_blocks * block_sec;
+    }
+
+    //make the next block, moving along the glides
+    void generateBlock(float32_t *I, float32_t *Q) {
+      if (n_freq_blocks > 0) cur_freq_Hz = (--n_freq_blocks == 0) ? target_freq_Hz : (cur_freq_Hz * freq_mult);
+      float32_t start_amp = cur_amp;
+      if (n_amp_blocks > 0) cur_amp = (--n_amp_blocks == 0) ? target_amp : (cur_amp + amp_step);
+      generate(I, Q, block_samples, freqToIncrement(cur_freq_Hz), start_amp, cur_amp);
+    }
+
+  private:
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    uint32_t phase = 0, phase_inc = 0;
+    float32_t table[NCO_TABLE_SIZE + 1];
+
+    int block_samples = AUDIO_BLOCK_SAMPLES;
+    float glide_msec = 30.0f;
+    int glide_blocks = 1;
+    float cur_freq_Hz = 0.0f, target_freq_Hz = 0.0f, freq_mult = 1.0f;
+    float32_t cur_amp = 0.0f, target_amp = 0.0f, amp_step = 0.0f;
+    int n_freq_blocks = 0, n_amp_blocks = 0;
+};
+
+#endif
@@ -11,6 +11,7 @@ extern AudioSettings_F32 audio_settings;
 extern AudioInputI2S_F32 i2s_in;
 extern AudioRecordQueue_F32 queueL, queueR;
 extern TympanBase audioHardware;
+extern bool isEventLogging(void);  //the event logger uses the same SD writer
 #define BOTH_SERIAL audioHardware
 
 //variables to control printing of warnings and timings and whatnot
@@ -68,6 +69,32 @@ class SDAudioWriter
       return 0;
     }
 
+    //write samples that are already int16 (eg, interleaved stereo)
+    int writeInt16(const int16_t *data, int n) {
+      if (!file.isOpen()) return 0;
+      if (flagPrintElapsedWriteTime) { usec = 0; }
+      file.write((const byte *)data, n * sizeof(data[0]));
+      nBlocksWritten++;
+      if (flagPrintElapsedWriteTime) { Serial.print("SD, us="); Serial.println(usec);  }
+      return n;
+    }
+
+    //a text file alongside the audio (eg, an event log).  Each line is synced, so a pulled card keeps what was logged.
+    bool openLog(char *fname) {
+      if (sd.exists(fname)) sd.remove(fname);
+      log_file.open(fname, O_RDWR | O_CREAT | O_TRUNC);
+      return isLogOpen();
+    }
+    int writeLog(const char *line) {
+      if (!log_file.isOpen()) return 0;
+      int n = log_file.write((const byte *)line, strlen(line));
+      log_file.sync();
+      return n;
+    }
+    void closeLog(void) { if (log_file.isOpen()) log_file.close(); }
+    bool isLogOpen(void) { return log_file.isOpen(); }
+    bool exists(char *fname) { return sd.exists(fname); }
+
     bool open(char *fname) {
       if (sd.exists(fname)) {  //maybe this isn't necessary when using the O_TRUNC flag below
         // The SD library writes new data to the end of the
@@ -123,6 +150,7 @@ class SDAudioWriter
     //SdFatSdio sd; //slower
     SdFatSdioEX sd; //faster
     SdFile_Gre file;
+    SdFile_Gre log_file;
     int16_t write_buffer[MAX_AUDIO_BUFF_LEN];
     boolean flagPrintElapsedWriteTime = false;
     elapsedMicros usec;
@@ -182,7 +210,9 @@ void startRecording(void) {
 
 
 void beginRecordingProcess(void) {
-  if (current_SD_state == STATE_STOPPED) {
+  if (isEventLogging()) {
+    BOTH_SERIAL.println("beginRecordingProcess: the event logger is using the SD.  Stop it first ('E').");
+  } else if (current_SD_state == STATE_STOPPED) {
     current_SD_state = STATE_BEGIN;  
     startRecording();
   } else {
@@ -203,7 +233,10 @@ void stopRecording(void) {
 
 
 
-void serviceSD(void) {
+//number of blocks waiting to go to the SD (the loop() scheduler watches this)
+int getSDQueueDepth(void) { return max(queueL.available(), queueR.available()); }
+
+bool serviceSD(void) {
   if (my_SD_writer.isFileOpen()) {
     //if audio data is ready, write it to SD
     if ((queueL.available()) && (queueR.available())) {
@@ -240,9 +273,11 @@ void serviceSD(void) {
       queueL.clearOverrun();
       queueR.clearOverrun();
       i2s_in.clear_isOutOfMemory();
+      return true;
     }
   } else {
     //no SD recording currently, so no SD action
   }
+  return false;
 }
 
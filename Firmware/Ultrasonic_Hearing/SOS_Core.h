@@ -0,0 +1,123 @@
+
+/*
+   SOS_Core
+
+   Purpose: A cascade of biquads (second-order sections) run on several channels at once.
+     It is not an audio node; it gets built into the nodes that need a filter (eg, the
+     fused ultrasound demodulator), and each section's
+     coefficients are loaded once for all of the channels.
+
+   How it works:
+     * transposed direct form II.  The state is stored [section][channel][2], so that each
+       section's state for a pair of channels sits together
+     * section by section, in place, across the whole block.  The channels are done in pairs
+       (two "lanes") inside the same sample loop, so the five coefficients and both
+       channels' state stay in registers.  An odd channel is done on its own.
+     * coefficients can be set directly (Matlab-style b and a, like setFilterCoeff_Matlab())
+       or designed at runtime, eg to move the high-pass along with the carrier
+
+   All of the channels share the same coefficients.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _SOS_Core_h
+#define _SOS_Core_h
+
+#include <Tympan_Library.h>
+
+#define SOS_MAX_SECTIONS (6)
+#define SOS_MAX_CHAN (4)
+
+class SOS_Core {
+  public:
+    SOS_Core(void) { resetState(); }
+    void setSampleRate_Hz(float fs_Hz) { sample_rate_Hz = fs_Hz; }
+
+    //Matlab-style coefficients: b = {b0, b1, b2}, a = {1, a1, a2}
+    void setCoefficients(int section, const float32_t *b, const float32_t *a) {
+      if ((section < 0) || (section >= SOS_MAX_SECTIONS)) return;
+      float32_t inv_a0 = 1.0f / a[0];
+      __disable_irq();
+      float32_t *c = coeff[section];
+      c[0] = b[0] * inv_a0; c[1] = b[1] * inv_a0; c[2] = b[2] * inv_a0;
+      c[3] = a[1] * inv_a0; c[4] = a[2] * inv_a0;
+      if (section >= n_sections) n_sections = section + 1;
+      __enable_irq();
+    }
+    void setNumSections(int n) {
+      __disable_irq();
+      n_sections = max(0, min(n, SOS_MAX_SECTIONS));
+      __enable_irq();
+    }
+    int getNumSections(void) { return n_sections; }
+
+    //2nd-order Butterworth (q = 0.7071) designs, via the bilinear transform
+    void setHighpass(int section, float fc_Hz, float q = 0.70710678f) { design(section, fc_Hz, q, true); }
+    void setLowpass(int section, float fc_Hz, float q = 0.70710678f) { design(section, fc_Hz, q, false); }
+
+    void resetState(void) {
+      __disable_irq();
+      for (int s = 0; s < SOS_MAX_SECTIONS; s++) for (int c = 0; c < SOS_MAX_CHAN; c++) { state[s][c][0] = 0.0f; state[s][c][1] = 0.0f; }
+      __enable_irq();
+    }
+
+    //filter n_active buffers in place.  chans[] says which channel's state goes with each.
+    void process(float32_t **data, const int *chans, int n_active, int n) {
+      for (int s = 0; s < n_sections; s++) {
+        int k = 0;
+        for ( ; k + 1 < n_active; k += 2) {
+          sectionPair(coeff[s], state[s][chans[k]], state[s][chans[k + 1]], data[k], data[k + 1], n);
+        }
+        if (k < n_active) sectionOne(coeff[s], state[s][chans[k]], data[k], n);
+      }
+    }
+
+  private:
+    float sample_rate_Hz = AUDIO_SAMPLE_RATE;
+    int n_sections = 0;
+    float32_t coeff[SOS_MAX_SECTIONS][5];                //b0, b1, b2, a1, a2
+    float32_t state[SOS_MAX_SECTIONS][SOS_MAX_CHAN][2];  //s1, s2 for each channel
+
+    void design(int section, float fc_Hz, float q, bool is_highpass) {
+      float w0 = 2.0f * M_PI * fc_Hz / sample_rate_Hz;
+      float alpha = sinf(w0) / (2.0f * q), cosw = cosf(w0);
+      float32_t a[3] = {1.0f + alpha, -2.0f * cosw, 1.0f - alpha};
+      float32_t b[3];
+      if (is_highpass) {
+        b[0] = 0.5f * (1.0f + cosw); b[1] = -(1.0f + cosw); b[2] = b[0];
+      } else {
+        b[0] = 0.5f * (1.0f - cosw); b[1] = (1.0f - cosw); b[2] = b[0];
+      }
+      setCoefficients(section, b, a);
+    }
+
+    //one section on two channels at once
+    static void sectionPair(const float32_t *c, float32_t *sA, float32_t *sB, float32_t *xA, float32_t *xB, int n) {
+      const float32_t b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+      float32_t a_s1 = sA[0], a_s2 = sA[1], b_s1 = sB[0], b_s2 = sB[1];
+      for (int i = 0; i < n; i++) {
+        float32_t inA = xA[i], inB = xB[i];
+        float32_t yA = b0 * inA + a_s1, yB = b0 * inB + b_s1;
+        a_s1 = b1 * inA - a1 * yA + a_s2;  b_s1 = b1 * inB - a1 * yB + b_s2;
+        a_s2 = b2 * inA - a2 * yA;         b_s2 = b2 * inB - a2 * yB;
+        xA[i] = yA; xB[i] = yB;
+      }
+      sA[0] = a_s1; sA[1] = a_s2; sB[0] = b_s1; sB[1] = b_s2;
+    }
+    //one section on one channel
+    static void sectionOne(const float32_t *c, float32_t *s, float32_t *x, int n) {
+      const float32_t b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+      float32_t s1 = s[0], s2 = s[1];
+      for (int i = 0; i < n; i++) {
+        float32_t in = x[i];
+        float32_t y = b0 * in + s1;
+        s1 = b1 * in - a1 * y + s2;
+        s2 = b2 * in - a2 * y;
+        x[i] = y;
+      }
+      s[0] = s1; s[1] = s2;
+    }
+};
+
+#endif
@@ -34,6 +34,11 @@ void SerialManager::printHelp(void) {
   audioHardware.println("   p: SD: prepare for recording");
   audioHardware.println("   r: SD: begin recording");
   audioHardware.println("   s: SD: stop recording");
+  audioHardware.println("   e: SD: start logging ultrasound events (just the events' audio, and a log)");
+  audioHardware.println("   E: SD: stop logging ultrasound events");
+  audioHardware.println("   d: Print the event detector's status");
+  audioHardware.println("   t: Events: raise the threshold by 3 dB");
+  audioHardware.println("   T: Events: lower the threshold by 3 dB");
   audioHardware.print  ("   i: Input: Increase gain by "); audioHardware.print(gainIncrement_dB); audioHardware.println(" dB");
   audioHardware.print  ("   I: Input: Decrease gain by "); audioHardware.print(gainIncrement_dB); audioHardware.println(" dB");
   //audioHardware.println("   q: Input: Mute");
@@ -42,6 +47,13 @@ void SerialManager::printHelp(void) {
   //audioHardware.println("   l: Processing: linear.");
   //audioHardware.println("   k: Processing: Fast-compression.");
   //audioHardware.println("   K: Processing: Slow-compression.");
+  audioHardware.println("   f: Spectrum: toggle streaming to the app (binary frames, on BT)");
+  audioHardware.println("   F: Spectrum: toggle printing it as text (on USB)");
+  audioHardware.println("   n: Benchmark the carrier oscillator (NCO)");
+  audioHardware.println("   u: Profile the audio memory (audio, ultrasound, both)");
+  audioHardware.println("   U: Save the profiled audio memory size (used from the next boot)");
+  audioHardware.println("   y: Print loop() task timing");
+  audioHardware.println("   Y: Print loop() task timing, then reset it");
   audioHardware.println("   h: Print this help");
 
 
@@ -61,6 +73,16 @@ extern void prepareSDforRecording(void);
 extern void setOutputMute(void);
 extern void setOutputAudio(bool);
 extern void setOutputUltrasound(bool);
+extern void printSchedulerStats(bool);
+extern void benchmarkCarrier(void);
+extern void startMemoryProfile(void);
+extern void saveMemoryProfile(void);
+extern void startEventLogging(void);
+extern void stopEventLogging(void);
+extern void printEventStatus(void);
+extern float incrementEventThreshold(float);
+extern void toggleSpectrumStreaming(void);
+extern void toggleSpectrumPrinting(void);
 //extern void setAudioLinear(void);
 //extern void setAudioFastComp(void);
 //extern void setAudioSlowComp(void);
@@ -179,6 +201,44 @@ void SerialManager::respondToByte(char c) {
       setButtonState("recordStart",false);
       setButtonState("recordStop",true);
       break;
+    case 'e':
+      audioHardware.println("Received: start event logging");
+      startEventLogging();
+      break;
+    case 'E':
+      audioHardware.println("Received: stop event logging");
+      stopEventLogging();
+      break;
+    case 'd':
+      printEventStatus();
+      break;
+    case 't':
+      audioHardware.print("Received: event threshold = floor + "); audioHardware.print(incrementEventThreshold(3.0f), 1); audioHardware.println(" dB");
+      break;
+    case 'T':
+      audioHardware.print("Received: event threshold = floor + "); audioHardware.print(incrementEventThreshold(-3.0f), 1); audioHardware.println(" dB");
+      break;
+    case 'f':
+      toggleSpectrumStreaming();
+      break;
+    case 'F':
+      toggleSpectrumPrinting();
+      break;
+    case 'n':
+      benchmarkCarrier();
+      break;
+    case 'u':
+      startMemoryProfile();
+      break;
+    case 'U':
+      saveMemoryProfile();
+      break;
+    case 'y':
+      printSchedulerStats(false);
+      break;
+    case 'Y':
+      printSchedulerStats(true);
+      break;
     case 'J':
       {
         // Print the layout for the Tympan Remote app, in a JSON-ish string
@@ -207,6 +267,8 @@ void SerialManager::respondToByte(char c) {
                               "{'title':'Tuner','cards':["
                                 "{'name':'Select Input','buttons':[{'label': 'PCB Mics', 'cmd': 'w', 'id': 'configPCB'},{'label': 'Headset Mics', 'cmd': 'W', 'id':'configHeadset'}]},"
                                 "{'name':'Record Mics to SD Card','buttons':[{'label': 'Prepare', 'cmd': 'p'},{'label': 'Start', 'cmd': 'r', 'id':'recordStart'},{'label': 'Stop', 'cmd': 's', 'id':'recordStop'}]},"
+                                "{'name':'Ultrasound Spectrum','buttons':[{'label': 'Stream On/Off', 'cmd': 'f'}]},"
+                                "{'name':'Log Ultrasound Events to SD','buttons':[{'label': 'Start', 'cmd': 'e'},{'label': 'Stop', 'cmd': 'E'},{'label': 'Status', 'cmd': 'd'}]},"
                                 "{'name':'Microphone Input Gain', 'buttons':[{'label': 'Less', 'cmd' :'I'},{'label': 'More', 'cmd': 'i'}]},"
                                 "{'name':'Extra Ultrasound Gain', 'buttons':[{'label': 'Less', 'cmd' :'O'},{'label': 'More', 'cmd': 'o'}]},"
                                 "{'name':'CPU Reporting', 'buttons':[{'label': 'Start', 'cmd' :'c','id':'cpuStart'},{'label': 'Stop', 'cmd': 'C'}]}"
@@ -0,0 +1,151 @@
+
+/*
+   SpectrumStreamer
+
+   Purpose: Takes the frames from AudioAnalyzeSpectrum_F32 (from loop()) and sends them to the
+     Tympan Remote app over BT (Serial1), as compact binary frames, within a fixed byte
+     budget.  It can also decode its own frames back to dB and print them as text (to the
+     USB serial, say), which is the reference for how to decode them.
+
+   Frame (same layout as the binary frames of the HearThru sketch):
+       SYNC (0xA5), LEN, RECORD (LEN bytes), CHECKSUM (XOR of the LEN bytes of RECORD)
+     where RECORD is TYPE (0x42), NBYTES, DATA (NBYTES bytes), and DATA is (little-endian):
+       uint16 seq          counts up by one per frame (a gap means that frames were dropped)
+       uint16 f_lo_Hz      the bottom of bin 0
+       uint16 f_hi_Hz      the top of the last bin.  The bins are evenly spaced in between.
+       int8   floor_dBFS   the level of code 0
+       uint8  step         dB per code, in 0.1 dB
+       uint8  n_bins
+       uint8  n_ffts       averaged into this frame (diagnostic)
+       uint8  code[n_bins] level = floor_dBFS + step/10 * code, in dBFS
+     With 64 bins, that is 79 bytes per frame, so 790 bytes/sec at 10 frames/sec.
+     Tools/SpectrumDecode (on the host) decodes a capture of them into CSV.
+
+   Budget: a frame is never sent sooner than its share of setMaxBytesPerSec() allows, and
+     only when the whole frame fits in the serial port's transmit buffer, so it never blocks
+     loop() and a frame never gets split by the text that is printed in between.  If it
+     can't go, the newest frame waits (replacing older ones) and the rest are counted as
+     skipped.
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _SpectrumStreamer_h
+#define _SpectrumStreamer_h
+
+#include "AudioAnalyzeSpectrum_F32.h"
+
+#define SPEC_SYNC (0xA5)
+#define SPEC_REC_SPECTRUM (0x42)
+#define SPEC_DATA_HEADER_BYTES (10)
+#define SPEC_MAX_FRAME_BYTES (2 + 2 + SPEC_DATA_HEADER_BYTES + SPEC_N_BINS + 1)
+#define SPEC_TX_EXTRA_BYTES (256)  //added to the serial port's transmit buffer, so that a whole frame fits
+
+class SpectrumStreamer {
+  public:
+    SpectrumStreamer(AudioAnalyzeSpectrum_F32 &_spec) : spec(_spec) {}
+
+    //give the port's transmit buffer room for a whole frame (Teensy's HardwareSerial)
+    void begin(HardwareSerial *_port) {
+      port = _port;
+      static uint8_t tx_extra[SPEC_TX_EXTRA_BYTES];
+      port->addMemoryForWrite(tx_extra, sizeof(tx_extra));
+    }
+    void setMaxBytesPerSec(int n) { max_bytes_per_sec = max(100, n); }
+    int getMaxBytesPerSec(void) { return max_bytes_per_sec; }
+
+    void setStreaming(bool state) { streaming = state; updateAnalyzer(); }
+    bool isStreaming(void) { return streaming; }
+    void setPrinting(Print *p) { print_ptr = p; updateAnalyzer(); }  //NULL to stop
+    bool isPrinting(void) { return print_ptr != NULL; }
+
+    unsigned long getNSent(void) { return n_sent; }
+    unsigned long getNSkipped(void) { return n_skipped; }
+
+    //call from loop().  Returns true if there was anything to do.
+    bool service(void) {
+      bool did_work = false;
+      AudioAnalyzeSpectrum_F32::Frame_t f;
+      while (spec.getFrame(f)) {
+        did_work = true;
+        if (have_frame && streaming) n_skipped++;  //never got out.  The newer one replaces it.
+        frame_len = makeFrame(f, frame);
+        have_frame = true;
+        if (print_ptr) printDecoded(print_ptr, frame, frame_len);
+      }
+      if (!have_frame) return did_work;
+      if (!streaming || !port) { have_frame = false; return did_work; }
+
+      //within the budget, and only if it all fits
+      const unsigned long min_interval_msec = (1000UL * frame_len) / max_bytes_per_sec;
+      if ((millis() - last_sent_msec) < min_interval_msec) return did_work;
+      if (port->availableForWrite() < frame_len) return did_work;
+      port->write(frame, frame_len);
+      last_sent_msec = millis();
+      have_frame = false;
+      n_sent++;
+      return true;
+    }
+
+    //decode a frame (this is how the app does it) and print it as one line:
+    //  "SPEC: seq, peak kHz, peak dBFS, then the level of each bin in dBFS"
+    static bool printDecoded(Print *p, const uint8_t *buf, int n) {
+      if ((n < 5) || (buf[0] != SPEC_SYNC) || (buf[1] != n - 3)) return false;
+      uint8_t check = 0;
+      for (int i = 2; i < n - 1; i++) check ^= buf[i];
+      if (check != buf[n - 1]) return false;
+      const uint8_t *rec = buf + 2, *d = rec + 2;
+      if ((rec[0] != SPEC_REC_SPECTRUM) || (rec[1] < SPEC_DATA_HEADER_BYTES)) return false;
+      const uint16_t seq = getU16(d), f_lo = getU16(d + 2), f_hi = getU16(d + 4);
+      const float floor_dB = (float)((int8_t)d[6]), step_dB = 0.1f * d[7];
+      const int n_bins = d[8];
+      if (rec[1] != SPEC_DATA_HEADER_BYTES + n_bins) return false;
+      const uint8_t *code = d + SPEC_DATA_HEADER_BYTES;
+
+      int best = 0;
+      for (int b = 1; b < n_bins; b++) if (code[b] > code[best]) best = b;
+      const float bin_Hz = ((float)(f_hi - f_lo)) / ((float)n_bins);
+      p->print("SPEC: "); p->print(seq);
+      p->print(", "); p->print(0.001f * (f_lo + (best + 0.5f) * bin_Hz), 2);
+      p->print(", "); p->print(floor_dB + step_dB * code[best], 1);
+      for (int b = 0; b < n_bins; b++) { p->print(", "); p->print(floor_dB + step_dB * code[b], 1); }
+      p->println();
+      return true;
+    }
+
+  private:
+    AudioAnalyzeSpectrum_F32 &spec;
+    HardwareSerial *port = NULL;
+    Print *print_ptr = NULL;
+    bool streaming = false, have_frame = false;
+    int max_bytes_per_sec = 1000;
+    uint8_t frame[SPEC_MAX_FRAME_BYTES];
+    int frame_len = 0;
+    unsigned long last_sent_msec = 0, n_sent = 0, n_skipped = 0;
+
+    void updateAnalyzer(void) { spec.enable(streaming || (print_ptr != NULL)); }
+
+    int makeFrame(const AudioAnalyzeSpectrum_F32::Frame_t &f, uint8_t *buf) {
+      uint8_t *rec = buf + 2, *d = rec + 2;
+      rec[0] = SPEC_REC_SPECTRUM; rec[1] = SPEC_DATA_HEADER_BYTES + SPEC_N_BINS;
+      putU16(d, f.seq);
+      putU16(d + 2, (uint16_t)(spec.getLowFreq_Hz() + 0.5f));
+      putU16(d + 4, (uint16_t)(spec.getHighFreq_Hz() + 0.5f));
+      d[6] = (uint8_t)((int8_t)SPEC_FLOOR_dBFS);
+      d[7] = (uint8_t)(10.0f * SPEC_STEP_dB + 0.5f);
+      d[8] = SPEC_N_BINS;
+      d[9] = f.n_ffts;
+      memcpy(d + SPEC_DATA_HEADER_BYTES, f.code, SPEC_N_BINS);
+
+      const int len = 2 + rec[1];
+      buf[0] = SPEC_SYNC; buf[1] = len;
+      uint8_t check = 0;
+      for (int i = 0; i < len; i++) check ^= rec[i];
+      buf[2 + len] = check;
+      return len + 3;
+    }
+    static void putU16(uint8_t *p, uint16_t val) { p[0] = val & 0xFF; p[1] = val >> 8; }
+    static uint16_t getU16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+};
+
+#endif
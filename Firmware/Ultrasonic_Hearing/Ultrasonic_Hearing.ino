@@ -20,11 +20,20 @@
 #define USE_STEREO 1
 
 //definitions for SD writing
-#define MAX_F32_BLOCKS (192)      //Can't seem to use more than 192, so you could set it to 192.  Won't run at all if much above 400.  
+#define MAX_F32_BLOCKS (192)      //The library's pool can't be bigger than 192.  A smaller size can be measured ('u') and saved ('U').
+int n_audio_blocks = 0;           //the size of the pool that was actually made at boot
 
 // Include all the of the needed libraries
 #include <Tympan_Library.h> //for AudioConvert_I16toF32, AudioConvert_F32toI16, and AudioEffectGain_F32
 #include "SDAudioWriter.h"
+#include "LoopScheduler.h"
+#include "AudioMixer4Ramped_F32.h"
+#include "AudioEffectUltrasoundDemod_F32.h"
+#include "AudioAnalyzeUltrasoundEvents_F32.h"
+#include "UltrasoundEventLogger.h"
+#include "AudioAnalyzeSpectrum_F32.h"
+#include "SpectrumStreamer.h"
+#include "AudioMemoryProfiler.h"
 #include "SerialManager.h"
 
 const float sample_rate_Hz = 96000.0f ; //24000 or 44117.64706f (or other frequencies in the table in AudioOutputI2S_F32
@@ -44,13 +53,12 @@ float ultrasound_gain_dB = 5.0;
 TympanPins                  tympPins(TYMPAN_REV_D3); //TYMPAN_REV_C or TYMPAN_REV_D
 TympanBase                  audioHardware(tympPins);
 AudioInputI2S_F32           i2s_in(audio_settings);  //Digital audio *from* the Teensy Audio Board ADC.  Sends Int16.  Stereo.
-AudioSynthWaveformSine_F32  carrier(audio_settings);   
 AudioRecordQueue_F32        queueL(audio_settings), queueR(audio_settings);     //gives access to audio data (will use for SD card)
 
-AudioEffectGain_F32         preGainL(audio_settings), preGainR(audio_settings);   
-AudioFilterBiquad_F32       iirL1(audio_settings), iirL2(audio_settings), iirR1(audio_settings), iirR2(audio_settings);         
-AudioMathMultiply_F32       multiplyL(audio_settings), multiplyR(audio_settings);  
-AudioMixer4_F32             mixerL(audio_settings), mixerR(audio_settings);
+AudioEffectUltrasoundDemod_F32 ultrasoundDemod(audio_settings);  //gain, high-pass, and carrier, for both channels in one node
+AudioAnalyzeUltrasoundEvents_F32 eventDetector(audio_settings);  //finds the bursts of ultrasound, and keeps the raw audio around them
+AudioAnalyzeSpectrum_F32    spectrum(audio_settings);       //the spectrum of the ultrasound band, for the app
+AudioMixer4Ramped_F32       mixerL(audio_settings), mixerR(audio_settings);  //gain changes are ramped (no clicks)
 AudioEffectCompWDRC_F32     fastCompL(audio_settings), fastCompR(audio_settings);      
 AudioOutputI2S_F32          i2s_out(audio_settings);        //Digital audio *to* the Teensy Audio Board DAC.  Expects Int16.  Stereo
 
@@ -58,14 +66,18 @@ AudioOutputI2S_F32          i2s_out(audio_settings);        //Digital audio *to*
 AudioConnection_F32           patchcord1001(i2s_in, 0, queueL, 0);   //connect Raw audio to queue (to enable SD writing)
 AudioConnection_F32           patchcord1002(i2s_in, 1, queueR, 0);  //connect Raw audio to queue (to enable SD writing)
 
+//Raw audio to the event detector (to enable SD writing of just the events)
+AudioConnection_F32           patchcord1003(i2s_in, 0, eventDetector, 0);
+AudioConnection_F32           patchcord1004(i2s_in, 1, eventDetector, 1);
+
+//Raw audio to the spectrum analyzer (to show the ultrasound in the app)
+AudioConnection_F32           patchcord1005(i2s_in, 0, spectrum, 0);
+AudioConnection_F32           patchcord1006(i2s_in, 1, spectrum, 1);
+
 //Make all of the audio connections for the left audio channel
 AudioConnection_F32         patchCord20(i2s_in, 0, mixerL, 0);  //raw path for hear-thru
-AudioConnection_F32         patchCord1(i2s_in, 0, preGainL, 0); //processed path for ultrasound
-AudioConnection_F32         patchCord2(preGainL, 0, iirL1, 0);
-AudioConnection_F32         patchCord3(iirL1, 0, iirL2, 0);
-AudioConnection_F32         patchCord10(iirL2, 0, multiplyL, 0);
-AudioConnection_F32         patchCord4(carrier, 0, multiplyL, 1);
-AudioConnection_F32         patchCord21(multiplyL, 0, mixerL, 1);  //end of ultrasound path
+AudioConnection_F32         patchCord1(i2s_in, 0, ultrasoundDemod, 0); //processed path for ultrasound
+AudioConnection_F32         patchCord21(ultrasoundDemod, 0, mixerL, 1);  //end of ultrasound path
 AudioConnection_F32         patchCord27(mixerL, 0, fastCompL, 0); //compression for whatever audio we're sending to the ears
 AudioConnection_F32         patchCord5(fastCompL, 0, i2s_out, 0); //send to left output
 //AudioConnection_F32         patchCord27(mixerL, 0, i2s_out, 0);  //send to left output
@@ -73,12 +85,8 @@ AudioConnection_F32         patchCord5(fastCompL, 0, i2s_out, 0); //send to left
 #if USE_STEREO
   //make all of the audio connections for the right audio channel
   AudioConnection_F32         patchCord2000(i2s_in, 1, mixerR, 0); //raw path for hear-thru
-  AudioConnection_F32         patchCord101(i2s_in, 1, preGainR, 0); //processed path for ultrasound
-  AudioConnection_F32         patchCord200(preGainR, 0, iirR1, 0);
-  AudioConnection_F32         patchCord300(iirR1, 0, iirR2, 0);
-  AudioConnection_F32         patchCord1000(iirR2, 0, multiplyR, 0);
-  AudioConnection_F32         patchCord400(carrier, 0, multiplyR, 1);
-  AudioConnection_F32         patchCord2100(multiplyR, 0, mixerR, 1);  //end of ultrasound path
+  AudioConnection_F32         patchCord101(i2s_in, 1, ultrasoundDemod, 1); //processed path for ultrasound
+  AudioConnection_F32         patchCord2100(ultrasoundDemod, 1, mixerR, 1);  //end of ultrasound path
   //AudioConnection_F32         patchCord2110(mixerR, 0, fastCompR, 0); //compression for whatever audio we're sending to the ears
   //AudioConnection_F32         patchCord500(fastCompR, 0, i2s_out, 1); //send to right output
   AudioConnection_F32         patchCord2110(mixerR,0,i2s_out,1);
@@ -94,11 +102,45 @@ const int config_mic_jack = 21;
 const int config_line_in_SE  = 22;
 
 int current_config = 0;
+
+//Changing the input is done in steps from loop(), with no delay()s: fade the output
+//down, switch the hardware, give the codec time to settle, and then fade back up.
+#define CONFIG_SETTLE_MSEC (100)
+enum class CONFIG_STEP { IDLE = 0, FADING_OUT, SETTLING };
+CONFIG_STEP config_step = CONFIG_STEP::IDLE;
+int pending_config = -1;
+unsigned long config_switched_msec = 0;
+
 void setConfiguration(int config) { 
+  pending_config = config;
+  mixerL.mute(true); mixerR.mute(true);  //fade out the output audio
+  config_step = CONFIG_STEP::FADING_OUT;
+}
+
+//run by the scheduler
+bool serviceConfiguration(void) {
+  switch (config_step) {
+    case CONFIG_STEP::IDLE:
+      return false;
+    case CONFIG_STEP::FADING_OUT:
+      if (mixerL.isRamping() || mixerR.isRamping()) return false;
+      applyConfiguration(pending_config);
+      config_switched_msec = millis();
+      config_step = CONFIG_STEP::SETTLING;
+      return true;
+    case CONFIG_STEP::SETTLING:
+      if ((millis() - config_switched_msec) < CONFIG_SETTLE_MSEC) return false;
+      mixerL.mute(false); mixerR.mute(false);  //fade the output audio back in
+      config_step = CONFIG_STEP::IDLE;
+      return true;
+  }
+  return false;
+}
+
+void applyConfiguration(int config) {
   switch (config) {
     case config_pcb_mics:
       //Select Input
-      audioHardware.setInputGain_dB(0); delay(100); //make quieter
       audioHardware.inputSelect(TYMPAN_INPUT_ON_BOARD_MIC); // use the on-board microphones
 
       //Set input gain to 0dB
@@ -112,7 +154,6 @@ void setConfiguration(int config) {
     case config_mic_jack:
 
       //Select Input
-      audioHardware.setInputGain_dB(0); delay(100); //make quieter
       audioHardware.inputSelect(TYMPAN_INPUT_JACK_AS_MIC); // use the mic jack
       audioHardware.setEnableStereoExtMicBias(true);
 
@@ -127,7 +168,6 @@ void setConfiguration(int config) {
     case config_line_in_SE:
       
       //Select Input
-      audioHardware.setInputGain_dB(0); delay(100); //make quieter
       audioHardware.inputSelect(TYMPAN_INPUT_LINE_IN); // use the line-input through holes
 
       //Set input gain to desired value
@@ -158,23 +198,21 @@ void setupAudioHardware(void) {
 //define my high-pass filter: [b,a]=butter(2,30000/(96000/2),'high')
 float32_t hp_b[] = {0.186694333116378,  -0.373388666232757,   0.186694333116378};
 float32_t hp_a[] = { 1.000000000000000,   0.462938025291041,   0.209715357756555};
+const float hp_below_carrier_Hz = 7000.0f;  //when the carrier moves, keep the high-pass this far below it (37 kHz -> 30 kHz, as above)
 
 float32_t carrier_freq_Hz = 37000.0f;
 
 //define functions to setup the audio processing parameters
 void setupAudioProcessing(void) {
   //set the pre-gain (if used)
-  preGainL.setGain_dB(ultrasound_gain_dB);
-  preGainR.setGain_dB(ultrasound_gain_dB);
+  ultrasoundDemod.setGain_dB(ultrasound_gain_dB);
 
   //setup the HP filter
-  iirL1.setFilterCoeff_Matlab(hp_a, hp_b);
-  iirL2.setFilterCoeff_Matlab(hp_a, hp_b); //appply the same filter a second time for steeper roll-off
-  iirR1.setFilterCoeff_Matlab(hp_a, hp_b);
-  iirR2.setFilterCoeff_Matlab(hp_a, hp_b); //appply the same filter a second time for steeper roll-off
+  ultrasoundDemod.setFilterCoefficients(0, hp_b, hp_a);
+  ultrasoundDemod.setFilterCoefficients(1, hp_b, hp_a); //appply the same filter a second time for steeper roll-off
 
   //setup the demodulation
-  carrier.amplitude(1.0);  carrier.frequency(carrier_freq_Hz);
+  ultrasoundDemod.setCarrier_Hz(carrier_freq_Hz);
 
   //setup the fast compression
   float maxdB = 105.0;  //calibration factor.  What dB SPL is full scale?
@@ -201,11 +239,15 @@ void togglePrintMemoryAndCPU(void) { enable_printCPUandMemory = !enable_printCPU
 void setPrintMemoryAndCPU(bool state) { enable_printCPUandMemory = state; };
 SerialManager serialManager(audioHardware);
 #define BOTH_SERIAL audioHardware
+LoopScheduler scheduler;  //runs all of the services from loop()
+#define SD_QUEUE_WATERMARK (8)  //blocks waiting for the SD.  Past this, the SD writing jumps the line.
+UltrasoundEventLogger eventLogger(eventDetector, my_SD_writer);  //writes the events' snippets (and a log of them) to the SD
+SpectrumStreamer spectrumStreamer(spectrum);  //sends the spectrum to the app over BT, as binary frames
 
 // define the setup() function, the function that is called once when the device is booting
 void setup() {
   //Setup serial communication
-  audioHardware.beginBothSerial(); delay(2000);
+  audioHardware.beginBothSerial();
 
   //print basic audio parameters
   BOTH_SERIAL.println(overall_name);
@@ -216,7 +258,8 @@ void setup() {
   #endif
   
   //allocate the audio memory
-  AudioMemory_F32_wSettings(MAX_F32_BLOCKS, audio_settings); //I can only seem to allocate 400 blocks
+  n_audio_blocks = allocateAudioMemory_F32(MAX_F32_BLOCKS, audio_settings); //sized from the saved profile, if there is one
+  BOTH_SERIAL.print("  Audio memory (F32 blocks): "); BOTH_SERIAL.println(n_audio_blocks);
 
   // Enable the audio shield, select input, and enable output
   setupAudioHardware();
@@ -224,92 +267,179 @@ void setup() {
   //setup filters and mixers
   setupAudioProcessing();
   
+  //the events get printed as they happen, even when they aren't being logged
+  eventLogger.setSerial(&BOTH_SERIAL);
+
+  //the spectrum: 64 bins from 15 to 48 kHz, 10 times a second.  At most 4 FFTs per frame, and 1000 bytes/sec on BT.
+  spectrum.setFrequencyRange_Hz(15000.0f, 48000.0f);
+  spectrum.setFrameRate_Hz(10.0f);
+  spectrum.setMaxFFTsPerFrame(4);
+  spectrumStreamer.begin(&Serial1);
+  spectrumStreamer.setMaxBytesPerSec(1000);
+
+  //set up the services for loop(), most important first.  Budgets are in microseconds.
+  int sd_task = scheduler.addTask("SD", serviceSDandEvents, 0, 5000);
+  scheduler.setUrgentTask(sd_task, isSDFallingBehind, 4);
+  scheduler.addTask("SerialIn", serviceSerialInput, 0, 1000);
+  scheduler.addTask("Config", serviceConfiguration, 0, 2000);
+  scheduler.addTask("Pot", servicePotentiometer, 100, 500);
+  scheduler.addTask("CPU", printCPUandMemory, 3000, 2000);
+  scheduler.addTask("LEDs", serviceLEDs, 50, 50);
+  scheduler.addTask("MemProfile", serviceMemoryProfile, 100, 500);
+  scheduler.addTask("Spectrum", serviceSpectrum, 20, 500);
+
   BOTH_SERIAL.println("setup() complete");
 } //end setup()
 
 
 // define the loop() function, the function that is repeated over and over for the life of the device
 void loop() {
-  //choose to sleep ("wait for interrupt") instead of spinning our wheels doing nothing but consuming power
-  asm(" WFI");  //ARM-specific.  Will wake on next interrupt.  The audio library issues tons of interrupts, so we wake up often.
+  //everything is a task in the scheduler.  When there is nothing to do, it sleeps ("wait for
+  //interrupt") instead of spinning our wheels doing nothing but consuming power.
+  scheduler.run();
 
-  //respond to Serial commands
-  while (Serial.available()) serialManager.respondToByte((char)Serial.read());   //USB Serial
-  while (Serial1.available()) serialManager.respondToByte((char)Serial1.read()); //BT Serial
-  
-  //service the SD recording
-  serviceSD();
+} //end loop()
 
-  //update the memory and CPU usage...if enough time has passed
-  if (enable_printCPUandMemory) printCPUandMemory(millis());
 
-  //change the LED status
-  serviceLEDs();
+bool serviceSerialInput(void) {
+  bool did_work = false;
+  while (Serial.available()) { serialManager.respondToByte((char)Serial.read()); did_work = true; }   //USB Serial
+  while (Serial1.available()) { serialManager.respondToByte((char)Serial1.read()); did_work = true; } //BT Serial
+  return did_work;
+}
 
-  //service the potentiometer...if enough time has passed
-  servicePotentiometer(millis());
-  
+bool isSDFallingBehind(void) { return (getSDQueueDepth() > SD_QUEUE_WATERMARK) || (eventLogger.getBacklog() > (USEVT_PRE_BLOCKS + SD_QUEUE_WATERMARK)); }
 
-} //end loop()
+//the continuous recording and the event logging share the SD (only one of them writes at a time)
+bool serviceSDandEvents(void) {
+  bool did_work = serviceSD();
+  if (eventLogger.service()) did_work = true;
+  return did_work;
+}
+
+//Event logging: only the bursts of ultrasound (and a log of them) go to the SD, instead of everything
+bool isEventLogging(void) { return eventLogger.isLogging(); }
+void startEventLogging(void) {
+  if (current_SD_state == STATE_RECORDING) { BOTH_SERIAL.println("Event Logging: stop the SD recording first ('s')."); return; }
+  prepareSDforRecording();
+  eventLogger.start();
+}
+void stopEventLogging(void) { eventLogger.stop(); }
+void printEventStatus(void) {
+  BOTH_SERIAL.print("Event Detector: "); BOTH_SERIAL.print(eventDetector.isActive() ? "in an event" : "idle");
+  BOTH_SERIAL.print(", 20-48 kHz = "); BOTH_SERIAL.print(eventDetector.getLevel_dBFS(), 1);
+  BOTH_SERIAL.print(" dBFS, floor = "); BOTH_SERIAL.print(eventDetector.getFloor_dBFS(), 1);
+  BOTH_SERIAL.print(" dBFS, threshold = floor + "); BOTH_SERIAL.print(eventDetector.getThreshold_dB(), 1);
+  BOTH_SERIAL.print(" dB, events = "); BOTH_SERIAL.print(eventDetector.getNEvents());
+  BOTH_SERIAL.print(" (dropped "); BOTH_SERIAL.print(eventDetector.getNDropped()); BOTH_SERIAL.println(")");
+  eventLogger.printStatus(&BOTH_SERIAL);
+}
+//Spectrum: streamed to the app (on BT), and/or decoded and printed as text (on USB)
+bool serviceSpectrum(void) { return spectrumStreamer.service(); }
+void toggleSpectrumStreaming(void) {
+  spectrumStreamer.setStreaming(!spectrumStreamer.isStreaming());
+  BOTH_SERIAL.print("Spectrum: streaming to the app is "); BOTH_SERIAL.println(spectrumStreamer.isStreaming() ? "ON" : "OFF");
+}
+void toggleSpectrumPrinting(void) {
+  spectrumStreamer.setPrinting(spectrumStreamer.isPrinting() ? NULL : &Serial);  //USB only, so it doesn't eat the BT bandwidth
+  BOTH_SERIAL.print("Spectrum: printing (on USB) is "); BOTH_SERIAL.println(spectrumStreamer.isPrinting() ? "ON" : "OFF");
+}
 
+float incrementEventThreshold(float increment_dB) {
+  eventDetector.setThreshold_dB(eventDetector.getThreshold_dB() + increment_dB);
+  return eventDetector.getThreshold_dB();
+}
+
+void printSchedulerStats(bool reset) {
+  scheduler.printStats(&BOTH_SERIAL);
+  if (reset) scheduler.resetStats();
+}
 
 //servicePotentiometer: listens to the blue potentiometer and sends the new pot value
 //  to the audio processing algorithm as a control parameter
-void servicePotentiometer(unsigned long curTime_millis) {
-  static unsigned long updatePeriod_millis = 100; //how many milliseconds between updating the potentiometer reading?
-  static unsigned long lastUpdate_millis = 0;
+//  (run by the scheduler every 100 msec)
+bool servicePotentiometer(void) {
   static float prev_val = 0;
 
-  //has enough time passed to update everything?
-  if (curTime_millis < lastUpdate_millis) lastUpdate_millis = 0; //handle wrap-around of the clock
-  if ((curTime_millis - lastUpdate_millis) > updatePeriod_millis) { //is it time to update the user interface?
-
-    //read potentiometer
-    float val = float(audioHardware.readPotentiometer()) / 1023.0; //0.0 to 1.0
-    val = 0.1 * (float)((int)(10.0 * val + 0.5)); //quantize so that it doesn't chatter...0 to 1.0
-
-    //send the potentiometer value to your algorithm as a control parameter
-    //float scaled_val = val / 3.0; scaled_val = scaled_val * scaled_val;
-    if (abs(val - prev_val) > 0.05) { //is it different than befor?
-      prev_val = val;  //save the value for comparison for the next time around
-
-
-      #if 0
-        //change the volume
-        float vol_dB = 0.f + 30.0f * ((val - 0.5) * 2.0); //set volume as 0dB +/- 30 dB
-        BOTH_SERIAL.print("Changing output volume frequency to = "); BOTH_SERIAL.print(vol_dB); BOTH_SERIAL.println(" dB");
-        audioHardware.volume_dB(vol_dB);
-      #else
-        //change the carrier
-        float freq = 30000 + 10000.f * val; //change tone carrier_Hz 30000-40000
-        BOTH_SERIAL.print("Changing carrier frequency to = "); BOTH_SERIAL.println(freq);
-        carrier.frequency(freq);
-        if (val < 0.025) {
-          mixerL.gain(0, 1.0);  mixerL.gain(1, 0.0); //switch to normal audio
-          mixerR.gain(0, 1.0);  mixerR.gain(1, 0.0); //switch to normal audio
-        } else {
-          mixerL.gain(0, 0.0);  mixerL.gain(1, 1.0); //switch to demodulated ultrasound
-          mixerR.gain(0, 0.0);  mixerR.gain(1, 1.0); //switch to demodulated ultrasound
-        }
-      #endif
-      
-    }
-    lastUpdate_millis = curTime_millis;
-  } // end if
+  //read potentiometer
+  float val = float(audioHardware.readPotentiometer()) / 1023.0; //0.0 to 1.0
+  val = 0.1 * (float)((int)(10.0 * val + 0.5)); //quantize so that it doesn't chatter...0 to 1.0
+
+  //send the potentiometer value to your algorithm as a control parameter
+  //float scaled_val = val / 3.0; scaled_val = scaled_val * scaled_val;
+  if (abs(val - prev_val) > 0.05) { //is it different than befor?
+    prev_val = val;  //save the value for comparison for the next time around
+
+
+    #if 0
+      //change the volume
+      float vol_dB = 0.f + 30.0f * ((val - 0.5) * 2.0); //set volume as 0dB +/- 30 dB
+      BOTH_SERIAL.print("Changing output volume frequency to = "); BOTH_SERIAL.print(vol_dB); BOTH_SERIAL.println(" dB");
+      audioHardware.volume_dB(vol_dB);
+    #else
+      //change the carrier
+      float freq = 30000 + 10000.f * val; //change tone carrier_Hz 30000-40000
+      BOTH_SERIAL.print("Changing carrier frequency to = "); BOTH_SERIAL.println(freq);
+      ultrasoundDemod.setCarrier_Hz(freq);
+      ultrasoundDemod.setHighpass(0, freq - hp_below_carrier_Hz);  //move the high-pass with the carrier
+      ultrasoundDemod.setHighpass(1, freq - hp_below_carrier_Hz);
+      if (val < 0.025) {
+        mixerL.gain(0, 1.0);  mixerL.gain(1, 0.0); //switch to normal audio
+        mixerR.gain(0, 1.0);  mixerR.gain(1, 0.0); //switch to normal audio
+      } else {
+        mixerL.gain(0, 0.0);  mixerL.gain(1, 1.0); //switch to demodulated ultrasound
+        mixerR.gain(0, 0.0);  mixerR.gain(1, 1.0); //switch to demodulated ultrasound
+      }
+    #endif
+    
+    return true;
+  }
+  return false;
 } //end servicePotentiometer();
 
 
-void printCPUandMemory(unsigned long curTime_millis) {
-  static unsigned long updatePeriod_millis = 3000; //how many milliseconds between updating gain reading?
-  static unsigned long lastUpdate_millis = 0;
-
-  //has enough time passed to update everything?
-  if (curTime_millis < lastUpdate_millis) lastUpdate_millis = 0; //handle wrap-around of the clock
-  if ((curTime_millis - lastUpdate_millis) > updatePeriod_millis) { //is it time to update the user interface?
-    printCPUandMemoryMessage();  
-    lastUpdate_millis = curTime_millis; //we will use this value the next time around.
+//Memory profile: normal audio, ultrasound, and both at once.  Afterwards, put the mixers back.
+AudioMemoryProfiler memProfiler;
+const int n_mem_profile_steps = 3;
+const char *mem_profile_names[n_mem_profile_steps] = {"Audio", "Ultrasound", "Audio + Ultrasound"};
+float mem_profile_saved_gains[2][2];
+void applyMemoryProfileStep(int step) {
+  if (step < n_mem_profile_steps) {
+    setOutputAudio(step != 1);
+    setOutputUltrasound(step != 0);
+  } else {
+    for (int i = 0; i < 2; i++) { mixerL.gain(i, mem_profile_saved_gains[0][i]); mixerR.gain(i, mem_profile_saved_gains[1][i]); }
   }
 }
+void startMemoryProfile(void) {
+  for (int i = 0; i < 2; i++) { mem_profile_saved_gains[0][i] = mixerL.getGain(i); mem_profile_saved_gains[1][i] = mixerR.getGain(i); }
+  if (!memProfiler.begin(n_mem_profile_steps, applyMemoryProfileStep, 1000)) {
+    BOTH_SERIAL.println("Memory Profile: already running.");
+    return;
+  }
+  BOTH_SERIAL.print("Memory Profile: running (about "); BOTH_SERIAL.print(n_mem_profile_steps); BOTH_SERIAL.print(" sec");
+  if (current_SD_state == STATE_RECORDING) BOTH_SERIAL.print(", including SD recording");
+  BOTH_SERIAL.println(")...");
+}
+bool serviceMemoryProfile(void) {
+  if (!memProfiler.service()) return false;
+  memProfiler.printReport(&audioHardware, mem_profile_names, MAX_F32_BLOCKS);
+  audioHardware.println("  Send 'U' to use the recommended pool size from the next boot.");
+  return true;
+}
+void saveMemoryProfile(void) {
+  if (memProfiler.getPeakBlocks() == 0) { BOTH_SERIAL.println("Memory Profile: run it first ('u')."); return; }
+  int n = memProfiler.getRecommendedBlocks(MAX_F32_BLOCKS);
+  saveAudioPoolSize(n);
+  BOTH_SERIAL.print("Memory Profile: saved.  The pool will be "); BOTH_SERIAL.print(n); BOTH_SERIAL.println(" blocks from the next boot.");
+}
+
+//run by the scheduler every few seconds
+bool printCPUandMemory(void) {
+  if (!enable_printCPUandMemory) return false;
+  printCPUandMemoryMessage();
+  return true;
+}
 void printCPUandMemoryMessage(void) {
     BOTH_SERIAL.print("CPU Cur/Peak: ");
     BOTH_SERIAL.print(audio_settings.processorUsage());
@@ -320,17 +450,83 @@ void printCPUandMemoryMessage(void) {
     BOTH_SERIAL.print(AudioMemoryUsage_F32());
     BOTH_SERIAL.print("/");
     BOTH_SERIAL.print(AudioMemoryUsageMax_F32());
+    BOTH_SERIAL.print(" of ");
+    BOTH_SERIAL.print(n_audio_blocks);
+    BOTH_SERIAL.print(", Ultrasound Demod CPU Cur/Peak: ");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(ultrasoundDemod.cpu_cycles),2);  //scaled for our sample rate and block size
+    BOTH_SERIAL.print("%/");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(ultrasoundDemod.cpu_cycles_max),2);
+    BOTH_SERIAL.print("%, Event Detector CPU Cur/Peak: ");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(eventDetector.cpu_cycles),2);
+    BOTH_SERIAL.print("%/");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(eventDetector.cpu_cycles_max),2);
+    BOTH_SERIAL.print("%, Spectrum CPU Cur/Peak: ");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(spectrum.cpu_cycles),2);
+    BOTH_SERIAL.print("%/");
+    BOTH_SERIAL.print(audio_settings.cpu_load_percent(spectrum.cpu_cycles_max),2);
+    BOTH_SERIAL.print("%");
     BOTH_SERIAL.println();
 }
 
-void serviceLEDs(void) {
+//Compare ways of making the carrier (cos and sin), for cost and for spectral purity.  The
+//error is against double-precision sin/cos at the same phase, so it bounds the spurs.
+//Each block is timed with interrupts off (which is short), so the audio doesn't get counted.
+void benchmarkCarrier(void) {
+  const int n_blocks = 32, n = AUDIO_BLOCK_SAMPLES;
+  float32_t I[n], Q[n];
+  static NCO_Core nco;  //static, so its table is only built once
+  nco.setSampleRate_Hz(audio_settings.sample_rate_Hz);
+  const uint32_t inc = nco.freqToIncrement(ultrasoundDemod.getCarrier_Hz());
+  nco.setIncrement(inc); nco.setPhase(0);
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;  //turn on the cycle counter
+  const char *names[] = {"NCO (table)", "sinf/cosf", "arm_sin/arm_cos"};
+  BOTH_SERIAL.print("Carrier benchmark at "); BOTH_SERIAL.print(ultrasoundDemod.getCarrier_Hz()); BOTH_SERIAL.print(" Hz, ");
+  BOTH_SERIAL.print(n_blocks * n); BOTH_SERIAL.println(" samples of I and Q:");
+  for (int method = 0; method < 3; method++) {
+    uint32_t phase = 0, cycles = 0;
+    double max_err = 0.0;
+    for (int b = 0; b < n_blocks; b++) {
+      uint32_t p = phase;
+      __disable_irq();
+      uint32_t start = ARM_DWT_CYCCNT;
+      if (method == 0) {
+        nco.generate(I, Q, n, inc, 1.0f, 1.0f);
+      } else if (method == 1) {
+        for (int i = 0; i < n; i++) { float x = ((float)p) * (2.0f * M_PI / 4294967296.0f); I[i] = cosf(x); Q[i] = sinf(x); p += inc; }
+      } else {
+        for (int i = 0; i < n; i++) { float x = ((float)p) * (2.0f * M_PI / 4294967296.0f); I[i] = arm_cos_f32(x); Q[i] = arm_sin_f32(x); p += inc; }
+      }
+      cycles += ARM_DWT_CYCCNT - start;
+      __enable_irq();
+
+      //check against the exact values
+      p = phase;
+      for (int i = 0; i < n; i++) {
+        double x = ((double)p) * (2.0 * M_PI / 4294967296.0);
+        max_err = max(max_err, max(fabs(I[i] - cos(x)), fabs(Q[i] - sin(x))));
+        p += inc;
+      }
+      phase = p;
+    }
+    float cyc_per_sample = ((float)cycles) / ((float)(n_blocks * n));
+    BOTH_SERIAL.print("  "); BOTH_SERIAL.print(names[method]);
+    BOTH_SERIAL.print(": cycles/sample = "); BOTH_SERIAL.print(cyc_per_sample, 1);
+    BOTH_SERIAL.print(" (CPU at fs = "); BOTH_SERIAL.print(100.0f * cyc_per_sample * audio_settings.sample_rate_Hz / ((float)F_CPU), 2);
+    BOTH_SERIAL.print("%), worst error = "); BOTH_SERIAL.print(20.0 * log10(max(max_err, 1.0e-12)), 1);
+    BOTH_SERIAL.println(" dBFS");
+  }
+}
+
+bool serviceLEDs(void) {
   if (current_SD_state == STATE_UNPREPARED) {
     audioHardware.setRedLED(HIGH); audioHardware.setAmberLED(HIGH); //Turn ON both
-  } else if (current_SD_state == STATE_RECORDING) {
+  } else if ((current_SD_state == STATE_RECORDING) || eventLogger.isLogging()) {
     audioHardware.setRedLED(LOW); audioHardware.setAmberLED(HIGH); //Go Amber
   } else {
     audioHardware.setRedLED(HIGH); audioHardware.setAmberLED(LOW); //Go Red
   }
+  return false;  //cheap, so never worth staying awake for
 }
 
 //here's a function to change the volume settings.   We'll also invoke it from our serialManager
@@ -346,8 +542,7 @@ float incrementInputGain(float increment_dB) {
 }
 float incrementUltrasoundGain(float increment_dB) {
   ultrasound_gain_dB += increment_dB;
-  preGainL.setGain_dB(ultrasound_gain_dB);
-  preGainR.setGain_dB(ultrasound_gain_dB);
+  ultrasoundDemod.setGain_dB(ultrasound_gain_dB);
   return ultrasound_gain_dB;
 }
 // //////////////////////////////////// Control the audio processing from the SerialManager
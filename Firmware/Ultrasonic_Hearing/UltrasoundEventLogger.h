@@ -0,0 +1,237 @@
+
+/*
+   UltrasoundEventLogger
+
+   Purpose: Takes what AudioAnalyzeUltrasoundEvents_F32 found (from loop()) and
+     * writes each event's snippet (the raw 96 kHz stereo, from just before it started to
+       just after it ended) to SNIPxx.RAW, one snippet after another
+     * writes one line per event to EVLOGxx.CSV, saying where its snippet is in the RAW file
+     * prints one "EVENT:" line per event to the serial, whether or not it's logging
+   So a survey only keeps the interesting bits, instead of recording everything.
+
+   It goes through the same SDAudioWriter as the continuous recording, so it can't run at the
+   same time as one.
+
+   RAW format: int16, interleaved L/R, at the detector's sample rate, no header (same as
+     RECORDxx.RAW).  Each snippet starts at offset_samples (counted in stereo samples, so
+     the byte offset is 4 x offset_samples) and is n_samples long.
+   CSV columns:
+     event, start_msec, offset_samples, n_samples, duration_msec, peak_dBFS, floor_dBFS, peak_kHz
+     where start_msec is millis() when it triggered, duration_msec is the event itself (the
+     snippet is longer, by the pre- and post-trigger), the levels are of the 20-48 kHz band,
+     and peak_kHz is the strongest of the detector's Goertzel frequencies.  If the SD fell
+     too far behind, the snippet can be missing (offset_samples = -1, n_samples = 0).  If
+     loop() fell so far behind that the detector's queue was full, the event itself is lost:
+     its number is skipped in the CSV, and the count is printed (and in the status).
+
+   Falling behind: the snippets are read straight out of the detector's ring, which keeps
+     getting overwritten.  So a snippet is thrown out (offset_samples = -1) if
+     * the count of written blocks, read again after a block went to the SD, says the block
+       could have been overwritten while it was being copied (the SD write can be slow)
+     * the logger had to skip ahead past its start, so that its first block isn't its event's
+       pre-trigger start (the event says where that is)
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _UltrasoundEventLogger_h
+#define _UltrasoundEventLogger_h
+
+#include "AudioAnalyzeUltrasoundEvents_F32.h"
+//SDAudioWriter.h must already be included (by the main file).  It also makes the globals, so it can't be included twice.
+
+#define EVLOG_BLOCKS_PER_CALL (4)   //each is 512 bytes, which is what the SD likes
+#define EVLOG_SAFETY_BLOCKS (4)     //don't read a block this close to being overwritten
+
+class UltrasoundEventLogger {
+  public:
+    UltrasoundEventLogger(AudioAnalyzeUltrasoundEvents_F32 &_det, SDAudioWriter &_writer) : det(_det), writer(_writer) {}
+    void setSerial(Print *_serial_ptr) { serial_ptr = _serial_ptr; }
+    void setPrintEvents(bool state) { print_events = state; }
+
+    //open the next SNIPxx.RAW and EVLOGxx.CSV and start logging.  The SD must already be initialized.
+    bool start(void) {
+      if (logging) return true;
+      if (writer.isFileOpen()) {
+        if (serial_ptr) serial_ptr->println("EventLogger: the SD is busy (recording?).");
+        return false;
+      }
+      char snip_fname[] = "SNIP00.RAW", log_fname[] = "EVLOG00.CSV";
+      int i = 0;
+      for ( ; i < 100; i++) {
+        snip_fname[4] = '0' + (i / 10); snip_fname[5] = '0' + (i % 10);
+        if (!writer.exists(snip_fname)) break;
+      }
+      log_fname[5] = snip_fname[4]; log_fname[6] = snip_fname[5];
+      if ((i >= 100) || !writer.open(snip_fname) || !writer.openLog(log_fname)) {
+        writer.close(); writer.closeLog();
+        if (serial_ptr) serial_ptr->println("EventLogger: could not open the files.");
+        return false;
+      }
+      writer.writeLog("event,start_msec,offset_samples,n_samples,duration_msec,peak_dBFS,floor_dBFS,peak_kHz\n");
+      offset_samples = 0; n_logged = 0; n_lost_blocks = 0; n_dropped = 0;
+      snip_id = 0; n_snips = 0; n_events = 0;
+      read_block = det.getNBlocksWritten();  //only the new ones
+      logging = true;
+      if (serial_ptr) { serial_ptr->print("EventLogger: logging to "); serial_ptr->print(snip_fname); serial_ptr->print(" and "); serial_ptr->println(log_fname); }
+      return true;
+    }
+    void stop(void) {
+      if (!logging) return;
+      finishSnippet();
+      while (n_events > 0) { logEvent(events[0], -1, 0); dropEvent(); }  //whatever is left, without its snippet
+      writer.close(); writer.closeLog();
+      logging = false;
+      if (serial_ptr) {
+        serial_ptr->print("EventLogger: stopped, after "); serial_ptr->print(n_logged); serial_ptr->print(" events");
+        if (n_dropped > 0) { serial_ptr->print(" ("); serial_ptr->print(n_dropped); serial_ptr->print(" more dropped)"); }
+        serial_ptr->println(".");
+      }
+    }
+    bool isLogging(void) { return logging; }
+    unsigned long getNLogged(void) { return n_logged; }
+    unsigned long getNLostBlocks(void) { return n_lost_blocks; }
+    unsigned long getNDropped(void) { return n_dropped; }  //events that the detector lost, while logging
+
+    //blocks in the detector's ring that haven't been looked at yet
+    int getBacklog(void) { return logging ? (int)(det.getNBlocksWritten() - read_block) : 0; }
+
+    //call from loop().  Returns true if there was anything to do.
+    bool service(void) {
+      bool did_work = false;
+
+      //the finished events
+      AudioAnalyzeUltrasoundEvents_F32::Event_t ev;
+      while (det.getEvent(ev)) {
+        did_work = true;
+        if (print_events) printEvent(ev);
+        if (!logging) continue;
+        if (n_events >= USEVT_QUEUE_LEN) { logEvent(events[0], -1, 0); dropEvent(); }  //shouldn't happen
+        events[n_events++] = ev;
+      }
+
+      //the events that didn't fit in the detector's queue
+      const unsigned long det_dropped = det.getNDropped();
+      if (det_dropped != last_det_dropped) {
+        const unsigned long n_new = det_dropped - last_det_dropped;
+        last_det_dropped = det_dropped;
+        if (print_events && serial_ptr) { serial_ptr->print("EventLogger: "); serial_ptr->print(n_new); serial_ptr->println(" event(s) dropped (the detector's queue was full)"); }
+        if (logging) n_dropped += n_new;
+        did_work = true;
+      }
+      if (!logging) return did_work;
+
+      //the snippets
+      const int n_blocks = det.getBlockSamples();
+      uint32_t n_written = det.getNBlocksWritten();
+      if ((n_written - read_block) > (USEVT_RING_BLOCKS - EVLOG_SAFETY_BLOCKS)) {
+        //fell too far behind.  Skip ahead, to what's still safe.
+        uint32_t new_read = n_written - (USEVT_RING_BLOCKS - EVLOG_SAFETY_BLOCKS);
+        n_lost_blocks += new_read - read_block;
+        read_block = new_read;
+        if (snip_id != 0) { snip_len = -1; }  //that one is broken
+        did_work = true;
+      }
+      for (int count = 0; (count < EVLOG_BLOCKS_PER_CALL) && (read_block != n_written); ) {
+        const uint16_t id = det.getBlockId(read_block);
+        if (id == 0) {
+          //unmarked.  Wait until it is too old to be someone's pre-trigger.
+          if ((n_written - read_block) <= USEVT_PRE_BLOCKS) break;
+          finishSnippet();
+          read_block++;
+          continue;
+        }
+        if (id != snip_id) { finishSnippet(); snip_id = id; snip_first_block = read_block; snip_offset = offset_samples; snip_len = 0; }
+        writer.writeInt16(det.getBlockData(read_block), 2 * n_blocks);
+        offset_samples += n_blocks;
+        if (snip_len >= 0) snip_len += n_blocks;
+        did_work = true;
+
+        //was it still safe when the copy finished?  If not, that snippet is broken, and the
+        //skip-ahead (next time) gets back to what is still safe.
+        const bool overrun = ((det.getNBlocksWritten() - read_block) > (USEVT_RING_BLOCKS - EVLOG_SAFETY_BLOCKS));  //same limit as the skip-ahead
+        read_block++; count++;
+        if (overrun) { snip_len = -1; break; }
+      }
+
+      //pair up the finished snippets with their events, and log them
+      while ((n_events > 0) && (n_snips > 0)) {
+        int16_t d = (int16_t)(snips[0].id - events[0].id);
+        if (d == 0) {
+          const bool whole = (snips[0].first_block == events[0].snip_start_block);  //not if a skip-ahead landed in the middle of it
+          logEvent(events[0], whole ? snips[0].offset : -1, whole ? snips[0].len : 0);
+          dropEvent(); dropSnip();
+        }
+        else if (d < 0) { dropSnip(); }                              //its event was lost
+        else { logEvent(events[0], -1, 0); dropEvent(); }           //its snippet was lost
+        did_work = true;
+      }
+      return did_work;
+    }
+
+    void printStatus(Print *p) {
+      p->print("Event Logger: "); p->print(logging ? "logging" : "not logging");
+      p->print(", events logged = "); p->print(n_logged);
+      p->print(", SD bytes = "); p->print(4 * offset_samples);
+      p->print(", backlog = "); p->print(getBacklog()); p->print(" blocks");
+      p->print(", blocks lost = "); p->print(n_lost_blocks);
+      p->print(", events dropped = "); p->println(n_dropped);
+    }
+
+  private:
+    AudioAnalyzeUltrasoundEvents_F32 &det;
+    SDAudioWriter &writer;
+    Print *serial_ptr = &Serial;
+    bool logging = false, print_events = true;
+    uint32_t read_block = 0;
+    unsigned long offset_samples = 0, n_logged = 0, n_lost_blocks = 0, n_dropped = 0, last_det_dropped = 0;
+
+    //the snippet being written, and the ones that are done but not yet logged
+    struct Snip_t { uint16_t id; uint32_t first_block; long offset, len; };
+    uint16_t snip_id = 0;
+    uint32_t snip_first_block = 0;
+    long snip_offset = 0, snip_len = 0;
+    Snip_t snips[USEVT_QUEUE_LEN];
+    int n_snips = 0;
+
+    //the events waiting for their snippets
+    AudioAnalyzeUltrasoundEvents_F32::Event_t events[USEVT_QUEUE_LEN];
+    int n_events = 0;
+
+    void finishSnippet(void) {
+      if (snip_id == 0) return;
+      if (n_snips >= USEVT_QUEUE_LEN) dropSnip();
+      snips[n_snips].id = snip_id;
+      snips[n_snips].first_block = snip_first_block;
+      snips[n_snips].offset = (snip_len >= 0) ? snip_offset : -1;
+      snips[n_snips].len = max(0L, snip_len);
+      n_snips++;
+      snip_id = 0;
+    }
+    void dropSnip(void) { for (int i = 1; i < n_snips; i++) snips[i - 1] = snips[i]; n_snips--; }
+    void dropEvent(void) { for (int i = 1; i < n_events; i++) events[i - 1] = events[i]; n_events--; }
+
+    void logEvent(const AudioAnalyzeUltrasoundEvents_F32::Event_t &ev, long offset, long len) {
+      char line[96];
+      const float block_msec = 1000.0f * det.getBlockSamples() / det.getSampleRate_Hz();
+      int n = snprintf(line, sizeof(line), "%u,%lu,%ld,%ld", (unsigned)ev.id, (unsigned long)ev.start_msec, offset, len);
+      const float vals[4] = { ev.n_blocks * block_msec, toDB(ev.peak_ms), toDB(ev.floor_ms), 0.001f * ev.peak_Hz };
+      for (int i = 0; i < 4; i++) { line[n++] = ','; dtostrf(vals[i], 1, 1, line + n); n += strlen(line + n); }  //no %f in printf here
+      line[n++] = '\n'; line[n] = '\0';
+      writer.writeLog(line);
+      n_logged++;
+    }
+    void printEvent(const AudioAnalyzeUltrasoundEvents_F32::Event_t &ev) {
+      if (!serial_ptr) return;
+      const float block_msec = 1000.0f * det.getBlockSamples() / det.getSampleRate_Hz();
+      serial_ptr->print("EVENT: "); serial_ptr->print(ev.id);
+      serial_ptr->print(", t = "); serial_ptr->print(0.001f * ev.start_msec, 3);
+      serial_ptr->print(" sec, "); serial_ptr->print(ev.n_blocks * block_msec, 1);
+      serial_ptr->print(" msec, peak = "); serial_ptr->print(toDB(ev.peak_ms), 1);
+      serial_ptr->print(" dBFS (floor "); serial_ptr->print(toDB(ev.floor_ms), 1);
+      serial_ptr->print("), near "); serial_ptr->print(0.001f * ev.peak_Hz, 1); serial_ptr->println(" kHz");
+    }
+    static float toDB(float32_t ms) { return 10.0f * log10f(max(ms, 1.0e-12f)); }
+};
+
+#endif
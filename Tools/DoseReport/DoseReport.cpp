@@ -0,0 +1,214 @@
+/*
+   DoseReport
+
+   Purpose: Adds up the DOSExx.BIN logs from the HearThru_wBTAudio sketch (see DoseLogger.h)
+     into one noise-exposure report: for each file, and for all of them together, the time
+     covered, the LAeq and the highest LCpeak of each channel, and the dose (NIOSH: 85 dBA
+     for 8 hours is 100%, 3 dB exchange rate).  So days of logs can be handed over as one
+     report for hearing conservation.
+
+   It runs on the host (PC, Mac, Linux), not on the Tympan.  Build it with any C++11 compiler:
+       g++ -O2 -std=c++11 -pthread DoseReport.cpp -o DoseReport
+   and run it on the files (or on the folders that hold them):
+       DoseReport [-j n_threads] [-c] DOSE00.BIN DOSE01.BIN ...  or  DoseReport /media/SDCARD
+     -c prints the per-file lines as CSV instead of the table
+
+   How it works:
+     * the files are read and added up in parallel, one file at a time per thread (there are
+       -j threads, or one per core).  Each file's sums are kept on their own and then merged,
+       in file order, so the report comes out the same however many threads there are.
+     * the energy is added up from each second's LAeq, so the dose doesn't stop at the 655%
+       that fits in the record's own running dose, and it carries on across files
+     * a record whose check word is wrong is counted and skipped.  The time that is missing
+       (seconds that the Tympan lost, or gaps where it wasn't logging) is counted too, so
+       the report says how much of the time it really covers.
+
+   The logs are little-endian, and so is every host that this is likely to run on.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+//the file format (must match DoseLogger.h)
+#define DOSE_LOG_VERSION (1)
+#define DOSE_RECORD_BYTES (32)
+#define DOSE_MAX_CHAN (4)
+#define DOSE_CRITERION_dBA (85.0)
+#define DOSE_CRITERION_SEC (8.0 * 3600.0)
+
+static const char *chan_names[DOSE_MAX_CHAN] = {"Mic L", "Mic R", "Ear L", "Ear R"};
+
+struct Summary_t {
+  std::string fname;
+  bool ok = false;
+  std::string error;
+  int n_chan = 0;
+  float cal_dBSPL = 0.0f;
+  unsigned long n_sec = 0, n_bad = 0, n_lost = 0, n_gap = 0;
+  double energy_sum[DOSE_MAX_CHAN] = {0.0};
+  float max_peak_dB[DOSE_MAX_CHAN] = {-200.0f, -200.0f, -200.0f, -200.0f};
+
+  double getLAeq_dB(int c) const { return (n_sec > 0) ? 10.0 * log10(std::max(energy_sum[c] / n_sec, 1.0e-20)) : 0.0; }
+  double getDose_percent(int c) const { return 100.0 * energy_sum[c] / (pow(10.0, 0.1 * DOSE_CRITERION_dBA) * DOSE_CRITERION_SEC); }
+
+  void add(const Summary_t &s) {
+    if (!s.ok) return;
+    n_chan = std::max(n_chan, s.n_chan);
+    n_sec += s.n_sec; n_bad += s.n_bad; n_lost += s.n_lost; n_gap += s.n_gap;
+    for (int c = 0; c < DOSE_MAX_CHAN; c++) {
+      energy_sum[c] += s.energy_sum[c];
+      max_peak_dB[c] = std::max(max_peak_dB[c], s.max_peak_dB[c]);
+    }
+    ok = true;
+  }
+};
+
+static uint16_t getU16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t getU32(const uint8_t *p) { return (uint32_t)getU16(p) | ((uint32_t)getU16(p + 2) << 16); }
+
+//read one DOSExx.BIN and add it up
+static void summarizeFile(Summary_t &s) {
+  FILE *f = fopen(s.fname.c_str(), "rb");
+  if (!f) { s.error = "could not open"; return; }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) data.insert(data.end(), chunk, chunk + n);
+  fclose(f);
+
+  if ((data.size() < DOSE_RECORD_BYTES) || (memcmp(data.data(), "DOSE", 4) != 0)) { s.error = "not a dose log"; return; }
+  const uint8_t *h = data.data();
+  if (getU16(h + 4) != DOSE_LOG_VERSION) { s.error = "unknown version " + std::to_string(getU16(h + 4)); return; }
+  if (getU16(h + 6) != DOSE_RECORD_BYTES) { s.error = "unexpected record size"; return; }
+  s.n_chan = getU16(h + 8);
+  if ((s.n_chan < 1) || (s.n_chan > DOSE_MAX_CHAN)) { s.error = "unexpected number of channels"; return; }
+  memcpy(&s.cal_dBSPL, h + 12, 4);
+
+  bool have_prev = false;
+  uint32_t prev_sec = 0;
+  for (size_t ind = DOSE_RECORD_BYTES; ind + DOSE_RECORD_BYTES <= data.size(); ind += DOSE_RECORD_BYTES) {
+    const uint8_t *r = data.data() + ind;
+    uint16_t check = 0;
+    for (int i = 0; i < DOSE_RECORD_BYTES - 2; i += 2) check ^= getU16(r + i);
+    if (check != getU16(r + DOSE_RECORD_BYTES - 2)) { s.n_bad++; continue; }
+
+    const uint32_t sec = getU32(r);
+    const unsigned long n_lost = getU16(r + 26);
+    s.n_lost += n_lost;
+    if (have_prev && (sec > prev_sec + 1)) s.n_gap += (sec - prev_sec - 1) - std::min<unsigned long>(n_lost, sec - prev_sec - 1);  //not counted twice
+    prev_sec = sec; have_prev = true;
+
+    for (int c = 0; c < s.n_chan; c++) {
+      s.energy_sum[c] += pow(10.0, 0.01 * 0.1 * (int16_t)getU16(r + 4 + 2 * c));
+      s.max_peak_dB[c] = std::max(s.max_peak_dB[c], 0.01f * (int16_t)getU16(r + 12 + 2 * c));
+    }
+    s.n_sec++;
+  }
+  s.ok = true;
+}
+
+//the files, and the DOSExx.BIN files in any folders
+static void findFiles(const char *path, std::vector<std::string> &fnames) {
+  struct stat st;
+  if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    std::vector<std::string> found;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+      const char *name = ent->d_name;
+      const size_t len = strlen(name);
+      if ((len > 8) && (strncmp(name, "DOSE", 4) == 0) && (strcmp(name + len - 4, ".BIN") == 0)) found.push_back(std::string(path) + "/" + name);
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());  //DOSE00, DOSE01, ... in the order they were made
+    fnames.insert(fnames.end(), found.begin(), found.end());
+  } else {
+    fnames.push_back(path);
+  }
+}
+
+static void printHours(double sec) { printf("%8.2f h", sec / 3600.0); }
+
+int main(int argc, char **argv) {
+  int n_threads = (int)std::thread::hardware_concurrency();
+  bool csv = false;
+  std::vector<std::string> fnames;
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc)) { n_threads = atoi(argv[++i]); continue; }
+    if (strcmp(argv[i], "-c") == 0) { csv = true; continue; }
+    findFiles(argv[i], fnames);
+  }
+  if (fnames.empty()) {
+    fprintf(stderr, "usage: DoseReport [-j n_threads] [-c] DOSExx.BIN ... (or folders)\n");
+    return 1;
+  }
+
+  //add up each file, in parallel
+  std::vector<Summary_t> summaries(fnames.size());
+  for (size_t i = 0; i < fnames.size(); i++) summaries[i].fname = fnames[i];
+  n_threads = std::max(1, std::min(n_threads, (int)fnames.size()));
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; t++) {
+    threads.push_back(std::thread([&]() {
+      for (size_t i = next++; i < summaries.size(); i = next++) summarizeFile(summaries[i]);
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+  //merge, in file order
+  Summary_t total;
+  int n_failed = 0;
+  for (size_t i = 0; i < summaries.size(); i++) {
+    if (!summaries[i].ok) { fprintf(stderr, "%s: %s (skipped)\n", summaries[i].fname.c_str(), summaries[i].error.c_str()); n_failed++; }
+    total.add(summaries[i]);
+  }
+
+  //per file
+  if (csv) {
+    printf("file,seconds,seconds_missing,bad_records,chan,LAeq_dBA,max_LCpeak_dBC,dose_percent\n");
+    for (size_t i = 0; i < summaries.size(); i++) {
+      const Summary_t &s = summaries[i];
+      if (!s.ok) continue;
+      for (int c = 0; c < s.n_chan; c++) {
+        printf("%s,%lu,%lu,%lu,%s,%.1f,%.1f,%.2f\n", s.fname.c_str(), s.n_sec, s.n_lost + s.n_gap, s.n_bad,
+               chan_names[c], s.getLAeq_dB(c), s.max_peak_dB[c], s.getDose_percent(c));
+      }
+    }
+    return (n_failed > 0) ? 2 : 0;
+  }
+  for (size_t i = 0; i < summaries.size(); i++) {
+    const Summary_t &s = summaries[i];
+    if (!s.ok) continue;
+    printf("%s: ", s.fname.c_str()); printHours(s.n_sec);
+    printf(" (cal %.1f dB SPL", s.cal_dBSPL);
+    if (s.n_lost + s.n_gap > 0) printf(", %lu sec missing", s.n_lost + s.n_gap);
+    if (s.n_bad > 0) printf(", %lu bad records", s.n_bad);
+    printf(")\n");
+    for (int c = 0; c < s.n_chan; c++) {
+      printf("    %s: LAeq = %5.1f dBA, max LCpeak = %5.1f dBC, dose = %7.2f%%\n", chan_names[c], s.getLAeq_dB(c), s.max_peak_dB[c], s.getDose_percent(c));
+    }
+  }
+
+  //all together
+  if (!total.ok) { fprintf(stderr, "No usable logs.\n"); return 2; }
+  printf("\nTotal: %d file(s), ", (int)summaries.size() - n_failed); printHours(total.n_sec);
+  printf(" logged, %lu sec missing, %lu bad records\n", total.n_lost + total.n_gap, total.n_bad);
+  for (int c = 0; c < total.n_chan; c++) {
+    printf("    %s: LAeq = %5.1f dBA, max LCpeak = %5.1f dBC, dose = %7.2f%%\n", chan_names[c], total.getLAeq_dB(c), total.max_peak_dB[c], total.getDose_percent(c));
+  }
+  return (n_failed > 0) ? 2 : 0;
+}
@@ -0,0 +1,120 @@
+/*
+   BeamformerSim
+
+   Purpose: Checks the directivity of the two-mic beamformer (Beamformer_Core, in
+     AudioEffectBeamformer_F32.h of the HearThru_wBTAudio sketch) with synthetic plane waves
+     from known angles, on the host.  This used to be the 'H' command on the Tympan, which
+     stopped the audio while it ran; 'H' now only times the modes.
+       g++ -O2 -std=c++14 -I. BeamformerSim.cpp -o BeamformerSim && ./BeamformerSim
+
+   The sketch's settings: 14 mm between the mics, the EQ corner at 200 Hz, 96 kHz.  For each
+   mode, it prints the response re: the front mic at 1 kHz from 0 to 180 deg, at 4 kHz from
+   the front and the back, and the directivity index at 1 kHz, and it checks:
+     * delay-and-sum: flat (within 1 dB) from the front
+     * cardioid: within 1.5 dB of the front mic on-axis (the EQ), at least 20 dB down at the
+       back, and a DI within 1 dB of the ideal cardioid's 4.8 dB
+     * adaptive: after half a second of noise from 120 deg, the null is within 10 deg of it,
+       and that noise is at least 6 dB further down than the cardioid gets it
+
+   It prints the results and returns nonzero if anything fails.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <Tympan_Library.h>
+#include "../../Firmware/HearThru_wBTAudio/AudioEffectBeamformer_F32.h"
+
+#define FS_HZ (96000.0f)
+#define N_SAMP (128)
+
+const float spacing_mm = 14.0f, eq_corner_Hz = 200.0f;  //the sketch's
+const float noise_deg = 120.0f;
+
+static int n_failed = 0;
+static void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "pass" : "FAIL", what);
+  if (!ok) n_failed++;
+}
+
+static float toDB(float x) { return 20.0f * log10f(max(x, 1.0e-10f)); }
+
+//Plane waves (a sum of tones) through a beamformer, from theta_deg (0 is straight ahead).
+//Returns the output RMS over the front mic's RMS, after it settles.
+static float beamResponse(Beamformer_Core &core, const float *freqs_Hz, int n_tones, float theta_deg, int n_blocks) {
+  static float32_t f[N_SAMP], r[N_SAMP], y[N_SAMP];
+  const int n_settle = 16;
+  const double lag = core.getDelay_samples() * cos(theta_deg * M_PI / 180.0);  //how much later it reaches the rear mic
+  double in_sq = 0.0, out_sq = 0.0;
+  for (long k = 0, t = 0; k < n_settle + n_blocks; k++) {
+    for (int i = 0; i < N_SAMP; i++, t++) {
+      f[i] = 0.0f; r[i] = 0.0f;
+      for (int j = 0; j < n_tones; j++) {
+        const double w = 2.0 * M_PI * freqs_Hz[j] / FS_HZ, ph = 1.7 * j;  //not all in phase
+        f[i] += (float32_t)(0.1 * sin(w * t + ph));
+        r[i] += (float32_t)(0.1 * sin(w * (t - lag) + ph));
+      }
+    }
+    core.process(f, r, y, N_SAMP);
+    if (k < n_settle) continue;
+    for (int i = 0; i < N_SAMP; i++) { in_sq += f[i] * f[i]; out_sq += y[i] * y[i]; }
+  }
+  return (float)sqrt(out_sq / max(in_sq, 1.0e-20));
+}
+
+int main(void) {
+  static Beamformer_Core core;
+  const float f_1k[] = {1000.0f}, f_4k[] = {4000.0f};
+  const float noise_tones[] = {300.0f, 700.0f, 1100.0f, 1900.0f, 2700.0f};
+  const int n_noise_tones = sizeof(noise_tones) / sizeof(noise_tones[0]);
+  const int n_blocks = 32;
+  const float mu = core.getAdaptRate();  //the default, as in the sketch
+  core.setSampleRate_Hz(FS_HZ);
+  core.setSpacing_mm(spacing_mm);
+  core.setEqCorner_Hz(eq_corner_Hz);
+
+  printf("Beamformer: mic spacing %.1f mm (%.2f samples).  Response re: the front mic, dB:\n", core.getSpacing_mm(), core.getDelay_samples());
+  printf("  mode: 1 kHz at 0/45/90/135/180 deg; 4 kHz at 0/180; DI at 1 kHz\n");
+  float front_dB[(int)Beamformer_Core::MODE::N_MODES], back_dB[(int)Beamformer_Core::MODE::N_MODES], di_dB[(int)Beamformer_Core::MODE::N_MODES];
+  float noise_dB[(int)Beamformer_Core::MODE::N_MODES];
+  for (int m = (int)Beamformer_Core::MODE::DELAY_SUM; m < (int)Beamformer_Core::MODE::N_MODES; m++) {
+    Beamformer_Core::MODE mode = (Beamformer_Core::MODE)m;
+    core.setMode(mode); core.reset();
+    core.setAdaptRate(mu);
+    if (mode == Beamformer_Core::MODE::ADAPTIVE) {
+      //let it adapt to a noise source at noise_deg for half a second, then freeze it to measure
+      beamResponse(core, noise_tones, n_noise_tones, noise_deg, (int)(0.5f * FS_HZ) / N_SAMP);
+      core.setAdaptRate(0.0f);
+    }
+    printf("    %s:", Beamformer_Core::getModeName(mode));
+    const float front = beamResponse(core, f_1k, 1, 0.0f, n_blocks);
+    for (int deg = 0; deg <= 180; deg += 45) printf(" %.1f", toDB(beamResponse(core, f_1k, 1, deg, n_blocks)));
+    printf("; %.1f %.1f", toDB(beamResponse(core, f_4k, 1, 0.0f, n_blocks)), toDB(beamResponse(core, f_4k, 1, 180.0f, n_blocks)));
+
+    //directivity index: on-axis power over the power averaged over a sphere (it's symmetric about the axis)
+    float sphere = 0.0f, weights = 0.0f;
+    for (int deg = 5; deg < 180; deg += 10) {
+      float g = beamResponse(core, f_1k, 1, deg, n_blocks), w = sinf(deg * M_PI / 180.0f);
+      sphere += w * g * g; weights += w;
+    }
+    front_dB[m] = toDB(front);
+    back_dB[m] = toDB(beamResponse(core, f_1k, 1, 180.0f, n_blocks));
+    di_dB[m] = 10.0f * log10f(front * front / max(sphere / weights, 1.0e-20f));
+    printf("; DI %.1f\n", di_dB[m]);
+
+    //how much does each one take off of the noise off to the side and behind?
+    noise_dB[m] = toDB(beamResponse(core, noise_tones, n_noise_tones, noise_deg, n_blocks)) - front_dB[m];
+  }
+  const int DS = (int)Beamformer_Core::MODE::DELAY_SUM, CARD = (int)Beamformer_Core::MODE::DIFFERENTIAL, ADAPT = (int)Beamformer_Core::MODE::ADAPTIVE;
+  printf("  noise at %.0f deg, re: straight ahead: cardioid %.1f dB, adaptive %.1f dB (beta %.2f, null at %.0f deg)\n",
+         noise_deg, noise_dB[CARD], noise_dB[ADAPT], core.getBeta(), core.getNullAngle_deg());
+
+  check(fabsf(front_dB[DS]) < 1.0f, "delay-and-sum is flat from the front");
+  check(fabsf(front_dB[CARD]) < 1.5f, "the cardioid is equalized to the front mic's level on-axis");
+  check(back_dB[CARD] - front_dB[CARD] < -20.0f, "the cardioid's null is at the back");
+  check(fabsf(di_dB[CARD] - 4.8f) < 1.0f, "the cardioid's DI is the ideal 4.8 dB");
+  check(fabsf(core.getNullAngle_deg() - noise_deg) < 10.0f, "the adaptive null finds the noise off to the side and behind");
+  check(noise_dB[ADAPT] < noise_dB[CARD] - 6.0f, "and takes it further down than the cardioid");
+  if (n_failed > 0) { printf("%d check(s) FAILED\n", n_failed); return 1; }
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+   BinauralSim
+
+   Purpose: Checks the binaural cue measurement (BinauralCues_Core, in AudioAnalyzeBinaural_F32.h
+     of the HearThru_wBTAudio sketch) and what the multi-band compressor (MultiBandWDRC_Core)
+     does to the cues, with its gains independent and linked.  It runs on the host, at the
+     analysis rate (96 kHz decimated by 4), with the sketch's bands and compressor settings.
+       g++ -O2 -std=c++14 -I. BinauralSim.cpp -o BinauralSim && ./BinauralSim
+   On the Tympan, 'Z' still times the analysis (and checks its accuracy on the way).
+
+   The tests:
+     * the measurement: white noise, with the right side delayed by a whole number of samples
+       and turned down.  The ITD must be right to within a sample, and each band's ILD to
+       within 0.5 dB.
+     * the compressor: the left at -20 dBFS, the right 6 dB down and 7 samples late, through
+       the multi-band compressor at 3:1 with its knees at -40 dBFS.  Independent gains squash
+       the ILD (towards 6/3 = 2 dB); linked gains must keep it, to within 0.5 dB in every band,
+       and keep the ITD.
+
+   It prints the results and returns nonzero if anything fails.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <Tympan_Library.h>
+#include "../../Firmware/HearThru_wBTAudio/AudioAnalyzeBinaural_F32.h"
+#include "../../Firmware/HearThru_wBTAudio/AudioEffectMultiBandWDRC_F32.h"
+
+#define FS_HZ (96000.0f / 4.0f)  //the analysis rate
+#define N_SAMP (128)
+#define N_FRAMES (40)
+
+static float crossovers_Hz[] = {500.0f, 2000.0f, 6000.0f};  //the sketch's
+const int n_crossovers = 3;
+
+static int n_failed = 0;
+static void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "pass" : "FAIL", what);
+  if (!ok) n_failed++;
+}
+
+static uint32_t seed = 12345;
+static float noise(void) { seed = seed * 1664525UL + 1013904223UL; return ((float)(seed >> 8)) / 8388608.0f - 1.0f; }
+
+static BinauralCues_Core core;
+static float32_t L[BINAURAL_FFT], R[BINAURAL_FFT], x[BINAURAL_FFT + 32];
+
+static void testMeasurement(void) {
+  printf("Cue measurement: %.0f Hz, FFT %d, %d frames each\n", FS_HZ, BINAURAL_FFT, N_FRAMES);
+  const int delays[] = {-14, -7, -2, 0, 3, 7, 14};
+  const float ilds_dB[] = {0.0f, 6.0f, -12.0f};
+  BinauralCues_Core::Cues_t cues;
+  float worst_itd_err = 0.0f, worst_ild_err = 0.0f;
+  for (int d : delays) {
+    for (float ild : ilds_dB) {
+      core.reset();
+      const float gain_R = powf(10.0f, -ild / 20.0f);
+      for (int f = 0; f < N_FRAMES; f++) {
+        for (int i = 0; i < BINAURAL_FFT + 32; i++) x[i] = 0.1f * noise();
+        for (int i = 0; i < BINAURAL_FFT; i++) { L[i] = x[16 + i]; R[i] = gain_R * x[16 + i - d]; }
+        core.analyze(L, R, cues);
+      }
+      worst_itd_err = max(worst_itd_err, fabsf(cues.itd_usec - 1.0e6f * d / FS_HZ));
+      for (int b = 0; b < cues.n_bands; b++) worst_ild_err = max(worst_ild_err, fabsf(cues.ild_dB[b] - ild));
+    }
+  }
+  printf("    worst error: ITD %.1f usec (one sample is %.1f usec), ILD %.2f dB\n", worst_itd_err, 1.0e6f / FS_HZ, worst_ild_err);
+  check(worst_itd_err < 1.0e6f / FS_HZ, "the ITD is right to within a sample");
+  check(worst_ild_err < 0.5f, "the ILD is right to within 0.5 dB in every band");
+}
+
+static void testLinking(void) {
+  static MultiBandWDRC_Core comp;
+  BinauralCues_Core::Cues_t cues;
+  const float ild_in_dB = 6.0f, knee_dBFS = -40.0f, cr = 3.0f, maxdB = 115.0f;
+  const int itd_samples = 7;
+  const float itd_in_usec = 1.0e6f * itd_samples / FS_HZ;
+  const float level_L = -20.0f, level_R = level_L - ild_in_dB;
+  const float amp_L = powf(10.0f, level_L / 20.0f) * sqrtf(3.0f), amp_R = powf(10.0f, level_R / 20.0f) * sqrtf(3.0f);  //uniform noise has an RMS of 1/sqrt(3)
+  printf("Multi-band compressor (3:1, knees at %.0f dBFS): ILD %.1f dB and ITD %.0f usec in\n", knee_dBFS, ild_in_dB, itd_in_usec);
+  float worst_linked_err = 0.0f, worst_indep_err = 0.0f, worst_itd_err = 0.0f;
+  for (int linked = 0; linked < 2; linked++) {
+    comp.setSampleRate_Hz(FS_HZ, N_SAMP);  //its crossovers and time constants are in Hz and msec, so the rate doesn't matter
+    comp.setCrossovers_Hz(crossovers_Hz, n_crossovers);
+    comp.setParams(5.0f, 100.0f, maxdB, 0.0f, cr, maxdB + knee_dBFS);
+    comp.setLinked(linked == 1);
+    core.reset();
+    for (int i = 0; i <= itd_samples; i++) x[i] = 0.0f;  //the right side's delay line
+    for (int f = -8; f < N_FRAMES; f++) {  //the first few frames just let the compressor settle
+      for (int i = 0; i < BINAURAL_FFT; i++) {
+        for (int j = itd_samples; j > 0; j--) x[j] = x[j - 1];
+        x[0] = noise();
+        L[i] = amp_L * x[0]; R[i] = amp_R * x[itd_samples];
+      }
+      for (int i = 0; i < BINAURAL_FFT; i += N_SAMP) comp.process(L + i, R + i, min(N_SAMP, BINAURAL_FFT - i));
+      if (f >= 0) core.analyze(L, R, cues);
+    }
+    printf("    %s ILD out by band:", linked ? "linked:     " : "independent:");
+    for (int b = 0; b < cues.n_bands; b++) {
+      printf(" %5.1f", cues.ild_dB[b]);
+      float err = fabsf(cues.ild_dB[b] - ild_in_dB);
+      if (linked) worst_linked_err = max(worst_linked_err, err); else worst_indep_err = max(worst_indep_err, err);
+    }
+    printf(" dB; ITD %.0f usec out\n", cues.itd_usec);
+    worst_itd_err = max(worst_itd_err, fabsf(cues.itd_usec - itd_in_usec));
+  }
+  check(worst_indep_err > 2.0f, "independent gains squash the ILD (so this test can see it)");
+  check(worst_linked_err < 0.5f, "linked gains keep the ILD to within 0.5 dB in every band");
+  check(worst_itd_err < 1.0e6f / FS_HZ, "and both keep the ITD to within a sample");
+}
+
+int main(void) {
+  core.setSampleRate_Hz(FS_HZ);
+  core.setBands_Hz(crossovers_Hz, n_crossovers);  //measure the ILDs in the compressor's bands, as the sketch does
+  testMeasurement();
+  testLinking();
+  if (n_failed > 0) { printf("%d check(s) FAILED\n", n_failed); return 1; }
+  printf("All checks passed\n");
+  return 0;
+}
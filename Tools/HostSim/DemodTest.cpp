@@ -0,0 +1,185 @@
+/*
+   DemodTest
+
+   Purpose: Checks the fused ultrasound demodulator (AudioEffectUltrasoundDemod_F32, in the
+     Ultrasonic_Hearing sketch) against the chain that it replaced, and checks the carrier's
+     accuracy.  It runs on the host; see Tympan_Library.h in this folder for the stand-ins.
+       g++ -O2 -std=c++14 -I. DemodTest.cpp -o DemodTest && ./DemodTest
+
+   The tests:
+     * fused vs unfused: the same two channels of input (ultrasound tones and noise) go through
+       the node and through a reference chain, done separately and in double: gain, the two
+       high-pass biquads, and a multiply by an exact cosine.  They must match, sample for
+       sample, to within the carrier's error.  The second half moves the carrier and the
+       high-pass, as the sketch does, and checks again once the glide is done.
+     * the carrier: NCO_Core's I and Q, against the exact cosine and sine at the same phase,
+       over several frequencies.  The worst error must be at the -94 dBFS that NCO_Core.h
+       promises for its 512-point table.
+
+   It prints the results and returns nonzero if anything fails.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <Tympan_Library.h>
+#include "../../Firmware/Ultrasonic_Hearing/AudioEffectUltrasoundDemod_F32.h"
+
+#define FS_HZ (96000.0f)
+#define N_SAMP (128)
+#define N_SEC (1.0f)
+
+//the sketch's settings: [b,a]=butter(2,30000/(96000/2),'high'), twice, and a 37 kHz carrier
+const double hp_b[] = {0.186694333116378, -0.373388666232757, 0.186694333116378};
+const double hp_a[] = {1.000000000000000, 0.462938025291041, 0.209715357756555};
+const float gain_dB = 5.0f, carrier1_Hz = 37000.0f, carrier2_Hz = 40000.0f, hp_below_carrier_Hz = 7000.0f;
+
+//the limits
+const float max_demod_error_dB = -90.0f;  //re the output's peak: the carrier's -94 dB, and float rounding in the filter
+const float max_nco_error_dBFS = -93.5f;  //(2*pi/512)^2/8 is -94.5 dBFS, and then the float rounding
+
+static int n_failed = 0;
+static void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "pass" : "FAIL", what);
+  if (!ok) n_failed++;
+}
+
+static float toDB(double x) { return 20.0f * log10f((float)max(x, 1.0e-20)); }
+
+//one biquad, Matlab-style b and a, in double (direct form I, so that it is not the same code)
+struct RefBiquad {
+  double b[3], a[3], x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+  void set(const double *bb, const double *aa) { for (int i = 0; i < 3; i++) { b[i] = bb[i] / aa[0]; a[i] = aa[i] / aa[0]; } }
+  void setHighpass(double fc_Hz) {  //the same design as SOS_Core::setHighpass()
+    double w0 = 2.0 * M_PI * fc_Hz / FS_HZ, alpha = sin(w0) / (2.0 * 0.70710678), cosw = cos(w0);
+    double bb[3] = {0.5 * (1.0 + cosw), -(1.0 + cosw), 0.5 * (1.0 + cosw)}, aa[3] = {1.0 + alpha, -2.0 * cosw, 1.0 - alpha};
+    set(bb, aa);
+  }
+  double process(double x) {
+    double y = b[0] * x + b[1] * x1 + b[2] * x2 - a[1] * y1 - a[2] * y2;
+    x2 = x1; x1 = x; y2 = y1; y1 = y;
+    return y;
+  }
+};
+
+//the input: a tone near the carrier, a tone well below the high-pass, and some noise
+static float inputSample(int chan, long t) {
+  static uint32_t seed[2] = {1, 2};
+  seed[chan] = seed[chan] * 1664525UL + 1013904223UL;
+  const float noise = ((float)(seed[chan] >> 8)) / 8388608.0f - 1.0f;
+  const double sec = ((double)t) / FS_HZ;
+  const double f_tone = (chan == 0) ? 38200.0 : 41500.0;
+  return (float)(0.3 * sin(2.0 * M_PI * f_tone * sec) + 0.2 * sin(2.0 * M_PI * 1000.0 * sec + chan) + 0.05 * noise);
+}
+
+static void testFusedVsReference(void) {
+  printf("Fused demodulator vs the reference chain (%.0f Hz, %d sample blocks):\n", FS_HZ, N_SAMP);
+  AudioSettings_F32 settings(FS_HZ, N_SAMP);
+  static AudioEffectUltrasoundDemod_F32 demod(settings);
+  demod.setGlideTime_msec(0.0f);  //one block, so that the reference can follow it exactly
+  const float32_t b0[] = {(float32_t)hp_b[0], (float32_t)hp_b[1], (float32_t)hp_b[2]};
+  const float32_t a0[] = {(float32_t)hp_a[0], (float32_t)hp_a[1], (float32_t)hp_a[2]};
+  demod.setGain_dB(gain_dB);
+  demod.setFilterCoefficients(0, b0, a0);
+  demod.setFilterCoefficients(1, b0, a0);
+  demod.setCarrier_Hz(carrier1_Hz);
+
+  //the reference, with the node's glides: the gain ramps up from 0 over the first block, and
+  //the phase increment ramps over the block after a carrier change
+  RefBiquad ref[2][2];
+  for (int c = 0; c < 2; c++) for (int s = 0; s < 2; s++) ref[c][s].set(hp_b, hp_a);
+  const double gain = pow(10.0, gain_dB / 20.0);
+  NCO_Core quant;  //only for the phase increment, which is quantized to 2^-32 of a turn
+  quant.setSampleRate_Hz(FS_HZ);
+  double phase_turns = 0.0;
+
+  audio_block_f32_t in[2];
+  const int n_blocks = (int)(N_SEC * FS_HZ) / N_SAMP;
+  double max_err[2] = {0.0, 0.0}, max_out = 0.0, max_err_after_move = 0.0;
+  uint32_t inc = quant.freqToIncrement(carrier1_Hz), prev_inc = inc;
+  long t = 0;
+  for (int b = 0; b < n_blocks; b++) {
+    bool moved = (b == n_blocks / 2);
+    if (moved) {
+      demod.setCarrier_Hz(carrier2_Hz);
+      demod.setHighpass(0, carrier2_Hz - hp_below_carrier_Hz);
+      demod.setHighpass(1, carrier2_Hz - hp_below_carrier_Hz);
+      for (int c = 0; c < 2; c++) for (int s = 0; s < 2; s++) ref[c][s].setHighpass(carrier2_Hz - hp_below_carrier_Hz);
+      prev_inc = inc; inc = quant.freqToIncrement(carrier2_Hz);
+    }
+    float32_t x[2][N_SAMP];  //a copy for the reference (the node works in place)
+    for (int c = 0; c < 2; c++) {
+      in[c].length = N_SAMP;
+      for (int i = 0; i < N_SAMP; i++) x[c][i] = in[c].data[i] = inputSample(c, t + i);
+      demod.putBlock(c, &in[c]);
+    }
+    demod.update();
+
+    //the reference
+    const int32_t dinc = moved ? ((int32_t)(inc - prev_inc)) / N_SAMP : 0;
+    uint32_t step = moved ? prev_inc : inc;
+    for (int i = 0; i < N_SAMP; i++) {
+      const double amp = (b == 0) ? gain * ((double)i) / N_SAMP : gain;
+      const double carrier = amp * cos(2.0 * M_PI * phase_turns);
+      for (int c = 0; c < 2; c++) {
+        double y = carrier * ref[c][1].process(ref[c][0].process(x[c][i]));
+        double err = fabs(y - in[c].data[i]);
+        max_out = max(max_out, fabs(y));
+        if (b < n_blocks / 2) max_err[c] = max(max_err[c], err);
+        else if (b > n_blocks / 2) max_err_after_move = max(max_err_after_move, err);
+      }
+      phase_turns += ((double)step) / 4294967296.0;
+      phase_turns -= floor(phase_turns);
+      step += dinc;
+    }
+    t += N_SAMP;
+  }
+
+  printf("    output peak %.2f; worst error L %.1f dB, R %.1f dB, after the carrier moved %.1f dB (re the peak)\n",
+         max_out, toDB(max_err[0] / max_out), toDB(max_err[1] / max_out), toDB(max_err_after_move / max_out));
+  check(toDB(max_err[0] / max_out) < max_demod_error_dB, "left matches the reference, sample for sample");
+  check(toDB(max_err[1] / max_out) < max_demod_error_dB, "right matches the reference, sample for sample");
+  check(toDB(max_err_after_move / max_out) < max_demod_error_dB, "still matches after moving the carrier and the high-pass");
+
+  //one channel missing: the other one still comes out, and the missing one doesn't
+  for (int i = 0; i < N_SAMP; i++) in[0].data[i] = inputSample(0, t + i);
+  demod.getTransmitted(0); demod.getTransmitted(1);  //(clear the last block's)
+  demod.putBlock(0, &in[0]);
+  demod.update();
+  audio_block_f32_t *out_L = demod.getTransmitted(0), *out_R = demod.getTransmitted(1);
+  check((out_L == &in[0]) && (out_R == NULL), "a missing input block just skips that channel");
+}
+
+static void testCarrier(void) {
+  printf("Carrier (NCO_Core, %d-point table):\n", NCO_TABLE_SIZE);
+  const float freqs_Hz[] = {1000.0f, 10000.0f, 25000.0f, 37000.0f, 40000.0f, 45123.4f};
+  const int n_blocks = 200;
+  static float32_t I[N_SAMP], Q[N_SAMP];
+  double worst_I = 0.0, worst_Q = 0.0;
+  for (float f : freqs_Hz) {
+    NCO_Core nco;
+    nco.setSampleRate_Hz(FS_HZ);
+    const uint32_t inc = nco.freqToIncrement(f);
+    nco.setIncrement(inc);
+    for (int b = 0; b < n_blocks; b++) {
+      const uint32_t p0 = nco.getPhase();
+      nco.generate(I, Q, N_SAMP, inc, 1.0f, 1.0f);
+      for (int i = 0; i < N_SAMP; i++) {
+        const double turns = ((double)(uint32_t)(p0 + i * inc)) / 4294967296.0;
+        worst_I = max(worst_I, fabs(I[i] - cos(2.0 * M_PI * turns)));
+        worst_Q = max(worst_Q, fabs(Q[i] - sin(2.0 * M_PI * turns)));
+      }
+    }
+  }
+  printf("    worst error: I %.1f dBFS, Q %.1f dBFS (the table's bound is %.1f dBFS)\n", toDB(worst_I), toDB(worst_Q),
+         toDB(pow(2.0 * M_PI / NCO_TABLE_SIZE, 2.0) / 8.0));
+  check(toDB(worst_I) < max_nco_error_dBFS, "the cosine (I) is within the table's error");
+  check(toDB(worst_Q) < max_nco_error_dBFS, "the sine (Q) is within the table's error");
+}
+
+int main(void) {
+  testFusedVsReference();
+  testCarrier();
+  if (n_failed > 0) { printf("%d check(s) FAILED\n", n_failed); return 1; }
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,180 @@
+/*
+   FeedbackSim
+
+   Purpose: Closes the feedback loop around the feedback canceller (FeedbackCancel_Core, in
+     AudioEffectFeedbackCancel_F32.h of the HearThru_wBTAudio sketch) in simulation, on the
+     host, and finds how much more hear-thru gain it allows before the loop rings.  This used
+     to be the 'Q' command on the Tympan, which stopped the audio for several seconds.  (The
+     canceller's cost is in 'R', with the rest of the processing.)
+       g++ -O2 -std=c++14 -I. FeedbackSim.cpp -o FeedbackSim && ./FeedbackSim
+
+   The loop: mic = outside sound + feedback path * speaker, and the hear-thru is a flat gain
+   with the graph's delays (the sketch's 32 sample blocks at 96 kHz, and 3 blocks of I/O).
+   The feedback path is a delay and then a decaying resonance (the speaker in the earcup);
+   change the fb_sim_ constants to match a measured one.  For each outside sound (white noise,
+   a tone with a little noise, and a strongly resonant AR process, like a vowel), the gain is
+   raised until the loop runs away, without and then with the canceller (plain NLMS and then
+   prewhitened, trained first at a safe gain).  It prints the most stable gain and how far
+   the canceller's taps ended up from the real path (the misalignment), and it checks that,
+   prewhitened, the canceller:
+     * adds at least 12 dB of stable gain on noise and on the AR process
+     * doesn't make the tone worse, and doesn't misadapt on it (its taps end up closer to
+       the path than no taps at all)
+
+   It prints the results and returns nonzero if anything fails.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <Tympan_Library.h>
+#include "../../Firmware/HearThru_wBTAudio/AudioEffectFeedbackCancel_F32.h"
+
+#define FS_HZ (96000.0f)
+#define N_SAMP (32)              //the sketch's audio_block_samples
+#define N_BLOCKS_IO_LATENCY (3)  //and its n_blocks_io_latency
+
+//the canceller's settings in the sketch
+const int fbc_taps = 64;
+const float fbc_step_size = 0.005f;
+
+//The simulated feedback path: a delay, and then a decaying resonance (the speaker in the
+//earcup).  Change these to match a measured path.
+const int fb_sim_delay_samples = 20;      //after the I/O buffers: the converters and the air
+const float fb_sim_resonance_Hz = 3000.0f, fb_sim_decay_msec = 0.3f, fb_sim_peak_dB = -6.0f;
+#define FB_SIM_TAPS (64)
+#define FB_SIM_HIST (1024)   //power of two, longer than all of the delays
+
+//The simulated outside sound.  White noise is the easy case.  A tone (with a little noise) or
+//a strongly resonant AR process (like a vowel) is predictable, which is what makes a closed-loop
+//canceller misadapt.
+enum { FB_SRC_NOISE = 0, FB_SRC_TONE, FB_SRC_AR, N_FB_SRC };
+const char *fb_src_names[N_FB_SRC] = { "noise", "1 kHz tone", "AR (1 kHz resonance)" };
+const float fb_sim_source_Hz = 1000.0f;
+
+static int n_failed = 0;
+static void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "pass" : "FAIL", what);
+  if (!ok) n_failed++;
+}
+
+//Run the loop at one gain, with the canceller (or without it, if fbc is NULL).  Returns
+//whether it stayed stable.
+static bool runFeedbackLoop(FeedbackCancel_Core *fbc, const float32_t *h, int source, float gain_dB, int n_blocks) {
+  const int N = N_SAMP;
+  const int io_delay = (N_BLOCKS_IO_LATENCY - 1) * N;   //graph output to the speaker, and the mic to the graph input
+  static float32_t out_hist[FB_SIM_HIST], err_hist[FB_SIM_HIST];
+  static float32_t mic[N_SAMP], ref[N_SAMP], err[N_SAMP];
+  const float g = powf(10.0f, gain_dB / 20.0f);
+  uint32_t seed = 777;
+  auto noise = [&seed](void) { seed = seed * 1664525UL + 1013904223UL; return 0.01f * (((float)(seed >> 8)) / 8388608.0f - 1.0f); };
+  const float w_src = 2.0f * M_PI * fb_sim_source_Hz / FS_HZ, r_ar = 0.995f;
+  float phase = 0.0f, ar1 = 0.0f, ar2 = 0.0f;
+  for (int i = 0; i < FB_SIM_HIST; i++) { out_hist[i] = 0.0f; err_hist[i] = 0.0f; }
+
+  double early_sq = 0.0, late_sq = 0.0;
+  for (int b = 0, t = 0; b < n_blocks; b++) {
+    for (int i = 0; i < N; i++) {
+      const int ti = t + i;
+      out_hist[ti & (FB_SIM_HIST - 1)] = g * err_hist[(ti - N) & (FB_SIM_HIST - 1)];  //the hear-thru: one block through the graph
+      float32_t fb = 0.0f;
+      for (int k = 0; k < FB_SIM_TAPS; k++) fb += h[k] * out_hist[(ti - io_delay - k) & (FB_SIM_HIST - 1)];
+      float32_t src = noise();
+      if (source == FB_SRC_TONE) {
+        phase += w_src; if (phase > 2.0f * M_PI) phase -= 2.0f * M_PI;
+        src = 0.01f * sinf(phase) + 0.03f * src;
+      } else if (source == FB_SRC_AR) {
+        float32_t y = src + 2.0f * r_ar * cosf(w_src) * ar1 - r_ar * r_ar * ar2;
+        ar2 = ar1; ar1 = y; src = 0.1f * y;
+      }
+      mic[i] = src + fb;
+      ref[i] = out_hist[(ti - N) & (FB_SIM_HIST - 1)];  //the canceller gets the output a block late
+    }
+    if (fbc) {
+      fbc->process(mic, ref, err, N);
+    } else {
+      for (int i = 0; i < N; i++) err[i] = mic[i];
+    }
+    for (int i = 0; i < N; i++) {
+      const int ti = t + i;
+      err_hist[ti & (FB_SIM_HIST - 1)] = err[i];
+      float32_t y = out_hist[ti & (FB_SIM_HIST - 1)];
+      if (fabsf(y) > 4.0f) return false;  //way past clipping: it has run away
+      if (b >= n_blocks / 2) { if (b < (3 * n_blocks) / 4) early_sq += y * y; else late_sq += y * y; }
+    }
+    t += N;
+  }
+  return late_sq < 4.0 * early_sq + 1.0e-12;  //stable, if the last quarter isn't still growing
+}
+
+//how far the canceller's taps are from the real path, relative to the path, in dB
+static float feedbackMisalignment_dB(FeedbackCancel_Core &fbc, const float32_t *h) {
+  double err_sq = 0.0, path_sq = 0.0;
+  for (int k = 0; k < FB_SIM_TAPS; k++) {
+    const float32_t c = fbc.getTap(k - fb_sim_delay_samples + FBC_MARGIN_SAMPLES);  //tap j sees the path at k = j + delay - margin
+    err_sq += (c - h[k]) * (c - h[k]); path_sq += h[k] * h[k];
+  }
+  return 10.0f * log10f(max(err_sq, 1.0e-20) / max(path_sq, 1.0e-20));
+}
+
+int main(void) {
+  static FeedbackCancel_Core trained, fbc;
+  static float32_t h[FB_SIM_TAPS];
+  const int N = N_SAMP;
+  const int n_blocks = (int)(0.25f * FS_HZ) / N;
+
+  //the feedback path
+  const float w = 2.0f * M_PI * fb_sim_resonance_Hz / FS_HZ, decay = expf(-1.0f / (0.001f * fb_sim_decay_msec * FS_HZ));
+  float peak = 0.0f;
+  for (int k = 0; k < FB_SIM_TAPS; k++) {
+    int j = k - fb_sim_delay_samples;
+    h[k] = (j < 0) ? 0.0f : powf(decay, (float)j) * sinf(w * (j + 1));
+    peak = max(peak, fabsf(h[k]));
+  }
+  for (int k = 0; k < FB_SIM_TAPS; k++) h[k] *= powf(10.0f, fb_sim_peak_dB / 20.0f) / max(peak, 1.0e-10f);
+
+  printf("Feedback Cancel: simulated loop, %d taps, step size %.3f\n", fbc_taps, fbc_step_size);
+  printf("  path: %d samples + %.0f Hz resonance, peak %.1f dB\n", fb_sim_delay_samples, fb_sim_resonance_Hz, fb_sim_peak_dB);
+  printf("  source, adaptation: max stable gain without, with, added (dB, to the nearest 2 dB), misalignment (dB)\n");
+
+  float added_dB[N_FB_SRC][2], misalign_dB[N_FB_SRC][2];
+  for (int source = 0; source < N_FB_SRC; source++) {
+    //without: the highest gain that is still stable
+    float msg_off = -100.0f;
+    for (float g_dB = -20.0f; g_dB <= 40.0f; g_dB += 2.0f) {
+      if (!runFeedbackLoop(NULL, h, source, g_dB, n_blocks)) break;
+      msg_off = g_dB;
+    }
+
+    //with: plain NLMS and then prewhitened.  Train at a gain that is safely stable, and then start each test from there.
+    for (int pw = 0; pw < 2; pw++) {
+      float msg_on = -100.0f;
+      trained.setTaps(fbc_taps);
+      trained.setStepSize(fbc_step_size);
+      trained.setPrewhitening(pw == 1);
+      trained.reset();
+      const int io_loopback = (N_BLOCKS_IO_LATENCY - 1) * N + fb_sim_delay_samples;  //what 't' would measure here
+      trained.setBulkDelay_samples(io_loopback - N - FBC_MARGIN_SAMPLES);
+      runFeedbackLoop(&trained, h, source, msg_off - 6.0f, 16 * n_blocks);
+      for (float g_dB = msg_off; g_dB <= 40.0f; g_dB += 2.0f) {
+        fbc = trained;
+        if (!runFeedbackLoop(&fbc, h, source, g_dB, n_blocks)) break;
+        msg_on = g_dB;
+      }
+
+      misalign_dB[source][pw] = feedbackMisalignment_dB(trained, h);
+      added_dB[source][pw] = msg_on - msg_off;
+      printf("    %s, %s: %.0f, ", fb_src_names[source], pw ? "prewhitened" : "plain NLMS", msg_off);
+      if (msg_on < msg_off) printf("unstable, -, ");  //even at the gain that was stable without it
+      else printf("%.0f, %.0f, ", msg_on, msg_on - msg_off);
+      printf("%.1f%s\n", misalign_dB[source][pw], (misalign_dB[source][pw] > 0.0f) ? "  <- misadapted" : "");  //further from the path than no taps at all
+    }
+  }
+
+  check(added_dB[FB_SRC_NOISE][1] >= 12.0f, "prewhitened, it adds at least 12 dB on noise");
+  check(added_dB[FB_SRC_AR][1] >= 12.0f, "prewhitened, it adds at least 12 dB on the AR process (a vowel)");
+  check(added_dB[FB_SRC_TONE][1] >= 0.0f, "prewhitened, it doesn't make the tone worse");
+  check(misalign_dB[FB_SRC_TONE][1] < 0.0f, "prewhitened, it doesn't misadapt on the tone");
+  if (n_failed > 0) { printf("%d check(s) FAILED\n", n_failed); return 1; }
+  printf("All checks passed\n");
+  return 0;
+}
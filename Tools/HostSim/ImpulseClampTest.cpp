@@ -0,0 +1,183 @@
+/*
+   ImpulseClampTest
+
+   Purpose: Checks the impulse clamp (ImpulseClamp_Core, in AudioEffectImpulseClamp_F32.h of
+     the HearThru_wBTAudio sketch) on synthetic sounds, on the host.  This used to be the 'z'
+     command on the Tympan, which stopped the audio while it ran.
+       g++ -O2 -std=c++14 -I. ImpulseClampTest.cpp -o ImpulseClampTest && ./ImpulseClampTest
+
+   The tests, all with the core's default settings at 96 kHz in 128 sample blocks:
+     * gunshots (Friedlander waves, 0.9 peak, 1 msec) on a quiet background, starting at every
+       position within a sub-block: each one must be caught once, with the onset reported to
+       the sample, the gain at the clamp level within the attack (4 samples) of the onset, the
+       output no more than 0.5 dB above the clamped level from then on, and the gain still
+       down at the end of the hold.  The first few samples of an onset near the start of a
+       sub-block get through only partly clamped (the attack can't start before the
+       sub-block); that overshoot is printed, and the limiter after the clamp is there for it.
+     * speech-like sound (a 125 Hz buzz with its harmonics, in syllables at 4 Hz, peaking
+       around -12 dBFS): no triggering
+     * a loud 1 kHz tone (-3 dBFS), coming up over 100 msec: no triggering.  (Out of quiet, a
+       sound that comes up 50 dB in 50 msec or less does get clamped once, at its onset: to
+       the crest factor detector, that is an impulse.)
+     * a loud 10 kHz tone (-3 dBFS, switched on abruptly), which keeps the slope detector over
+       its threshold: it may clamp at the switch-on, but it must let go after the maximum
+       impulse length, the hold and the release, and stay let go.  Once the tone stops, a
+       gunshot must be caught again.
+
+   It prints the results and returns nonzero if anything fails.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <Tympan_Library.h>
+#include "../../Firmware/HearThru_wBTAudio/AudioEffectImpulseClamp_F32.h"
+
+#define FS_HZ (96000.0f)
+#define N_SAMP (128)
+
+const float shot_peak = 0.9f, shot_T_sec = 0.001f;
+
+static int n_failed = 0;
+static void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "pass" : "FAIL", what);
+  if (!ok) n_failed++;
+}
+
+static uint32_t seed = 12345;
+static float noise(void) { seed = seed * 1664525UL + 1013904223UL; return ((float)(seed >> 8)) / 8388608.0f - 1.0f; }
+static float gunshot(long t) { return (t >= 0) ? shot_peak * (1.0f - t / (shot_T_sec * FS_HZ)) * expf(-t / (shot_T_sec * FS_HZ)) : 0.0f; }
+
+static void newCore(ImpulseClamp_Core &core) {
+  core.setSampleRate_Hz(FS_HZ);  //(back to the defaults)
+  core.reset();
+}
+
+//run a sound through the core, a block at a time.  Returns the number of impulses it found.
+template <class F>
+static int run(ImpulseClamp_Core &core, long &t, float sec, F sound, float32_t *x_last = NULL, float32_t *y_last = NULL) {
+  static float32_t y[N_SAMP];
+  int n_found = 0;
+  for (int b = 0; b < (int)(sec * FS_HZ / N_SAMP + 0.5f); b++) {
+    for (int i = 0; i < N_SAMP; i++) { y[i] = sound(t + i); if (x_last) x_last[i] = y[i]; }
+    n_found += core.process(y, NULL, N_SAMP);
+    if (y_last) for (int i = 0; i < N_SAMP; i++) y_last[i] = y[i];
+    t += N_SAMP;
+  }
+  return n_found;
+}
+
+static void testGunshots(void) {
+  static ImpulseClamp_Core core;
+  newCore(core);
+  const float clamp = powf(10.0f, core.getClamp_dB() / 20.0f);
+  printf("Gunshots: %.1f dBFS peak, clamp %.1f dB, at every offset within a sub-block\n", 20.0f * log10f(shot_peak), core.getClamp_dB());
+  const int attack_samples = 4;  //the default
+  int n_missed = 0, n_extra = 0, n_bad_onset = 0, worst_late = -1000, n_released_early = 0;
+  float worst_overshoot_dB = -100.0f, worst_onset_overshoot_dB = -100.0f;
+  auto background = [](long) { return 0.01f * noise(); };  //about -45 dBFS
+  for (int offset = 0; offset < 16; offset++) {
+    newCore(core);
+    long t = 0;
+    run(core, t, 0.05f, background);  //so it knows what normal is
+
+    //the shot starts "offset" samples into the next block
+    const long t_shot = t + offset;
+    static float32_t x[N_SAMP], y[N_SAMP];
+    int n_found = 0, late = -1;
+    float max_out = 0.0f, max_onset_out = 0.0f;
+    for (int b = 0; b < (int)(0.015f * FS_HZ) / N_SAMP; b++) {
+      for (int i = 0; i < N_SAMP; i++) { x[i] = gunshot(t + i - t_shot) + 0.01f * noise(); y[i] = x[i]; }
+      if (core.process(y, NULL, N_SAMP)) {
+        n_found++;
+        if (t + core.last_offset != t_shot) n_bad_onset++;
+      }
+      for (int i = 0; i < N_SAMP; i++) {
+        const long ts = t + i - t_shot;
+        if (ts < 0) continue;
+        if (ts < attack_samples) max_onset_out = max(max_onset_out, fabsf(y[i]));
+        else max_out = max(max_out, fabsf(y[i]));
+        if ((late < 0) && (fabsf(x[i]) > 0.05f) && (fabsf(y[i] / x[i]) <= 1.05f * clamp)) late = (int)ts;
+      }
+      t += N_SAMP;
+    }
+    if (core.getGain() > 1.05f * clamp) n_released_early++;  //15 msec in: still in the 20 msec hold
+    if (n_found == 0) { n_missed++; continue; }
+    n_extra += n_found - 1;
+    worst_late = max(worst_late, late);
+    worst_overshoot_dB = max(worst_overshoot_dB, 20.0f * log10f(max_out / (shot_peak * clamp)));
+    worst_onset_overshoot_dB = max(worst_onset_overshoot_dB, 20.0f * log10f(max_onset_out / (shot_peak * clamp)));
+  }
+  printf("    missed %d, extra %d, wrong onset %d, at the clamp by sample %d; worst overshoot %.2f dB after the attack, %.1f dB during it\n",
+         n_missed, n_extra, n_bad_onset, worst_late, worst_overshoot_dB, worst_onset_overshoot_dB);
+  check(n_missed == 0, "every gunshot is caught");
+  check(n_extra == 0, "each one only once");
+  check(n_bad_onset == 0, "the onset is reported to the sample");
+  check((worst_late >= 0) && (worst_late <= attack_samples), "the gain is at the clamp level within the attack");
+  check(worst_overshoot_dB < 0.5f, "after that, the output is within 0.5 dB of the clamped level");
+  check(n_released_early == 0, "the gain is still down during the hold");
+}
+
+static void testSpeech(void) {
+  static ImpulseClamp_Core core;
+  newCore(core);
+  long t = 0;
+  auto speech = [](long t) {
+    const double sec = t / FS_HZ;
+    double buzz = 0.0;
+    for (int k = 1; k <= 30; k++) buzz += sin(2.0 * M_PI * 125.0 * k * sec + 0.3 * k * k) / k;  //a glottal-ish buzz, rolling off 6 dB/octave
+    const double syllables = 0.55 - 0.45 * cos(2.0 * M_PI * 4.0 * sec);                         //0.1 to 1
+    return (float)(0.12 * syllables * buzz) + 0.003f * noise();
+  };
+  float32_t y[N_SAMP];
+  double peak = 0.0;
+  int n_found = run(core, t, 3.0f, [&](long ts) { float v = speech(ts); peak = max(peak, fabs(v)); return v; }, NULL, y);
+  printf("Speech-like sound, peaking at %.1f dBFS, for 3 sec: %d impulses\n", 20.0 * log10(peak), n_found);
+  check(n_found == 0, "speech doesn't trigger it");
+}
+
+static void testLoudTones(void) {
+  static ImpulseClamp_Core core;
+  const float amp = 0.707f;  //-3 dBFS
+
+  newCore(core);
+  long t = 0;
+  int n_found = run(core, t, 2.0f, [amp](long ts) {
+    const float fade = min(1.0f, ts / (0.1f * FS_HZ));
+    return amp * fade * sinf(2.0f * M_PI * 1000.0f * ts / FS_HZ) + 0.003f * noise();
+  });
+  printf("1 kHz tone at -3 dBFS, 100 msec fade-in, for 2 sec: %d impulses\n", n_found);
+  check(n_found == 0, "a loud 1 kHz tone doesn't trigger it");
+
+  //a loud high tone, switched on: its slope (0.44 per sample) is over the threshold all of the time
+  newCore(core);
+  t = 0;
+  auto high_tone = [amp](long ts) { return amp * sinf(2.0f * M_PI * 10000.0f * ts / FS_HZ) + 0.003f * noise(); };
+  const float max_sec = 0.25f, hold_sec = 0.02f, release_sec = 5.0f * 0.06f;  //the defaults, and 5 release time constants
+  n_found = run(core, t, max_sec + hold_sec + release_sec, high_tone);
+  const float gain_at_end = core.getGain();
+  float min_gain_after = 1.0f;
+  for (int b = 0; b < (int)(2.0f * FS_HZ) / N_SAMP; b++) {
+    n_found += run(core, t, ((float)N_SAMP) / FS_HZ, high_tone);
+    min_gain_after = min(min_gain_after, core.getGain());
+  }
+  printf("10 kHz tone at -3 dBFS, switched on, for 2.6 sec: %d impulse(s); gain %.3f after %.2f sec, and no lower than %.3f after that\n",
+         n_found, gain_at_end, max_sec + hold_sec + release_sec, min_gain_after);
+  check(n_found <= 1, "a loud high tone only triggers it at the switch-on");
+  check((gain_at_end > 0.99f) && (min_gain_after >= gain_at_end), "and it lets go, and stays let go (it doesn't latch)");
+
+  //after the tone, it is ready for the next impulse
+  run(core, t, 0.05f, [](long) { return 0.01f * noise(); });
+  const long t_shot = t + 5;
+  n_found = run(core, t, 0.01f, [&](long ts) { return gunshot(ts - t_shot) + 0.01f * noise(); });
+  printf("    then quiet, and a gunshot: %d impulse(s)\n", n_found);
+  check(n_found == 1, "once the tone stops, a gunshot is caught again");
+}
+
+int main(void) {
+  testGunshots();
+  testSpeech();
+  testLoudTones();
+  if (n_failed > 0) { printf("%d check(s) FAILED\n", n_failed); return 1; }
+  printf("All checks passed\n");
+  return 0;
+}
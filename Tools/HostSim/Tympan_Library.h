@@ -0,0 +1,92 @@
+/*
+   Tympan_Library.h (host stand-in)
+
+   Purpose: Just enough of Tympan_Library for the firmware's processing headers to build on
+     the host (PC, Mac, Linux), so that the tests and simulations in this folder can run them
+     without a Tympan.  It is not the library: there is no audio graph and no update list.
+
+   What is here:
+     * audio_block_f32_t, AudioSettings_F32 and the block size and sample rate defaults
+     * AudioStream_F32, as a box: putBlock() gives a node its input blocks, update() runs it,
+       and getTransmitted() has the block that it sent on each output
+     * allocate_f32() hands out blocks from a small pool (they are never really freed)
+     * __disable_irq() and __enable_irq() do nothing, and millis() and micros() are the host's
+       clock since the start
+
+   The CMSIS functions are in arm_math.h, next to this file.  Build the tests with this folder
+   on the include path, eg:
+       g++ -O2 -std=c++14 -I. DemodTest.cpp -o DemodTest
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _HostSim_Tympan_Library_h
+#define _HostSim_Tympan_Library_h
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "arm_math.h"
+
+using std::max;
+using std::min;
+
+#define AUDIO_BLOCK_SAMPLES (128)
+#define AUDIO_SAMPLE_RATE (96000)
+#define HOSTSIM_N_POOL (16)
+
+inline void __disable_irq(void) {}
+inline void __enable_irq(void) {}
+inline uint32_t micros(void) {
+  static const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+inline uint32_t millis(void) { return micros() / 1000; }
+
+typedef struct audio_block_f32_struct {
+  float32_t data[AUDIO_BLOCK_SAMPLES];
+  int length = AUDIO_BLOCK_SAMPLES;
+} audio_block_f32_t;
+
+class AudioSettings_F32 {
+  public:
+    AudioSettings_F32(float fs_Hz = AUDIO_SAMPLE_RATE, int block_size = AUDIO_BLOCK_SAMPLES) :
+      sample_rate_Hz(fs_Hz), audio_block_samples(block_size) {}
+    float sample_rate_Hz;
+    int audio_block_samples;
+};
+
+class AudioStream_F32 {
+  public:
+    AudioStream_F32(int n_inputs, audio_block_f32_t **) : inputs(n_inputs, NULL), outputs(8, NULL) {}
+    virtual ~AudioStream_F32(void) {}
+    virtual void update(void) = 0;
+
+    //the host side: give it the blocks, run update(), and see what came out
+    void putBlock(int input, audio_block_f32_t *block) { inputs[input] = block; }
+    audio_block_f32_t *getTransmitted(int output) { audio_block_f32_t *b = outputs[output]; outputs[output] = NULL; return b; }
+
+    static audio_block_f32_t *allocate_f32(void) {
+      static audio_block_f32_t pool[HOSTSIM_N_POOL];
+      static int next = 0;
+      audio_block_f32_t *b = &pool[next];
+      next = (next + 1) % HOSTSIM_N_POOL;
+      b->length = AUDIO_BLOCK_SAMPLES;
+      return b;
+    }
+    static void release(audio_block_f32_t *) {}
+
+  protected:
+    audio_block_f32_t *receiveReadOnly_f32(int input) { audio_block_f32_t *b = inputs[input]; inputs[input] = NULL; return b; }
+    audio_block_f32_t *receiveWritable_f32(int input) { return receiveReadOnly_f32(input); }
+    void transmit(audio_block_f32_t *block, int output = 0) { outputs[output] = block; }
+
+  private:
+    std::vector<audio_block_f32_t *> inputs, outputs;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/*
+   arm_math.h (host stand-in)
+
+   Purpose: Plain C++ versions of the CMSIS-DSP functions that the firmware's processing
+     headers use, so that they can run on the host with the tests and simulations in this
+     folder.  They are written to be obviously right, not fast: the sums are in double, and
+     the FFT is a direct DFT.
+
+   They keep the CMSIS conventions that the firmware depends on:
+     * arm_fir_f32() and arm_lms_norm_f32(): the state holds numTaps-1 old samples ahead of
+       the block, and the coefficients are time-reversed (pCoeffs[0] multiplies the oldest)
+     * arm_lms_norm_f32() adapts sample by sample with mu / (energy + 1e-6), where the energy
+       is the running sum of squares over the taps
+     * arm_cfft_radix4_f32(): interleaved complex, in place, and the inverse scales by 1/N
+       (with bitReverseFlag set, as the firmware always does)
+
+   MIT License.  Use at your own risk.
+*/
+
+#ifndef _HostSim_arm_math_h
+#define _HostSim_arm_math_h
+
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+typedef float float32_t;
+
+#ifndef PI
+#define PI (3.14159265358979f)
+#endif
+
+inline void arm_fill_f32(float32_t value, float32_t *dst, uint32_t n) { for (uint32_t i = 0; i < n; i++) dst[i] = value; }
+inline void arm_copy_f32(const float32_t *src, float32_t *dst, uint32_t n) { memmove(dst, src, n * sizeof(float32_t)); }
+inline void arm_add_f32(const float32_t *a, const float32_t *b, float32_t *dst, uint32_t n) { for (uint32_t i = 0; i < n; i++) dst[i] = a[i] + b[i]; }
+inline void arm_sub_f32(const float32_t *a, const float32_t *b, float32_t *dst, uint32_t n) { for (uint32_t i = 0; i < n; i++) dst[i] = a[i] - b[i]; }
+inline void arm_mult_f32(const float32_t *a, const float32_t *b, float32_t *dst, uint32_t n) { for (uint32_t i = 0; i < n; i++) dst[i] = a[i] * b[i]; }
+inline void arm_scale_f32(const float32_t *src, float32_t scale, float32_t *dst, uint32_t n) { for (uint32_t i = 0; i < n; i++) dst[i] = src[i] * scale; }
+inline void arm_power_f32(const float32_t *src, uint32_t n, float32_t *result) {
+  double sum = 0.0;
+  for (uint32_t i = 0; i < n; i++) sum += (double)src[i] * src[i];
+  *result = (float32_t)sum;
+}
+
+//FIR
+typedef struct {
+  uint16_t numTaps;
+  float32_t *pState;
+  const float32_t *pCoeffs;
+} arm_fir_instance_f32;
+
+inline void arm_fir_init_f32(arm_fir_instance_f32 *S, uint16_t numTaps, const float32_t *pCoeffs, float32_t *pState, uint32_t blockSize) {
+  S->numTaps = numTaps; S->pCoeffs = pCoeffs; S->pState = pState;
+  memset(pState, 0, (numTaps + blockSize - 1) * sizeof(float32_t));
+}
+inline void arm_fir_f32(const arm_fir_instance_f32 *S, const float32_t *src, float32_t *dst, uint32_t n) {
+  const int T = S->numTaps;
+  float32_t *st = S->pState;
+  memcpy(st + T - 1, src, n * sizeof(float32_t));
+  for (uint32_t i = 0; i < n; i++) {
+    double acc = 0.0;
+    for (int k = 0; k < T; k++) acc += (double)st[i + k] * S->pCoeffs[k];
+    dst[i] = (float32_t)acc;
+  }
+  memmove(st, st + n, (T - 1) * sizeof(float32_t));
+}
+
+//normalized LMS
+typedef struct {
+  uint16_t numTaps;
+  float32_t *pState;
+  float32_t *pCoeffs;
+  float32_t mu;
+  float32_t energy;
+  float32_t x0;
+} arm_lms_norm_instance_f32;
+
+inline void arm_lms_norm_init_f32(arm_lms_norm_instance_f32 *S, uint16_t numTaps, float32_t *pCoeffs, float32_t *pState, float32_t mu, uint32_t blockSize) {
+  S->numTaps = numTaps; S->pCoeffs = pCoeffs; S->pState = pState; S->mu = mu;
+  S->energy = 0.0f; S->x0 = 0.0f;
+  memset(pState, 0, (numTaps + blockSize - 1) * sizeof(float32_t));
+}
+inline void arm_lms_norm_f32(arm_lms_norm_instance_f32 *S, const float32_t *src, float32_t *ref, float32_t *out, float32_t *err, uint32_t n) {
+  const int T = S->numTaps;
+  float32_t *st = S->pState, *b = S->pCoeffs;
+  float32_t energy = S->energy, x0 = S->x0;
+  for (uint32_t i = 0; i < n; i++) {
+    st[T - 1 + i] = src[i];
+    float32_t *px = st + i;
+    float32_t acc = 0.0f;
+    for (int k = 0; k < T; k++) acc += px[k] * b[k];
+    out[i] = acc;
+    float32_t e = ref[i] - acc;
+    err[i] = e;
+    energy -= x0 * x0;
+    energy += src[i] * src[i];
+    float32_t w = e * S->mu / (energy + 0.000001f);
+    for (int k = 0; k < T; k++) b[k] += w * px[k];
+    x0 = *px;
+  }
+  S->energy = energy; S->x0 = x0;
+  memmove(st, st + n, (T - 1) * sizeof(float32_t));
+}
+
+//complex FFT
+typedef struct {
+  uint16_t fftLen;
+  uint8_t ifftFlag;
+} arm_cfft_radix4_instance_f32;
+
+inline int arm_cfft_radix4_init_f32(arm_cfft_radix4_instance_f32 *S, uint16_t fftLen, uint8_t ifftFlag, uint8_t) {
+  S->fftLen = fftLen; S->ifftFlag = ifftFlag;
+  return 0;
+}
+inline void arm_cfft_radix4_f32(const arm_cfft_radix4_instance_f32 *S, float32_t *x) {
+  const int N = S->fftLen;
+  const double sign = S->ifftFlag ? 1.0 : -1.0;
+  std::vector<std::complex<double> > y(N);
+  for (int k = 0; k < N; k++) {
+    std::complex<double> acc = 0.0;
+    for (int i = 0; i < N; i++) acc += std::complex<double>(x[2 * i], x[2 * i + 1]) * std::polar(1.0, sign * 2.0 * M_PI * ((double)k) * i / N);
+    y[k] = S->ifftFlag ? (acc / (double)N) : acc;
+  }
+  for (int k = 0; k < N; k++) { x[2 * k] = (float32_t)y[k].real(); x[2 * k + 1] = (float32_t)y[k].imag(); }
+}
+
+#endif
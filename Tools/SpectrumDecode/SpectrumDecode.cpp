@@ -0,0 +1,137 @@
+/*
+   SpectrumDecode
+
+   Purpose: Decodes a capture of the spectrum frames that the Ultrasonic_Hearing sketch sends
+     over BT (see SpectrumStreamer.h) into CSV, one line per frame, so that a session can be
+     looked at or plotted afterwards.  The capture is just the bytes that came in (from a
+     serial terminal's "save raw data", say), with whatever text was printed in between.
+
+   It runs on the host (PC, Mac, Linux), not on the Tympan.  Build it with any C++11 compiler:
+       g++ -O2 -std=c++11 SpectrumDecode.cpp -o SpectrumDecode
+   and run it on the capture (or - for stdin):
+       SpectrumDecode [-s] capture.bin > spectrum.csv
+     -s only prints the summary, not the CSV
+
+   How it works:
+     * it looks for SYNC (0xA5), and takes it as a frame only if the whole frame is there,
+       the XOR checksum over the record matches, and the record is a spectrum record whose
+       length agrees with its number of bins.  Anything else is skipped a byte at a time,
+       so it gets back in step at the next good frame.  A SYNC that isn't a good frame is
+       counted as a bad frame (once, not again for the SYNCs inside what it said was its
+       length), unless the capture ends before the frame does (then it is truncated).
+     * the CSV has the levels in dBFS, decoded as SpectrumStreamer::printDecoded() does.  Its
+       header names the bins by their center frequency in kHz, and it is printed again if the
+       bins change partway through.
+     * a gap in the frames' sequence numbers means that frames never got sent (or were lost
+       on the way).  Those are counted too.
+   The summary goes to stderr, so that it stays out of the CSV.
+
+   MIT License.  Use at your own risk.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+//the frame format (must match SpectrumStreamer.h)
+#define SPEC_SYNC (0xA5)
+#define SPEC_REC_SPECTRUM (0x42)
+#define SPEC_DATA_HEADER_BYTES (10)
+
+struct Layout_t {
+  uint16_t f_lo_Hz = 0, f_hi_Hz = 0;
+  int n_bins = 0;
+  bool operator!=(const Layout_t &o) const { return (f_lo_Hz != o.f_lo_Hz) || (f_hi_Hz != o.f_hi_Hz) || (n_bins != o.n_bins); }
+};
+
+static uint16_t getU16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+//is there a whole, good frame at buf?  Returns its length, 0 if it is bad, or -1 if the data runs out first.
+static int checkFrame(const uint8_t *buf, size_t n_avail) {
+  if (n_avail < 2) return -1;
+  const int len = buf[1];
+  if ((size_t)len + 3 > n_avail) return -1;
+  uint8_t check = 0;
+  for (int i = 0; i < len; i++) check ^= buf[2 + i];
+  if (check != buf[2 + len]) return 0;
+  const uint8_t *rec = buf + 2;
+  if ((len < 2 + SPEC_DATA_HEADER_BYTES) || (rec[0] != SPEC_REC_SPECTRUM) || (rec[1] != len - 2)) return 0;
+  if (rec[1] != SPEC_DATA_HEADER_BYTES + rec[2 + 8]) return 0;  //NBYTES has to fit n_bins
+  return len + 3;
+}
+
+static void printHeader(const Layout_t &lay) {
+  const double bin_Hz = ((double)(lay.f_hi_Hz - lay.f_lo_Hz)) / lay.n_bins;
+  printf("seq,n_ffts,peak_kHz,peak_dBFS");
+  for (int b = 0; b < lay.n_bins; b++) printf(",%.2f", 0.001 * (lay.f_lo_Hz + (b + 0.5) * bin_Hz));
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  bool csv = true;
+  const char *fname = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) { csv = false; continue; }
+    fname = argv[i];
+  }
+  if (!fname) {
+    fprintf(stderr, "usage: SpectrumDecode [-s] capture.bin (or - for stdin)\n");
+    return 1;
+  }
+
+  FILE *f = (strcmp(fname, "-") == 0) ? stdin : fopen(fname, "rb");
+  if (!f) { fprintf(stderr, "%s: could not open\n", fname); return 1; }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) data.insert(data.end(), chunk, chunk + n);
+  if (f != stdin) fclose(f);
+
+  unsigned long n_good = 0, n_bad = 0, n_truncated = 0, n_missing = 0, n_skipped_bytes = 0;
+  size_t bad_until = 0;  //the end of the last bad frame, by its own LEN
+  bool have_prev = false;
+  uint16_t prev_seq = 0;
+  Layout_t layout;
+  for (size_t ind = 0; ind < data.size(); ) {
+    if (data[ind] != SPEC_SYNC) { n_skipped_bytes++; ind++; continue; }
+    const int frame_len = checkFrame(data.data() + ind, data.size() - ind);
+    if (frame_len <= 0) {
+      if (frame_len < 0) {
+        if (ind >= bad_until) n_truncated++;
+        bad_until = data.size();  //the rest is all inside it
+      } else if (ind >= bad_until) {
+        n_bad++;
+        bad_until = ind + 3 + data[ind + 1];
+      }
+      n_skipped_bytes++; ind++;  //get back in step at the next SYNC
+      continue;
+    }
+
+    //a good frame
+    const uint8_t *d = data.data() + ind + 4;
+    const uint16_t seq = getU16(d);
+    Layout_t lay;
+    lay.f_lo_Hz = getU16(d + 2); lay.f_hi_Hz = getU16(d + 4); lay.n_bins = d[8];
+    const float floor_dB = (float)((int8_t)d[6]), step_dB = 0.1f * d[7];
+    const uint8_t *code = d + SPEC_DATA_HEADER_BYTES;
+    if (have_prev) n_missing += (uint16_t)(seq - prev_seq - 1);  //it wraps at 65536
+    prev_seq = seq; have_prev = true;
+    n_good++;
+    ind += frame_len;
+    if (!csv || (lay.n_bins < 1)) continue;
+
+    if (lay != layout) printHeader(lay);  //the first one, or the bins changed
+    layout = lay;
+    int best = 0;
+    for (int b = 1; b < lay.n_bins; b++) if (code[b] > code[best]) best = b;
+    const double bin_Hz = ((double)(lay.f_hi_Hz - lay.f_lo_Hz)) / lay.n_bins;
+    printf("%u,%u,%.2f,%.1f", (unsigned)seq, (unsigned)d[9], 0.001 * (lay.f_lo_Hz + (best + 0.5) * bin_Hz), floor_dB + step_dB * code[best]);
+    for (int b = 0; b < lay.n_bins; b++) printf(",%.1f", floor_dB + step_dB * code[b]);
+    printf("\n");
+  }
+
+  fprintf(stderr, "%s: %lu good frames, %lu bad (checksum or format), %lu truncated, %lu missing by sequence number; %lu bytes skipped\n",
+          fname, n_good, n_bad, n_truncated, n_missing, n_skipped_bytes);
+  return (n_good > 0) ? 0 : 2;
+}